@@ -20,6 +20,7 @@
 #include <linux/rbtree.h>
 #include <linux/semaphore.h>
 #include <linux/net.h>
+#include <linux/in.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <rdma/ib_verbs.h>
@@ -137,6 +138,7 @@
 
 #define PIB_QPN_MASK			(0xFFFFFF)
 #define PIB_PSN_MASK			(0xFFFFFF)
+#define PIB_MSN_MASK			(0xFFFFFF)
 #define PIB_LOCAL_ACK_TIMEOUT_MASK	(0x1F)
 #define PIB_MIN_RNR_NAK_TIMER_MASK	(0x1F)
 
@@ -173,11 +175,17 @@
 #define PIB_IMM_DATA_LKEY		(0xA0B0C0D0)
 
 #define PIB_SCHED_TIMEOUT		(0x3FFFFFFF) /* 1/4 of max value of unsigned long */
+#define PIB_SCHED_BURST			(16)  /* max packets per QP per scheduling */
+#define PIB_SCHED_QUANTUM		(32768) /* bytes per QP per scheduling */
+
+#define PIB_CAPTURE_SUBBUF_SIZE		(256 * 1024)
+#define PIB_CAPTURE_NR_SUBBUFS		(8)   /* per CPU */
 
 #define PIB_PKEY_PER_BLOCK              (32)
 #define PIB_PKEY_TABLE_LEN              (PIB_PKEY_PER_BLOCK * 1)
 
-#define PIB_MCAST_QP_ATTACH             (128)
+#define PIB_MCAST_QP_ATTACH             (4096) /* max QPs per multicast group */
+#define PIB_MCAST_HASH_SIZE		(1024) /* must be power of 2 */
 #define PIB_LID_PERMISSIVE		(0xFFFF)
 
 #define PIB_DEVICE_CAP_FLAGS		(IB_DEVICE_CHANGE_PHY_PORT |\
@@ -195,6 +203,18 @@
 
 #define PIB_MAX_CONTIG_REQUESTS		(64)
 #define PIB_MAX_CONTIG_READ_ACKS	(64)
+
+#define PIB_ACK_COALESCE		(16)
+#define PIB_ACK_DELAY			(1000) /* in microseconds */
+
+#define PIB_CC_MIN_WINDOW		(2)
+#define PIB_CC_INIT_WINDOW		(16)
+#define PIB_CC_MAX_WINDOW		(256)
+#define PIB_CC_INIT_SSTHRESH		(PIB_MAX_CONTIG_REQUESTS)
+#define PIB_CNP_INTERVAL		(16) /* packets between congestion notifications per QP */
+
+#define PIB_MIN_RTO			(1000) /* in microseconds */
+#define PIB_RTT_MAX_SAMPLE		(1000000) /* in microseconds */
 	
 
 #define pib_debug(fmt, args...)					\
@@ -362,16 +382,31 @@ enum pib_debugfs_type {
 	PIB_DEBUGFS_AH,
 	PIB_DEBUGFS_CQ,
 	PIB_DEBUGFS_QP,
+	PIB_DEBUGFS_RC_QP,
 	PIB_DEBUGFS_LAST
 };
 
 
+enum pib_capture_direction {
+	PIB_CAPTURE_INBOUND	= 1,
+	PIB_CAPTURE_OUTBOUND
+};
+
+
+enum {
+	PIB_CAPTURE_FILTER_LID	  = 1U << 0, /* SLID or DLID */
+	PIB_CAPTURE_FILTER_QPN	  = 1U << 1, /* Destination QP */
+	PIB_CAPTURE_FILTER_OPCODE = 1U << 2
+};
+
+
 enum pib_link_cmd {
 	PIB_LINK_CMD_CONNECT	= 1,
 	PIB_LINK_CMD_CONNECT_ACK,
 	PIB_LINK_CMD_DISCONNECT,
 	PIB_LINK_CMD_DISCONNECT_ACK,
 	PIB_LINK_SHUTDOWN,
+	PIB_LINK_CMD_LID_MAP,	/* pibnetd -> pib.ko: LID からホストのアドレスへの対応表 */
 };
 
 
@@ -396,10 +431,25 @@ struct pib_work_struct {
 
 
 struct pib_mcast_link {
+	union ib_gid		mgid;
 	u16			lid;
 	u32			qp_num;
 	struct list_head        qp_list;
-	struct list_head        lid_list;
+};
+
+
+/*
+ *  MGID と MLID で識別されるマルチキャストグループと、参加している QP の配列。
+ *  attach/detach の度に作り直して dev->mcast_hash に RCU で公開し、受信側は
+ *  ロックを取らずに参照する。
+ */
+struct pib_mcast_group {
+	struct list_head	list; /* link to dev->mcast_hash[] */
+	struct rcu_head		rcu;
+	union ib_gid		mgid;
+	u16			mlid;
+	int			nr_qps;
+	struct pib_qp	       *qps[0];
 };
 
 
@@ -461,6 +511,9 @@ struct pib_port {
 	struct pib_qp	       *qp_info[PIB_MAD_QPS_CORE];
 	__be16			pkey_table[PIB_PKEY_TABLE_LEN];
 
+	/* LID・GID prefix・P_Key table を変更する度に増やす。パケットヘッダの雛形の作り直しに使う */
+	u32			template_gen;
+
 	struct {
 		enum pib_link_cmd	cmd;
 		struct pib_work_struct	work;
@@ -551,6 +604,21 @@ struct pib_dev {
 		void	       *send_buffer; /* buffer for sendmsg */
 		void	       *recv_buffer; /* buffer for recvmsg */
 		int		recv_size;
+		struct sockaddr_in6 recv_sockaddr; /* recvmsg で受け取った送信元 */
+
+		/*
+		 *  QP を 1 回スケジュールする間に組み立てたパケット。
+		 *  QP のロックを外してからまとめて sendmsg する。
+		 */
+		void	       *burst_buffer; /* PIB_SCHED_BURST 個分の send_buffer */
+		int		nr_burst_packets;
+		struct {
+			u8	port_num;
+			u16	slid;
+			u16	dlid;
+			u32	src_qp_num;
+			u32	trace_id;
+		} burst_packets[PIB_SCHED_BURST];
 
 		u8		port_num;
 		u16		slid;
@@ -558,9 +626,15 @@ struct pib_dev {
 		u32		src_qp_num;
 		u32		trace_id;
 		int		ready_to_send;
+		int		congested; /* 受信ソケットに未処理のパケットが溜まっている */
+
+		/* pibnetd を経由せずに直接送る相手 (pib_netd_lid_table のコピー) */
+		struct sockaddr_in direct_sockaddr;
 	} thread;
 
-	struct list_head       *mcast_table;
+	struct mutex		mcast_mutex; /* mcast_hash の更新用 */
+	int			nr_mcast_grp;
+	struct list_head       *mcast_hash; /* MGID のハッシュ値ごとの pib_mcast_group のリスト */
 	struct pib_port	       *ports;
 
 	struct {
@@ -584,6 +658,24 @@ struct pib_dev {
 	struct {
 		u32		local_ack_timeout;
 	} perf;
+
+	/* pcapng capture (pib_capture.c) */
+	struct {
+		spinlock_t	lock;	/* enabled と relay_reserve を守る */
+		struct mutex	mutex;	/* start/stop */
+		int		enabled;
+		struct rchan   *chan;
+		struct dentry  *ctrl;
+		void	       *header; /* SHB + IDBs written at each sub-buffer */
+		size_t		header_size;
+		u32		snaplen;
+		u32		filter; /* PIB_CAPTURE_FILTER_XXX */
+		u16		lid;
+		u32		qpn;
+		u8		opcode;
+		u64		nr_packets;
+		atomic_t	dropped;
+	} capture;
 };
 
 
@@ -635,16 +727,32 @@ struct pib_pd {
 	u32			pd_num;
 	struct timespec		creation_time;
 
-	spinlock_t		lock;
+	spinlock_t		lock; /* mr_table の更新用。参照は RCU で行う */
 
 	int                     nr_mr;
-	struct pib_mr	      **mr_table;
+	struct pib_mr __rcu   **mr_table;
+};
+
+
+/*
+ *  送信パケットの LRH, GRH, BTH の雛形。
+ *  AH と RC・UC の QP のアドレスが決まった時点で作成しておき、パケット毎には
+ *  コピーして OpCode や PSN などを書き換えるだけにする。
+ */
+struct pib_packet_template {
+	u8			port_num; /* 0 の時は未作成 */
+	u8			size;     /* LRH + (GRH) + BTH のバイト数 */
+	u32			gen;      /* 作成時の port->template_gen */
+	u16			slid;
+	u16			dlid;
+	u8			buffer[sizeof(struct pib_packet_lrh) + sizeof(struct ib_grh) + sizeof(struct pib_packet_bth)];
 };
 
 
 struct pib_ah {
 	struct ib_ah            ib_ah;
 	struct ib_ah_attr       ib_ah_attr;
+	struct pib_packet_template template; /* BTH の P_Key と DestQP は Send WR 毎に埋める */
 	struct list_head        list; /* link to dev->ah_head */
 
 	u32			ah_num;
@@ -726,6 +834,7 @@ struct pib_srq {
 struct pib_rd_atom_slot {
 	u32                     psn;
 	u32                     expected_psn;
+	u32                     msn;
 	int                     OpCode;
 
 	union {
@@ -789,6 +898,8 @@ struct pib_qp {
 	struct ib_qp_attr       ib_qp_attr; /* don't use qp_state and cur_qp_state. */ 
 	struct ib_qp_init_attr  ib_qp_init_attr;
 
+	struct pib_packet_template template; /* RC と UC のみ */
+
 	struct rb_node          rb_node; /* for dev->qp_table */
 
 	pib_spinlock_t		lock;
@@ -806,6 +917,8 @@ struct pib_qp {
 	struct {
 		u32			psn; /* sq_psn */
 		u32			expected_psn;
+		u32			msn; /* responder で完了したことを確認したメッセージ数 */
+		u64			nr_retired_swqes; /* MSN によってまとめて完了させた Send WQE 数 */
 
 		/* list of WRs to be new submitted in SQ but not to be processed. */
 		int                     nr_submitted_swqe;
@@ -819,6 +932,15 @@ struct pib_qp {
 		int                     nr_waiting_swqe;
 		struct list_head        waiting_swqe_head;
 
+		/*
+		 *  waiting list と sending list の Send WQE を PSN 順に並べたリング。
+		 *  PSN を割り当てた時に末尾に加え、完了した時に先頭から外す。
+		 */
+		struct pib_send_wqe   **inflight_swqes;
+		u32			inflight_mask;
+		u32			inflight_head;
+		u32			nr_inflight_swqe;
+
 		u8                      max_rd_atomic; /* これは ib_qp_attr.max_rd_atomic をベースに flow-control のために動的に調整する */
 		int			nr_rd_atomic;
 
@@ -826,13 +948,46 @@ struct pib_qp {
 
 		void		       *inline_data_buffer;
 
-		int 			nr_contig_requests; /* 連続して RC Request を送信した回数 */
 		int 			nr_contig_read_acks; /* 連続して RDMA READ ACK を受信した回数  */
+
+		/*
+		 *  輻輳制御 (AIMD): ACK されていないパケット数を cwnd 以下に抑える。
+		 *  recover_psn が ACK されるまでは再度ウィンドウを縮小しない。
+		 */
+		struct {
+			u32		cwnd;
+			u32		ssthresh;
+			u32		cwnd_cnt; /* congestion avoidance 中に ACK されたパケット数 */
+			u32		recover_psn;
+			int		in_recovery;
+			u32		nr_read_packets; /* 応答待ちの RDMA READ が予約した 2 つ目以降の PSN の数 */
+			u64		nr_cnps; /* 受信した輻輳通知の数 */
+			u64		nr_decreases; /* ウィンドウを縮小した回数 */
+		} cc;
+
+		/*
+		 *  Local ACK Timeout は in-flight の最も古いパケットに対して QP で
+		 *  1 つだけ持つ。再送時間 (RTO) は ACK の往復時間から見積もる。
+		 */
+		unsigned long		local_ack_time; /* in jiffies */
+
+		struct {
+			u32		srtt;   /* in microseconds << 3 */
+			u32		rttvar; /* in microseconds << 2 */
+			unsigned long	rto;    /* in jiffies */
+			unsigned long	retry_time; /* in jiffies, retry_cnt を最後に減らすか ACK を受けた時刻 */
+			u32		high_psn; /* 一度でも送信した PSN の次 */
+			u32		psn;    /* 往復時間を計測中の PSN */
+			int		timing;
+			s64		timestamp; /* in nanoseconds */
+			u64		nr_samples;
+		} rtt;
 	} requester;
 
 	/* responder side */
 	struct {
 		u32			psn; /* rq_psn */
+		u32			msn; /* Message Sequence Number */
 					
 		/* list of WRs to be submitted in RQ. */
 		int                     nr_recv_wqe;
@@ -852,10 +1007,25 @@ struct pib_qp {
 			u32		dmalen;
 		} rdma_write;
 
-		int			slot_index;
+		/* 最近受理した RDMA READ / Atomic の max_dest_rd_atomic 個をリングで保持する */
+		u32			slot_index;
 		struct pib_rd_atom_slot slots[PIB_MAX_RD_ATOM];
 
-		int 			nr_contig_read_acks; /* 連続して RDMA READ ACK を送信した回数  */
+		/*
+		 *  RDMA READ response のウィンドウ: requester が受信を通知した PSN から
+		 *  PIB_MAX_CONTIG_READ_ACKS 個先までの response を続けて送信できる。
+		 */
+		u32			read_acked_psn;
+
+		/*
+		 *  Delayed ACK: 0 以外の時は ack_head に 1 つだけ積まれた ACK を
+		 *  delayed_ack_time まで送信を遅延させている。
+		 */
+		int			nr_delayed_acks; /* 遅延中の ACK に合体したパケット数 */
+		unsigned long		delayed_ack_time; /* in jiffies */
+
+		int			nr_packets_since_cnp; /* 最後に輻輳通知を送ってから受信したパケット数 */
+		u64			nr_cnps; /* 送信した輻輳通知の数 */
 	} responder;
 
 	struct list_head	mcast_head;
@@ -882,7 +1052,6 @@ struct pib_swqe_processing {
 	u32                     first_sent_packets;
 
 	unsigned long           schedule_time;
-	unsigned long           local_ack_time;
 
 	int                     retry_cnt;
 
@@ -975,6 +1144,8 @@ extern u64 pib_hca_guid_base;
 extern struct pib_dev *pib_devs[];
 extern struct pib_easy_sw pib_easy_sw;
 extern struct sockaddr **pib_lid_table;
+extern struct sockaddr_in *pib_netd_lid_table;
+extern spinlock_t pib_netd_lid_lock;
 extern unsigned int pib_num_hca;
 extern unsigned int pib_phys_port_cnt;
 extern unsigned int pib_behavior;
@@ -1059,6 +1230,14 @@ extern int pib_dealloc_pd(struct ib_pd *ibpd);
 extern u32 pib_alloc_obj_num(struct pib_dev *dev, u32 start, u32 size, u32 *last_num_p);
 extern void pib_dealloc_obj_num(struct pib_dev *dev, u32 start, u32 index);
 extern void pib_fill_grh(struct pib_dev *dev, u8 port_num, struct ib_grh *dest, const struct ib_global_route *src);
+extern void pib_init_packet_template(struct pib_dev *dev, struct pib_packet_template *template, u8 port_num, const struct ib_ah_attr *ah_attr);
+extern void *pib_copy_packet_template(const struct pib_packet_template *template, void *buffer, struct pib_packet_lrh **lrh_p, struct ib_grh **grh_p, struct pib_packet_bth **bth_p);
+
+static inline bool pib_packet_template_is_valid(const struct pib_dev *dev, const struct pib_packet_template *template, u8 port_num)
+{
+	return (template->port_num == port_num) &&
+		(template->gen == dev->ports[port_num - 1].template_gen);
+}
 
 
 /*
@@ -1083,6 +1262,7 @@ extern struct ib_ah *pib_create_ah(struct ib_pd *pd, struct ib_ah_attr *ah_attr)
 extern int pib_query_ah(struct ib_ah *ibah, struct ib_ah_attr *ah_attr);
 extern int pib_modify_ah(struct ib_ah *ibah, struct ib_ah_attr *ah_attr);
 extern int pib_destroy_ah(struct ib_ah *ibah);
+extern void pib_update_ah_packet_template(struct pib_dev *dev, struct pib_ah *ah);
 
 /*
  *  in pib_mr.c
@@ -1160,6 +1340,9 @@ extern int pib_post_send(struct ib_qp *ibqp, struct ib_send_wr *wr,
 extern int pib_post_recv(struct ib_qp *ibqp, struct ib_recv_wr *wr,
 			 struct ib_recv_wr **bad_wr);
 extern void pib_util_free_send_wqe(struct pib_qp *qp, struct pib_send_wqe *send_wqe);
+extern void pib_update_qp_packet_template(struct pib_dev *dev, struct pib_qp *qp);
+extern void pib_util_push_inflight_swqe(struct pib_qp *qp, struct pib_send_wqe *send_wqe);
+extern void pib_util_pop_inflight_swqe(struct pib_qp *qp, struct pib_send_wqe *send_wqe);
 extern void pib_util_free_recv_wqe(struct pib_qp *qp, struct pib_recv_wqe *recv_wqe);
 extern struct pib_qp *pib_util_find_qp(struct pib_dev *dev, int qp_num);
 extern void pib_util_flush_qp(struct pib_qp *qp, int send_only);
@@ -1172,6 +1355,7 @@ extern void pib_util_insert_async_qp_event(struct pib_qp *qp, enum ib_event_type
 extern int pib_attach_mcast(struct ib_qp *ibqp, union ib_gid *gid, u16 lid);
 extern int pib_detach_mcast(struct ib_qp *ibqp, union ib_gid *gid, u16 lid);
 extern void pib_detach_all_mcast(struct pib_dev *dev, struct pib_qp *qp);
+extern struct pib_mcast_group *pib_find_mcast_group(struct pib_dev *dev, const union ib_gid *mgid, u16 mlid);
 
 /*
  *  in pib_dma.c 
@@ -1190,7 +1374,14 @@ extern void pib_receive_ud_qp_incoming_message(struct pib_dev *dev, u8 port_num,
 extern int pib_process_rc_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
 extern int pib_process_local_only_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
 extern void pib_receive_rc_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size);
+extern void pib_receive_uc_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size);
 extern int pib_generate_rc_qp_acknowledge(struct pib_dev *dev, struct pib_qp *qp);
+extern void pib_reset_rc_qp_congestion_control(struct pib_qp *qp);
+extern void pib_reset_rc_qp_read_window(struct pib_qp *qp);
+extern bool pib_is_rc_qp_read_window_full(struct pib_qp *qp);
+extern bool pib_is_rc_qp_window_full(struct pib_qp *qp);
+extern void pib_reset_rc_qp_rtt(struct pib_qp *qp);
+extern bool pib_notify_rc_qp_local_ack_timeout(struct pib_qp *qp, unsigned long now);
 
 /*
  *  in pib_mad.c
@@ -1228,6 +1419,19 @@ extern int pib_register_debugfs(void);
 extern void pib_unregister_debugfs(void);
 extern void pib_inject_err_handler(struct pib_work_struct *work);
 
+/*
+ *  in pib_capture.c
+ */
+extern int pib_register_capture(struct pib_dev *dev);
+extern void pib_unregister_capture(struct pib_dev *dev);
+extern void pib_capture_packet(struct pib_dev *dev, u8 port_num, int direction, void *buffer, int size);
+
+static inline void pib_capture(struct pib_dev *dev, u8 port_num, int direction, void *buffer, int size)
+{
+	if (unlikely(dev->capture.enabled))
+		pib_capture_packet(dev, port_num, direction, buffer, size);
+}
+
 /*
  *  in pib_lib.c
  */
@@ -44,6 +44,7 @@ pib_create_ah(struct ib_pd *ibpd, struct ib_ah_attr *ah_attr)
 	spin_unlock_irqrestore(&dev->lock, flags);
 
 	ah->ib_ah_attr = *ah_attr;
+	pib_update_ah_packet_template(dev, ah);
 
 	pib_trace_api(dev, IB_USER_VERBS_CMD_CREATE_AH, ah_num);
 
@@ -70,6 +71,7 @@ int pib_modify_ah(struct ib_ah *ibah, struct ib_ah_attr *ah_attr)
 	pib_trace_api(dev, IB_USER_VERBS_CMD_MODIFY_AH, ah->ah_num);
 
 	ah->ib_ah_attr = *ah_attr;
+	pib_update_ah_packet_template(dev, ah);
 
 	return 0;
 }
@@ -119,3 +121,20 @@ int pib_destroy_ah(struct ib_ah *ibah)
 	return 0;
 }
 
+
+/*
+ *  送信時の検査を通らない AH では雛形を作らずにおく。
+ *  送信時に port_num が一致しなければ作り直される。
+ */
+void pib_update_ah_packet_template(struct pib_dev *dev, struct pib_ah *ah)
+{
+	const struct ib_ah_attr *ah_attr = &ah->ib_ah_attr;
+
+	if ((ah_attr->port_num < 1) || (dev->ib_dev.phys_port_cnt < ah_attr->port_num) ||
+	    ((ah_attr->ah_flags & IB_AH_GRH) && (PIB_GID_PER_PORT <= ah_attr->grh.sgid_index))) {
+		ah->template.port_num = 0;
+		return;
+	}
+
+	pib_init_packet_template(dev, &ah->template, ah_attr->port_num, ah_attr);
+}
@@ -0,0 +1,508 @@
+/*
+ * pib_capture.c - Packet capture in pcapng format
+ *
+ * Copyright (c) 2013-2015 Minoru NAKAMURA <nminoru@nminoru.jp>
+ *
+ * This code is licenced under the GPL version 2 or BSD license.
+ */
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/relay.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
+
+#include "pib.h"
+#include "pib_spinlock.h"
+#include "pib_packet.h"
+
+
+/*
+ *  送受信したパケットを relay の per-CPU バッファに pcapng 形式で書き出す。
+ *
+ *    /sys/kernel/debug/pib/pib_X/capture_ctrl
+ *        "start [snaplen=N] [lid=N] [qpn=N] [opcode=N]" で開始、"stop" で停止
+ *    /sys/kernel/debug/pib/pib_X/capture<cpu>
+ *        CPU ごとの pcapng ストリーム (read または mmap で読む)
+ *
+ *  各サブバッファの先頭に SHB と IDB を置くので、サブバッファ単位で独立した
+ *  pcapng のセクションになる。CPU ごとのファイルをつなげればそのまま読める。
+ */
+
+#define PCAPNG_BLOCK_SHB	(0x0A0D0D0A)
+#define PCAPNG_BLOCK_IDB	(0x00000001)
+#define PCAPNG_BLOCK_EPB	(0x00000006)
+#define PCAPNG_BYTE_ORDER_MAGIC	(0x1A2B3C4D)
+#define PCAPNG_LINKTYPE_INFINIBAND (247)
+
+#define PCAPNG_OPT_ENDOFOPT	(0)
+#define PCAPNG_OPT_IF_NAME	(2)
+#define PCAPNG_OPT_IF_TSRESOL	(9)
+#define PCAPNG_OPT_EPB_FLAGS	(2)
+
+#define PIB_CAPTURE_CTRL_LEN	(128)
+
+
+static int build_header(struct pib_dev *dev);
+static void stop_capture(struct pib_dev *dev);
+
+
+static inline u32 pcapng_align(u32 size)
+{
+	return (size + 3) & ~3U;
+}
+
+
+static void *put_u16(void *p, u16 value)
+{
+	memcpy(p, &value, sizeof(value));
+	return p + sizeof(value);
+}
+
+
+static void *put_u32(void *p, u32 value)
+{
+	memcpy(p, &value, sizeof(value));
+	return p + sizeof(value);
+}
+
+
+static void *put_option(void *p, u16 code, const void *data, u16 length)
+{
+	p = put_u16(p, code);
+	p = put_u16(p, length);
+	memcpy(p, data, length);
+	memset(p + length, 0, pcapng_align(length) - length);
+	return p + pcapng_align(length);
+}
+
+
+/******************************************************************************/
+/* relay callbacks                                                            */
+/******************************************************************************/
+
+static int subbuf_start_callback(struct rchan_buf *buf, void *subbuf,
+				 void *prev_subbuf, size_t prev_padding)
+{
+	struct pib_dev *dev = buf->chan->private_data;
+
+	/* 読み手が追いつかない時は古いデータを上書きせずに捨てる */
+	if (relay_buf_full(buf)) {
+		atomic_inc(&dev->capture.dropped);
+		return 0;
+	}
+
+	memcpy(subbuf, dev->capture.header, dev->capture.header_size);
+	subbuf_start_reserve(buf, dev->capture.header_size);
+
+	return 1;
+}
+
+
+static struct dentry *create_buf_file_callback(const char *filename,
+					       struct dentry *parent,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 3, 0)
+					       umode_t mode,
+#else
+					       int mode,
+#endif
+					       struct rchan_buf *buf,
+					       int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf, &relay_file_operations);
+}
+
+
+static int remove_buf_file_callback(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+
+	return 0;
+}
+
+
+static struct rchan_callbacks relay_callbacks = {
+	.subbuf_start	 = subbuf_start_callback,
+	.create_buf_file = create_buf_file_callback,
+	.remove_buf_file = remove_buf_file_callback,
+};
+
+
+/******************************************************************************/
+/* Capture                                                                    */
+/******************************************************************************/
+
+void pib_capture_packet(struct pib_dev *dev, u8 port_num, int direction, void *buffer, int size)
+{
+	unsigned long flags;
+	struct pib_packet_lrh *lrh;
+	struct ib_grh         *grh;
+	struct pib_packet_bth *bth;
+	u32 caplen, block_len, flag;
+	u64 time;
+	void *p;
+
+	lrh = (struct pib_packet_lrh *)buffer;
+
+	/* pibnetd との間の制御パケット (Raw packet) は IB のパケットではない */
+	if (size < sizeof(*lrh) || (lrh->sl_rsv_lnh & 0x3) == 0)
+		return;
+
+	if (dev->capture.filter) {
+		if (pib_parse_packet_header(buffer, size, &lrh, &grh, &bth) < 0)
+			return;
+
+		if ((dev->capture.filter & PIB_CAPTURE_FILTER_LID) &&
+		    (be16_to_cpu(lrh->dlid) != dev->capture.lid) &&
+		    (be16_to_cpu(lrh->slid) != dev->capture.lid))
+			return;
+
+		if ((dev->capture.filter & PIB_CAPTURE_FILTER_QPN) &&
+		    ((be32_to_cpu(bth->destQP) & PIB_QPN_MASK) != dev->capture.qpn))
+			return;
+
+		if ((dev->capture.filter & PIB_CAPTURE_FILTER_OPCODE) &&
+		    (bth->OpCode != dev->capture.opcode))
+			return;
+	}
+
+	caplen	  = min_t(u32, size, dev->capture.snaplen);
+	block_len = 28 + pcapng_align(caplen) + 12 + 4;
+	time	  = ktime_to_ns(ktime_get_real());
+	flag	  = (direction == PIB_CAPTURE_INBOUND) ? 1 : 2;
+
+	spin_lock_irqsave(&dev->capture.lock, flags);
+
+	if (!dev->capture.enabled)
+		goto done;
+
+	p = relay_reserve(dev->capture.chan, block_len);
+	if (!p) {
+		atomic_inc(&dev->capture.dropped);
+		goto done;
+	}
+
+	p = put_u32(p, PCAPNG_BLOCK_EPB);
+	p = put_u32(p, block_len);
+	p = put_u32(p, port_num - 1); /* Interface ID */
+	p = put_u32(p, (u32)(time >> 32));
+	p = put_u32(p, (u32)time);
+	p = put_u32(p, caplen);
+	p = put_u32(p, size);
+	memcpy(p, buffer, caplen);
+	memset(p + caplen, 0, pcapng_align(caplen) - caplen);
+	p += pcapng_align(caplen);
+	p = put_option(p, PCAPNG_OPT_EPB_FLAGS, &flag, sizeof(flag));
+	p = put_u32(p, PCAPNG_OPT_ENDOFOPT);
+	put_u32(p, block_len);
+
+	dev->capture.nr_packets++;
+
+done:
+	spin_unlock_irqrestore(&dev->capture.lock, flags);
+}
+
+
+/*
+ *  サブバッファの先頭に書く SHB とポートごとの IDB を組み立てておく。
+ */
+static int build_header(struct pib_dev *dev)
+{
+	int i;
+	u32 size, shb_len = 28, idb_len, snaplen;
+	void *p;
+	u8 tsresol = 9; /* nsec */
+
+	idb_len = 16 + (4 + pcapng_align(IB_DEVICE_NAME_MAX + 4)) + (4 + 4) + 4 + 4;
+	size	= shb_len + idb_len * dev->ib_dev.phys_port_cnt;
+
+	kfree(dev->capture.header);
+
+	dev->capture.header = kzalloc(size, GFP_KERNEL);
+	if (!dev->capture.header)
+		return -ENOMEM;
+
+	p = dev->capture.header;
+
+	p = put_u32(p, PCAPNG_BLOCK_SHB);
+	p = put_u32(p, shb_len);
+	p = put_u32(p, PCAPNG_BYTE_ORDER_MAGIC);
+	p = put_u16(p, 1); /* Major Version */
+	p = put_u16(p, 0); /* Minor Version */
+	p = put_u32(p, 0xFFFFFFFF); /* Section Length (unspecified) */
+	p = put_u32(p, 0xFFFFFFFF);
+	p = put_u32(p, shb_len);
+
+	snaplen = dev->capture.snaplen;
+
+	for (i=0 ; i<dev->ib_dev.phys_port_cnt ; i++) {
+		char name[IB_DEVICE_NAME_MAX + 4];
+		void *start = p;
+		u32 len;
+
+		snprintf(name, sizeof(name), "%s:%u", dev->ib_dev.name, i + 1);
+
+		p = put_u32(p, PCAPNG_BLOCK_IDB);
+		p = put_u32(p, 0); /* 後で埋める */
+		p = put_u16(p, PCAPNG_LINKTYPE_INFINIBAND);
+		p = put_u16(p, 0);
+		p = put_u32(p, snaplen);
+		p = put_option(p, PCAPNG_OPT_IF_NAME, name, strlen(name));
+		p = put_option(p, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+		p = put_u32(p, PCAPNG_OPT_ENDOFOPT);
+
+		len = p - start + 4;
+		p = put_u32(p, len);
+		put_u32(start + 4, len);
+	}
+
+	dev->capture.header_size = p - dev->capture.header;
+
+	return 0;
+}
+
+
+static int start_capture(struct pib_dev *dev)
+{
+	int ret;
+	unsigned long flags;
+	struct rchan *chan;
+
+	/* 前回のバッファは次の start まで読めるように残してある */
+	if (dev->capture.chan) {
+		relay_close(dev->capture.chan);
+		dev->capture.chan = NULL;
+	}
+
+	ret = build_header(dev);
+	if (ret)
+		return ret;
+
+	chan = relay_open("capture", dev->debugfs.dir,
+			  PIB_CAPTURE_SUBBUF_SIZE, PIB_CAPTURE_NR_SUBBUFS,
+			  &relay_callbacks, dev);
+	if (!chan) {
+		pr_err("pib: failed to create debugfs \"pib/%s/capture\"\n", dev->ib_dev.name);
+		return -ENOMEM;
+	}
+
+	atomic_set(&dev->capture.dropped, 0);
+	dev->capture.nr_packets = 0;
+
+	spin_lock_irqsave(&dev->capture.lock, flags);
+	dev->capture.chan    = chan;
+	dev->capture.enabled = 1;
+	spin_unlock_irqrestore(&dev->capture.lock, flags);
+
+	return 0;
+}
+
+
+static void stop_capture(struct pib_dev *dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->capture.lock, flags);
+	dev->capture.enabled = 0;
+	spin_unlock_irqrestore(&dev->capture.lock, flags);
+
+	if (dev->capture.chan)
+		relay_flush(dev->capture.chan);
+}
+
+
+/******************************************************************************/
+/* debugfs "capture_ctrl"                                                     */
+/******************************************************************************/
+
+static int capture_ctrl_open(struct inode *inode, struct file *file)
+{
+	if (!try_module_get(THIS_MODULE))
+		return -EBUSY;
+
+	nonseekable_open(inode, file);
+
+	file->private_data = inode->i_private;
+
+	return 0;
+}
+
+
+static ssize_t
+capture_ctrl_write(struct file *file, const char __user *buf,
+		   size_t len, loff_t *ppos)
+{
+	int ret;
+	struct pib_dev *dev;
+	char cmd[PIB_CAPTURE_CTRL_LEN], *p, *token;
+	u32 snaplen = PIB_PACKET_BUFFER, filter = 0, qpn = 0;
+	u16 lid = 0;
+	u8 opcode = 0;
+
+	dev = file->private_data;
+
+	if (*ppos != 0)
+		return 0;
+
+	if (len >= sizeof(cmd))
+		return -EINVAL;
+
+	if (copy_from_user(cmd, buf, len))
+		return -EFAULT;
+
+	cmd[len] = '\0';
+
+	p = cmd;
+	token = strsep(&p, " \t\n");
+
+	if (strcmp(token, "stop") == 0) {
+		mutex_lock(&dev->capture.mutex);
+		stop_capture(dev);
+		mutex_unlock(&dev->capture.mutex);
+		goto done;
+	}
+
+	if (strcmp(token, "start") != 0)
+		return -EINVAL;
+
+	while ((token = strsep(&p, " \t\n")) != NULL) {
+		unsigned int value;
+
+		if (*token == '\0')
+			continue;
+
+		if (sscanf(token, "snaplen=%i", &value) == 1) {
+			if (value < sizeof(struct pib_packet_lrh))
+				return -EINVAL;
+			snaplen = value;
+		} else if (sscanf(token, "lid=%i", &value) == 1) {
+			if (0xFFFF < value)
+				return -EINVAL;
+			lid = value;
+			filter |= PIB_CAPTURE_FILTER_LID;
+		} else if (sscanf(token, "qpn=%i", &value) == 1) {
+			if (PIB_QPN_MASK < value)
+				return -EINVAL;
+			qpn = value;
+			filter |= PIB_CAPTURE_FILTER_QPN;
+		} else if (sscanf(token, "opcode=%i", &value) == 1) {
+			if (0xFF < value)
+				return -EINVAL;
+			opcode = value;
+			filter |= PIB_CAPTURE_FILTER_OPCODE;
+		} else
+			return -EINVAL;
+	}
+
+	mutex_lock(&dev->capture.mutex);
+
+	stop_capture(dev);
+
+	dev->capture.snaplen = snaplen;
+	dev->capture.filter  = filter;
+	dev->capture.lid     = lid;
+	dev->capture.qpn     = qpn;
+	dev->capture.opcode  = opcode;
+
+	ret = start_capture(dev);
+
+	mutex_unlock(&dev->capture.mutex);
+
+	if (ret)
+		return ret;
+
+done:
+	*ppos = len;
+
+	return len;
+}
+
+
+static ssize_t capture_ctrl_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct pib_dev *dev;
+	char status[PIB_CAPTURE_CTRL_LEN * 2];
+	int len;
+
+	dev = file->private_data;
+
+	mutex_lock(&dev->capture.mutex);
+
+	len = snprintf(status, sizeof(status),
+		       "%s snaplen=%u", dev->capture.enabled ? "start" : "stop", dev->capture.snaplen);
+
+	if (dev->capture.filter & PIB_CAPTURE_FILTER_LID)
+		len += snprintf(status + len, sizeof(status) - len, " lid=0x%x", dev->capture.lid);
+	if (dev->capture.filter & PIB_CAPTURE_FILTER_QPN)
+		len += snprintf(status + len, sizeof(status) - len, " qpn=0x%x", dev->capture.qpn);
+	if (dev->capture.filter & PIB_CAPTURE_FILTER_OPCODE)
+		len += snprintf(status + len, sizeof(status) - len, " opcode=0x%x", dev->capture.opcode);
+
+	len += snprintf(status + len, sizeof(status) - len, "\npackets=%llu dropped=%u\n",
+			(unsigned long long)dev->capture.nr_packets,
+			atomic_read(&dev->capture.dropped));
+
+	mutex_unlock(&dev->capture.mutex);
+
+	return simple_read_from_buffer(buf, count, ppos, status, len);
+}
+
+
+static int capture_ctrl_release(struct inode *inode, struct file *file)
+{
+	module_put(THIS_MODULE);
+
+	return 0;
+}
+
+
+static const struct file_operations capture_ctrl_fops = {
+	.owner   = THIS_MODULE,
+	.open    = capture_ctrl_open,
+	.read    = capture_ctrl_read,
+	.write   = capture_ctrl_write,
+	.llseek  = no_llseek,
+	.release = capture_ctrl_release,
+};
+
+
+int pib_register_capture(struct pib_dev *dev)
+{
+	spin_lock_init(&dev->capture.lock);
+	mutex_init(&dev->capture.mutex);
+
+	dev->capture.snaplen = PIB_PACKET_BUFFER;
+
+	dev->capture.ctrl = debugfs_create_file("capture_ctrl", S_IFREG | S_IRUGO | S_IWUSR,
+						dev->debugfs.dir,
+						dev,
+						&capture_ctrl_fops);
+	if (!dev->capture.ctrl) {
+		pr_err("pib: failed to create debugfs \"pib/%s/capture_ctrl\"\n", dev->ib_dev.name);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+
+void pib_unregister_capture(struct pib_dev *dev)
+{
+	if (dev->capture.ctrl) {
+		debugfs_remove(dev->capture.ctrl);
+		dev->capture.ctrl = NULL;
+	}
+
+	/* register 前に失敗した時はロックも初期化されていない */
+	if (dev->capture.chan) {
+		stop_capture(dev);
+		relay_close(dev->capture.chan);
+		dev->capture.chan = NULL;
+	}
+
+	kfree(dev->capture.header);
+	dev->capture.header = NULL;
+}
@@ -65,6 +65,7 @@ static const char *debug_file_symbols[] = {
 	[PIB_DEBUGFS_AH]       = "ah",
 	[PIB_DEBUGFS_CQ]       = "cq",
 	[PIB_DEBUGFS_QP]       = "qp",
+	[PIB_DEBUGFS_RC_QP]    = "rc_qp",
 };
 
 
@@ -144,6 +145,23 @@ struct pib_qp_record {
 };
 
 
+struct pib_rc_qp_record {
+	struct pib_base_record	base;
+	u8	state;
+	u8	in_recovery;
+	u32	cwnd;
+	u32	ssthresh;
+	u64	nr_cnps_sent;
+	u64	nr_cnps_recv;
+	u64	nr_decreases;
+	u32	srtt;	/* in microseconds */
+	u32	rttvar;	/* in microseconds */
+	u32	rto;	/* in microseconds */
+	u64	nr_samples;
+	u64	nr_retired_swqes;
+};
+
+
 struct pib_record_control {
 	struct pib_dev	       *dev;
 	enum pib_debugfs_type	type;
@@ -168,6 +186,7 @@ static void *inspection_seq_start(struct seq_file *file, loff_t *pos)
 
 	case PIB_DEBUGFS_AH:
 	case PIB_DEBUGFS_QP:
+	case PIB_DEBUGFS_RC_QP:
 		seq_printf(file, "%-6s %-4s %-5s %-33s ", "OID", "UCTX", "UHWD", "CREATIONTIME");
 		break;
 
@@ -202,6 +221,12 @@ static void *inspection_seq_start(struct seq_file *file, loff_t *pos)
 			   "PD", "QT", "STATE", "S-CQ", "R-CQ", "SRQ", "MAX-S", "CUR-S", "MAX-R", "CUR-R");
 		break;
 
+	case PIB_DEBUGFS_RC_QP:
+		seq_printf(file, "%-5s %-4s %-4s %-3s %-8s %-8s %-8s %-8s %-8s %-8s %-8s %-8s\n",
+			   "STATE", "CWND", "SSTH", "REC", "CNP-S", "CNP-R", "DECR",
+			   "SRTT", "RTTVAR", "RTO", "SAMPLES", "RETIRED");
+		break;
+
 	default:
 		seq_puts(file, "\n");
 		break;
@@ -251,6 +276,7 @@ static int inspection_seq_show(struct seq_file *file, void *iter)
 	switch (control->type) {
 	case PIB_DEBUGFS_AH:
 	case PIB_DEBUGFS_QP:
+	case PIB_DEBUGFS_RC_QP:
 		seq_printf(file, "%06x ", record->obj_num);
 		break;
 
@@ -336,6 +362,21 @@ static int inspection_seq_show(struct seq_file *file, void *iter)
 		break;
 	}
 
+	case PIB_DEBUGFS_RC_QP: {
+		struct pib_rc_qp_record *rc_qp_rec = (struct pib_rc_qp_record *)record;
+		seq_printf(file, " %-5s %4u %4u %-3s %8llu %8llu %8llu %8u %8u %8u %8llu %8llu",
+			   pib_get_qp_state(rc_qp_rec->state),
+			   rc_qp_rec->cwnd, rc_qp_rec->ssthresh,
+			   (rc_qp_rec->in_recovery ? "REC" : "-"),
+			   (unsigned long long)rc_qp_rec->nr_cnps_sent,
+			   (unsigned long long)rc_qp_rec->nr_cnps_recv,
+			   (unsigned long long)rc_qp_rec->nr_decreases,
+			   rc_qp_rec->srtt, rc_qp_rec->rttvar, rc_qp_rec->rto,
+			   (unsigned long long)rc_qp_rec->nr_samples,
+			   (unsigned long long)rc_qp_rec->nr_retired_swqes);
+		break;
+	}
+
 	default:
 		BUG();
 	}
@@ -597,6 +638,46 @@ static int inspection_open(struct inode *inode, struct file *file)
 		break;
 	}
 
+	case PIB_DEBUGFS_RC_QP: {
+		struct pib_qp *qp;
+		struct pib_rc_qp_record *records;
+
+		control = vzalloc(sizeof(struct pib_record_control) +
+				  dev->nr_qp * sizeof(struct pib_rc_qp_record));
+		if (!control)
+			return -ENOMEM;
+
+		records  = (struct pib_rc_qp_record *)control->records;
+
+		i=0;
+		spin_lock_irqsave(&dev->lock, flags);
+		list_for_each_entry(qp, &dev->qp_head, list) {
+			if (qp->qp_type != IB_QPT_RC)
+				continue;
+			records[i].base.obj_num       = qp->ib_qp.qp_num;
+			records[i].base.creation_time = qp->creation_time;
+			records[i].state	      = qp->state;
+			records[i].in_recovery	      = qp->requester.cc.in_recovery;
+			records[i].cwnd		      = qp->requester.cc.cwnd;
+			records[i].ssthresh	      = qp->requester.cc.ssthresh;
+			records[i].nr_cnps_sent	      = qp->responder.nr_cnps;
+			records[i].nr_cnps_recv	      = qp->requester.cc.nr_cnps;
+			records[i].nr_decreases	      = qp->requester.cc.nr_decreases;
+			records[i].srtt		      = qp->requester.rtt.srtt >> 3;
+			records[i].rttvar	      = qp->requester.rtt.rttvar >> 2;
+			records[i].rto		      = jiffies_to_usecs(qp->requester.rtt.rto);
+			records[i].nr_samples	      = qp->requester.rtt.nr_samples;
+			records[i].nr_retired_swqes   = qp->requester.nr_retired_swqes;
+			set_pid_and_handle(&records[i].base, qp->ib_qp.uobject);
+			i++;
+		}
+		spin_unlock_irqrestore(&dev->lock, flags);
+		
+		control->count = i;
+		control->record_size = sizeof(struct pib_rc_qp_record);
+		break;
+	}
+
 	default:
 		BUG();
 	}
@@ -1504,6 +1585,10 @@ static int register_dev(struct dentry *root, struct pib_dev *dev)
 	/* 初回は必ずタイムレコードを記録できるようにする */
 	dev->debugfs.last_record_time_index = -PIB_TRACE_MAX_ENTRIES;
 
+	/* Packet capture */
+	if (pib_register_capture(dev))
+		goto err;
+
 	/* Object inspection */
 	for (i=0 ; i<PIB_DEBUGFS_LAST ; i++) {
 		struct dentry *dentry;
@@ -1543,6 +1628,8 @@ static void unregister_dev(struct pib_dev *dev)
 			debugfs_remove(dentry);
 	}
 
+	pib_unregister_capture(dev);
+
 	if (dev->debugfs.inject_err) {
 		debugfs_remove(dev->debugfs.inject_err);
 		dev->debugfs.inject_err = NULL;
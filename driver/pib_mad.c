@@ -564,6 +564,10 @@ static int subn_set_portinfo(struct ib_smp *smp, struct pib_dev *dev, u8 in_port
 	
 	pib_subn_set_portinfo(smp, port, port_num, PIB_PORT_CA);
 
+	/* LID や GID prefix が変わったかもしれないのでパケットヘッダの雛形を無効にする */
+	smp_wmb();
+	port->template_gen++;
+
 	if (port->is_connected) {
 		if (port->ib_port_attr.phys_state != PIB_PHYS_PORT_LINK_UP)
 			port->ib_port_attr.phys_state = PIB_PHYS_PORT_LINK_UP;
@@ -814,6 +818,8 @@ static int subn_set_pkey_table(struct ib_smp *smp, struct pib_dev *dev, u8 in_po
 
 		dev->ports[in_port_num - 1].pkey_table[i] = nkey;
 	}
+	smp_wmb();
+	dev->ports[in_port_num - 1].template_gen++;
 	spin_unlock_irqrestore(&dev->lock, flags);
 
 	if (changed) {
@@ -46,6 +46,8 @@ u64 pib_hca_guid_base;
 struct pib_dev *pib_devs[PIB_MAX_HCA];
 struct pib_easy_sw  pib_easy_sw;
 struct sockaddr **pib_lid_table;
+struct sockaddr_in *pib_netd_lid_table; /* multi-host-mode で pibnetd から教わった LID の宛先 */
+DEFINE_SPINLOCK(pib_netd_lid_lock);
 
 
 int pib_debug_level;
@@ -230,6 +232,71 @@ void pib_fill_grh(struct pib_dev *dev, u8 port_num, struct ib_grh *dest, const s
 }
 
 
+/*
+ *  AH の内容から LRH, GRH, BTH の雛形を作る。
+ *  BTH は全て 0 なので P_Key と DestQP は呼び出し側で埋めること。
+ */
+void pib_init_packet_template(struct pib_dev *dev, struct pib_packet_template *template, u8 port_num, const struct ib_ah_attr *ah_attr)
+{
+	void *buffer;
+	struct pib_packet_lrh *lrh;
+	struct ib_grh         *grh;
+	u8 lnh;
+
+	BUG_ON((port_num < 1) || (dev->ib_dev.phys_port_cnt < port_num));
+
+	memset(template, 0, sizeof(*template));
+
+	/* 先に世代を読んでおけば、作成中にポートの設定が変わっても次の送信で作り直される */
+	template->gen      = dev->ports[port_num - 1].template_gen;
+	smp_rmb();
+
+	template->port_num = port_num;
+	template->slid     = dev->ports[port_num - 1].ib_port_attr.lid;
+	template->dlid     = ah_attr->dlid;
+
+	buffer = template->buffer;
+
+	lrh = (struct pib_packet_lrh*)buffer;
+	buffer += sizeof(*lrh);
+	if (ah_attr->ah_flags & IB_AH_GRH) {
+		grh = (struct ib_grh*)buffer;
+		pib_fill_grh(dev, port_num, grh, &ah_attr->grh);
+		buffer += sizeof(*grh);
+		lnh = 0x3;
+	} else {
+		lnh = 0x2;
+	}
+	buffer += sizeof(struct pib_packet_bth);
+
+	lrh->sl_rsv_lnh = (ah_attr->sl << 4) | lnh; /* Transport: IBA & Next Header: BTH */
+	lrh->dlid   = cpu_to_be16(template->dlid);
+	lrh->slid   = cpu_to_be16(template->slid);
+
+	template->size = buffer - (void*)template->buffer;
+}
+
+
+/*
+ *  雛形を buffer にコピーして、LRH, GRH, BTH の位置を返す。
+ *  戻り値は BTH の直後。
+ */
+void *pib_copy_packet_template(const struct pib_packet_template *template, void *buffer, struct pib_packet_lrh **lrh_p, struct ib_grh **grh_p, struct pib_packet_bth **bth_p)
+{
+	memcpy(buffer, template->buffer, template->size);
+
+	*lrh_p = (struct pib_packet_lrh*)buffer;
+	*grh_p = (template->size == sizeof(template->buffer)) ?
+		(struct ib_grh*)(buffer + sizeof(struct pib_packet_lrh)) : NULL;
+
+	buffer += template->size;
+
+	*bth_p = (struct pib_packet_bth*)(buffer - sizeof(struct pib_packet_bth));
+
+	return buffer;
+}
+
+
 static int pib_query_pkey(struct ib_device *ibdev, u8 port_num, u16 index, u16 *pkey)
 {
 	struct pib_dev *dev;
@@ -584,12 +651,14 @@ static struct pib_dev *pib_dev_add(struct device *dma_device, int dev_id)
 
 	dev->ib_dev_attr		= ib_dev_attr;
 
-	dev->mcast_table		= vzalloc(sizeof(struct list_head) * (PIB_MAX_LID - PIB_MCAST_LID_BASE));
-	if (!dev->mcast_table)
-		goto err_mcast_table;
+	dev->mcast_hash			= vzalloc(sizeof(struct list_head) * PIB_MCAST_HASH_SIZE);
+	if (!dev->mcast_hash)
+		goto err_mcast_hash;
 
-	for (i=0 ; i<PIB_MAX_LID - PIB_MCAST_LID_BASE ; i++)
-		INIT_LIST_HEAD(&dev->mcast_table[i]);
+	for (i=0 ; i<PIB_MCAST_HASH_SIZE ; i++)
+		INIT_LIST_HEAD(&dev->mcast_hash[i]);
+
+	mutex_init(&dev->mcast_mutex);
 
 	dev->ports	= vzalloc(sizeof(struct sockaddr*) * dev->ib_dev.phys_port_cnt);
 	if (!dev->ports)
@@ -645,8 +714,8 @@ err_obj_num_bitmap:
 	vfree(dev->ports);
 err_ports:
 
-	vfree(dev->mcast_table);
-err_mcast_table:
+	vfree(dev->mcast_hash);
+err_mcast_hash:
 
 	ib_dealloc_device(&dev->ib_dev);
 
@@ -790,7 +859,7 @@ static void pib_dev_remove(struct pib_dev *dev)
 
 	vfree(dev->ports);
 	vfree(dev->obj_num_bitmap);
-	vfree(dev->mcast_table);
+	vfree(dev->mcast_hash);
 
 #ifdef PIB_HACK_IPOIB_LEAK_AH
 	/*
@@ -1066,6 +1135,10 @@ static int __init pib_init(void)
 		pib_lid_table = vzalloc(sizeof(struct sockaddr*) * PIB_MAX_LID);
 		if (!pib_lid_table)
 			goto err_alloc_lid_table;
+	} else if (pib_netd_sockaddr->sa_family == AF_INET) {
+		pib_netd_lid_table = vzalloc(sizeof(struct sockaddr_in) * PIB_MCAST_LID_BASE);
+		if (!pib_netd_lid_table)
+			goto err_alloc_lid_table;
 	}
 
 	if (pib_kmem_cache_create()) {
@@ -1115,6 +1188,10 @@ err_kmem_cache_destroy:
 		vfree(pib_lid_table);
 	pib_lid_table = NULL;
 
+	if (pib_netd_lid_table)
+		vfree(pib_netd_lid_table);
+	pib_netd_lid_table = NULL;
+
 err_alloc_lid_table:
 
 	device_unregister(dummy_parent_device);
@@ -1156,6 +1233,11 @@ static void __exit pib_cleanup(void)
 		pib_lid_table = NULL;
 	}
 
+	if (pib_netd_lid_table) {
+		vfree(pib_netd_lid_table);
+		pib_netd_lid_table = NULL;
+	}
+
 	if (dummy_parent_device) {
 		device_unregister(dummy_parent_device);
 		dummy_parent_device = NULL;
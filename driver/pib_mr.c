@@ -7,6 +7,7 @@
  */
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/rcupdate.h>
 #include <asm/atomic.h>
 
 
@@ -16,9 +17,31 @@
 
 
 static struct pib_mr *create_mr(struct pib_dev *dev, struct pib_pd *pd, enum pib_mr_state init_state, bool fast_reg_mr, int max_page_list_len);
+static enum ib_wc_status copy_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge, void *buffer, u64 offset, u64 size, int access_flags, enum pib_mr_direction direction);
 static enum ib_wc_status copy_data_with_rkey(struct pib_pd *pd, u32 rkey, void *buffer, u64 address, u64 size, int access_flags, enum pib_mr_direction direction, bool check_only);
 static int mr_copy_data(struct pib_mr *mr, void *buffer, u64 offset, u64 size, u64 swap, u64 compare, enum pib_mr_direction direction);
 static bool mr_copy_data_sub(void *buffer, void *target_vaddr, u64 range, u64 swap, u64 compare, enum pib_mr_direction direction);
+static enum ib_wc_status mr_atomic(struct pib_pd *pd, u32 rkey, u64 address, u64 swap, u64 compare, u64 *result, enum pib_mr_direction direction);
+
+
+/*
+ *  データパスは pd->lock を取らずに RCU で mr_table を参照する。
+ *  mr_table の更新は pd->lock を取って行い、外した MR は synchronize_rcu() で
+ *  参照が終わるのを待ってから解放する。
+ */
+static inline struct pib_mr *
+lookup_mr(struct pib_pd *pd, u32 key)
+{
+	return rcu_dereference(pd->mr_table[(key & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT]);
+}
+
+
+static inline struct pib_mr *
+lookup_mr_locked(struct pib_pd *pd, u32 key)
+{
+	return rcu_dereference_protected(pd->mr_table[(key & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT],
+					 lockdep_is_held(&pd->lock));
+}
 
 
 static int
@@ -30,7 +53,7 @@ reg_mr(struct pib_pd *pd, struct pib_mr *mr)
 	/* find an empty slot in mr_table[] */
 	spin_lock_irqsave(&pd->lock, flags);
 	for (i=0 ; i<PIB_MAX_MR_PER_PD ; i++)
-		if (pd->mr_table[i] == NULL)
+		if (rcu_access_pointer(pd->mr_table[i]) == NULL)
 			goto generate_new_key;
 	spin_unlock_irqrestore(&pd->lock, flags);
 
@@ -48,7 +71,7 @@ generate_new_key:
 		goto generate_new_key;
 #endif
 
-	pd->mr_table[i] = mr;
+	rcu_assign_pointer(pd->mr_table[i], mr);
 
 	pd->nr_mr++;
 
@@ -162,14 +185,15 @@ create_mr(struct pib_dev *dev, struct pib_pd *pd, enum pib_mr_state init_state,
 	mr->mr_num = mr_num;
 	spin_unlock_irqrestore(&dev->lock, flags);
 
-	if (reg_mr(pd, mr))
-		goto err_reg_mr;
-
 	mr->state = init_state;
 
 	mr->page_list = page_list;
 	mr->max_page_list_len = max_page_list_len;
 
+	/* reg_mr() した時点でデータパスから見えるようになる */
+	if (reg_mr(pd, mr))
+		goto err_reg_mr;
+
 	return mr;
 
 err_reg_mr:
@@ -211,9 +235,9 @@ pib_dereg_mr(struct ib_mr *ibmr)
 
 	spin_lock_irqsave(&pd->lock, flags);
 	lkey = (mr->ib_mr.lkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT;
-	mr_comp = pd->mr_table[lkey];
+	mr_comp = lookup_mr_locked(pd, mr->ib_mr.lkey);
 	if (mr == mr_comp) {
-		pd->mr_table[lkey] = NULL;
+		RCU_INIT_POINTER(pd->mr_table[lkey], NULL);
 		pd->nr_mr--;
 	} else {
 		pr_err("pib: MR(%u) don't be registered in PD(%u) (pib_dereg_mr)\n",
@@ -222,6 +246,9 @@ pib_dereg_mr(struct ib_mr *ibmr)
 	}
 	spin_unlock_irqrestore(&pd->lock, flags);
 
+	/* データパスでこの MR を参照している間は umem を解放しない */
+	synchronize_rcu();
+
 	if (mr->ib_umem)
 		ib_umem_release(mr->ib_umem);
 
@@ -325,6 +352,19 @@ pib_free_fast_reg_page_list(struct ib_fast_reg_page_list *page_list)
 
 enum ib_wc_status
 pib_util_mr_copy_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge, void *buffer, u64 offset, u64 size, int access_flags, enum pib_mr_direction direction)
+{
+	enum ib_wc_status status;
+
+	rcu_read_lock();
+	status = copy_data(pd, sge_array, num_sge, buffer, offset, size, access_flags, direction);
+	rcu_read_unlock();
+
+	return status;
+}
+
+
+static enum ib_wc_status
+copy_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge, void *buffer, u64 offset, u64 size, int access_flags, enum pib_mr_direction direction)
 {
 	int i;
 
@@ -336,7 +376,7 @@ pib_util_mr_copy_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge,
 		struct pib_mr *mr;
 		u64 range, mr_base, offset_tmp;
 
-		mr = pd->mr_table[(sge.lkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT];
+		mr = lookup_mr(pd, sge.lkey);
 
 		if (!mr)
 			return IB_WC_LOC_PROT_ERR;
@@ -381,14 +421,26 @@ pib_util_mr_copy_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge,
 enum ib_wc_status
 pib_util_mr_verify_rkey_validation(struct pib_pd *pd, u32 rkey, u64 address, u64 size, int access_flags)
 {
-	return copy_data_with_rkey(pd, rkey, NULL, address, size, access_flags, PIB_MR_CHECK, true);
+	enum ib_wc_status status;
+
+	rcu_read_lock();
+	status = copy_data_with_rkey(pd, rkey, NULL, address, size, access_flags, PIB_MR_CHECK, true);
+	rcu_read_unlock();
+
+	return status;
 }
 
 
 enum ib_wc_status
 pib_util_mr_copy_data_with_rkey(struct pib_pd *pd, u32 rkey, void *buffer, u64 address, u64 size, int access_flags, enum pib_mr_direction direction)
 {
-	return copy_data_with_rkey(pd, rkey, buffer, address, size, access_flags, direction, false);
+	enum ib_wc_status status;
+
+	rcu_read_lock();
+	status = copy_data_with_rkey(pd, rkey, buffer, address, size, access_flags, direction, false);
+	rcu_read_unlock();
+
+	return status;
 }
 
 
@@ -400,7 +452,7 @@ copy_data_with_rkey(struct pib_pd *pd, u32 rkey, void *buffer, u64 address, u64
 	if (PIB_MAX_PAYLOAD_LEN < size)
 		return IB_WC_LOC_LEN_ERR;
 
-	mr = pd->mr_table[(rkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT];
+	mr = lookup_mr(pd, rkey);
 
 	if (!mr)
 		return IB_WC_LOC_PROT_ERR;
@@ -434,10 +486,23 @@ copy_data_with_rkey(struct pib_pd *pd, u32 rkey, void *buffer, u64 address, u64
 
 enum ib_wc_status
 pib_util_mr_atomic(struct pib_pd *pd, u32 rkey, u64 address, u64 swap, u64 compare, u64 *result, enum pib_mr_direction direction)
+{
+	enum ib_wc_status status;
+
+	rcu_read_lock();
+	status = mr_atomic(pd, rkey, address, swap, compare, result, direction);
+	rcu_read_unlock();
+
+	return status;
+}
+
+
+static enum ib_wc_status
+mr_atomic(struct pib_pd *pd, u32 rkey, u64 address, u64 swap, u64 compare, u64 *result, enum pib_mr_direction direction)
 {
 	struct pib_mr *mr;
 
-	mr = pd->mr_table[(rkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT];
+	mr = lookup_mr(pd, rkey);
 
 	if (!mr)
 		return IB_WC_LOC_PROT_ERR;
@@ -633,12 +698,17 @@ mr_copy_data_sub(void *buffer, void *target_vaddr, u64 range, u64 swap, u64 comp
 	return false;
 }
 
+/*
+ *  Invalidate と Fast Register は pd->lock を取って呼び出すこと。
+ *  同じ PD の MR をコピーするデータパスは同じ kthread 上で動くので、
+ *  変更中の MR が参照されることはない。
+ */
 enum ib_wc_status
 pib_util_mr_invalidate(struct pib_pd *pd, u32 rkey)
 {
 	struct pib_mr *mr;
 
-	mr = pd->mr_table[(rkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT];
+	mr = lookup_mr_locked(pd, rkey);
 
 	if (!mr)
 		return IB_WC_MW_BIND_ERR;
@@ -671,7 +741,7 @@ pib_util_mr_fast_reg_pmr(struct pib_pd *pd, u32 rkey, u64 iova_start, struct ib_
 	struct pib_mr *mr;
 	size_t ps;
 
-	mr = pd->mr_table[(rkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT];
+	mr = lookup_mr_locked(pd, rkey);
 
 	if (!mr)
 		return IB_WC_MW_BIND_ERR;
@@ -7,24 +7,32 @@
  */
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/jhash.h>
 #include <rdma/ib_pack.h>
 
 #include "pib.h"
 #include "pib_trace.h"
 
 
+static struct list_head *get_mcast_hash_head(struct pib_dev *dev, const union ib_gid *mgid);
+static struct pib_mcast_group *find_mcast_group_locked(struct pib_dev *dev, const union ib_gid *mgid, u16 mlid);
+static int add_qp_to_mcast_group(struct pib_dev *dev, const union ib_gid *mgid, u16 mlid, struct pib_qp *qp);
+static void remove_qp_from_mcast_group(struct pib_dev *dev, const union ib_gid *mgid, u16 mlid, struct pib_qp *qp);
+
+
 int pib_attach_mcast(struct ib_qp *ibqp, union ib_gid *gid, u16 lid)
 {
-	int ret, count;
+	int ret;
 	struct pib_qp *qp;
 	struct pib_dev *dev;
-	unsigned long flags;
 	struct pib_mcast_link *mcast_link;
 
 	pib_debug("pib: pib_attach_mcast(qp=0x%06x, lid=0x%04x)\n",
 		  (int)ibqp->qp_num, lid);
 
-	if (!ibqp)
+	if (!ibqp || !gid)
 		return -EINVAL;
 
 	if (lid < PIB_MCAST_LID_BASE)
@@ -37,38 +45,34 @@ int pib_attach_mcast(struct ib_qp *ibqp, union ib_gid *gid, u16 lid)
 
 	pib_trace_api(dev, IB_USER_VERBS_CMD_ATTACH_MCAST, qp->ib_qp.qp_num);
 
-	spin_lock_irqsave(&dev->lock, flags);
+	mutex_lock(&dev->mcast_mutex);
 
-	count = 0;
-
-	list_for_each_entry(mcast_link, &qp->mcast_head, qp_list) {
-		if (mcast_link->lid == lid)
+	list_for_each_entry(mcast_link, &qp->mcast_head, qp_list)
+		if ((mcast_link->lid == lid) && !memcmp(&mcast_link->mgid, gid, sizeof(*gid)))
 			goto done;
-		count++;
-	}
 
-	if (PIB_MCAST_QP_ATTACH < count) {
+	mcast_link = kmem_cache_zalloc(pib_mcast_link_cachep, GFP_KERNEL);
+	if (!mcast_link) {
 		ret = -ENOMEM;
 		goto done;
 	}
 
-	mcast_link = kmem_cache_zalloc(pib_mcast_link_cachep, GFP_ATOMIC); /* @todo 割禁の外に */
-	if (!mcast_link) {
-		ret = -ENOMEM;
+	ret = add_qp_to_mcast_group(dev, gid, lid, qp);
+	if (ret) {
+		kmem_cache_free(pib_mcast_link_cachep, mcast_link);
 		goto done;
 	}
 
+	mcast_link->mgid = *gid;
 	mcast_link->lid = lid;
 	mcast_link->qp_num = qp->ib_qp.qp_num;
 
 	INIT_LIST_HEAD(&mcast_link->qp_list);
-	INIT_LIST_HEAD(&mcast_link->lid_list);
 
 	list_add_tail(&mcast_link->qp_list, &qp->mcast_head);
-	list_add_tail(&mcast_link->lid_list, &dev->mcast_table[lid - PIB_MCAST_LID_BASE]);
 
 done:
-	spin_unlock_irqrestore(&dev->lock, flags);
+	mutex_unlock(&dev->mcast_mutex);
 
 	return ret;
 }
@@ -76,54 +80,191 @@ done:
 
 int pib_detach_mcast(struct ib_qp *ibqp, union ib_gid *gid, u16 lid)
 {
-	int ret;
 	struct pib_qp *qp;
 	struct pib_dev *dev;
-	unsigned long flags;
 	struct pib_mcast_link *mcast_link;
 
 	pib_debug("pib: pib_detach_mcast(qp=0x%06x, lid=0x%04x)\n",
 		  (int)ibqp->qp_num, lid);
 
-	if (!ibqp)
+	if (!ibqp || !gid)
 		return -EINVAL;
 
 	if (lid < PIB_MCAST_LID_BASE)
 		return -EINVAL;
 
-	ret = 0;
-
 	dev = to_pdev(ibqp->device);
 	qp = to_pqp(ibqp);
 
 	pib_trace_api(dev, IB_USER_VERBS_CMD_DETACH_MCAST, qp->ib_qp.qp_num);
 
-	spin_lock_irqsave(&dev->lock, flags);
+	mutex_lock(&dev->mcast_mutex);
 	list_for_each_entry(mcast_link, &qp->mcast_head, qp_list) {
-		if (mcast_link->lid == lid) {
+		if ((mcast_link->lid == lid) && !memcmp(&mcast_link->mgid, gid, sizeof(*gid))) {
 			list_del(&mcast_link->qp_list);
-			list_del(&mcast_link->lid_list);
+			remove_qp_from_mcast_group(dev, &mcast_link->mgid, lid, qp);
 			kmem_cache_free(pib_mcast_link_cachep, mcast_link);
 			goto done;
 		}
 	}
 done:
-	spin_unlock_irqrestore(&dev->lock, flags);
+	mutex_unlock(&dev->mcast_mutex);
 
 	return 0;
 }
 
 
+/*
+ *  QP の破棄の前に呼ぶ。
+ *  戻った時点で受信スレッドがこの QP を参照していないことを保証する。
+ */
 void pib_detach_all_mcast(struct pib_dev *dev, struct pib_qp *qp)
 {
-	unsigned long flags;
+	bool detached = false;
 	struct pib_mcast_link *mcast_link, *next_mcast_link;
 
-	spin_lock_irqsave(&dev->lock, flags);
+	mutex_lock(&dev->mcast_mutex);
 	list_for_each_entry_safe(mcast_link, next_mcast_link, &qp->mcast_head, qp_list) {
 		list_del(&mcast_link->qp_list);
-		list_del(&mcast_link->lid_list);
+		remove_qp_from_mcast_group(dev, &mcast_link->mgid, mcast_link->lid, qp);
 		kmem_cache_free(pib_mcast_link_cachep, mcast_link);
+		detached = true;
+	}
+	mutex_unlock(&dev->mcast_mutex);
+
+	if (detached)
+		synchronize_rcu();
+}
+
+
+/*
+ *  受信スレッドから rcu_read_lock() を取った状態で呼ぶ。
+ */
+struct pib_mcast_group *pib_find_mcast_group(struct pib_dev *dev, const union ib_gid *mgid, u16 mlid)
+{
+	struct pib_mcast_group *group;
+
+	list_for_each_entry_rcu(group, get_mcast_hash_head(dev, mgid), list)
+		if ((group->mlid == mlid) && !memcmp(&group->mgid, mgid, sizeof(*mgid)))
+			return group;
+
+	return NULL;
+}
+
+
+static struct list_head *get_mcast_hash_head(struct pib_dev *dev, const union ib_gid *mgid)
+{
+	u32 hash = jhash2((const u32 *)mgid->raw, sizeof(mgid->raw) / sizeof(u32), 0);
+
+	return &dev->mcast_hash[hash & (PIB_MCAST_HASH_SIZE - 1)];
+}
+
+
+static struct pib_mcast_group *find_mcast_group_locked(struct pib_dev *dev, const union ib_gid *mgid, u16 mlid)
+{
+	struct pib_mcast_group *group;
+
+	BUG_ON(!mutex_is_locked(&dev->mcast_mutex));
+
+	list_for_each_entry(group, get_mcast_hash_head(dev, mgid), list)
+		if ((group->mlid == mlid) && !memcmp(&group->mgid, mgid, sizeof(*mgid)))
+			return group;
+
+	return NULL;
+}
+
+
+static struct pib_mcast_group *alloc_mcast_group(const union ib_gid *mgid, u16 mlid, int nr_qps)
+{
+	struct pib_mcast_group *group;
+
+	group = kmalloc(sizeof(*group) + sizeof(struct pib_qp *) * nr_qps, GFP_KERNEL);
+	if (!group)
+		return NULL;
+
+	INIT_LIST_HEAD(&group->list);
+	group->mgid   = *mgid;
+	group->mlid   = mlid;
+	group->nr_qps = nr_qps;
+
+	return group;
+}
+
+
+/*
+ *  グループは読み手から見て不変なので、QP を加えたものを作って置き換える。
+ */
+static int add_qp_to_mcast_group(struct pib_dev *dev, const union ib_gid *mgid, u16 mlid, struct pib_qp *qp)
+{
+	int nr_qps;
+	struct pib_mcast_group *group, *old_group;
+
+	old_group = find_mcast_group_locked(dev, mgid, mlid);
+
+	if (!old_group && (dev->ib_dev_attr.max_mcast_grp <= dev->nr_mcast_grp))
+		return -ENOMEM;
+
+	nr_qps = old_group ? old_group->nr_qps : 0;
+
+	if (dev->ib_dev_attr.max_mcast_qp_attach <= nr_qps)
+		return -ENOMEM;
+
+	group = alloc_mcast_group(mgid, mlid, nr_qps + 1);
+	if (!group)
+		return -ENOMEM;
+
+	if (old_group)
+		memcpy(group->qps, old_group->qps, sizeof(struct pib_qp *) * nr_qps);
+	group->qps[nr_qps] = qp;
+
+	if (old_group) {
+		list_replace_rcu(&old_group->list, &group->list);
+		kfree_rcu(old_group, rcu);
+	} else {
+		list_add_tail_rcu(&group->list, get_mcast_hash_head(dev, mgid));
+		dev->nr_mcast_grp++;
+	}
+
+	return 0;
+}
+
+
+/*
+ *  減らす場合に失敗すると破棄される QP を参照し続けかねないので、
+ *  メモリが確保できない時は公開を取り下げて読み手を待ってから古い配列を詰める。
+ */
+static void remove_qp_from_mcast_group(struct pib_dev *dev, const union ib_gid *mgid, u16 mlid, struct pib_qp *qp)
+{
+	int i, j;
+	struct pib_mcast_group *group, *old_group;
+
+	old_group = find_mcast_group_locked(dev, mgid, mlid);
+	if (!old_group)
+		return;
+
+	if (old_group->nr_qps == 1) {
+		list_del_rcu(&old_group->list);
+		kfree_rcu(old_group, rcu);
+		dev->nr_mcast_grp--;
+		return;
+	}
+
+	group = alloc_mcast_group(mgid, mlid, old_group->nr_qps - 1);
+	if (!group) {
+		list_del_rcu(&old_group->list);
+		synchronize_rcu();
+		group = old_group;
+	}
+
+	for (i = 0, j = 0 ; i < old_group->nr_qps ; i++)
+		if (old_group->qps[i] != qp)
+			group->qps[j++] = old_group->qps[i];
+	group->nr_qps = j;
+
+	if (group != old_group) {
+		list_replace_rcu(&old_group->list, &group->list);
+		kfree_rcu(old_group, rcu);
+	} else {
+		list_add_tail_rcu(&group->list, get_mcast_hash_head(dev, mgid));
 	}
-	spin_unlock_irqrestore(&dev->lock, flags);
 }
@@ -17,7 +17,8 @@
 
 enum {
 	PIB_OPCODE_CNP                   = 0x80,
-	PIB_OPCODE_CNP_SEND_NOTIFY       = 0x80
+	PIB_OPCODE_CNP_SEND_NOTIFY       = 0x80,
+	PIB_OPCODE_CNP_CONGESTION_NOTIFY = 0x81  /* same as the RoCEv2 CNP */
 };
 
 enum {
@@ -132,6 +133,19 @@ static inline void pib_packet_bth_set_solicited(struct pib_packet_bth *bth, int
 }
 
 
+static inline int pib_packet_bth_get_ackreq(const struct pib_packet_bth *bth)
+{
+	return (be32_to_cpu(bth->psn) >> 31) & 0x1;
+}
+
+
+static inline void pib_packet_bth_set_ackreq(struct pib_packet_bth *bth, int ackreq)
+{
+	bth->psn &= ~cpu_to_be32(1U << 31);
+	bth->psn |= cpu_to_be32((u32)(!!ackreq) << 31);
+}
+
+
 /* Datagram Extended Transport Header */
 struct pib_packet_deth {
 	__be32	qkey;	/* Queue Key */
@@ -183,6 +197,25 @@ struct pib_packet_link {
 } __attribute__ ((packed));
 
 
+/*
+ * PIB_LINK_CMD_LID_MAP の本体。first_lid から last_lid までの LID のうち
+ * entries に無いものは pibnetd 経由で送る。
+ */
+struct pib_packet_lid_map {
+	__be16	first_lid;
+	__be16	last_lid;
+	__be16	nr_entries;
+	__be16	reserved;
+} __attribute__ ((packed));
+
+
+struct pib_packet_lid_map_entry {
+	__be16	lid;
+	__be16	udp_port;
+	__be32	ipv4_addr;
+} __attribute__ ((packed));
+
+
 union pib_packet_footer {
 	struct {
 		__be16	vcrc; /* Variant CRC */
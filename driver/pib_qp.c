@@ -8,6 +8,7 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/vmalloc.h>
+#include <linux/log2.h>
 #include <rdma/ib_pack.h>
 
 #include "pib.h"
@@ -101,6 +102,9 @@ void pib_util_flush_qp(struct pib_qp *qp, int send_only)
 	}
 	qp->requester.nr_sending_swqe = 0;
 
+	qp->requester.inflight_head    = 0;
+	qp->requester.nr_inflight_swqe = 0;
+
 	list_for_each_entry_safe(send_wqe, next_send_wqe, &qp->requester.submitted_swqe_head, list) {
 		flush_send_wqe(qp, send_wqe);
 	}
@@ -124,6 +128,7 @@ void pib_util_flush_qp(struct pib_qp *qp, int send_only)
 		kmem_cache_free(pib_ack_cachep, ack);
 	}
 	qp->responder.nr_rd_atomic = 0;
+	qp->responder.nr_delayed_acks = 0;
 	
 	/* Last WQE Reached event */
 	if (qp->ib_qp_init_attr.srq && qp->push_rcqe && !qp->issue_last_wqe_reached) {
@@ -133,9 +138,9 @@ void pib_util_flush_qp(struct pib_qp *qp, int send_only)
 
 	pib_util_reschedule_qp(qp);
 
-	qp->requester.nr_contig_requests = 0;
+	pib_reset_rc_qp_congestion_control(qp);
 	qp->requester.nr_contig_read_acks = 0;
-	qp->responder.nr_contig_read_acks = 0;
+	pib_reset_rc_qp_read_window(qp);
 }
 
 
@@ -186,6 +191,9 @@ static int reset_qp(struct pib_qp *qp)
 	}
 	qp->requester.nr_sending_swqe = 0;
 
+	qp->requester.inflight_head    = 0;
+	qp->requester.nr_inflight_swqe = 0;
+
 	list_for_each_entry_safe(send_wqe, next_send_wqe, &qp->requester.submitted_swqe_head, list) {
 		if (signal_all_wr || (send_wqe->send_flags & IB_SEND_SIGNALED))
 			count++;
@@ -208,6 +216,7 @@ static int reset_qp(struct pib_qp *qp)
 		kmem_cache_free(pib_ack_cachep, ack);
 	}
 	qp->responder.nr_rd_atomic = 0;
+	qp->responder.nr_delayed_acks = 0;
 
 	count += pib_util_remove_cq(qp->send_cq, qp);
 	if (qp->send_cq != qp->recv_cq)
@@ -217,9 +226,8 @@ static int reset_qp(struct pib_qp *qp)
 
 	pib_util_reschedule_qp(qp);
 
-	qp->requester.nr_contig_requests = 0;
 	qp->requester.nr_contig_read_acks = 0;
-	qp->responder.nr_contig_read_acks = 0;
+	pib_reset_rc_qp_read_window(qp);
 
 	return count;
 }
@@ -231,16 +239,22 @@ static void reset_qp_attr(struct pib_qp *qp)
 
 	qp->requester.psn	   = 0;
 	qp->requester.expected_psn = 0;
+	qp->requester.msn	   = 0;
 	qp->requester.nr_rd_atomic = 0;
 
 	qp->responder.psn	   = 0;
-	qp->responder.last_OpCode  = (qp->qp_type == IB_QPT_RC) ?
+	qp->responder.msn	   = 0;
+	/* UC の responder も RC の OpCode で順序を管理する */
+	qp->responder.last_OpCode  = ((qp->qp_type == IB_QPT_RC) || (qp->qp_type == IB_QPT_UC)) ?
 		IB_OPCODE_RC_SEND_ONLY : IB_OPCODE_UD_SEND_ONLY; /* dummy opcode */
 	qp->responder.offset       = 0;
 	qp->responder.nr_rd_atomic = 0;
 
 	memset(&qp->responder.slots, 0, sizeof(qp->responder.slots));
 
+	pib_reset_rc_qp_congestion_control(qp);
+	pib_reset_rc_qp_rtt(qp);
+
 	qp->push_rcqe              = 0;
 	qp->issue_comm_est         = 0;
 	qp->issue_sq_drained       = 0;
@@ -326,6 +340,7 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 		break;
 
 	case IB_QPT_RC:
+	case IB_QPT_UC:
 	case IB_QPT_UD:
 		if (pib_get_behavior(PIB_BEHAVIOR_QPN_REALLOCATION))
 			dev->last_qp_num = PIB_QP1 + 1;
@@ -362,6 +377,12 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 			goto err_alloc_inlin_data_buffer;
 	}
 
+	/* allocate the ring of in-flight Send WQEs */
+	qp->requester.inflight_mask  = roundup_pow_of_two(max_t(u32, init_attr->cap.max_send_wr, 1)) - 1;
+	qp->requester.inflight_swqes = vzalloc((qp->requester.inflight_mask + 1) * sizeof(struct pib_send_wqe *));
+	if (!qp->requester.inflight_swqes)
+		goto err_alloc_inflight_swqes;
+
 	/* allocate Send WQEs and Recv WQEs */
 
 	for (i=0 ; i<init_attr->cap.max_send_wr ; i++) {
@@ -399,6 +420,9 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 err_alloc_wqe:
 	dealloc_free_wqe(qp);
 
+	vfree(qp->requester.inflight_swqes);
+
+err_alloc_inflight_swqes:
 	if (qp->requester.inline_data_buffer)
 		vfree(qp->requester.inline_data_buffer);
 
@@ -432,6 +456,7 @@ static bool qp_init_attr_is_ok(const struct pib_dev *dev, const struct ib_qp_ini
 	case IB_QPT_SMI:
 	case IB_QPT_GSI:
 	case IB_QPT_RC:
+	case IB_QPT_UC:
 	case IB_QPT_UD:
 		break;
 
@@ -515,6 +540,8 @@ int pib_destroy_qp(struct ib_qp *ibqp)
 	dealloc_free_wqe(qp);
 	pib_spin_unlock(&qp->lock);
 
+	vfree(qp->requester.inflight_swqes);
+
 	if (qp->requester.inline_data_buffer)
 		vfree(qp->requester.inline_data_buffer);
 
@@ -620,6 +647,7 @@ int pib_modify_qp(struct ib_qp *ibqp, struct ib_qp_attr *attr,
 	if (attr_mask & IB_QP_SQ_PSN) {
 		qp->requester.psn          = attr->sq_psn & PIB_PSN_MASK;
 		qp->requester.expected_psn = attr->sq_psn & PIB_PSN_MASK;
+		qp->requester.rtt.high_psn = attr->sq_psn & PIB_PSN_MASK;
 	}
 
 	if (attr_mask & IB_QP_DEST_QPN)
@@ -676,6 +704,7 @@ int pib_modify_qp(struct ib_qp *ibqp, struct ib_qp_attr *attr,
 	if (attr_mask & IB_QP_TIMEOUT) {
 		qp->ib_qp_attr.timeout     = attr->timeout; /* 解像度は local_ca_ack_delay に制限される */
 		qp->local_ack_timeout      = pib_get_local_ack_time(attr->timeout);
+		qp->requester.rtt.rto      = qp->local_ack_timeout;
 	}
 
 	if (attr_mask & IB_QP_RETRY_CNT)
@@ -752,6 +781,11 @@ int pib_modify_qp(struct ib_qp *ibqp, struct ib_qp_attr *attr,
 			qp->issue_sq_drained = 0;
 	}
 
+	/* RTR 以降はアドレスが確定しているので RC・UC のパケットヘッダの雛形を作る */
+	if (((qp->qp_type == IB_QPT_RC) || (qp->qp_type == IB_QPT_UC)) &&
+	    (IB_QPS_RTR <= qp->state) && (qp->state <= IB_QPS_SQE))
+		pib_update_qp_packet_template(dev, qp);
+
 	/* 送信可能状態に */
 	if (pending_send_wr)
 		get_ready_to_send(dev, qp);
@@ -1074,6 +1108,25 @@ next_wr:
 		}		
 		break;
 
+	case IB_QPT_UC:
+		switch (ibwr->opcode) {
+		case IB_WR_RDMA_WRITE:
+		case IB_WR_RDMA_WRITE_WITH_IMM:
+			send_wqe->wr.rdma.remote_addr   = ibwr->wr.rdma.remote_addr;
+			send_wqe->wr.rdma.rkey          = ibwr->wr.rdma.rkey;
+			break;
+
+		case IB_WR_SEND:
+		case IB_WR_SEND_WITH_IMM:
+			break;
+
+		default:
+			/* UC で使えるのは SEND と RDMA WRITE のみ。QP は ERR にしない */
+			ret = -EINVAL;
+			goto done;
+		}
+		break;
+
 	case IB_QPT_UD:
 	case IB_QPT_SMI:
 	case IB_QPT_GSI:
@@ -1268,6 +1321,29 @@ void pib_util_free_send_wqe(struct pib_qp *qp, struct pib_send_wqe *send_wqe)
 }
 
 
+void pib_util_push_inflight_swqe(struct pib_qp *qp, struct pib_send_wqe *send_wqe)
+{
+	u32 index;
+
+	BUG_ON(qp->requester.inflight_mask < qp->requester.nr_inflight_swqe);
+
+	index = (qp->requester.inflight_head + qp->requester.nr_inflight_swqe) & qp->requester.inflight_mask;
+
+	qp->requester.inflight_swqes[index] = send_wqe;
+	qp->requester.nr_inflight_swqe++;
+}
+
+
+void pib_util_pop_inflight_swqe(struct pib_qp *qp, struct pib_send_wqe *send_wqe)
+{
+	BUG_ON(qp->requester.nr_inflight_swqe == 0);
+	BUG_ON(qp->requester.inflight_swqes[qp->requester.inflight_head] != send_wqe);
+
+	qp->requester.inflight_head = (qp->requester.inflight_head + 1) & qp->requester.inflight_mask;
+	qp->requester.nr_inflight_swqe--;
+}
+
+
 void pib_util_free_recv_wqe(struct pib_qp *qp, struct pib_recv_wqe *recv_wqe)
 {
 	BUG_ON(!pib_spin_is_locked(&qp->lock));
@@ -1292,9 +1368,8 @@ static void get_ready_to_send(struct pib_dev *dev, struct pib_qp *qp)
 {
 	pib_util_reschedule_qp(qp);
 
-	qp->requester.nr_contig_requests = 0;
 	qp->requester.nr_contig_read_acks = 0;
-	qp->responder.nr_contig_read_acks = 0;
+	pib_reset_rc_qp_read_window(qp);
 
 	complete(&dev->thread.completion);
 }
@@ -1323,3 +1398,26 @@ void pib_util_insert_async_qp_event(struct pib_qp *qp, enum ib_event_type event)
 {
 	pib_util_insert_async_qp_error(qp, event);
 }
+
+
+void pib_update_qp_packet_template(struct pib_dev *dev, struct pib_qp *qp)
+{
+	const struct ib_ah_attr *ah_attr = &qp->ib_qp_attr.ah_attr;
+	u8 port_num = qp->ib_qp_attr.port_num;
+	struct pib_packet_bth *bth;
+
+	BUG_ON(!pib_spin_is_locked(&qp->lock));
+
+	if ((port_num < 1) || (dev->ib_dev.phys_port_cnt < port_num) ||
+	    ((ah_attr->ah_flags & IB_AH_GRH) && (PIB_GID_PER_PORT <= ah_attr->grh.sgid_index))) {
+		qp->template.port_num = 0;
+		return;
+	}
+
+	pib_init_packet_template(dev, &qp->template, port_num, ah_attr);
+
+	bth = (struct pib_packet_bth*)(qp->template.buffer + qp->template.size - sizeof(*bth));
+
+	bth->pkey   = dev->ports[port_num - 1].pkey_table[qp->ib_qp_attr.pkey_index];
+	bth->destQP = cpu_to_be32(qp->ib_qp_attr.dest_qp_num);
+}
@@ -1,5 +1,5 @@
 /*
- * pib_rc.c - Reliable Connection service processing
+ * pib_rc.c - Reliable Connection & Unreliable Connection service processing
  *
  * Copyright (c) 2013-2015 Minoru NAKAMURA <nminoru@nminoru.jp>
  *
@@ -19,6 +19,8 @@
 #include <linux/if_vlan.h>
 #include <linux/random.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <rdma/ib_user_verbs.h>
 #include <rdma/ib_pack.h>
 
@@ -37,6 +39,9 @@ static enum ib_wc_status process_Atomic_request(struct pib_dev *dev, struct pib_
 
 static enum ib_wc_status process_LOCAL_INVALIDATE_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
 static enum ib_wc_status process_FAST_REGISTER_PMR_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
+static bool is_uc_wr_opcode(enum ib_wr_opcode opcode);
+static void complete_uc_send_wqe(struct pib_qp *qp, struct pib_send_wqe *send_wqe);
+static void *write_packet_header(struct pib_dev *dev, struct pib_qp *qp, void *buffer, struct pib_packet_lrh **lrh_p, struct ib_grh **grh_p, struct pib_packet_bth **bth_p);
 
 /*
  *  Responder: Receiving Inbound Request Packets
@@ -46,23 +51,29 @@ static int receive_SEND_request(struct pib_dev *dev, u8 port_num, u32 psn, int O
 static int receive_RDMA_WRITE_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, struct pib_qp *qp,  struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size);
 static int receive_RDMA_READ_request(struct pib_dev *dev, u8 port_num, u32 psn, struct pib_qp *qp, void *buffer, int siz, int new_request, int slot_index);
 static int receive_Atomic_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, struct pib_qp *qp,  void *buffer, int size);
+static int find_rd_atom_slot(struct pib_qp *qp, int OpCode, u32 psn);
+static void push_rd_atom_slot(struct pib_qp *qp, const struct pib_rd_atom_slot *slot);
 static void push_acknowledge(struct pib_qp *qp, u32 psn, enum pib_syndrome syndrome);
+static void push_delayed_acknowledge(struct pib_qp *qp, u32 psn);
 static void remove_overlapped_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected_psn);
-static void push_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected_psn, u64 vaddress, u32 rkey, u32 size);
-static void push_atomic_acknowledge(struct pib_qp *qp, u32 psn, u64 res);
+static void push_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected_psn, u32 msn, u64 vaddress, u32 rkey, u32 size);
+static void push_atomic_acknowledge(struct pib_qp *qp, u32 psn, u32 msn, u64 res);
+static bool has_rdma_read_acknowledge(struct pib_qp *qp);
 
 /*
  *  Responder: Generating Acknowledge Packets
  */
+static u32 get_rdma_read_response_psn(struct pib_qp *qp, struct pib_ack *ack);
 static void generate_Normal_or_Atomic_acknowledge(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, struct pib_ack *ack);
 static int generate_RDMA_READ_response(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, struct pib_ack *ack);
-static int pack_acknowledge_packet(struct pib_dev *dev, struct pib_qp *qp, int OpCode, u32 psn, int with_aeth, enum pib_syndrome syndrome, int with_atomiceth, u64 res, struct pib_packet_bth **bth_p);
+static int pack_acknowledge_packet(struct pib_dev *dev, struct pib_qp *qp, int OpCode, u32 psn, int with_aeth, enum pib_syndrome syndrome, u32 msn, int with_atomiceth, u64 res, struct pib_packet_bth **bth_p);
 
 /*
  *  Requester: Receiving Responses
  */
 static int receive_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size);
 static int receive_ACK_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 psn);
+static void retire_acknowledged_messages(struct pib_qp *qp, u32 psn, u32 msn);
 static int process_acknowledge(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe, u32 psn);
 static void set_send_wqe_to_error(struct pib_qp *qp, u32 psn, enum ib_wc_status status);
 static int receive_RDMA_READ_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 psn, void *buffer, int size);
@@ -71,8 +82,25 @@ static int receive_Atomic_response(struct pib_dev *dev, u8 port_num, struct pib_
 /*
  *  Congestion Notification Packet
  */
-static void process_cnp_notify_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
+static void process_cnp_notify_request(struct pib_dev *dev, struct pib_qp *qp, int OpCode, u32 psn, u32 trace_id);
 static void receive_cnp_notify(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size);
+static void check_congestion(struct pib_dev *dev, struct pib_qp *qp);
+
+/*
+ *  Congestion Control
+ */
+static u32 get_acked_psn(struct pib_qp *qp);
+static u32 get_next_psn(struct pib_qp *qp);
+static u32 get_inflight_packets(struct pib_qp *qp);
+static void increase_congestion_window(struct pib_qp *qp, u32 psn, u32 nr_packets);
+static void decrease_congestion_window(struct pib_qp *qp, bool timeout);
+
+/*
+ *  Retransmission Timer
+ */
+static void start_rtt_sample(struct pib_qp *qp, u32 psn, u32 nr_packets);
+static void update_rtt(struct pib_qp *qp, u32 psn);
+static void process_acknowledged_packets(struct pib_qp *qp, u32 psn, u32 nr_packets);
 
 /*
  *  Helper functions
@@ -84,6 +112,23 @@ static void issue_comm_est(struct pib_qp *qp);
 static void postpone_local_ack_timeout(struct pib_qp *qp);
 
 
+static unsigned int ack_coalesce = PIB_ACK_COALESCE;
+module_param_named(ack_coalesce, ack_coalesce, uint, 0644);
+MODULE_PARM_DESC(ack_coalesce, "Max packets acknowledged by one coalesced ACK (0 or 1 disables delayed ACK)");
+
+static unsigned int ack_delay = PIB_ACK_DELAY;
+module_param_named(ack_delay, ack_delay, uint, 0644);
+MODULE_PARM_DESC(ack_delay, "Microseconds to delay a coalesced ACK (0 disables delayed ACK)");
+
+static bool congestion_control = true;
+module_param_named(congestion_control, congestion_control, bool, 0644);
+MODULE_PARM_DESC(congestion_control, "Enable the AIMD congestion window of RC QPs (default: true)");
+
+static bool adaptive_rto = true;
+module_param_named(adaptive_rto, adaptive_rto, bool, 0644);
+MODULE_PARM_DESC(adaptive_rto, "Estimate the local ACK timeout of RC QPs from round-trip times (default: true)");
+
+
 /******************************************************************************/
 
 static s32 get_psn_diff(u32 psn, u32 based_psn)
@@ -92,6 +137,24 @@ static s32 get_psn_diff(u32 psn, u32 based_psn)
 }
 
 
+/* MSN も PSN と同じく 24 ビットで一周する */
+static s32 get_msn_diff(u32 msn, u32 based_msn)
+{
+	return ((s32)((msn - based_msn) << 8)) >> 8;
+}
+
+
+static bool is_last_packet_to_send(struct pib_qp *qp, struct pib_send_wqe *send_wqe)
+{
+	if ((send_wqe->opcode != IB_WR_RDMA_READ) &&
+	    (send_wqe->processing.sent_packets + 1 < send_wqe->processing.all_packets))
+		return false;
+
+	return list_is_last(&send_wqe->list, &qp->requester.sending_swqe_head) &&
+		list_empty(&qp->requester.submitted_swqe_head);
+}
+
+
 static enum pib_syndrome get_resources_not_ready(struct pib_qp *qp)
 {
 	return PIB_SYND_RNR_NAK_CODE | (qp->ib_qp_attr.min_rnr_timer & ~PIB_SYND_CODE_MASK);
@@ -109,13 +172,11 @@ int pib_process_rc_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 	int with_inv = 0;
 	void *buffer;
 	u8 port_num;
-	struct ib_ah_attr ah_attr;
-	u16 slid, dlid;
 	struct pib_packet_lrh *lrh;
 	struct ib_grh         *grh;
 	struct pib_packet_bth *bth;
-	u32 lnh;
 	u32 psn;
+	u32 inflight_packets;
 	enum ib_wc_status status;
 
 	if (send_wqe->local_only_request) {
@@ -139,40 +200,20 @@ int pib_process_rc_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 		goto completion_error;
 	}
 
-	port_num = qp->ib_qp_attr.port_num;
-	ah_attr  = qp->ib_qp_attr.ah_attr;
-
-	buffer = dev->thread.send_buffer;
-
-	slid = dev->ports[port_num - 1].ib_port_attr.lid;
-	dlid = ah_attr.dlid;
+	if ((qp->qp_type == IB_QPT_UC) && !is_uc_wr_opcode(send_wqe->opcode)) {
+		/* UC で使えるのは SEND と RDMA WRITE のみ */
+		status = IB_WC_LOC_QP_OP_ERR;
+		goto completion_error;
+	}
 
-	memset(buffer, 0, sizeof(*lrh) + sizeof(*grh) + sizeof(*bth));
+	port_num = qp->ib_qp_attr.port_num;
 
 	/* write IB Packet Header (LRH, GRH, BTH) */
-	lrh = (struct pib_packet_lrh*)buffer; 
-	buffer += sizeof(*lrh);
-	if (ah_attr.ah_flags & IB_AH_GRH) {
-		grh = (struct ib_grh*)buffer;
-		pib_fill_grh(dev, port_num, grh, &ah_attr.grh);
-		buffer += sizeof(*grh);
-		lnh = 0x3;
-	} else {
-		grh = NULL;
-		lnh = 0x2;
-	}
-	bth = (struct pib_packet_bth*)buffer;
-	buffer += sizeof(*bth);
-
-	lrh->sl_rsv_lnh = (ah_attr.sl << 4) | lnh; /* Transport: IBA & Next Header: BTH */
-	lrh->dlid   = cpu_to_be16(dlid);
-	lrh->slid   = cpu_to_be16(slid);
+	buffer = write_packet_header(dev, qp, dev->thread.send_buffer, &lrh, &grh, &bth);
 
 	psn = send_wqe->processing.based_psn + send_wqe->processing.sent_packets;
 
-	bth->pkey   = dev->ports[port_num - 1].pkey_table[qp->ib_qp_attr.pkey_index];
-	bth->destQP = cpu_to_be32(qp->ib_qp_attr.dest_qp_num);
-	bth->psn    = cpu_to_be32(psn & PIB_PSN_MASK); /* A-bit is 0 */
+	bth->psn    = cpu_to_be32(psn & PIB_PSN_MASK);
 
 	switch (send_wqe->opcode) {
 
@@ -271,29 +312,65 @@ int pib_process_rc_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 	if (status != IB_WC_SUCCESS)
 		goto completion_error;
 
+	if (qp->qp_type == IB_QPT_UC) {
+		/*
+		 *  UC は RC と同じパケットを UC の OpCode で送る。ACK を待たないので
+		 *  A-bit、Local ACK Timer、輻輳ウィンドウは使わない。
+		 */
+		bth->OpCode = IB_OPCODE_UC + (bth->OpCode & 0x1F);
+		goto ready_to_send;
+	}
+
+	inflight_packets = get_inflight_packets(qp);
+
+	/*
+	 *  輻輳ウィンドウを使い切るパケットと、後に続く Send WQE がない最後の
+	 *  パケットには A-bit を立てて、responder に ACK を遅延させずに返すよう
+	 *  要求する。
+	 */
+	if ((qp->requester.cc.cwnd <= inflight_packets + 1) ||
+	    is_last_packet_to_send(qp, send_wqe))
+		pib_packet_bth_set_ackreq(bth, 1);
+
+	/* in-flight の最初のパケットなら local ACK timer を開始する */
+	if ((inflight_packets == 0) || time_after_eq(jiffies, qp->requester.local_ack_time))
+		qp->requester.local_ack_time = jiffies + qp->requester.rtt.rto;
+
+	if (inflight_packets == 0)
+		qp->requester.rtt.retry_time = jiffies;
+
+	start_rtt_sample(qp, psn,
+			 (send_wqe->opcode == IB_WR_RDMA_READ) ? send_wqe->processing.all_packets : 1);
+
+ready_to_send:
 	dev->thread.port_num	= port_num;
-	dev->thread.slid	= slid;
-	dev->thread.dlid	= dlid;
+	dev->thread.slid	= qp->template.slid;
+	dev->thread.dlid	= qp->template.dlid;
 	dev->thread.src_qp_num	= qp->ib_qp.qp_num;
 	dev->thread.trace_id    = send_wqe->trace_id;
 	dev->thread.ready_to_send = 1;
 
 	if (send_wqe->opcode != IB_WR_RDMA_READ) {
 		send_wqe->processing.sent_packets++;
-		qp->requester.nr_contig_requests++;
 
 		if (send_wqe->processing.sent_packets < send_wqe->processing.all_packets) {
 			/* Send WQE にはまだ送信すべきパケットが残っている。 */
 			return 0;
 		}
+	} else
+		/* RDMA READ は応答の PSN を予約するが、輻輳ウィンドウでは 1 つと数える */
+		qp->requester.cc.nr_read_packets +=
+			send_wqe->processing.all_packets - send_wqe->processing.ack_packets - 1;
+
+	if (qp->qp_type == IB_QPT_UC) {
+		/* UC は最後のパケットを送信した時点で完了する */
+		complete_uc_send_wqe(qp, send_wqe);
+		return 0;
 	}
 
 skip_to_send_packet:
 	send_wqe->processing.list_type = PIB_SWQE_WAITING;
 
-	/* Calucate the next time in jififes to resend this request by local ACK timer */
-	send_wqe->processing.local_ack_time = jiffies + qp->local_ack_timeout;
-
 	return 0;
 
 completion_error:
@@ -304,6 +381,60 @@ completion_error:
 }
 
 
+/*
+ *  QP のパケットヘッダの雛形を buffer にコピーする。
+ *  ポートの LID や P_Key table が変わっていれば作り直す。
+ */
+static void *
+write_packet_header(struct pib_dev *dev, struct pib_qp *qp, void *buffer, struct pib_packet_lrh **lrh_p, struct ib_grh **grh_p, struct pib_packet_bth **bth_p)
+{
+	u8 port_num = qp->ib_qp_attr.port_num;
+
+	if (unlikely(!pib_packet_template_is_valid(dev, &qp->template, port_num))) {
+		pib_update_qp_packet_template(dev, qp);
+		BUG_ON(!pib_packet_template_is_valid(dev, &qp->template, port_num));
+	}
+
+	return pib_copy_packet_template(&qp->template, buffer, lrh_p, grh_p, bth_p);
+}
+
+
+static bool
+is_uc_wr_opcode(enum ib_wr_opcode opcode)
+{
+	switch (opcode) {
+	case IB_WR_SEND:
+	case IB_WR_SEND_WITH_IMM:
+	case IB_WR_RDMA_WRITE:
+	case IB_WR_RDMA_WRITE_WITH_IMM:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+static void
+complete_uc_send_wqe(struct pib_qp *qp, struct pib_send_wqe *send_wqe)
+{
+	list_del_init(&send_wqe->list);
+	qp->requester.nr_sending_swqe--;
+	send_wqe->processing.list_type = PIB_SWQE_FREE;
+
+	if ((qp->ib_qp_init_attr.sq_sig_type == IB_SIGNAL_ALL_WR) ||
+	    (send_wqe->send_flags & IB_SEND_SIGNALED)) {
+		struct ib_wc wc = {
+			.wr_id    = send_wqe->wr_id,
+			.status   = IB_WC_SUCCESS,
+			.opcode   = pib_convert_wr_opcode_to_wc_opcode(send_wqe->opcode),
+			.qp       = &qp->ib_qp,
+		};
+
+		pib_util_insert_wc_success(qp->send_cq, &wc, 0);
+	}
+}
+
+
 static enum ib_wc_status
 process_SEND_or_RDMA_WRITE_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int with_reth, int with_imm, int with_inv)
 {
@@ -311,7 +442,6 @@ process_SEND_or_RDMA_WRITE_request(struct pib_dev *dev, struct pib_qp *qp, struc
 	u64 mr_offset;
 	u32 payload_size, packet_length, fix_packet_length;
 	enum ib_wc_status status = IB_WC_SUCCESS;
-	unsigned long flags;
 
 	if (PIB_MAX_PAYLOAD_LEN < send_wqe->total_length)
 		return IB_WC_LOC_LEN_ERR;
@@ -323,8 +453,6 @@ process_SEND_or_RDMA_WRITE_request(struct pib_dev *dev, struct pib_qp *qp, struc
 		reth->vaddr  = cpu_to_be64(send_wqe->wr.rdma.remote_addr);
 		reth->rkey   = cpu_to_be32(send_wqe->wr.rdma.rkey);
 		reth->dmalen = cpu_to_be32(send_wqe->total_length);
-
-		qp->requester.nr_contig_requests = 0;
 	}
 
 	if (with_imm) {
@@ -351,12 +479,10 @@ process_SEND_or_RDMA_WRITE_request(struct pib_dev *dev, struct pib_qp *qp, struc
 	} else {
 		pd = to_ppd(qp->ib_qp.pd);
 
-		spin_lock_irqsave(&pd->lock, flags);
 		status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge,
 					       buffer, mr_offset, payload_size,
 					       0,
 					       PIB_MR_COPY_FROM);
-		spin_unlock_irqrestore(&pd->lock, flags);
 	}
 
 	if (status != IB_WC_SUCCESS)
@@ -546,9 +672,13 @@ void pib_receive_rc_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct
 		/* silently drop */
 		return;
 
-	if (bth->OpCode == PIB_OPCODE_CNP_SEND_NOTIFY) {
+	switch (bth->OpCode) {
+	case PIB_OPCODE_CNP_SEND_NOTIFY:
+	case PIB_OPCODE_CNP_CONGESTION_NOTIFY:
 		receive_cnp_notify(dev, port_num, qp, lrh, grh, bth, buffer, size);
 		return;
+	default:
+		break;
 	}
 
 	if (pib_opcode_is_acknowledge(bth->OpCode))
@@ -560,6 +690,85 @@ void pib_receive_rc_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct
 }
 
 
+/*
+ *  UC の受信は RC の SEND / RDMA WRITE の処理を使い回すが、acknowledge は返さない。
+ *  PSN が飛んだり不正なパケットを受けた場合は、受信途中のメッセージを破棄して
+ *  次のメッセージの先頭まで読み捨てる。
+ */
+void pib_receive_uc_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size)
+{
+	int ret;
+	int OpCode;
+	u32 psn;
+
+	if (!pib_is_recv_ok(qp->state))
+		/* silently drop */
+		return;
+
+	if (qp->ib_qp_attr.port_num != port_num)
+		/* silently drop */
+		return;
+
+	if ((bth->OpCode & 0xE0) != IB_OPCODE_UC)
+		/* silently drop */
+		return;
+
+	/* 以降は RC の OpCode として扱う */
+	OpCode = IB_OPCODE_RC + (bth->OpCode & 0x1F);
+	psn    = be32_to_cpu(bth->psn) & PIB_PSN_MASK;
+
+	pib_trace_recv_ok(dev, port_num, bth->OpCode, psn, qp->ib_qp.qp_num, size);
+
+	issue_comm_est(qp);
+
+	if (psn != qp->responder.psn)
+		/* Out of sequence: 受信途中のメッセージを破棄する */
+		qp->responder.last_OpCode = IB_OPCODE_RC_SEND_ONLY;
+
+	qp->responder.psn = (psn + 1) & PIB_PSN_MASK;
+
+	switch (OpCode) {
+
+	case IB_OPCODE_RC_SEND_FIRST:
+	case IB_OPCODE_RC_SEND_MIDDLE:
+	case IB_OPCODE_RC_SEND_LAST:
+	case IB_OPCODE_RC_SEND_ONLY:
+	case IB_OPCODE_RC_SEND_LAST_WITH_IMMEDIATE:
+	case IB_OPCODE_RC_SEND_ONLY_WITH_IMMEDIATE:
+		if (!pib_opcode_is_in_order_sequence(OpCode, qp->responder.last_OpCode))
+			goto drop_message;
+		ret = receive_SEND_request(dev, port_num, psn, OpCode, qp, lrh, grh, bth, buffer, size);
+		break;
+
+	case IB_OPCODE_RC_RDMA_WRITE_FIRST:
+	case IB_OPCODE_RC_RDMA_WRITE_MIDDLE:
+	case IB_OPCODE_RC_RDMA_WRITE_LAST:
+	case IB_OPCODE_RC_RDMA_WRITE_LAST_WITH_IMMEDIATE:
+	case IB_OPCODE_RC_RDMA_WRITE_ONLY:
+	case IB_OPCODE_RC_RDMA_WRITE_ONLY_WITH_IMMEDIATE:
+		if (!pib_opcode_is_in_order_sequence(OpCode, qp->responder.last_OpCode))
+			goto drop_message;
+		ret = receive_RDMA_WRITE_request(dev, port_num, psn, OpCode, qp, lrh, grh, bth, buffer, size);
+		break;
+
+	default:
+		/* UC では使えない OpCode */
+		goto drop_message;
+	}
+
+	if (ret < 0)
+		goto drop_message;
+
+	qp->responder.last_OpCode = OpCode;
+
+	return;
+
+drop_message:
+	/* 次の FIRST か ONLY が来るまで読み捨てる */
+	qp->responder.last_OpCode = IB_OPCODE_RC_SEND_ONLY;
+}
+
+
 /******************************************************************************/
 /* Responder: Receiving Inbound Request Packets                               */
 /******************************************************************************/
@@ -589,28 +798,22 @@ receive_request(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_
 	}
 
 	if (psn_diff < 0) {
-		int i;
-		struct pib_rd_atom_slot slot;
+		int slot_index;
 
 		switch (OpCode) {
 		case IB_OPCODE_RC_RDMA_READ_REQUEST:
 		case IB_OPCODE_RC_COMPARE_SWAP:
 		case IB_OPCODE_RC_FETCH_ADD:
-			for (i=1 ; i <= qp->ib_qp_attr.max_dest_rd_atomic ; i++) {
-				int slot_index = ((unsigned int)(qp->responder.slot_index - i)) % PIB_MAX_RD_ATOM;
-
-				slot = qp->responder.slots[slot_index];
-
-				if ((slot.OpCode != OpCode) ||
-				    (get_psn_diff(psn, slot.psn)          <   0) ||
-				    (get_psn_diff(psn, slot.expected_psn) >=  0))
-					continue;
+			slot_index = find_rd_atom_slot(qp, OpCode, psn);
 
+			if (0 <= slot_index) {
 				if (OpCode == IB_OPCODE_RC_RDMA_READ_REQUEST)
 					receive_RDMA_READ_request(dev, port_num, psn, qp, buffer, size,
 								  0, slot_index);
 				else
-					push_atomic_acknowledge(qp, psn, slot.data.atomic.res);
+					push_atomic_acknowledge(qp, psn,
+								qp->responder.slots[slot_index].msn,
+								qp->responder.slots[slot_index].data.atomic.res);
 
 				return; 
 			}
@@ -679,6 +882,8 @@ receive_request(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_
 	if (ret >= 0) {
 		qp->responder.psn += ret;
 		qp->responder.last_OpCode = OpCode;
+
+		check_congestion(dev, qp);
 	}
 }
 
@@ -800,7 +1005,6 @@ receive_SEND_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, stru
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
 	status = pib_util_mr_copy_data(pd, recv_wqe->sge_array, recv_wqe->num_sge,
 				       buffer, qp->responder.offset, size,
 				       IB_ACCESS_LOCAL_WRITE,
@@ -808,14 +1012,15 @@ receive_SEND_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, stru
 
 	if (with_inv && status == IB_WC_SUCCESS)
 	{
+		spin_lock_irqsave(&pd->lock, flags);
 		status = pib_util_mr_invalidate(pd, invalidate_rkey);
+		spin_unlock_irqrestore(&pd->lock, flags);
 		if (status != IB_WC_SUCCESS)
 		{
 			remote_invalidate_error = 1;
 			goto completion_error;
 		}
 	}
-	spin_unlock_irqrestore(&pd->lock, flags);
 
 	switch (status) {
 	case IB_WC_SUCCESS:
@@ -862,18 +1067,31 @@ receive_SEND_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, stru
 		qp->responder.nr_recv_wqe--;
 
 		pib_util_free_recv_wqe(qp, recv_wqe);
+
+		qp->responder.msn = (qp->responder.msn + 1) & PIB_MSN_MASK;
 	}
 
-	push_acknowledge(qp, psn, PIB_SYND_ACK_CODE);
+	if (qp->qp_type == IB_QPT_UC)
+		return 1;
+
+	if (pib_packet_bth_get_ackreq(bth))
+		push_acknowledge(qp, psn, PIB_SYND_ACK_CODE);
+	else
+		push_delayed_acknowledge(qp, psn);
 
 	return 1; /* 1 packet */
 
 resources_not_ready:
-	push_acknowledge(qp, psn, get_resources_not_ready(qp));
+	/* UC はメッセージを破棄する */
+	if (qp->qp_type == IB_QPT_RC)
+		push_acknowledge(qp, psn, get_resources_not_ready(qp));
 
 	return -1;
 
 nak_invalid_request:
+	if (qp->qp_type == IB_QPT_UC)
+		return -1;
+
 	push_acknowledge(qp, psn, PIB_SYND_NAK_CODE_INV_REQ_ERR);
 
 	/* Invalid Request Local Work Queue Error */
@@ -891,7 +1109,7 @@ completion_error:
 	qp->responder.nr_recv_wqe--;
 	pib_util_free_recv_wqe(qp, recv_wqe);
 
-	if (!remote_invalidate_error)
+	if (!remote_invalidate_error && (qp->qp_type == IB_QPT_RC))
 		push_acknowledge(qp, psn, syndrome);
 
 	qp->state = IB_QPS_ERR;
@@ -913,7 +1131,6 @@ receive_RDMA_WRITE_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode
 	struct pib_recv_wqe *recv_wqe = NULL;
 	struct pib_pd *pd;
 	enum ib_wc_status status = IB_WC_SUCCESS;
-	unsigned long flags;
 
 	pmtu = (128U << qp->ib_qp_attr.path_mtu);
 
@@ -1015,14 +1232,12 @@ receive_RDMA_WRITE_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
 	status = pib_util_mr_copy_data_with_rkey(pd, qp->responder.rdma_write.rkey,
 						 buffer,
 						 qp->responder.rdma_write.vaddr + qp->responder.offset,
 						 size,
 						 IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_WRITE,
 						 PIB_MR_COPY_TO);
-	spin_unlock_irqrestore(&pd->lock, flags);
 
 	/*
 	 * IBA Spec. Vol.1 10.7.2.2 states the following sentence
@@ -1037,6 +1252,10 @@ receive_RDMA_WRITE_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode
 	 */
 	if (status != IB_WC_SUCCESS) {
 	skip:		
+		if (qp->qp_type == IB_QPT_UC)
+			/* UC はアクセスエラーのメッセージを破棄する */
+			return -1;
+
 		if (with_imm && !pib_get_behavior(PIB_BEHAVIOR_RDMA_WRITE_WITH_IMM_ALWAYS_ASYNC_ERR))
 			goto completion_error;
 		else
@@ -1069,16 +1288,30 @@ receive_RDMA_WRITE_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode
 		pib_util_free_recv_wqe(qp, recv_wqe);
 	}
 
-	push_acknowledge(qp, psn, PIB_SYND_ACK_CODE);
+	if (finit)
+		qp->responder.msn = (qp->responder.msn + 1) & PIB_MSN_MASK;
+
+	if (qp->qp_type == IB_QPT_UC)
+		return 1;
+
+	if (pib_packet_bth_get_ackreq(bth))
+		push_acknowledge(qp, psn, PIB_SYND_ACK_CODE);
+	else
+		push_delayed_acknowledge(qp, psn);
 
 	return 1; /* 1 packet */
 
 resources_not_ready:
-	push_acknowledge(qp, psn, get_resources_not_ready(qp));
+	/* UC はメッセージを破棄する */
+	if (qp->qp_type == IB_QPT_RC)
+		push_acknowledge(qp, psn, get_resources_not_ready(qp));
 
 	return -1;
 
 nak_invalid_request:
+	if (qp->qp_type == IB_QPT_UC)
+		return -1;
+
 	/* Invalid Request Local Work Queue Error */
 	push_acknowledge(qp, psn, PIB_SYND_NAK_CODE_INV_REQ_ERR);
 	insert_async_qp_error(dev, qp, IB_EVENT_QP_REQ_ERR);
@@ -1129,7 +1362,6 @@ receive_Atomic_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, st
 	struct pib_rd_atom_slot slot;
 	u64 vaddr;
 	u64 result;
-	unsigned long flags;
 
 	if (size != sizeof(*atomiceth)) {
 		/* Invalid Request Local Work Queue Error */
@@ -1157,13 +1389,11 @@ receive_Atomic_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, st
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
 	status = pib_util_mr_atomic(pd, be32_to_cpu(atomiceth->rkey), vaddr,
 				    be64_to_cpu(atomiceth->swap_dt),
 				    be64_to_cpu(atomiceth->cmp_dt),
 				    &result,
 				    (OpCode == IB_WR_ATOMIC_CMP_AND_SWP) ? PIB_MR_CAS : PIB_MR_FETCHADD);
-	spin_unlock_irqrestore(&pd->lock, flags);
 
 	if (status != IB_WC_SUCCESS) {
 		/* Local Access Violation Work Queue Error */
@@ -1172,14 +1402,17 @@ receive_Atomic_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, st
 		return -1;
 	}
 
+	qp->responder.msn = (qp->responder.msn + 1) & PIB_MSN_MASK;
+
 	slot.OpCode          = OpCode;
 	slot.psn             = qp->responder.psn;
 	slot.expected_psn    = qp->responder.psn + 1;
+	slot.msn             = qp->responder.msn;
 	slot.data.atomic.res = result;
 
-	qp->responder.slots[(qp->responder.slot_index++) % PIB_MAX_RD_ATOM] = slot;
+	push_rd_atom_slot(qp, &slot);
 
-	push_atomic_acknowledge(qp, psn, result);
+	push_atomic_acknowledge(qp, psn, slot.msn, result);
 
 	return 1; /* 1 packet */
 }
@@ -1197,7 +1430,6 @@ receive_RDMA_READ_request(struct pib_dev *dev, u8 port_num, u32 psn, struct pib_
 	struct pib_rd_atom_slot slot;
 	struct pib_pd *pd;
 	enum ib_wc_status status = IB_WC_SUCCESS;
-	unsigned long flags;
 
 	if (size != sizeof(*reth))
 		goto nak_invalid_request;
@@ -1215,9 +1447,7 @@ receive_RDMA_READ_request(struct pib_dev *dev, u8 port_num, u32 psn, struct pib_
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
 	status = pib_util_mr_verify_rkey_validation(pd, rkey, remote_addr, dmalen, IB_ACCESS_REMOTE_READ);
-	spin_unlock_irqrestore(&pd->lock, flags);
 
 	if (status != IB_WC_SUCCESS) {
 		/* Local Access Violation Work Queue Error */
@@ -1230,21 +1460,21 @@ receive_RDMA_READ_request(struct pib_dev *dev, u8 port_num, u32 psn, struct pib_
 
 	if (new_request) {
 		/* new RMDA READ Request */
-		struct pib_rd_atom_slot overwrite_slot;
-
 		if (qp->ib_qp_attr.max_dest_rd_atomic <= qp->responder.nr_rd_atomic)
 			goto length_error_or_too_many_rdma_read;
 
-		overwrite_slot = qp->responder.slots[((unsigned int)(qp->responder.slot_index - qp->ib_qp_attr.max_dest_rd_atomic)) % PIB_MAX_RD_ATOM];
+		/* RDMA READ は Request を受理した時点で MSN を進める */
+		qp->responder.msn = (qp->responder.msn + 1) & PIB_MSN_MASK;
 
 		slot.OpCode                  = IB_OPCODE_RC_RDMA_READ_REQUEST;
 		slot.psn                     = qp->responder.psn;
 		slot.expected_psn            = qp->responder.psn + num_packets;
+		slot.msn                     = qp->responder.msn;
 		slot.data.rdma_read.vaddress = remote_addr;
 		slot.data.rdma_read.rkey     = rkey;
 		slot.data.rdma_read.dmalen   = dmalen;
 
-		qp->responder.slots[(qp->responder.slot_index++) % PIB_MAX_RD_ATOM] = slot;
+		push_rd_atom_slot(qp, &slot);
 
 		/* rq_psn は RDMA READ response packets を投げる前に一気に進める */
 		ret = num_packets;
@@ -1270,10 +1500,14 @@ receive_RDMA_READ_request(struct pib_dev *dev, u8 port_num, u32 psn, struct pib_
 	if (qp->ib_qp_attr.max_dest_rd_atomic <= qp->responder.nr_rd_atomic)
 		goto length_error_or_too_many_rdma_read;
 
-	push_rdma_read_acknowledge(qp, psn, slot.expected_psn, remote_addr, rkey, dmalen);
+	/*
+	 *  先行する RDMA READ response を送信中でなければ、この response から
+	 *  ウィンドウを開く。送信中ならその後ろに続けて送信する。
+	 */
+	if (!has_rdma_read_acknowledge(qp))
+		qp->responder.read_acked_psn = psn;
 
-	/* RDMA READ ACK の連続送信回数をクリア */ 
-	qp->responder.nr_contig_read_acks = 0;
+	push_rdma_read_acknowledge(qp, psn, slot.expected_psn, slot.msn, remote_addr, rkey, dmalen);
 
 	return ret;
 
@@ -1294,11 +1528,44 @@ length_error_or_too_many_rdma_read:
 }
 
 
+/*
+ *  重複した RDMA READ / Atomic Request の PSN を含む slot を新しいものから探す。
+ *  max_dest_rd_atomic 個より古い slot は上書きされているので探さない。
+ */
+static int
+find_rd_atom_slot(struct pib_qp *qp, int OpCode, u32 psn)
+{
+	u32 i;
+
+	for (i=1 ; i <= qp->ib_qp_attr.max_dest_rd_atomic ; i++) {
+		u32 slot_index = (qp->responder.slot_index - i) % PIB_MAX_RD_ATOM;
+		struct pib_rd_atom_slot *slot = &qp->responder.slots[slot_index];
+
+		if ((slot->OpCode == OpCode) &&
+		    (get_psn_diff(psn, slot->psn)          >= 0) &&
+		    (get_psn_diff(psn, slot->expected_psn) <  0))
+			return slot_index;
+	}
+
+	return -1;
+}
+
+
+static void
+push_rd_atom_slot(struct pib_qp *qp, const struct pib_rd_atom_slot *slot)
+{
+	qp->responder.slots[qp->responder.slot_index++ % PIB_MAX_RD_ATOM] = *slot;
+}
+
+
 static void
 push_acknowledge(struct pib_qp *qp, u32 psn, enum pib_syndrome syndrome)
 {
 	struct pib_ack *ack;
 
+	/* 遅延中の ACK があれば、この acknowledge と一緒に直ちに送信する */
+	qp->responder.nr_delayed_acks = 0;
+
 	if (!list_empty(&qp->responder.ack_head)) {
 		struct pib_ack *ack_last;
 
@@ -1320,6 +1587,7 @@ push_acknowledge(struct pib_qp *qp, u32 psn, enum pib_syndrome syndrome)
 				/* IBA Spec. Vol.1 9.7.5.1.2. Coalesced Acknowledge Messages */
 				ack_last->psn          = psn;
 				ack_last->expected_psn = psn + 1;
+				ack_last->msn          = qp->responder.msn;
 				return;
 			}
 		}
@@ -1333,13 +1601,54 @@ push_acknowledge(struct pib_qp *qp, u32 psn, enum pib_syndrome syndrome)
 	ack->type		= PIB_ACK_NORMAL;
 	ack->psn		= psn;
 	ack->expected_psn	= psn + 1;
+	ack->msn		= qp->responder.msn;
 	ack->syndrome		= syndrome;
 
 	list_add_tail(&ack->list, &qp->responder.ack_head);
+}
+
+
+/*
+ *  Push a normal ACK for a packet whose A-bit is clear.  The MSN carried by
+ *  the ACK lets the requester retire every message it covers at once.
+ *
+ *  The ACK is held back until ack_coalesce packets have been coalesced into
+ *  it or ack_delay has elapsed, whichever comes first. Any other acknowledge
+ *  pushed in the meantime flushes it (IBA Spec. Vol.1 9.7.5.1.2).
+ */
+static void
+push_delayed_acknowledge(struct pib_qp *qp, u32 psn)
+{
+	int nr_delayed_acks;
+	bool pending;
+	unsigned long delay;
+
+	nr_delayed_acks = qp->responder.nr_delayed_acks;
+
+	/* 他の acknowledge が既に積まれていれば、それと一緒に送信すればよい */
+	pending = (nr_delayed_acks == 0) && !list_empty(&qp->responder.ack_head);
+
+	push_acknowledge(qp, psn, PIB_SYND_ACK_CODE);
+
+	if (pending || list_empty(&qp->responder.ack_head))
+		return;
 
-	if ((syndrome & PIB_SYND_CODE_MASK) != PIB_SYND_ACK_CODE)
-		/* RDMA READ ACK の連続送信回数をクリア */ 
-		qp->responder.nr_contig_read_acks = 0;
+	/* Requester の Local ACK Timeout より十分に短くなければならない */
+	delay = usecs_to_jiffies(ack_delay);
+	if (qp->local_ack_timeout / 2 < delay)
+		delay = qp->local_ack_timeout / 2;
+
+	if ((ack_coalesce <= 1) || (delay == 0))
+		return;
+
+	if (ack_coalesce <= ++nr_delayed_acks)
+		/* 合体したパケット数が上限に達したので直ちに送信する */
+		return;
+
+	if (nr_delayed_acks == 1)
+		qp->responder.delayed_ack_time = jiffies + delay;
+
+	qp->responder.nr_delayed_acks = nr_delayed_acks;
 }
 
 
@@ -1367,10 +1676,13 @@ remove_overlapped_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected
 
 
 static void
-push_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected_psn, u64 vaddress, u32 rkey, u32 size)
+push_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected_psn, u32 msn, u64 vaddress, u32 rkey, u32 size)
 {
 	struct pib_ack *ack;
 
+	/* 遅延中の ACK は RDMA READ response より先に送信する */
+	qp->responder.nr_delayed_acks = 0;
+
 	ack = kmem_cache_zalloc(pib_ack_cachep, GFP_ATOMIC);
 	if (!ack)
 		return;
@@ -1378,6 +1690,7 @@ push_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected_psn, u64 vad
 	ack->type		= PIB_ACK_RMDA_READ;
 	ack->psn		= psn;
 	ack->expected_psn	= expected_psn;
+	ack->msn		= msn;
 
 	ack->data.rdma_read.vaddress	= vaddress;
 	ack->data.rdma_read.rkey	= rkey;
@@ -1390,10 +1703,13 @@ push_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected_psn, u64 vad
 
 
 static void
-push_atomic_acknowledge(struct pib_qp *qp, u32 psn, u64 res)
+push_atomic_acknowledge(struct pib_qp *qp, u32 psn, u32 msn, u64 res)
 {
 	struct pib_ack *ack;
 
+	/* 遅延中の ACK は Atomic ACK より先に送信する */
+	qp->responder.nr_delayed_acks = 0;
+
 	ack = kmem_cache_zalloc(pib_ack_cachep, GFP_ATOMIC);
 	if (!ack)
 		return;
@@ -1401,6 +1717,7 @@ push_atomic_acknowledge(struct pib_qp *qp, u32 psn, u64 res)
 	ack->type		= PIB_ACK_ATOMIC;
 	ack->psn		= psn;
 	ack->expected_psn	= psn + 1;
+	ack->msn		= msn;
 
 	ack->data.atomic.res	= res;
 
@@ -1410,6 +1727,19 @@ push_atomic_acknowledge(struct pib_qp *qp, u32 psn, u64 res)
 }
 
 
+static bool
+has_rdma_read_acknowledge(struct pib_qp *qp)
+{
+	struct pib_ack *ack;
+
+	list_for_each_entry(ack, &qp->responder.ack_head, list)
+		if (ack->type == PIB_ACK_RMDA_READ)
+			return true;
+
+	return false;
+}
+
+
 /******************************************************************************/
 /* Responder: Generating Acknowledge Packets                                  */
 /******************************************************************************/
@@ -1426,6 +1756,14 @@ int pib_generate_rc_qp_acknowledge(struct pib_dev *dev, struct pib_qp *qp)
 	if (list_empty(&qp->responder.ack_head))
 		return 0;
 
+	if (0 < qp->responder.nr_delayed_acks) {
+		/* Delayed ACK: 遅延時刻に達するまでは送信しない */
+		if (time_after(qp->responder.delayed_ack_time, jiffies))
+			return 0;
+
+		qp->responder.nr_delayed_acks = 0;
+	}
+
 	ack = list_first_entry(&qp->responder.ack_head, struct pib_ack, list);
 
 	port_num = qp->ib_qp_attr.port_num;
@@ -1445,7 +1783,11 @@ int pib_generate_rc_qp_acknowledge(struct pib_dev *dev, struct pib_qp *qp)
 		break;
 
 	case PIB_ACK_RMDA_READ:
-		if (PIB_MAX_CONTIG_READ_ACKS < qp->responder.nr_contig_read_acks)
+		/*
+		 *  requester の受信通知を待たずに送信できるのはウィンドウ内まで。
+		 *  残りのパケットは同じスケジューリングで続けて送信される。
+		 */
+		if (pib_is_rc_qp_read_window_full(qp))
 			return 0;
 
 		generate_RDMA_READ_response(dev, qp, dlid, ack);
@@ -1454,7 +1796,16 @@ int pib_generate_rc_qp_acknowledge(struct pib_dev *dev, struct pib_qp *qp)
 			return 1;
 
 		qp->responder.nr_rd_atomic--;
-		break;
+
+		list_del_init(&ack->list);
+		kmem_cache_free(pib_ack_cachep, ack);
+
+		/*
+		 *  後ろに並んでいる RDMA READ response のウィンドウはその先頭の
+		 *  PSN から開く。間の SEND や RDMA WRITE の PSN は数えない。
+		 */
+		pib_reset_rc_qp_read_window(qp);
+		return 1;
 
 	default:
 		BUG();
@@ -1478,11 +1829,11 @@ generate_Normal_or_Atomic_acknowledge(struct pib_dev *dev, struct pib_qp *qp, u1
 	if (ack->type == PIB_ACK_NORMAL)
 		size = pack_acknowledge_packet(dev, qp,
 					       IB_OPCODE_RC_ACKNOWLEDGE, ack->psn,
-					       1, ack->syndrome, 0, 0, NULL);
+					       1, ack->syndrome, ack->msn, 0, 0, NULL);
 	else
 		size = pack_acknowledge_packet(dev, qp,
 					       IB_OPCODE_RC_ATOMIC_ACKNOWLEDGE, ack->psn,
-					       1, PIB_SYND_ACK_CODE, 1, ack->data.atomic.res, NULL);
+					       1, PIB_SYND_ACK_CODE, ack->msn, 1, ack->data.atomic.res, NULL);
 
 	dev->thread.port_num    = port_num;
 	dev->thread.slid	= dev->ports[port_num - 1].ib_port_attr.lid;
@@ -1505,7 +1856,6 @@ generate_RDMA_READ_response(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, st
 	struct pib_packet_lrh *lrh;
 	struct pib_packet_bth *bth;
 	enum ib_wc_status status;
-	unsigned long flags;
 	u8 port_num;
 
 	lrh = (struct pib_packet_lrh*)dev->thread.send_buffer;
@@ -1527,7 +1877,7 @@ generate_RDMA_READ_response(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, st
 	/* ここからパケット送信 */
 
 	size = pack_acknowledge_packet(dev, qp, OpCode, ack->psn + psn_offset,
-				       with_aeth, PIB_SYND_ACK_CODE, 0, 0, &bth);
+				       with_aeth, PIB_SYND_ACK_CODE, ack->msn, 0, 0, &bth);
 
 	data_size = (ack->data.rdma_read.size - ack->data.rdma_read.offset < pmtu) ?
 		(ack->data.rdma_read.size - ack->data.rdma_read.offset) : pmtu;
@@ -1539,7 +1889,6 @@ generate_RDMA_READ_response(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, st
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
 	status = pib_util_mr_copy_data_with_rkey(pd,
 						 ack->data.rdma_read.rkey,
 						 dev->thread.send_buffer + size,
@@ -1547,7 +1896,6 @@ generate_RDMA_READ_response(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, st
 						 data_size,
 						 IB_ACCESS_REMOTE_READ,
 						 PIB_MR_COPY_FROM);
-	spin_unlock_irqrestore(&pd->lock, flags);
 
 	/* @todo data_size が 4 の倍数で終わらない場合に尻尾にゴミが入っている */
 
@@ -1566,65 +1914,73 @@ generate_RDMA_READ_response(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, st
 
 	ack->data.rdma_read.offset += data_size;
 
-	/* RDMA READ ACK の連続送信回数をカウントアップ */ 
-	qp->responder.nr_contig_read_acks++;
-
 	return IB_WC_SUCCESS;
 }
 
 
-static int
-pack_acknowledge_packet(struct pib_dev *dev, struct pib_qp *qp, int OpCode, u32 psn, int with_aeth, enum pib_syndrome syndrome, int with_atomiceth, u64 res, struct pib_packet_bth **bth_p)
+/*
+ *  RDMA READ response で次に送信するパケットの PSN
+ */
+static u32
+get_rdma_read_response_psn(struct pib_qp *qp, struct pib_ack *ack)
 {
-	int size;
-	void *buffer;
-	u8 port_num;
-	struct ib_ah_attr ah_attr;
-	struct pib_packet_lrh *lrh;
-	struct ib_grh         *grh;
-	struct pib_packet_bth *bth;
-	struct pib_packet_aeth *aeth = NULL;
-	struct pib_packet_atomicacketh *atomicacketh = NULL;
-	u32 lnh;
-
-	port_num = qp->ib_qp_attr.port_num;
-	ah_attr  = qp->ib_qp_attr.ah_attr;
-
-	buffer = dev->thread.send_buffer;
+	return ack->psn + (ack->data.rdma_read.offset / 128U >> qp->ib_qp_attr.path_mtu);
+}
 
-	memset(buffer, 0, sizeof(*lrh) + sizeof(*grh) + sizeof(*bth) + sizeof(*aeth) + sizeof(*atomicacketh));
 
-	/* @todo not yet implemented credit count */
+void pib_reset_rc_qp_read_window(struct pib_qp *qp)
+{
+	struct pib_ack *ack;
 
-	lrh = (struct pib_packet_lrh*)buffer; 
-	buffer += sizeof(*lrh);
-	if (ah_attr.ah_flags & IB_AH_GRH) {
-		grh = (struct ib_grh*)buffer;
-		pib_fill_grh(dev, port_num, grh, &ah_attr.grh);
-		buffer += sizeof(*grh);
-		lnh = 0x3;
-	} else {
-		grh = NULL;
-		lnh = 0x2;
+	list_for_each_entry(ack, &qp->responder.ack_head, list) {
+		if (ack->type == PIB_ACK_RMDA_READ) {
+			qp->responder.read_acked_psn = get_rdma_read_response_psn(qp, ack);
+			return;
+		}
 	}
+}
+
+
+bool pib_is_rc_qp_read_window_full(struct pib_qp *qp)
+{
+	struct pib_ack *ack;
+
+	if (list_empty(&qp->responder.ack_head))
+		return false;
+
+	ack = list_first_entry(&qp->responder.ack_head, struct pib_ack, list);
+
+	if (ack->type != PIB_ACK_RMDA_READ)
+		return false;
+
+	return PIB_MAX_CONTIG_READ_ACKS <= get_psn_diff(get_rdma_read_response_psn(qp, ack),
+							qp->responder.read_acked_psn);
+}
+
+
+static int
+pack_acknowledge_packet(struct pib_dev *dev, struct pib_qp *qp, int OpCode, u32 psn, int with_aeth, enum pib_syndrome syndrome, u32 msn, int with_atomiceth, u64 res, struct pib_packet_bth **bth_p)
+{
+	int size;
+	void *buffer;
+	struct pib_packet_lrh *lrh;
+	struct ib_grh         *grh;
+	struct pib_packet_bth *bth;
+	struct pib_packet_aeth *aeth = NULL;
+	struct pib_packet_atomicacketh *atomicacketh = NULL;
 
-	bth = (struct pib_packet_bth*)buffer;
-	buffer += sizeof(*bth);
+	/* @todo not yet implemented credit count */
 
-	lrh->sl_rsv_lnh = (qp->ib_qp_attr.ah_attr.sl << 4) | lnh; /* Transport: IBA & Next Header: BTH */
-	lrh->dlid	= cpu_to_be16(qp->ib_qp_attr.ah_attr.dlid);
-	lrh->slid       = cpu_to_be16(dev->ports[port_num - 1].ib_port_attr.lid);
+	buffer = write_packet_header(dev, qp, dev->thread.send_buffer, &lrh, &grh, &bth);
 
 	bth->OpCode     = OpCode;
-	bth->pkey       = dev->ports[port_num - 1].pkey_table[qp->ib_qp_attr.pkey_index];
-	bth->destQP     = cpu_to_be32(qp->ib_qp_attr.dest_qp_num);
 	bth->psn        = cpu_to_be32(psn & PIB_PSN_MASK); /* A-bit is 0 */ 
 
 	if (with_aeth) {
 		aeth = (struct pib_packet_aeth*)buffer;
 		buffer += sizeof(*aeth);
 
-		aeth->syndrome_msn = cpu_to_be32(syndrome << 24);
+		aeth->syndrome_msn = cpu_to_be32((syndrome << 24) | (msn & PIB_MSN_MASK));
 	}
 
 	if (with_atomiceth) {
@@ -1655,7 +2011,7 @@ static int
 receive_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size)
 {
 	int ret;
-	u32 psn, syndrome;
+	u32 psn, syndrome, msn;
 	unsigned long rnr_nak_timeout = 0;
 	struct pib_packet_aeth *aeth;
 	struct pib_send_wqe *send_wqe, *next_send_wqe;
@@ -1664,9 +2020,6 @@ receive_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib
 		/* @todo これはエラーにとらないでいいか？ */
 		return 0;
 
-	/* レスポンスを受ければ連続送信はクリアできる */
-	qp->requester.nr_contig_requests = 0;
-
 	/* response's PSN */
 	psn = be32_to_cpu(bth->psn) & PIB_PSN_MASK;
 
@@ -1675,6 +2028,7 @@ receive_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib
 	size      -= sizeof(*aeth);
 
 	syndrome =  be32_to_cpu(aeth->syndrome_msn) >> 24;
+	msn      =  be32_to_cpu(aeth->syndrome_msn) & PIB_MSN_MASK;
 
 	pib_trace_recv_ok(dev, port_num, bth->OpCode, psn, qp->ib_qp.qp_num, syndrome);
 
@@ -1686,10 +2040,13 @@ receive_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib
 
 	case PIB_SYND_ACK_CODE:
 		/* ACK */
+		/* RDMA READ response と Atomic ACK はそれより前のメッセージを暗黙に ACK する */
+		retire_acknowledged_messages(qp, (bth->OpCode == IB_OPCODE_RC_ACKNOWLEDGE) ? psn : psn - 1, msn);
 		break;
 
 	case PIB_SYND_RNR_NAK_CODE:
 		/* RNR NAK */
+		retire_acknowledged_messages(qp, psn - 1, msn);
 		rnr_nak_timeout = pib_get_rnr_nak_time(syndrome & 0x1F);
 		goto retry_send;
 
@@ -1701,6 +2058,9 @@ receive_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib
 			/* PSN Sequence Error */
 			/* @todo PSN Sequence Error を RNR NAK と同様に扱ってリトライをかけるが
 			   これは正しい仕様か？ */
+			/* パケットの欠落は輻輳とみなす (RNR NAK は輻輳ではない) */
+			retire_acknowledged_messages(qp, psn - 1, msn);
+			decrease_congestion_window(qp, false);
 			goto retry_send;
 
 		case PIB_SYND_NAK_CODE_INV_REQ_ERR:
@@ -1766,6 +2126,9 @@ switch_OpCode:
 	return ret;
 
 retry_send:
+	/* 再送するパケットの往復時間は計測しない */
+	qp->requester.rtt.timing = 0;
+
 	/* waiting list から sending list へ戻す */
 	list_for_each_entry_safe_reverse(send_wqe, next_send_wqe, &qp->requester.waiting_swqe_head, list) {
 		send_wqe->processing.list_type = PIB_SWQE_SENDING;
@@ -1780,6 +2143,8 @@ retry_send:
 		send_wqe->processing.sent_packets = send_wqe->processing.ack_packets;
 	}
 
+	qp->requester.cc.nr_read_packets = 0;
+
 	/* 最初の Send WQE が SEND また RDMA WRITE w/Immediate なら rnr_retry を減算する */
 	if (rnr_nak_timeout && !list_empty(&qp->requester.sending_swqe_head)) {
 		send_wqe = list_first_entry(&qp->requester.sending_swqe_head, struct pib_send_wqe, list);
@@ -1810,24 +2175,81 @@ static void
 set_send_wqe_to_error(struct pib_qp *qp, u32 psn, enum ib_wc_status status)
 {
 	struct pib_send_wqe *send_wqe;
+	int first_send_wqe;
+	int *nr_swqe_p;
 
-	list_for_each_entry(send_wqe, &qp->requester.waiting_swqe_head, list) {
-		if ((get_psn_diff(psn, send_wqe->processing.based_psn)       >= 0) &&
-		    (get_psn_diff(psn, send_wqe->processing.expected_psn) <  0)) {
-			send_wqe->processing.status = status;
-			return;
-		}
-	}
+	send_wqe = match_send_wqe(qp, psn, &first_send_wqe, &nr_swqe_p);
 
-	list_for_each_entry(send_wqe, &qp->requester.sending_swqe_head, list) {
-		if ((get_psn_diff(psn, send_wqe->processing.based_psn)       >= 0) &&
-		    (get_psn_diff(psn, send_wqe->processing.expected_psn) <  0)) {
-			send_wqe->processing.status = status;
-			return;
+	if (send_wqe == NULL)
+		/* silently drop */
+		return;
+
+	send_wqe->processing.status = status;
+}
+
+
+/*
+ *  AETH の MSN から responder で完了したメッセージの数を求め、in-flight の
+ *  先頭からその数だけ Send WQE をまとめて完了させる。
+ *
+ *  psn より後ろのパケットを含む Send WQE と、応答のデータを受け取る必要のある
+ *  RDMA READ・Atomic はここでは完了させず、従来通り PSN で処理する。
+ */
+static void
+retire_acknowledged_messages(struct pib_qp *qp, u32 psn, u32 msn)
+{
+	s32 nr_messages;
+	u32 nr_packets = 0;
+	struct pib_send_wqe *send_wqe;
+
+	nr_messages = get_msn_diff(msn, qp->requester.msn);
+
+	for ( ; (0 < nr_messages) && (0 < qp->requester.nr_inflight_swqe) ; nr_messages--) {
+		send_wqe = qp->requester.inflight_swqes[qp->requester.inflight_head];
+
+		if (send_wqe->local_only_request ||
+		    pib_is_wr_opcode_rd_atomic(send_wqe->opcode) ||
+		    (send_wqe->processing.status != IB_WC_SUCCESS))
+			break;
+
+		if (get_psn_diff(psn, send_wqe->processing.expected_psn) < -1)
+			/* 最後のパケットが ACK されていない */
+			break;
+
+		nr_packets += send_wqe->processing.all_packets - send_wqe->processing.ack_packets;
+
+		if ((qp->ib_qp_init_attr.sq_sig_type == IB_SIGNAL_ALL_WR) ||
+		    (send_wqe->send_flags & IB_SEND_SIGNALED)) {
+			struct ib_wc wc = {
+				.wr_id    = send_wqe->wr_id,
+				.status   = IB_WC_SUCCESS,
+				.opcode   = pib_convert_wr_opcode_to_wc_opcode(send_wqe->opcode),
+				.qp       = &qp->ib_qp,
+			};
+
+			pib_util_insert_wc_success(qp->send_cq, &wc, 0);
 		}
+
+		qp->requester.psn = (send_wqe->processing.expected_psn & PIB_PSN_MASK);
+		qp->requester.msn = (qp->requester.msn + 1) & PIB_MSN_MASK;
+		qp->requester.nr_retired_swqes++;
+
+		if (send_wqe->processing.list_type == PIB_SWQE_WAITING)
+			qp->requester.nr_waiting_swqe--;
+		else
+			qp->requester.nr_sending_swqe--;
+
+		list_del_init(&send_wqe->list);
+		pib_util_pop_inflight_swqe(qp, send_wqe);
+		pib_util_free_send_wqe(qp, send_wqe);
 	}
 
-	/* silently drop */
+	if (nr_packets == 0)
+		return;
+
+	process_acknowledged_packets(qp, psn, nr_packets);
+
+	postpone_local_ack_timeout(qp);
 }
 
 
@@ -1852,11 +2274,14 @@ receive_ACK_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 ps
 		case RET_ERROR:
 			list_del_init(&send_wqe->list);
 			qp->requester.nr_waiting_swqe--;
+			pib_util_pop_inflight_swqe(qp, send_wqe);
 			goto completion_error;
 
 		case RET_COMPLETE:
 			list_del_init(&send_wqe->list);
 			qp->requester.nr_waiting_swqe--;
+			qp->requester.msn = (qp->requester.msn + 1) & PIB_MSN_MASK;
+			pib_util_pop_inflight_swqe(qp, send_wqe);
 			pib_util_free_send_wqe(qp, send_wqe);
 			is_postpone_local_ack_timeout = true;
 			break;
@@ -1877,11 +2302,14 @@ receive_ACK_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 ps
 		case RET_ERROR:
 			list_del_init(&send_wqe->list);
 			qp->requester.nr_sending_swqe--;
+			pib_util_pop_inflight_swqe(qp, send_wqe);
 			goto completion_error;
 
 		case RET_COMPLETE:
 			list_del_init(&send_wqe->list);
 			qp->requester.nr_sending_swqe--;
+			qp->requester.msn = (qp->requester.msn + 1) & PIB_MSN_MASK;
+			pib_util_pop_inflight_swqe(qp, send_wqe);
 			pib_util_free_send_wqe(qp, send_wqe);
 			is_postpone_local_ack_timeout = true;
 			break;
@@ -1952,11 +2380,13 @@ process_acknowledge(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe
 
 	if (psn_diff + 1 < send_wqe->processing.all_packets) {
 		/* Left packets to send */
+		process_acknowledged_packets(qp, psn, psn_diff + 1 - send_wqe->processing.ack_packets);
 		send_wqe->processing.ack_packets = psn_diff + 1;
 		return RET_CONTINUE;
 	}
 
 	/* Complete to send */
+	process_acknowledged_packets(qp, psn, send_wqe->processing.all_packets - send_wqe->processing.ack_packets);
 
 	if ((qp->ib_qp_init_attr.sq_sig_type == IB_SIGNAL_ALL_WR) || 
 	    (send_wqe->send_flags & IB_SEND_SIGNALED)) {
@@ -1985,7 +2415,6 @@ receive_RDMA_READ_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp,
 	int *nr_swqe_p;
 	struct pib_pd *pd;
 	enum ib_wc_status status;
-	unsigned long flags;
 	u32 dmalen, offset;
 
 	send_wqe = match_send_wqe(qp, psn, &first_send_wqe, &nr_swqe_p);
@@ -2014,14 +2443,12 @@ receive_RDMA_READ_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp,
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
 	status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge,
 				       buffer,
 				       offset,
 				       size,
 				       IB_ACCESS_LOCAL_WRITE,
 				       PIB_MR_COPY_TO);
-	spin_unlock_irqrestore(&pd->lock, flags);
 
 	if (status != IB_WC_SUCCESS) {
 		send_wqe->processing.status = status;
@@ -2029,14 +2456,19 @@ receive_RDMA_READ_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp,
 	}
 
 	/* ACK が受理できれば local_ack_time は延長可能 */
-	send_wqe->processing.local_ack_time = jiffies + qp->local_ack_timeout;
+	postpone_local_ack_timeout(qp);
 
 	send_wqe->processing.sent_packets++;
 	send_wqe->processing.ack_packets++;
 
-	/* RDMA READ ACK に対して定期的に CNP を送信する */
+	if (send_wqe->processing.ack_packets < send_wqe->processing.all_packets)
+		qp->requester.cc.nr_read_packets--;
+
+	process_acknowledged_packets(qp, psn, 1);
+
+	/* RDMA READ ACK に対して定期的に CNP で受信済みの PSN を通知する */
 	if ((PIB_MAX_CONTIG_READ_ACKS / 3) < ++qp->requester.nr_contig_read_acks) {
-		process_cnp_notify_request(dev, qp, send_wqe);
+		process_cnp_notify_request(dev, qp, PIB_OPCODE_CNP_SEND_NOTIFY, psn + 1, send_wqe->trace_id);
 		qp->requester.nr_contig_read_acks = 0;
 	}
 
@@ -2061,10 +2493,12 @@ receive_RDMA_READ_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp,
 	BUG_ON(qp->requester.nr_rd_atomic < 0);
 
 	qp->requester.psn = (send_wqe->processing.expected_psn & PIB_PSN_MASK);
+	qp->requester.msn = (qp->requester.msn + 1) & PIB_MSN_MASK;
 
 	(*nr_swqe_p)--;
 
 	list_del_init(&send_wqe->list);
+	pib_util_pop_inflight_swqe(qp, send_wqe);
 	pib_util_free_send_wqe(qp, send_wqe);
 
 	postpone_local_ack_timeout(qp);
@@ -2083,7 +2517,6 @@ receive_Atomic_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32
 	struct pib_pd *pd;
 	enum ib_wc_status status;
 	u64 res;
-	unsigned long flags;
 
 	if (size !=  sizeof(*atomicacketh))
 		/* @todo これはエラーにとらないでいいか？ */
@@ -2112,12 +2545,10 @@ receive_Atomic_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
 	status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge,
 				       (void*)&res, 0, sizeof(res),
 				       IB_ACCESS_LOCAL_WRITE,
 				       PIB_MR_COPY_TO);
-	spin_unlock_irqrestore(&pd->lock, flags);
 
 	if (status != IB_WC_SUCCESS) {
 		send_wqe->processing.status = status;
@@ -2137,14 +2568,18 @@ receive_Atomic_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32
 		ret = pib_util_insert_wc_success(qp->send_cq, &wc, 0);
 	}
 
+	process_acknowledged_packets(qp, psn, 1);
+
 	qp->requester.nr_rd_atomic--;
 	BUG_ON(qp->requester.nr_rd_atomic < 0);
 
 	qp->requester.psn = (send_wqe->processing.expected_psn & PIB_PSN_MASK);
+	qp->requester.msn = (qp->requester.msn + 1) & PIB_MSN_MASK;
 
 	(*nr_swqe_p)--;
 
 	list_del_init(&send_wqe->list);
+	pib_util_pop_inflight_swqe(qp, send_wqe);
 	pib_util_free_send_wqe(qp, send_wqe);
 
 	postpone_local_ack_timeout(qp);
@@ -2158,61 +2593,26 @@ receive_Atomic_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32
 /******************************************************************************/
 
 static void
-process_cnp_notify_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe)
+process_cnp_notify_request(struct pib_dev *dev, struct pib_qp *qp, int OpCode, u32 psn, u32 trace_id)
 {
 	void *buffer;
-	u8 port_num;
-	struct ib_ah_attr ah_attr;
-	u16 slid, dlid;
 	struct pib_packet_lrh *lrh;
 	struct ib_grh         *grh;
 	struct pib_packet_bth *bth;
-	u32 lnh;
-	u32 psn;
-
-	port_num = qp->ib_qp_attr.port_num;
-	ah_attr  = qp->ib_qp_attr.ah_attr;
-
-	buffer = dev->thread.send_buffer;
-
-	slid = dev->ports[port_num - 1].ib_port_attr.lid;
-	dlid = ah_attr.dlid;
-
-	memset(buffer, 0, sizeof(*lrh) + sizeof(*grh) + sizeof(*bth));
 
 	/* write IB Packet Header (LRH, GRH, BTH) */
-	lrh = (struct pib_packet_lrh*)buffer; 
-	buffer += sizeof(*lrh);
-	if (ah_attr.ah_flags & IB_AH_GRH) {
-		grh = (struct ib_grh*)buffer;
-		pib_fill_grh(dev, port_num, grh, &ah_attr.grh);
-		buffer += sizeof(*grh);
-		lnh = 0x3;
-	} else {
-		grh = NULL;
-		lnh = 0x2;
-	}
-	bth = (struct pib_packet_bth*)buffer;
-	buffer += sizeof(*bth);
-
-	lrh->sl_rsv_lnh = (ah_attr.sl << 4) | lnh; /* Transport: IBA & Next Header: BTH */
-	lrh->dlid   = cpu_to_be16(dlid);
-	lrh->slid   = cpu_to_be16(slid);
+	buffer = write_packet_header(dev, qp, dev->thread.send_buffer, &lrh, &grh, &bth);
 
 	pib_packet_lrh_set_pktlen(lrh, (buffer - dev->thread.send_buffer + 4) / 4); /* add ICRC size */
 
-	psn = send_wqe->processing.based_psn + send_wqe->processing.sent_packets;
-
-	bth->OpCode = PIB_OPCODE_CNP_SEND_NOTIFY;
-	bth->pkey   = dev->ports[port_num - 1].pkey_table[qp->ib_qp_attr.pkey_index];
-	bth->destQP = cpu_to_be32(qp->ib_qp_attr.dest_qp_num);
-	bth->psn    = cpu_to_be32(qp->responder.psn & PIB_PSN_MASK); /* A-bit is 0 */
+	bth->OpCode = OpCode;
+	bth->psn    = cpu_to_be32(psn & PIB_PSN_MASK); /* A-bit is 0 */
 
-	dev->thread.port_num	= port_num;
-	dev->thread.slid	= slid;
-	dev->thread.dlid	= dlid;
+	dev->thread.port_num	= qp->ib_qp_attr.port_num;
+	dev->thread.slid	= qp->template.slid;
+	dev->thread.dlid	= qp->template.dlid;
 	dev->thread.src_qp_num	= qp->ib_qp.qp_num;
-	dev->thread.trace_id    = send_wqe->trace_id;
+	dev->thread.trace_id    = trace_id;
 	dev->thread.ready_to_send = 1;
 }
 
@@ -2228,8 +2628,325 @@ receive_cnp_notify(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct p
 
 	pib_trace_recv_ok(dev, port_num, OpCode, psn, qp->ib_qp.qp_num, size);
 
-	/* RDMA READ ACK の連続送信回数をクリア */ 
-	qp->responder.nr_contig_read_acks = 0;
+	switch (OpCode) {
+
+	case PIB_OPCODE_CNP_SEND_NOTIFY:
+		/* requester が psn の直前までの RDMA READ response を受信した */
+		if (0 < get_psn_diff(psn, qp->responder.read_acked_psn))
+			qp->responder.read_acked_psn = psn;
+		break;
+
+	case PIB_OPCODE_CNP_CONGESTION_NOTIFY:
+		/* 相手の responder が輻輳を検出した */
+		qp->requester.cc.nr_cnps++;
+		decrease_congestion_window(qp, false);
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+/*
+ *  受信ソケットにパケットが溜まっている間は、新しい Request を受け取った
+ *  QP の requester に PIB_CNP_INTERVAL パケット毎に輻輳を通知する。
+ */
+static void
+check_congestion(struct pib_dev *dev, struct pib_qp *qp)
+{
+	if (!dev->thread.congested)
+		return;
+
+	/* 同じパケットで RDMA READ 用の CNP を作成済み */
+	if (dev->thread.ready_to_send)
+		return;
+
+	if (++qp->responder.nr_packets_since_cnp < PIB_CNP_INTERVAL)
+		return;
+
+	qp->responder.nr_packets_since_cnp = 0;
+	qp->responder.nr_cnps++;
+
+	process_cnp_notify_request(dev, qp, PIB_OPCODE_CNP_CONGESTION_NOTIFY, qp->responder.psn, 0);
+}
+
+
+/******************************************************************************/
+/* Congestion Control                                                         */
+/******************************************************************************/
+
+void pib_reset_rc_qp_congestion_control(struct pib_qp *qp)
+{
+	qp->requester.cc.cwnd        = congestion_control ? PIB_CC_INIT_WINDOW : PIB_MAX_CONTIG_REQUESTS;
+	qp->requester.cc.ssthresh    = PIB_CC_INIT_SSTHRESH;
+	qp->requester.cc.cwnd_cnt    = 0;
+	qp->requester.cc.recover_psn = 0;
+	qp->requester.cc.in_recovery = 0;
+	qp->requester.cc.nr_read_packets = 0;
+
+	qp->responder.nr_packets_since_cnp = 0;
+}
+
+
+/*
+ *  送信中の Send WQE の中で最も古い ACK されていない PSN
+ */
+static u32
+get_acked_psn(struct pib_qp *qp)
+{
+	struct pib_send_wqe *send_wqe;
+
+	if (!list_empty(&qp->requester.waiting_swqe_head))
+		send_wqe = list_first_entry(&qp->requester.waiting_swqe_head, struct pib_send_wqe, list);
+	else if (!list_empty(&qp->requester.sending_swqe_head))
+		send_wqe = list_first_entry(&qp->requester.sending_swqe_head, struct pib_send_wqe, list);
+	else
+		return qp->requester.expected_psn;
+
+	return send_wqe->processing.based_psn + send_wqe->processing.ack_packets;
+}
+
+
+/*
+ *  次に送信するパケットの PSN
+ */
+static u32
+get_next_psn(struct pib_qp *qp)
+{
+	struct pib_send_wqe *send_wqe;
+
+	if (list_empty(&qp->requester.sending_swqe_head))
+		return qp->requester.expected_psn;
+
+	send_wqe = list_first_entry(&qp->requester.sending_swqe_head, struct pib_send_wqe, list);
+
+	return send_wqe->processing.based_psn + send_wqe->processing.sent_packets;
+}
+
+
+/*
+ *  ACK されていないパケット数。RDMA READ は応答のパケット数に関わらず
+ *  1 つの要求として数える (応答は responder の READ ウィンドウで抑える)。
+ */
+static u32
+get_inflight_packets(struct pib_qp *qp)
+{
+	s32 psn_diff;
+
+	psn_diff = get_psn_diff(get_next_psn(qp), get_acked_psn(qp));
+
+	if (psn_diff <= 0)
+		return 0;
+
+	if ((u32)psn_diff <= qp->requester.cc.nr_read_packets)
+		return 1;
+
+	return psn_diff - qp->requester.cc.nr_read_packets;
+}
+
+
+bool pib_is_rc_qp_window_full(struct pib_qp *qp)
+{
+	return qp->requester.cc.cwnd <= get_inflight_packets(qp);
+}
+
+
+/*
+ *  psn までの nr_packets 個のパケットが ACK された。
+ *  slow start 中は ACK されたパケット数だけ、congestion avoidance 中は
+ *  cwnd 個の ACK 毎に 1 つウィンドウを広げる。
+ */
+static void
+increase_congestion_window(struct pib_qp *qp, u32 psn, u32 nr_packets)
+{
+	if (!congestion_control)
+		return;
+
+	if (qp->requester.cc.in_recovery) {
+		if (get_psn_diff(psn + 1, qp->requester.cc.recover_psn) < 0)
+			return;
+		qp->requester.cc.in_recovery = 0;
+	}
+
+	if (qp->requester.cc.cwnd < qp->requester.cc.ssthresh) {
+		qp->requester.cc.cwnd += nr_packets;
+	} else {
+		qp->requester.cc.cwnd_cnt += nr_packets;
+		if (qp->requester.cc.cwnd <= qp->requester.cc.cwnd_cnt) {
+			qp->requester.cc.cwnd_cnt -= qp->requester.cc.cwnd;
+			qp->requester.cc.cwnd++;
+		}
+	}
+
+	if (PIB_CC_MAX_WINDOW < qp->requester.cc.cwnd)
+		qp->requester.cc.cwnd = PIB_CC_MAX_WINDOW;
+}
+
+
+/*
+ *  輻輳 (CNP, PSN Sequence Error NAK, Local ACK Timeout) を検出したので
+ *  ウィンドウを縮小する。送信済みのパケットが ACK されるまでは縮小は 1 回
+ *  だけだが、Local ACK Timeout の場合は常に最小ウィンドウからやり直す。
+ */
+static void
+decrease_congestion_window(struct pib_qp *qp, bool timeout)
+{
+	if (!congestion_control)
+		return;
+
+	if (qp->requester.cc.in_recovery && !timeout)
+		return;
+
+	qp->requester.cc.ssthresh    = max_t(u32, qp->requester.cc.cwnd / 2, PIB_CC_MIN_WINDOW);
+	qp->requester.cc.cwnd        = timeout ? PIB_CC_MIN_WINDOW : qp->requester.cc.ssthresh;
+	qp->requester.cc.cwnd_cnt    = 0;
+	qp->requester.cc.recover_psn = get_next_psn(qp);
+	qp->requester.cc.in_recovery = 1;
+	qp->requester.cc.nr_decreases++;
+}
+
+
+/******************************************************************************/
+/* Retransmission Timer                                                       */
+/******************************************************************************/
+
+/*
+ *  RTO の上限。IBA では Local ACK Timeout は ib_qp_attr.timeout から
+ *  求めた時間の 4 倍までは許される。timeout = 0 は無限大を表す。
+ */
+static unsigned long
+get_max_rto(struct pib_qp *qp)
+{
+	if (qp->ib_qp_attr.timeout == 0)
+		return PIB_SCHED_TIMEOUT;
+
+	return min_t(unsigned long, qp->local_ack_timeout * 4, PIB_SCHED_TIMEOUT);
+}
+
+
+void pib_reset_rc_qp_rtt(struct pib_qp *qp)
+{
+	qp->requester.rtt.srtt     = 0;
+	qp->requester.rtt.rttvar   = 0;
+	qp->requester.rtt.rto      = qp->local_ack_timeout;
+	qp->requester.rtt.retry_time = jiffies;
+	qp->requester.rtt.high_psn = qp->requester.expected_psn;
+	qp->requester.rtt.timing   = 0;
+}
+
+
+/*
+ *  まだ一度も送信していないパケットを送る時に、計測中でなければ
+ *  往復時間の計測を始める (Karn のアルゴリズム)。
+ */
+static void
+start_rtt_sample(struct pib_qp *qp, u32 psn, u32 nr_packets)
+{
+	if (get_psn_diff(psn, qp->requester.rtt.high_psn) < 0)
+		return;
+
+	qp->requester.rtt.high_psn = psn + nr_packets;
+
+	if (qp->requester.rtt.timing)
+		return;
+
+	qp->requester.rtt.psn       = psn;
+	qp->requester.rtt.timestamp = ktime_to_ns(ktime_get());
+	qp->requester.rtt.timing    = 1;
+}
+
+
+/*
+ *  計測中の PSN が ACK されたら SRTT と RTTVAR を更新して RTO を求める。
+ *  (RFC 6298 と同じ計算)
+ */
+static void
+update_rtt(struct pib_qp *qp, u32 psn)
+{
+	s64 delta;
+	s32 sample, err;
+	u32 rto;
+
+	if (!qp->requester.rtt.timing)
+		return;
+
+	if (get_psn_diff(psn, qp->requester.rtt.psn) < 0)
+		return;
+
+	qp->requester.rtt.timing = 0;
+
+	delta = ktime_to_ns(ktime_get()) - qp->requester.rtt.timestamp;
+	if (delta < 0)
+		return;
+
+	delta = div_s64(delta, NSEC_PER_USEC);
+	sample = (delta < PIB_RTT_MAX_SAMPLE) ? (s32)delta : PIB_RTT_MAX_SAMPLE;
+
+	qp->requester.rtt.nr_samples++;
+
+	if (qp->requester.rtt.srtt == 0) {
+		qp->requester.rtt.srtt   = max_t(s32, sample, 1) << 3;
+		qp->requester.rtt.rttvar = sample << 1;
+	} else {
+		err = sample - (qp->requester.rtt.srtt >> 3);
+		qp->requester.rtt.srtt += err;
+		if (err < 0)
+			err = -err;
+		err -= (qp->requester.rtt.rttvar >> 2);
+		qp->requester.rtt.rttvar += err;
+	}
+
+	if (!adaptive_rto || (qp->ib_qp_attr.timeout == 0))
+		return;
+
+	/* 相手の responder が ACK を遅延させる時間よりも短くしてはならない */
+	rto = (qp->requester.rtt.srtt >> 3) +
+		max_t(u32, qp->requester.rtt.rttvar, max_t(u32, PIB_MIN_RTO, 2 * ack_delay));
+
+	qp->requester.rtt.rto = clamp_t(unsigned long, usecs_to_jiffies(rto), 1, get_max_rto(qp));
+}
+
+
+static void
+process_acknowledged_packets(struct pib_qp *qp, u32 psn, u32 nr_packets)
+{
+	update_rtt(qp, psn);
+	increase_congestion_window(qp, psn, nr_packets);
+}
+
+
+/*
+ *  Local ACK Timeout で再送する時は RTO を倍にして、輻輳ウィンドウを
+ *  最小にする。retry_cnt を減らすべき時に true を返す。
+ */
+bool pib_notify_rc_qp_local_ack_timeout(struct pib_qp *qp, unsigned long now)
+{
+	bool charge = true;
+
+	qp->requester.rtt.timing = 0;
+
+	/* 呼び出し元で送信済みの RDMA READ を全て送り直す */
+	qp->requester.cc.nr_read_packets = 0;
+
+	if (adaptive_rto && (qp->ib_qp_attr.timeout != 0))
+		qp->requester.rtt.rto = min_t(unsigned long, qp->requester.rtt.rto * 2, get_max_rto(qp));
+
+	decrease_congestion_window(qp, true);
+
+	/*
+	 *  RTO が Local ACK Timeout より短くても、retry_cnt は前回減らしてから
+	 *  Local ACK Timeout が経過した時にだけ減らす。再送の回数ではなく
+	 *  retry_cnt × Local ACK Timeout の間 ACK が無ければエラーにする。
+	 */
+	if (adaptive_rto && (qp->ib_qp_attr.timeout != 0)) {
+		if (time_before(now, qp->requester.rtt.retry_time + qp->local_ack_timeout))
+			charge = false;
+		else
+			qp->requester.rtt.retry_time = now;
+	}
+
+	return charge;
 }
 
 
@@ -2273,33 +2990,50 @@ abort_active_rwqe(struct pib_dev *dev, struct pib_qp *qp)
 }
 
 
+/*
+ *  psn を含む Send WQE を in-flight のリングから探す。
+ *  リングは PSN 順なので、先頭の Send WQE の based_psn からのオフセットで
+ *  二分探索できる。ほとんどの応答は先頭の Send WQE に対するものである。
+ */
 static struct pib_send_wqe *
 match_send_wqe(struct pib_qp *qp, u32 psn, int *first_send_wqe_p, int **nr_swqe_pp)
 {
-	int first_send_wqe = 1;
+	u32 low, high, mask, head, based_psn, offset;
 	struct pib_send_wqe *send_wqe;
 
-	list_for_each_entry(send_wqe, &qp->requester.waiting_swqe_head, list) {
-		if ((get_psn_diff(psn, send_wqe->processing.based_psn)    >= 0) &&
-		    (get_psn_diff(psn, send_wqe->processing.expected_psn) <  0)) {
-			*first_send_wqe_p = first_send_wqe;
-			*nr_swqe_pp       = &qp->requester.nr_waiting_swqe;
-			return send_wqe;
-		}
-		first_send_wqe = 0;
-	}
+	if (qp->requester.nr_inflight_swqe == 0)
+		return NULL;
 
-	list_for_each_entry(send_wqe, &qp->requester.sending_swqe_head, list) {
-		if ((get_psn_diff(psn, send_wqe->processing.based_psn)    >= 0) &&
-		    (get_psn_diff(psn, send_wqe->processing.expected_psn) <  0)) {
-			*first_send_wqe_p = first_send_wqe;
-			*nr_swqe_pp       = &qp->requester.nr_sending_swqe;
-			return send_wqe;
-		}
-		first_send_wqe = 0;
+	mask      = qp->requester.inflight_mask;
+	head      = qp->requester.inflight_head;
+	based_psn = qp->requester.inflight_swqes[head]->processing.based_psn;
+	offset    = (psn - based_psn) & PIB_PSN_MASK;
+
+	/* 最後の Send WQE で based_psn <= psn となるものを探す */
+	low  = 0;
+	high = qp->requester.nr_inflight_swqe - 1;
+
+	while (low < high) {
+		u32 mid = low + (high - low + 1) / 2;
+
+		send_wqe = qp->requester.inflight_swqes[(head + mid) & mask];
+
+		if (((send_wqe->processing.based_psn - based_psn) & PIB_PSN_MASK) <= offset)
+			low  = mid;
+		else
+			high = mid - 1;
 	}
 
-	return NULL;
+	send_wqe = qp->requester.inflight_swqes[(head + low) & mask];
+
+	if (((psn - send_wqe->processing.based_psn) & PIB_PSN_MASK) >= send_wqe->processing.all_packets)
+		return NULL;
+
+	*first_send_wqe_p = (low == 0);
+	*nr_swqe_pp       = (send_wqe->processing.list_type == PIB_SWQE_WAITING) ?
+		&qp->requester.nr_waiting_swqe : &qp->requester.nr_sending_swqe;
+
+	return send_wqe;
 }
 
 
@@ -2316,19 +3050,24 @@ issue_comm_est(struct pib_qp *qp)
 
 
 /**
- *  受信が成功した場合には waiting list に入っている SWQE の local ack timeout
- *  を延期する
+ *  受信が成功した場合には QP の local ack timeout を延期して、
+ *  in-flight の先頭の SWQE の retry_cnt を元に戻す。
+ *
+ *  retry_cnt を減らすのは先頭の SWQE だけであり、後続の SWQE は
+ *  先頭の SWQE が完了した ACK の受信時に戻されるので、全体を走査しなくてよい。
  */
 static void
 postpone_local_ack_timeout(struct pib_qp *qp)
 {
-	unsigned long local_ack_timeout;
 	struct pib_send_wqe *send_wqe;
 
-	local_ack_timeout = jiffies + qp->local_ack_timeout;
+	if (qp->requester.nr_inflight_swqe == 0)
+		return;
 
-	list_for_each_entry(send_wqe, &qp->requester.waiting_swqe_head, list) {
-		send_wqe->processing.retry_cnt = qp->ib_qp_attr.retry_cnt;
-		send_wqe->processing.local_ack_time = local_ack_timeout;
-	}
+	send_wqe = qp->requester.inflight_swqes[qp->requester.inflight_head];
+
+	send_wqe->processing.retry_cnt = qp->ib_qp_attr.retry_cnt;
+
+	qp->requester.local_ack_time  = jiffies + qp->requester.rtt.rto;
+	qp->requester.rtt.retry_time  = jiffies;
 }
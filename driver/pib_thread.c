@@ -19,6 +19,7 @@
 #include <linux/if_vlan.h>
 #include <linux/random.h>
 #include <linux/kthread.h>
+#include <linux/rcupdate.h>
 #include <net/sock.h> /* for struct sock */
 #include <rdma/ib_user_verbs.h>
 #include <rdma/ib_pack.h>
@@ -34,15 +35,21 @@ static void kthread_routine_iteration(struct pib_dev *dev);
 static int create_socket(struct pib_dev *dev, u8 port_num);
 static void release_socket(struct pib_dev *dev, u8 port_num);
 static void process_on_qp_scheduler(struct pib_dev *dev);
+static int process_on_qp_scheduler_once(struct pib_dev *dev, struct pib_qp *qp, unsigned long now);
+static int push_burst_packet(struct pib_dev *dev);
+static void process_burst_sendmsg(struct pib_dev *dev);
 static int process_new_send_wr(struct pib_qp *qp);
 static int process_send_wr(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
 static int receive_packet(struct pib_dev *dev, u8 port_num);
 static void process_incoming_message(struct pib_dev *dev, u8 port_num, void *buffer, int packet_size);
 static void process_incoming_message_per_qp(struct pib_dev *dev, u8 port_num, u16 dlid, u32 dest_qp_num, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size);
+static bool check_incoming_pkey(struct pib_port *port, struct pib_qp *qp, u32 dest_qp_num, struct pib_packet_bth *bth);
+static void dispatch_incoming_message(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size);
 static void connect_pibnetd(struct pib_dev *dev, u8 port_num);
 static void disconnect_pibnetd(struct pib_dev *dev, u8 port_num);
 static void send_raw_packet_to_pibnetd(struct pib_dev *dev, u8 port_num, bool disconnect);
 static void process_raw_packet(struct pib_dev *dev, u8 port_num, struct pib_packet_lrh *lrh, void *buffer, int size);
+static void update_netd_lid_table(struct pib_dev *dev, void *buffer, int size);
 static void process_on_wq_scheduler(struct pib_dev *dev);
 static void process_sendmsg(struct pib_dev *dev);
 static struct sockaddr *get_sockaddr_from_dlid(struct pib_dev *dev, u8 port_num, u32 src_qp_num, u16 dlid);
@@ -67,6 +74,14 @@ static int pib_nice = PIB_DEFAULT_NICE;
 module_param_named(nice, pib_nice, int, 0644);
 MODULE_PARM_DESC(nice, "kthread priority (from -19 to 20)");
 
+static unsigned int sched_burst = PIB_SCHED_BURST;
+module_param_named(sched_burst, sched_burst, uint, 0644);
+MODULE_PARM_DESC(sched_burst, "Max packets that a QP sends per scheduling (from 1 to 16)");
+
+static unsigned int sched_quantum = PIB_SCHED_QUANTUM;
+module_param_named(sched_quantum, sched_quantum, uint, 0644);
+MODULE_PARM_DESC(sched_quantum, "Bytes that a QP sends per scheduling");
+
 
 int pib_create_kthread(struct pib_dev *dev)
 {
@@ -79,12 +94,15 @@ int pib_create_kthread(struct pib_dev *dev)
 	dev->thread.timer.function = timer_timeout_callback;
 	dev->thread.timer.data     = (unsigned long)dev;
 
-	dev->thread.send_buffer	   = vmalloc(PIB_PACKET_BUFFER);
-	if (!dev->thread.send_buffer) {
+	dev->thread.burst_buffer   = vmalloc(PIB_PACKET_BUFFER * PIB_SCHED_BURST);
+	if (!dev->thread.burst_buffer) {
 		ret = -ENOMEM;
 		goto err_send_vmalloc;
 	}
 
+	dev->thread.send_buffer	     = dev->thread.burst_buffer;
+	dev->thread.nr_burst_packets = 0;
+
 	dev->thread.recv_buffer	   = vmalloc(PIB_PACKET_BUFFER);
 	if (!dev->thread.recv_buffer) {
 		ret = -ENOMEM;
@@ -119,8 +137,9 @@ err_sock:
 
 err_recv_vmalloc:
 
-	vfree(dev->thread.send_buffer);
-	dev->thread.send_buffer = NULL;
+	vfree(dev->thread.burst_buffer);
+	dev->thread.burst_buffer = NULL;
+	dev->thread.send_buffer  = NULL;
 
 err_send_vmalloc:
 
@@ -150,8 +169,9 @@ void pib_release_kthread(struct pib_dev *dev)
 	vfree(dev->thread.recv_buffer);
 	dev->thread.recv_buffer = NULL;
 
-	vfree(dev->thread.send_buffer);
-	dev->thread.send_buffer = NULL;
+	vfree(dev->thread.burst_buffer);
+	dev->thread.burst_buffer = NULL;
+	dev->thread.send_buffer  = NULL;
 }
 
 
@@ -348,11 +368,10 @@ static void kthread_routine_iteration(struct pib_dev *dev)
 
 static void process_on_qp_scheduler(struct pib_dev *dev)
 {
-	int ret;
+	int nr_packets, bytes;
 	unsigned long now;
 	unsigned long flags;
 	struct pib_qp *qp;
-	struct pib_send_wqe *send_wqe, *next_send_wqe;
 
 restart:
 	now = jiffies;
@@ -369,18 +388,82 @@ restart:
 	pib_spin_lock(&qp->lock);
 	spin_unlock(&dev->lock);
 
+	/*
+	 *  QP のロックを取ったまま sched_burst 個か sched_quantum バイトまで
+	 *  パケットを組み立て、スケジューラの操作と sendmsg をまとめて行う。
+	 */
+	nr_packets = 0;
+	bytes      = 0;
+
+	while (process_on_qp_scheduler_once(dev, qp, now)) {
+		if (dev->thread.ready_to_send)
+			bytes += push_burst_packet(dev);
+
+		if ((clamp_t(unsigned int, sched_burst, 1, PIB_SCHED_BURST) <= ++nr_packets) ||
+		    (sched_quantum <= bytes))
+			break;
+
+		/* 受信などの優先度の高い処理が待っていれば中断する */
+		if (dev->thread.flags & ((1U << PIB_THREAD_QP_SCHEDULE) - 1))
+			break;
+	}
+
+	if (dev->thread.ready_to_send)
+		push_burst_packet(dev);
+
+	pib_util_reschedule_qp(qp); /* 必要の応じてスケジューラから抜くために呼び出す */
+
+	pib_spin_unlock_irqrestore(&qp->lock, flags);
+
+	process_burst_sendmsg(dev);
+
+	if (dev->thread.flags & ((1U << PIB_THREAD_QP_SCHEDULE) - 1))
+		return;
+
+	spin_lock_irqsave(&dev->qp_sched.lock, flags);
+	if (time_after(dev->qp_sched.wakeup_time, jiffies)) {
+		spin_unlock_irqrestore(&dev->qp_sched.lock, flags);
+		return;
+	}
+	spin_unlock_irqrestore(&dev->qp_sched.lock, flags);
+
+	cond_resched();
+
+	goto restart;
+}
+
+
+/*
+ *  QP のパケットを 1 つ処理する。続けて同じ QP を処理できる場合は 1 を返す。
+ */
+static int process_on_qp_scheduler_once(struct pib_dev *dev, struct pib_qp *qp, unsigned long now)
+{
+	int ret;
+	struct pib_send_wqe *send_wqe, *next_send_wqe;
+
 	/* Responder: generating acknowledge packets */
 	if (qp->qp_type == IB_QPT_RC)
 		if (pib_generate_rc_qp_acknowledge(dev, qp) == 1)
-			goto done;
+			return 1;
 
 	/* Requester: generating request packets */
 	if ((qp->state != IB_QPS_RTS) && (qp->state != IB_QPS_SQD))
-		goto done;
+		return 0;
 
 	/* Waiting list の先頭の Send WQE があれば取り出す */
-	if (list_empty(&qp->requester.waiting_swqe_head))
-		goto first_sending_wsqe;
+	if (list_empty(&qp->requester.waiting_swqe_head)) {
+		/*
+		 *  RC で輻輳ウィンドウが閉じていれば、送信途中の Send WQE も
+		 *  Local ACK Timeout の対象にする。
+		 */
+		if ((qp->qp_type != IB_QPT_RC) ||
+		    list_empty(&qp->requester.sending_swqe_head) ||
+		    !pib_is_rc_qp_window_full(qp))
+			goto first_sending_wsqe;
+
+		send_wqe = list_first_entry(&qp->requester.sending_swqe_head, struct pib_send_wqe, list);
+		goto check_local_ack_timeout;
+	}
 
 	send_wqe = list_first_entry(&qp->requester.waiting_swqe_head, struct pib_send_wqe, list);
 
@@ -397,6 +480,8 @@ restart:
 		if (!pib_get_behavior(PIB_BEHAVIOR_RELAXED_INVALIDATION_ORDERING))
 			ret = pib_process_local_only_request(dev, qp, send_wqe);
 
+		pib_util_pop_inflight_swqe(qp, send_wqe);
+
 		if (ret != 0) {
 			pib_util_insert_wc_error(qp->send_cq, qp, send_wqe->wr_id,
 						 send_wqe->processing.status, send_wqe->opcode);
@@ -420,23 +505,26 @@ restart:
 		send_wqe->processing.list_type = PIB_SWQE_FREE;
 
 		pib_util_free_send_wqe(qp, send_wqe);
-		goto done;
+		return 1;
 	}
 
+check_local_ack_timeout:
 	/*
-	 *  Waiting list の先頭の Send WQE が再送時刻に達していれば
+	 *  QP の Local ACK Timeout の時刻に達していれば
 	 *  waiting list から sending list へ戻して再送信を促す。
 	 */
-	if (time_after(send_wqe->processing.local_ack_time, now))
+	if (time_after(qp->requester.local_ack_time, now))
 		goto first_sending_wsqe;
 
 	pib_trace_retry(dev, qp->ib_qp_attr.port_num, send_wqe);
 
-	send_wqe->processing.retry_cnt--;
-	send_wqe->processing.local_ack_time = now + PIB_SCHED_TIMEOUT;
+	qp->requester.local_ack_time = now + PIB_SCHED_TIMEOUT;
 
 	dev->perf.local_ack_timeout++;
 
+	if ((qp->qp_type != IB_QPT_RC) || pib_notify_rc_qp_local_ack_timeout(qp, now))
+		send_wqe->processing.retry_cnt--;
+
 	/* waiting list から sending list へ戻す */
 	list_for_each_entry_safe_reverse(send_wqe, next_send_wqe, &qp->requester.waiting_swqe_head, list) {
 		send_wqe->processing.list_type = PIB_SWQE_SENDING;
@@ -457,7 +545,7 @@ first_sending_wsqe:
 		if (process_new_send_wr(qp))
 			goto first_sending_wsqe;
 		else
-			goto done;
+			return 0;
 	}
 
 	send_wqe = list_first_entry(&qp->requester.sending_swqe_head, struct pib_send_wqe, list);
@@ -468,19 +556,19 @@ first_sending_wsqe:
 	 */
 	if (send_wqe->processing.status != IB_WC_SUCCESS)
 		if (!list_empty(&qp->requester.waiting_swqe_head))
-			goto done;
+			return 0;
 
 	/*
-	 *  SEND & RDMA WRITE が連続送信の制限に引掛る場合は、一時停止
+	 *  ACK されていないパケットが輻輳ウィンドウに達した場合は、一時停止
 	 */
-	if (PIB_MAX_CONTIG_REQUESTS < qp->requester.nr_contig_requests)
-		goto done;
+	if ((qp->qp_type == IB_QPT_RC) && pib_is_rc_qp_window_full(qp))
+		return 0;
 
 	/*
 	 *  RNR NAK タイムアウト時刻の判定
 	 */
 	if (time_after(send_wqe->processing.schedule_time, now))
-		goto done;
+		return 0;
 
 	send_wqe->processing.schedule_time = now;
 
@@ -510,27 +598,56 @@ first_sending_wsqe:
 		BUG();
 	}
 
-done:
-	pib_util_reschedule_qp(qp); /* 必要の応じてスケジューラから抜くために呼び出す */
+	return 1;
+}
 
-	pib_spin_unlock_irqrestore(&qp->lock, flags);
 
-	if (dev->thread.ready_to_send)
-		process_sendmsg(dev);
+/*
+ *  send_buffer に組み立てたパケットを burst に積み、次のパケットは
+ *  burst_buffer の次の領域に組み立てる。積んだパケットのバイト数を返す。
+ */
+static int push_burst_packet(struct pib_dev *dev)
+{
+	int index = dev->thread.nr_burst_packets;
 
-	if (dev->thread.flags & ((1U << PIB_THREAD_QP_SCHEDULE) - 1))
-		return;
+	BUG_ON(PIB_SCHED_BURST <= index);
 
-	spin_lock_irqsave(&dev->qp_sched.lock, flags);
-	if (time_after(dev->qp_sched.wakeup_time, jiffies)) {
-		spin_unlock_irqrestore(&dev->qp_sched.lock, flags);
-		return;
-	}
-	spin_unlock_irqrestore(&dev->qp_sched.lock, flags);
+	dev->thread.burst_packets[index].port_num   = dev->thread.port_num;
+	dev->thread.burst_packets[index].slid       = dev->thread.slid;
+	dev->thread.burst_packets[index].dlid       = dev->thread.dlid;
+	dev->thread.burst_packets[index].src_qp_num = dev->thread.src_qp_num;
+	dev->thread.burst_packets[index].trace_id   = dev->thread.trace_id;
 
-	cond_resched();
+	dev->thread.nr_burst_packets++;
 
-	goto restart;
+	dev->thread.send_buffer   = dev->thread.burst_buffer +
+		PIB_PACKET_BUFFER * dev->thread.nr_burst_packets;
+	dev->thread.trace_id      = 0;
+	dev->thread.ready_to_send = 0;
+
+	return pib_packet_lrh_get_pktlen(dev->thread.burst_buffer + PIB_PACKET_BUFFER * index) * 4;
+}
+
+
+static void process_burst_sendmsg(struct pib_dev *dev)
+{
+	int i;
+
+	for (i=0 ; i < dev->thread.nr_burst_packets ; i++) {
+		dev->thread.send_buffer   = dev->thread.burst_buffer + PIB_PACKET_BUFFER * i;
+		dev->thread.port_num      = dev->thread.burst_packets[i].port_num;
+		dev->thread.slid          = dev->thread.burst_packets[i].slid;
+		dev->thread.dlid          = dev->thread.burst_packets[i].dlid;
+		dev->thread.src_qp_num    = dev->thread.burst_packets[i].src_qp_num;
+		dev->thread.trace_id      = dev->thread.burst_packets[i].trace_id;
+		dev->thread.ready_to_send = 1;
+
+		process_sendmsg(dev);
+	}
+
+	dev->thread.send_buffer      = dev->thread.burst_buffer;
+	dev->thread.nr_burst_packets = 0;
+	dev->thread.ready_to_send    = 0;
 }
 
 
@@ -595,8 +712,10 @@ static int process_new_send_wr(struct pib_qp *qp)
 
 	qp->requester.expected_psn        += num_packets;
 
+	if (qp->qp_type == IB_QPT_RC)
+		pib_util_push_inflight_swqe(qp, send_wqe);
+
 	send_wqe->processing.schedule_time = now;
-	send_wqe->processing.local_ack_time = now + PIB_SCHED_TIMEOUT;
 
 	send_wqe->processing.retry_cnt     = qp->ib_qp_attr.retry_cnt;
 	send_wqe->processing.rnr_retry     = qp->ib_qp_attr.rnr_retry;
@@ -627,6 +746,7 @@ static int process_send_wr(struct pib_dev *dev, struct pib_qp *qp, struct pib_se
 	switch (qp->qp_type) {
 
 	case IB_QPT_RC:
+	case IB_QPT_UC:
 		return pib_process_rc_qp_request(dev, qp, send_wqe);
 
 	case IB_QPT_UD:
@@ -650,6 +770,7 @@ completion_error:
 
 	switch (qp->qp_type) {
 	case IB_QPT_RC:
+	case IB_QPT_UC:
 		qp->state = IB_QPS_ERR;
 		pib_util_flush_qp(qp, 0);
 		break;
@@ -681,6 +802,9 @@ static int receive_packet(struct pib_dev *dev, u8 port_num)
 	iov.iov_base = dev->thread.recv_buffer;
 	iov.iov_len  = PIB_PACKET_BUFFER;
 
+	msghdr.msg_name    = &dev->thread.recv_sockaddr;
+	msghdr.msg_namelen = sizeof(dev->thread.recv_sockaddr);
+
 	port = &dev->ports[port_num - 1];
 
 	ret = kernel_recvmsg(port->socket, &msghdr,
@@ -694,6 +818,10 @@ static int receive_packet(struct pib_dev *dev, u8 port_num)
 		return -EAGAIN;
 
 	dev->thread.recv_size = ret;
+
+	/* 受信ソケットに未処理のデータが溜まっていれば輻輳とみなす */
+	dev->thread.congested =
+		(sk_rmem_alloc_get(port->socket->sk) > (port->socket->sk->sk_rcvbuf >> 2));
 	
 	return ret;
 }
@@ -723,6 +851,8 @@ static void process_incoming_message(struct pib_dev *dev, u8 port_num, void *buf
 	port->perf.rcv_packets++;
 	port->perf.rcv_data += packet_size;
 
+	pib_capture(dev, port_num, PIB_CAPTURE_INBOUND, buffer, size);
+
 	header_size = pib_parse_packet_header(buffer, size, &lrh, &grh, &bth);
 	if (header_size < 0) {
 		pib_debug("pib: wrong drop packet(size=%u)\n", size);
@@ -778,12 +908,11 @@ static void process_incoming_message(struct pib_dev *dev, u8 port_num, void *buf
 						lrh, grh, bth, buffer, size);
 	} else {
 		/* Multicast */
-		int i, max;
+		int i;
 		struct pib_packet_deth *deth;
 		u16 port_lid, slid;
 		u32 src_qp_num;
-		struct pib_mcast_link *mcast_link;
-		u32 qp_nums[PIB_MCAST_QP_ATTACH];
+		struct pib_mcast_group *group;
 		unsigned long flags;
 
 		if ((bth->OpCode != IB_OPCODE_UD_SEND_ONLY) && 
@@ -795,37 +924,45 @@ static void process_incoming_message(struct pib_dev *dev, u8 port_num, void *buf
 		if (size < sizeof(struct pib_packet_deth))
 			goto silently_drop;
 
+		/* マルチキャストパケットは GRH の MGID でグループを特定する */
+		if (!grh) {
+			pib_debug("pib: drop packet: multicast packet without GRH\n");
+			goto silently_drop;
+		}
+
 		deth = (struct pib_packet_deth*)buffer;
 
 		src_qp_num = be32_to_cpu(deth->srcQP) & PIB_QPN_MASK;
 
-		spin_lock_irqsave(&dev->lock, flags);
-		i=0;
-		list_for_each_entry(mcast_link, &dev->mcast_table[dlid - PIB_MCAST_LID_BASE], lid_list) {
-			qp_nums[i] = mcast_link->qp_num;
-			i++;
-		}
-		spin_unlock_irqrestore(&dev->lock, flags);
-
-		max = i;
-
 		port_lid = port->ib_port_attr.lid;
 		slid     = be16_to_cpu(lrh->slid);
 
 		/* 
 		 * マルチキャストパケットを届ける QP は複数かもしれない。
 		 * ただし送信した QP 自身は受け取らない。
+		 *
+		 * グループの QP は RCU で保護されているので dev->lock を取らずに
+		 * 直接配る。QP の破棄は pib_detach_all_mcast で読み手を待つ。
 		 */
-		for (i=0 ; i<max ; i++) {
-			if ((port_lid == slid) && (src_qp_num == qp_nums[i]))
+		rcu_read_lock();
+		group = pib_find_mcast_group(dev, &grh->dgid, dlid);
+		for (i=0 ; group && (i < group->nr_qps) ; i++) {
+			struct pib_qp *qp = group->qps[i];
+
+			if ((port_lid == slid) && (src_qp_num == qp->ib_qp.qp_num))
 				continue;
 
-			pib_debug("pib: MC packet qp_num=0x%06x\n", qp_nums[i]);
-			process_incoming_message_per_qp(dev, port_num, dlid, qp_nums[i],
-							lrh, grh, bth, buffer, size);
+			pib_debug("pib: MC packet qp_num=0x%06x\n", qp->ib_qp.qp_num);
 
-			cond_resched();
+			pib_spin_lock_irqsave(&qp->lock, flags);
+			if (check_incoming_pkey(port, qp, qp->ib_qp.qp_num, bth))
+				dispatch_incoming_message(dev, port_num, qp, lrh, grh, bth, buffer, size);
+			pib_spin_unlock_irqrestore(&qp->lock, flags);
 		}
+		rcu_read_unlock();
+
+		if (dev->thread.ready_to_send)
+			process_sendmsg(dev);
 	}
 
 silently_drop:
@@ -947,10 +1084,34 @@ static void process_incoming_message_per_qp(struct pib_dev *dev, u8 port_num, u1
 		goto silently_drop;
 	}
 
-	/* Check P_Key */ 
+	if (!check_incoming_pkey(port, qp, dest_qp_num, bth)) {
+		spin_unlock_irqrestore(&dev->lock, flags);
+		goto silently_drop;
+	}
+
+	/* @notice ロックの入れ子関係を一部崩している */
+	pib_spin_lock(&qp->lock);
+	spin_unlock(&dev->lock);
+
+	dispatch_incoming_message(dev, port_num, qp, lrh, grh, bth, buffer, size);
+
+	pib_spin_unlock_irqrestore(&qp->lock, flags);
+
+	if (dev->thread.ready_to_send)
+		process_sendmsg(dev);
+
+silently_drop:
+
+	return;
+}
+
+
+static bool check_incoming_pkey(struct pib_port *port, struct pib_qp *qp, u32 dest_qp_num, struct pib_packet_bth *bth)
+{
 	if (dest_qp_num == PIB_QP0) {
 		/* C9-41: In the destination QP is QP0, the P_Key shall not
 		   be checkd. */
+		return true;
 	} else if (dest_qp_num == PIB_QP1) {
 		/* C9-42: In the destination QP is QP1, the P_Key shall be
 		   compared to the set of P_Keys associated with the port. */
@@ -958,30 +1119,36 @@ static void process_incoming_message_per_qp(struct pib_dev *dev, u8 port_num, u1
 		for (i=0 ; i<PIB_PKEY_TABLE_LEN ; i++) {
 			__be16 pkey = port->pkey_table[i];
 			if (pkey == bth->pkey)
-				goto pass_pkey_checking;
+				return true;
 		}
-		port->ib_port_attr.bad_pkey_cntr++;
-		goto silently_drop;
 	} else {
 		/* C9-43: */
 		__be16 pkey = port->pkey_table[qp->ib_qp_attr.pkey_index];
-		if (pkey != bth->pkey) {
-			port->ib_port_attr.bad_pkey_cntr++;
-			goto silently_drop;			
-		}
+		if (pkey == bth->pkey)
+			return true;
 	}
-pass_pkey_checking:
 
-	/* @notice ロックの入れ子関係を一部崩している */
-	pib_spin_lock(&qp->lock);
-	spin_unlock(&dev->lock);
+	port->ib_port_attr.bad_pkey_cntr++;
+
+	return false;
+}
 
+
+/*
+ *  Lock: qp
+ */
+static void dispatch_incoming_message(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size)
+{
 	switch (qp->qp_type) {
 
 	case IB_QPT_RC:
 		pib_receive_rc_qp_incoming_message(dev, port_num, qp, lrh, grh, bth, buffer, size);
 		break;
 
+	case IB_QPT_UC:
+		pib_receive_uc_qp_incoming_message(dev, port_num, qp, lrh, grh, bth, buffer, size);
+		break;
+
 	case IB_QPT_UD:
 	case IB_QPT_GSI:
 	case IB_QPT_SMI:
@@ -995,15 +1162,6 @@ pass_pkey_checking:
 	}
 
 	pib_util_reschedule_qp(qp);	
-
-	pib_spin_unlock_irqrestore(&qp->lock, flags);
-
-	if (dev->thread.ready_to_send)
-		process_sendmsg(dev);
-
-silently_drop:
-
-	return;
 }
 
 
@@ -1076,28 +1234,99 @@ static void process_raw_packet(struct pib_dev *dev, u8 port_num, struct pib_pack
 
 	port = &dev->ports[port_num-1];
 
-	if (size == sizeof(*link)) {
-		link = buffer;
-		switch (be32_to_cpu(link->cmd)) {
-		case PIB_LINK_CMD_CONNECT_ACK:
-			/* @tod lock */
-			port->is_connected = true;
-			port->ib_port_attr.phys_state = PIB_PHYS_PORT_LINK_UP;
-			port->ib_port_attr.state      = IB_PORT_INIT;
-			break;
-		case PIB_LINK_CMD_DISCONNECT_ACK:
-		case PIB_LINK_SHUTDOWN:
-			port->is_connected = false;
-			port->ib_port_attr.phys_state = PIB_PHYS_PORT_POLLING;
-			port->ib_port_attr.state      = IB_PORT_DOWN;
-			break;
-		default:
-			break;
-		}
+	if (size < sizeof(*link))
+		return;
+
+	link = buffer;
+	switch (be32_to_cpu(link->cmd)) {
+	case PIB_LINK_CMD_CONNECT_ACK:
+		/* @tod lock */
+		port->is_connected = true;
+		port->ib_port_attr.phys_state = PIB_PHYS_PORT_LINK_UP;
+		port->ib_port_attr.state      = IB_PORT_INIT;
+		break;
+	case PIB_LINK_CMD_DISCONNECT_ACK:
+	case PIB_LINK_SHUTDOWN:
+		port->is_connected = false;
+		port->ib_port_attr.phys_state = PIB_PHYS_PORT_POLLING;
+		port->ib_port_attr.state      = IB_PORT_DOWN;
+		break;
+	case PIB_LINK_CMD_LID_MAP:
+		update_netd_lid_table(dev, buffer + sizeof(*link), size - sizeof(*link));
+		break;
+	default:
+		break;
 	}
 }
 
 
+/*
+ *  pibnetd から届いた LID とホストのアドレスの対応を pib_netd_lid_table に
+ *  写す。first_lid から last_lid の範囲で載っていない LID は忘れる。
+ *  直接届くパケットと同じソケットで受けるので、pibnetd 以外から来たものは捨てる。
+ */
+static void update_netd_lid_table(struct pib_dev *dev, void *buffer, int size)
+{
+	int i, nr_entries;
+	u16 lid, first_lid, last_lid;
+	unsigned long flags;
+	struct sockaddr_in *src, *netd;
+	struct pib_packet_lid_map *lid_map;
+	struct pib_packet_lid_map_entry *entries;
+
+	if (!pib_netd_lid_table)
+		return;
+
+	src  = (struct sockaddr_in *)&dev->thread.recv_sockaddr;
+	netd = (struct sockaddr_in *)pib_netd_sockaddr;
+
+	if ((src->sin_family != AF_INET) ||
+	    (src->sin_addr.s_addr != netd->sin_addr.s_addr) ||
+	    (src->sin_port != netd->sin_port)) {
+		pib_debug("pib: drop LID map not from pibnetd\n");
+		return;
+	}
+
+	if (size < sizeof(*lid_map))
+		return;
+
+	lid_map    = buffer;
+	first_lid  = be16_to_cpu(lid_map->first_lid);
+	last_lid   = be16_to_cpu(lid_map->last_lid);
+	nr_entries = be16_to_cpu(lid_map->nr_entries);
+
+	if ((first_lid == 0) || (last_lid < first_lid) || (PIB_MCAST_LID_BASE <= last_lid))
+		return;
+
+	if (size < sizeof(*lid_map) + nr_entries * sizeof(*entries))
+		return;
+
+	entries = buffer + sizeof(*lid_map);
+
+	spin_lock_irqsave(&pib_netd_lid_lock, flags);
+
+	for (lid = first_lid ; lid <= last_lid ; lid++)
+		pib_netd_lid_table[lid].sin_family = AF_UNSPEC;
+
+	for (i = 0 ; i < nr_entries ; i++) {
+		struct sockaddr_in *sockaddr;
+
+		lid = be16_to_cpu(entries[i].lid);
+
+		if ((lid < first_lid) || (last_lid < lid))
+			continue;
+
+		sockaddr = &pib_netd_lid_table[lid];
+
+		sockaddr->sin_family      = AF_INET;
+		sockaddr->sin_port        = entries[i].udp_port;
+		sockaddr->sin_addr.s_addr = entries[i].ipv4_addr;
+	}
+
+	spin_unlock_irqrestore(&pib_netd_lid_lock, flags);
+}
+
+
 void pib_netd_comm_handler(struct pib_work_struct *work)
 {
 	struct pib_dev *dev = work->dev;
@@ -1146,19 +1375,23 @@ void pib_util_reschedule_qp(struct pib_qp *qp)
 
 	if ((qp->qp_type == IB_QPT_RC) && pib_is_recv_ok(qp->state))
 		if (!list_empty(&qp->responder.ack_head) &&
-		    (qp->responder.nr_contig_read_acks < PIB_MAX_CONTIG_READ_ACKS)) {
-			schedule_time = now;
-			goto skip;
+		    !pib_is_rc_qp_read_window_full(qp)) {
+			if (qp->responder.nr_delayed_acks == 0) {
+				schedule_time = now;
+				goto skip;
+			}
+
+			/* Delayed ACK */
+			if (time_before(qp->responder.delayed_ack_time, schedule_time))
+				schedule_time = qp->responder.delayed_ack_time;
 		}
 
 	if ((qp->state != IB_QPS_RTS) && (qp->state != IB_QPS_SQD))
-		return;
+		goto skip;
 
 	if (!list_empty(&qp->requester.waiting_swqe_head)) {
-		send_wqe = list_first_entry(&qp->requester.waiting_swqe_head, struct pib_send_wqe, list);
-
-		if (time_before(send_wqe->processing.local_ack_time, schedule_time))
-			schedule_time = send_wqe->processing.local_ack_time;
+		if (time_before(qp->requester.local_ack_time, schedule_time))
+			schedule_time = qp->requester.local_ack_time;
 	}
 
 	if (!list_empty(&qp->requester.sending_swqe_head)) {
@@ -1168,8 +1401,13 @@ void pib_util_reschedule_qp(struct pib_qp *qp)
 			if (!list_empty(&qp->requester.waiting_swqe_head))
 				goto skip;
 
-		if (PIB_MAX_CONTIG_REQUESTS < qp->requester.nr_contig_requests)
+		/* 輻輳ウィンドウが閉じていれば ACK か Local ACK Timeout を待つ */
+		if ((qp->qp_type == IB_QPT_RC) && pib_is_rc_qp_window_full(qp)) {
+			if (list_empty(&qp->requester.waiting_swqe_head) &&
+			    time_before(qp->requester.local_ack_time, schedule_time))
+				schedule_time = qp->requester.local_ack_time;
 			goto skip;
+		}
 
 		if (time_before(send_wqe->processing.schedule_time, schedule_time))
 			schedule_time = send_wqe->processing.schedule_time;
@@ -1393,6 +1631,8 @@ static void process_sendmsg(struct pib_dev *dev)
 		return;
 	}
 
+	pib_capture(dev, port_num, PIB_CAPTURE_OUTBOUND, dev->thread.send_buffer, msg_size);
+
 	/* フッターとして VCRC が入る領域に Port GUID を入れる */
 	footer = dev->thread.send_buffer + msg_size;
 	footer->pib.port_guid = port->gid[0].global.interface_id;
@@ -1454,8 +1694,24 @@ get_sockaddr_from_dlid(struct pib_dev *dev, u8 port_num, u32 src_qp_num, u16 dli
 	unsigned long flags;
 	struct sockaddr *sockaddr = NULL;
 
-	if (pib_multi_host_mode)
-		return pib_netd_sockaddr;
+	if (pib_multi_host_mode) {
+		/*
+		 * pibnetd から宛先を教わっている LID へのデータパケットは
+		 * ホスト間で直接送る。MAD とマルチキャストは pibnetd を経由する。
+		 */
+		if (pib_netd_lid_table &&
+		    (src_qp_num != PIB_QP0) && (src_qp_num != PIB_QP1) && (src_qp_num != PIB_LINK_QP) &&
+		    (0 < dlid) && (dlid < PIB_MCAST_LID_BASE)) {
+			spin_lock_irqsave(&pib_netd_lid_lock, flags);
+			if (pib_netd_lid_table[dlid].sin_family == AF_INET) {
+				dev->thread.direct_sockaddr = pib_netd_lid_table[dlid];
+				sockaddr = (struct sockaddr *)&dev->thread.direct_sockaddr;
+			}
+			spin_unlock_irqrestore(&pib_netd_lid_lock, flags);
+		}
+
+		return sockaddr ? sockaddr : pib_netd_sockaddr;
+	}
 
 	if (src_qp_num != PIB_QP0) {
 		if (dlid == 0)
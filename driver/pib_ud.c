@@ -47,11 +47,9 @@ int pib_process_ud_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 	struct ib_grh         *grh;
 	struct pib_packet_bth *bth;
 	struct pib_packet_deth *deth;
-	u8 lnh;
 	enum ib_wr_opcode opcode;
 	enum ib_wc_status status = IB_WC_SUCCESS;
 	int with_imm;
-	unsigned long flags;
 	u32 packet_length, fix_packet_length;
 
 	opcode = send_wqe->opcode;
@@ -102,41 +100,25 @@ int pib_process_ud_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 			goto completion_error;
 		}
 
-	slid = dev->ports[port_num - 1].ib_port_attr.lid;
-	dlid = ah->ib_ah_attr.dlid;
-
 	push_wc  = (qp->ib_qp_init_attr.sq_sig_type == IB_SIGNAL_ALL_WR)
 		|| (send_wqe->send_flags & IB_SEND_SIGNALED);
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	buffer = dev->thread.send_buffer;
+	/* AH 作成時の雛形はポートの LID や P_Key table が変わっていれば作り直す */
+	if (unlikely(!pib_packet_template_is_valid(dev, &ah->template, port_num)))
+		pib_init_packet_template(dev, &ah->template, port_num, &ah->ib_ah_attr);
 
-	memset(buffer, 0, sizeof(*lrh) + sizeof(*grh) + sizeof(*bth) + sizeof(*deth));
+	slid = ah->template.slid;
+	dlid = ah->template.dlid;
 
 	/* write IB Packet Header (LRH, GRH, BTH, DETH) */
-	lrh = (struct pib_packet_lrh*)buffer; 
-	buffer += sizeof(*lrh);
-	if (ah->ib_ah_attr.ah_flags & IB_AH_GRH) {
-		grh = (struct ib_grh*)buffer;
-		pib_fill_grh(dev, port_num, grh, &ah->ib_ah_attr.grh);
-		buffer += sizeof(*grh);
-		lnh = 0x3;
-	} else {
-		grh = NULL;
-		lnh = 0x2;
-	}
-	bth = (struct pib_packet_bth*)buffer;
-	buffer += sizeof(*bth);
+	buffer = pib_copy_packet_template(&ah->template, dev->thread.send_buffer, &lrh, &grh, &bth);
 	deth = (struct pib_packet_deth*)buffer;
 	buffer += sizeof(*deth);
 
 	bth->OpCode = with_imm ? IB_OPCODE_UD_SEND_ONLY_WITH_IMMEDIATE : IB_OPCODE_UD_SEND_ONLY;
 
-	lrh->sl_rsv_lnh = (ah->ib_ah_attr.sl << 4) | lnh; /* Transport: IBA & Next Header: BTH */
-	lrh->dlid   = cpu_to_be16(ah->ib_ah_attr.dlid);
-	lrh->slid   = cpu_to_be16(slid);
-
 	bth->pkey   = dev->ports[port_num - 1].pkey_table[send_wqe->wr.ud.pkey_index];
 	bth->destQP = cpu_to_be32(send_wqe->wr.ud.remote_qpn);
 	bth->psn    = cpu_to_be32(qp->ib_qp_attr.sq_psn & PIB_PSN_MASK); /* A-bit is 0 */
@@ -179,12 +161,10 @@ int pib_process_ud_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 	} else if (send_wqe->send_flags & IB_SEND_INLINE) {
 		memcpy(buffer, send_wqe->inline_data_buffer, send_wqe->total_length);
 	} else {
-		spin_lock_irqsave(&pd->lock, flags);
 		status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge,
 					       buffer, 0, send_wqe->total_length,
 					       0,
 					       PIB_MR_COPY_FROM);
-		spin_unlock_irqrestore(&pd->lock, flags);
 	}
 
 	if (status != IB_WC_SUCCESS)
@@ -254,7 +234,6 @@ void pib_receive_ud_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct
 	u32 qkey;
 	enum ib_wc_status status = IB_WC_SUCCESS;
 	__be32 imm_data = 0;
-	unsigned long flags;
 
 	if (!pib_is_recv_ok(qp->state))
 		goto silently_drop;
@@ -337,8 +316,6 @@ void pib_receive_ud_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
-
 	if (grh)
 		status = pib_util_mr_copy_data(pd, recv_wqe->sge_array, recv_wqe->num_sge,
 					       grh, 0, sizeof(*grh),
@@ -350,8 +327,6 @@ void pib_receive_ud_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct
 					       IB_ACCESS_LOCAL_WRITE,
 					       PIB_MR_COPY_TO);
 
-	spin_unlock_irqrestore(&pd->lock, flags);
-
 	if (status != IB_WC_SUCCESS) {
 		if (status == IB_WC_LOC_LEN_ERR) {
 			if (qp->ib_qp_init_attr.srq)
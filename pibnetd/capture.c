@@ -0,0 +1,443 @@
+/*
+ * capture.c - Packet capture in pcapng format
+ *
+ * Copyright (c) 2014 Minoru NAKAMURA <nminoru@nminoru.jp>
+ *
+ * This code is licenced under the GPL version 2 or BSD license.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "pibnetd.h"
+#include "pibnetd_packet.h"
+
+/*
+ *  ワーカーは中継したパケットを自分専用のリングバッファにコピーするだけで、
+ *  pcapng ファイルへの書き出しは専用のスレッドが行う。
+ *  リングの書き手はワーカー 1 つ、読み手は書き出しスレッド 1 つなので、
+ *  head と tail をそれぞれが一方的に進めればロックはいらない。
+ *  リングが一杯の時はパケットを捨てて数えておく。
+ */
+
+#define PCAPNG_BLOCK_SHB	(0x0A0D0D0A)
+#define PCAPNG_BLOCK_IDB	(0x00000001)
+#define PCAPNG_BLOCK_EPB	(0x00000006)
+#define PCAPNG_BYTE_ORDER_MAGIC	(0x1A2B3C4D)
+#define PCAPNG_LINKTYPE_INFINIBAND (247)
+
+#define PCAPNG_OPT_ENDOFOPT	(0)
+#define PCAPNG_OPT_IF_NAME	(2)
+#define PCAPNG_OPT_IF_TSRESOL	(9)
+#define PCAPNG_OPT_EPB_FLAGS	(2)
+
+#define PIB_CAPTURE_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+
+
+struct pib_capture_record {
+	uint32_t		size;	/* 0 means skip to the end of the ring */
+	uint32_t		caplen;
+	uint32_t		length;
+	uint16_t		if_index;
+	uint16_t		direction;
+	uint64_t		time;	/* [nsec] of CLOCK_REALTIME */
+	uint8_t			data[];
+};
+
+
+struct pib_capture_ring {
+	uint64_t		head;	/* written only by the worker */
+	uint64_t		dropped;
+	uint8_t		       *data;
+	char			pad[64];
+	uint64_t		tail;	/* written only by the writer thread */
+};
+
+
+struct pib_capture {
+	FILE		       *fp;
+	const char	       *filename;
+	pthread_t		thread;
+	volatile int		stop;
+
+	uint32_t		snaplen;
+	uint32_t		filter;	/* PIB_CAPTURE_FILTER_XXX */
+	uint16_t		lid;
+	uint32_t		qpn;
+	uint8_t			opcode;
+
+	int			nr_rings;
+	struct pib_capture_ring *rings;
+
+	uint64_t		nr_written;
+};
+
+
+static int parse_filter(struct pib_capture *capture, const char *filter);
+static void write_header(struct pib_capture *capture, struct pib_control *control);
+static void *writer_thread(void *arg);
+static int drain_ring(struct pib_capture *capture, struct pib_capture_ring *ring);
+static void write_option(FILE *fp, uint16_t code, const void *data, uint16_t length);
+static void write_u16(FILE *fp, uint16_t value);
+static void write_u32(FILE *fp, uint32_t value);
+
+
+struct pib_capture *pib_capture_open(struct pib_control *control, const char *filename, const char *filter, uint32_t snaplen)
+{
+	int i;
+	struct pib_capture *capture;
+
+	capture = calloc(1, sizeof(*capture));
+	assert(capture);
+
+	capture->filename = filename;
+	capture->snaplen  = snaplen;
+
+	if (filter && (parse_filter(capture, filter) < 0)) {
+		pib_report_err("pibnetd: wrong capture filter: %s", filter);
+		free(capture);
+		return NULL;
+	}
+
+	capture->fp = fopen(filename, "wb");
+	if (capture->fp == NULL) {
+		int eno = errno;
+		pib_report_err("pibnetd: fopen(%s, errno=%d)", filename, eno);
+		free(capture);
+		return NULL;
+	}
+
+	capture->nr_rings = control->nr_workers;
+	capture->rings	  = calloc(capture->nr_rings, sizeof(struct pib_capture_ring));
+	assert(capture->rings);
+
+	for (i=0 ; i<capture->nr_rings ; i++) {
+		capture->rings[i].data = malloc(PIB_NETD_CAPTURE_RING_SIZE);
+		assert(capture->rings[i].data);
+	}
+
+	write_header(capture, control);
+
+	return capture;
+}
+
+
+/*
+ *  "lid=<LID>,qpn=<QPN>,opcode=<OpCode>" の形式。値は 0x を付ければ 16 進数。
+ */
+static int parse_filter(struct pib_capture *capture, const char *filter)
+{
+	char *copy, *token, *saveptr = NULL;
+	int ret = 0;
+
+	copy = strdup(filter);
+	assert(copy);
+
+	for (token = strtok_r(copy, ", \t", &saveptr) ; token ; token = strtok_r(NULL, ", \t", &saveptr)) {
+		char *eq, *end;
+		unsigned long value;
+
+		eq = strchr(token, '=');
+		if (eq == NULL) {
+			ret = -1;
+			break;
+		}
+
+		*eq++ = '\0';
+
+		errno = 0;
+		value = strtoul(eq, &end, 0);
+		if ((errno != 0) || (end == eq) || (*end != '\0')) {
+			ret = -1;
+			break;
+		}
+
+		if ((strcmp(token, "lid") == 0) && (value <= 0xFFFF)) {
+			capture->lid	 = value;
+			capture->filter |= PIB_CAPTURE_FILTER_LID;
+		} else if ((strcmp(token, "qpn") == 0) && (value <= PIB_QPN_MASK)) {
+			capture->qpn	 = value;
+			capture->filter |= PIB_CAPTURE_FILTER_QPN;
+		} else if ((strcmp(token, "opcode") == 0) && (value <= 0xFF)) {
+			capture->opcode	 = value;
+			capture->filter |= PIB_CAPTURE_FILTER_OPCODE;
+		} else {
+			ret = -1;
+			break;
+		}
+	}
+
+	free(copy);
+
+	return ret;
+}
+
+
+/*
+ *  Section Header Block と、スイッチのポートごとの Interface Description Block。
+ *  Interface ID は sw->port_base + ポート番号になる。
+ */
+static void write_header(struct pib_capture *capture, struct pib_control *control)
+{
+	int i, j;
+	FILE *fp = capture->fp;
+	uint8_t tsresol = 9; /* nsec */
+
+	write_u32(fp, PCAPNG_BLOCK_SHB);
+	write_u32(fp, 28);
+	write_u32(fp, PCAPNG_BYTE_ORDER_MAGIC);
+	write_u16(fp, 1); /* Major Version */
+	write_u16(fp, 0); /* Minor Version */
+	write_u32(fp, 0xFFFFFFFF); /* Section Length (unspecified) */
+	write_u32(fp, 0xFFFFFFFF);
+	write_u32(fp, 28);
+
+	for (i=0 ; i<control->nr_switches ; i++) {
+		struct pib_switch *sw = control->switches[i];
+
+		for (j=0 ; j<sw->port_cnt ; j++) {
+			char name[PIB_SWITCH_NAME_LEN + 8];
+			uint32_t name_len, block_len;
+
+			snprintf(name, sizeof(name), "%s:%u", sw->name, j);
+
+			name_len  = strlen(name);
+			block_len = 16 + 4 + ((name_len + 3) & ~3) + 4 + 4 + 4 + 4;
+
+			write_u32(fp, PCAPNG_BLOCK_IDB);
+			write_u32(fp, block_len);
+			write_u16(fp, PCAPNG_LINKTYPE_INFINIBAND);
+			write_u16(fp, 0);
+			write_u32(fp, capture->snaplen);
+			write_option(fp, PCAPNG_OPT_IF_NAME, name, name_len);
+			write_option(fp, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+			write_u32(fp, PCAPNG_OPT_ENDOFOPT);
+			write_u32(fp, block_len);
+		}
+	}
+
+	fflush(fp);
+}
+
+
+/*
+ *  シグナルを止めたスレッドから呼ぶこと。
+ */
+void pib_capture_start(struct pib_capture *capture)
+{
+	int ret;
+
+	ret = pthread_create(&capture->thread, NULL, writer_thread, capture);
+	if (ret != 0) {
+		pib_report_err("pibnetd: pthread_create(ret=%d)", ret);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+void pib_capture_close(struct pib_capture *capture)
+{
+	int i;
+	uint64_t dropped = 0;
+
+	capture->stop = 1;
+	pthread_join(capture->thread, NULL);
+
+	for (i=0 ; i<capture->nr_rings ; i++) {
+		drain_ring(capture, &capture->rings[i]);
+		dropped += capture->rings[i].dropped;
+		free(capture->rings[i].data);
+	}
+
+	fclose(capture->fp);
+
+	pib_report_info("pibnetd: captured %" PRIu64 " packets into %s (%" PRIu64 " dropped)",
+			capture->nr_written, capture->filename, dropped);
+
+	free(capture->rings);
+	free(capture);
+}
+
+
+/*
+ *  ワーカー worker_id から呼ぶ。packet はフッタを含まない。
+ */
+void pib_capture_packet(struct pib_capture *capture, int worker_id, int if_index, int direction, const void *packet, size_t length)
+{
+	const struct pib_packet_lrh *lrh = packet;
+	struct pib_capture_ring *ring = &capture->rings[worker_id];
+	struct pib_capture_record *record;
+	struct timespec ts;
+	uint64_t head, tail, pos, skip;
+	size_t caplen, size;
+	uint8_t lnh;
+
+	if (length < sizeof(*lrh))
+		return;
+
+	/* pibnetd との間の制御パケット (Raw packet) は IB のパケットではない */
+	lnh = lrh->sl_rsv_lnh & 0x3;
+	if (lnh == 0)
+		return;
+
+	if (capture->filter) {
+		const struct pib_packet_bth *bth;
+		size_t header_size = sizeof(*lrh) + ((lnh == 0x3) ? sizeof(struct pib_grh) : 0);
+
+		if (length < header_size + sizeof(*bth))
+			return;
+
+		bth = packet + header_size;
+
+		if ((capture->filter & PIB_CAPTURE_FILTER_LID) &&
+		    (be16toh(lrh->dlid) != capture->lid) &&
+		    (be16toh(lrh->slid) != capture->lid))
+			return;
+
+		if ((capture->filter & PIB_CAPTURE_FILTER_QPN) &&
+		    ((be32toh(bth->destQP) & PIB_QPN_MASK) != capture->qpn))
+			return;
+
+		if ((capture->filter & PIB_CAPTURE_FILTER_OPCODE) &&
+		    (bth->OpCode != capture->opcode))
+			return;
+	}
+
+	caplen = (length < capture->snaplen) ? length : capture->snaplen;
+	size   = PIB_CAPTURE_ALIGN(sizeof(*record) + caplen);
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	/* レコードはリングの端をまたがない */
+	pos  = head & (PIB_NETD_CAPTURE_RING_SIZE - 1);
+	skip = (PIB_NETD_CAPTURE_RING_SIZE - pos < size) ? PIB_NETD_CAPTURE_RING_SIZE - pos : 0;
+
+	if (PIB_NETD_CAPTURE_RING_SIZE - (head - tail) < skip + size) {
+		ring->dropped++;
+		return;
+	}
+
+	if (skip) {
+		*(uint32_t *)(ring->data + pos) = 0;
+		head += skip;
+		pos   = 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	record = (struct pib_capture_record *)(ring->data + pos);
+
+	record->size	  = size;
+	record->caplen	  = caplen;
+	record->length	  = length;
+	record->if_index  = if_index;
+	record->direction = direction;
+	record->time	  = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	memcpy(record->data, packet, caplen);
+
+	__atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+
+static void *writer_thread(void *arg)
+{
+	struct pib_capture *capture = arg;
+
+	while (!capture->stop) {
+		int i, nr_records = 0;
+
+		for (i=0 ; i<capture->nr_rings ; i++)
+			nr_records += drain_ring(capture, &capture->rings[i]);
+
+		if (nr_records == 0) {
+			struct timespec ts = { .tv_sec = 0, .tv_nsec = PIB_NETD_CAPTURE_INTERVAL * 1000000 };
+			fflush(capture->fp);
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ *  リングに溜まったレコードを Enhanced Packet Block として書き出す。
+ */
+static int drain_ring(struct pib_capture *capture, struct pib_capture_ring *ring)
+{
+	int nr_records = 0;
+	uint64_t head, tail;
+	FILE *fp = capture->fp;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	while (tail != head) {
+		uint64_t pos = tail & (PIB_NETD_CAPTURE_RING_SIZE - 1);
+		struct pib_capture_record *record;
+		uint32_t block_len, flags;
+		static const uint8_t zero[4];
+
+		record = (struct pib_capture_record *)(ring->data + pos);
+
+		if (record->size == 0) {
+			tail += PIB_NETD_CAPTURE_RING_SIZE - pos;
+			continue;
+		}
+
+		block_len = 28 + ((record->caplen + 3) & ~3) + 8 + 4 + 4;
+		flags	  = (record->direction == PIB_CAPTURE_INBOUND) ? 1 : 2;
+
+		write_u32(fp, PCAPNG_BLOCK_EPB);
+		write_u32(fp, block_len);
+		write_u32(fp, record->if_index);
+		write_u32(fp, (uint32_t)(record->time >> 32));
+		write_u32(fp, (uint32_t)record->time);
+		write_u32(fp, record->caplen);
+		write_u32(fp, record->length);
+		fwrite(record->data, 1, record->caplen, fp);
+		fwrite(zero, 1, ((record->caplen + 3) & ~3) - record->caplen, fp);
+		write_option(fp, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+		write_u32(fp, PCAPNG_OPT_ENDOFOPT);
+		write_u32(fp, block_len);
+
+		tail += record->size;
+		nr_records++;
+	}
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	capture->nr_written += nr_records;
+
+	return nr_records;
+}
+
+
+static void write_option(FILE *fp, uint16_t code, const void *data, uint16_t length)
+{
+	static const uint8_t zero[4];
+
+	write_u16(fp, code);
+	write_u16(fp, length);
+	fwrite(data, 1, length, fp);
+	fwrite(zero, 1, ((length + 3) & ~3) - length, fp);
+}
+
+
+static void write_u16(FILE *fp, uint16_t value)
+{
+	fwrite(&value, sizeof(value), 1, fp);
+}
+
+
+static void write_u32(FILE *fp, uint32_t value)
+{
+	fwrite(&value, sizeof(value), 1, fp);
+}
@@ -7,64 +7,285 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
 #include <syslog.h>
+#include <pthread.h>
 
 #include "pibnetd.h"
 
+/*
+ *  メッセージは呼び出したスレッドで整形してリングに積み、出力は専用のスレッドで
+ *  行う。複数のワーカーが書き込むので、スロットごとの通し番号で空きを判定する
+ *  (Vyukov の bounded MPMC queue と同じ方式)。リングが一杯なら捨てて数える。
+ *
+ *  pib_logger_start() を呼ぶ前と pib_logger_stop() の後はその場で出力する。
+ */
+
+struct pib_log_slot {
+	uint64_t		seq;
+	int			level;
+	char			message[PIB_NETD_LOG_MESSAGE_LEN];
+};
+
+
+volatile int pib_log_level = PIB_LOG_INFO;
 
-void __pib_report_info(const char *filename, int lineno, const char *format, ...)
+static struct pib_log_slot log_ring[PIB_NETD_LOG_RING_SLOTS];
+static uint64_t log_head;	/* next slot to be claimed by a producer */
+static uint64_t log_tail;	/* next slot to be output, under consumer_lock */
+static uint64_t log_dropped;
+
+static pthread_mutex_t consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t writer;
+static volatile int is_async;
+static volatile int stop_writer;
+
+static void report(struct pib_log_site *site, int level, int with_location, const char *format, va_list arg);
+static int check_rate_limit(struct pib_log_site *site, uint32_t *suppressed_p);
+static void enqueue_message(int level, const char *message);
+static void output_message(int level, const char *message);
+static int drain_messages(void);
+static void *writer_thread(void *arg);
+static void flush_at_exit(void);
+
+
+void pib_logger_init(void)
+{
+	uint64_t i;
+
+	for (i=0 ; i<PIB_NETD_LOG_RING_SLOTS ; i++)
+		log_ring[i].seq = i;
+
+	/* exit() で終わる時もリングに残ったメッセージを出す */
+	atexit(flush_at_exit);
+}
+
+
+/*
+ *  シグナルを止めたスレッドから呼ぶこと。
+ */
+void pib_logger_start(void)
 {
 	int ret;
-	va_list arg;
-	char buffer[1024];
 
-	va_start(arg, format);
-	ret = vsprintf(buffer, format, arg);
-	va_end(arg);
+	ret = pthread_create(&writer, NULL, writer_thread, NULL);
+	if (ret != 0) {
+		pib_report_err("pibnetd: pthread_create(ret=%d)", ret);
+		exit(EXIT_FAILURE);
+	}
+
+	is_async = 1;
+}
 
-	sprintf(buffer + ret, "\n");
 
-	fputs(buffer, stdout);
-	fflush(stdout);
+void pib_logger_stop(void)
+{
+	if (!is_async)
+		return;
+
+	stop_writer = 1;
+	pthread_join(writer, NULL);
+
+	is_async = 0;
 
-	syslog(LOG_INFO, buffer);
+	pthread_mutex_lock(&consumer_lock);
+	drain_messages();
+	pthread_mutex_unlock(&consumer_lock);
 }
 
 
-void __pib_report_debug(const char *filename, int lineno, const char *format, ...)
+void __pib_report_info(struct pib_log_site *site, const char *format, ...)
 {
-	int ret;
 	va_list arg;
-	char buffer[1024];
 
 	va_start(arg, format);
-	ret = vsprintf(buffer, format, arg);
+	report(site, PIB_LOG_INFO, 0, format, arg);
 	va_end(arg);
+}
 
-	sprintf(buffer + ret, " at %s(%u)\n", filename, lineno);
 
-	fputs(buffer, stdout);
-	fflush(stdout);
+void __pib_report_debug(struct pib_log_site *site, const char *format, ...)
+{
+	va_list arg;
 
-	syslog(LOG_INFO, buffer);
+	va_start(arg, format);
+	report(site, PIB_LOG_DEBUG, 1, format, arg);
+	va_end(arg);
 }
 
 
-void __pib_report_err(const char *filename, int lineno, const char *format, ...)
+void __pib_report_err(struct pib_log_site *site, const char *format, ...)
 {
-	int ret;
 	va_list arg;
-	char buffer[1024];
 
 	va_start(arg, format);
-	ret = vsprintf(buffer, format, arg);
+	report(site, PIB_LOG_ERR, 1, format, arg);
 	va_end(arg);
+}
 
-	sprintf(buffer + ret, " at %s(%u)\n", filename, lineno);
 
-	fputs(buffer, stderr);
-	fflush(stderr);
+static void report(struct pib_log_site *site, int level, int with_location, const char *format, va_list arg)
+{
+	int ret;
+	uint32_t suppressed = 0;
+	char buffer[PIB_NETD_LOG_MESSAGE_LEN];
+
+	if (!check_rate_limit(site, &suppressed))
+		return;
+
+	if (suppressed > 0) {
+		snprintf(buffer, sizeof(buffer), "pibnetd: %u messages suppressed at %s(%u)",
+			 suppressed, site->filename, site->lineno);
+		enqueue_message(level, buffer);
+	}
 
-	syslog(LOG_ERR, buffer);
+	ret = vsnprintf(buffer, sizeof(buffer), format, arg);
+
+	if (with_location && (0 <= ret) && (ret < sizeof(buffer)))
+		snprintf(buffer + ret, sizeof(buffer) - ret, " at %s(%u)", site->filename, site->lineno);
+
+	enqueue_message(level, buffer);
+}
+
+
+/*
+ *  呼び出し元ごとに 1 秒あたり PIB_NETD_LOG_RATE_LIMIT 件まで出力する。
+ *  複数のスレッドが同時に来た時の数え間違いは許容する。
+ */
+static int check_rate_limit(struct pib_log_site *site, uint32_t *suppressed_p)
+{
+	struct timespec ts;
+	uint64_t now, window;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	now = ts.tv_sec;
+
+	window = site->window;
+	if ((window != now) && __sync_bool_compare_and_swap(&site->window, window, now)) {
+		*suppressed_p = __sync_lock_test_and_set(&site->suppressed, 0);
+		site->count = 0;
+	}
+
+	if (__sync_add_and_fetch(&site->count, 1) <= PIB_NETD_LOG_RATE_LIMIT)
+		return 1;
+
+	__sync_add_and_fetch(&site->suppressed, 1);
+
+	return 0;
+}
+
+
+static void enqueue_message(int level, const char *message)
+{
+	uint64_t pos;
+	struct pib_log_slot *slot;
+
+	if (!is_async) {
+		pthread_mutex_lock(&consumer_lock);
+		output_message(level, message);
+		pthread_mutex_unlock(&consumer_lock);
+		return;
+	}
+
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		uint64_t seq;
+
+		slot = &log_ring[pos & (PIB_NETD_LOG_RING_SLOTS - 1)];
+		seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (seq < pos) {
+			/* 書き出しスレッドが追いついていない */
+			__sync_add_and_fetch(&log_dropped, 1);
+			return;
+		} else
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	}
+
+	slot->level = level;
+	strncpy(slot->message, message, sizeof(slot->message) - 1);
+	slot->message[sizeof(slot->message) - 1] = '\0';
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+static void output_message(int level, const char *message)
+{
+	FILE *fp = (level == PIB_LOG_ERR) ? stderr : stdout;
+
+	fputs(message, fp);
+	fputc('\n', fp);
+	fflush(fp);
+
+	syslog((level == PIB_LOG_ERR) ? LOG_ERR : LOG_INFO, "%s", message);
+}
+
+
+/*
+ *  consumer_lock を取って呼ぶ。
+ */
+static int drain_messages(void)
+{
+	int nr_messages = 0;
+	uint64_t dropped;
+
+	for (;;) {
+		struct pib_log_slot *slot = &log_ring[log_tail & (PIB_NETD_LOG_RING_SLOTS - 1)];
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_tail + 1)
+			break;
+
+		output_message(slot->level, slot->message);
+
+		__atomic_store_n(&slot->seq, log_tail + PIB_NETD_LOG_RING_SLOTS, __ATOMIC_RELEASE);
+		log_tail++;
+		nr_messages++;
+	}
+
+	dropped = __sync_lock_test_and_set(&log_dropped, 0);
+	if (dropped > 0) {
+		char buffer[64];
+		snprintf(buffer, sizeof(buffer), "pibnetd: %" PRIu64 " log messages dropped", dropped);
+		output_message(PIB_LOG_ERR, buffer);
+	}
+
+	return nr_messages;
+}
+
+
+static void *writer_thread(void *arg)
+{
+	while (!stop_writer) {
+		int nr_messages;
+
+		pthread_mutex_lock(&consumer_lock);
+		nr_messages = drain_messages();
+		pthread_mutex_unlock(&consumer_lock);
+
+		if (nr_messages == 0) {
+			struct timespec ts = { .tv_sec = 0, .tv_nsec = PIB_NETD_LOG_INTERVAL * 1000000 };
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+
+static void flush_at_exit(void)
+{
+	pthread_mutex_lock(&consumer_lock);
+	drain_messages();
+	pthread_mutex_unlock(&consumer_lock);
 }
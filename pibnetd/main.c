@@ -5,6 +5,7 @@
  *
  * This code is licenced under the GPL version 2 or BSD license.
  */
+#define _GNU_SOURCE /* for recvmmsg, sendmmsg and pthread_rwlockattr_setkind_np */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -14,10 +15,13 @@
 #include <assert.h>
 #include <getopt.h>
 #include <signal.h>
+#include <time.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
@@ -28,28 +32,128 @@
 #include "pibnetd_packet.h"
 
 
+/*
+ *  recvmmsg で受信したパケットは中継先への sendmmsg が終わるまで受信バッファに
+ *  置いたままにして、送信キューはそのバッファを直接指す。
+ */
+struct pib_io_batch {
+	void		       *recv_buffers; /* PIB_NETD_RECV_BATCH * PIB_PACKET_BUFFER */
+	struct mmsghdr		recv_msgs[PIB_NETD_RECV_BATCH];
+	struct iovec		recv_iovecs[PIB_NETD_RECV_BATCH];
+	struct sockaddr_in	recv_sockaddrs[PIB_NETD_RECV_BATCH];
+
+	int			nr_send_msgs;
+	struct mmsghdr		send_msgs[PIB_NETD_SEND_BATCH];
+	struct iovec		send_iovecs[PIB_NETD_SEND_BATCH];
+	int			send_perf_index[PIB_NETD_SEND_BATCH]; /* -1 の時は perf に数えない */
+
+	/* statistics */
+	uint64_t		nr_recv_calls;
+	uint64_t		nr_recv_packets;
+	uint64_t		nr_send_calls;
+	uint64_t		nr_send_packets;
+};
+
+
+/*
+ *  ワーカーはそれぞれ SO_REUSEPORT で同じ UDP ポートに bind したソケットを持ち、
+ *  カーネルが送信元アドレスで振り分けたパケットを処理する。
+ */
+struct pib_worker {
+	int			id;
+	pthread_t		thread;
+	struct pib_control     *control;
+	int			sockfd;
+	int			epollfd;
+	void		       *buffer; /* buffer for packets that pibnetd generates */
+	struct pib_io_batch    *batch;  /* buffers for recvmmsg/sendmmsg */
+	struct pib_uring       *uring;  /* NULL unless --io-uring */
+	int			exclusive; /* nesting depth of begin_exclusive() */
+	int			nr_hops;   /* switch-to-switch hops of the current packet */
+	struct pib_port	      **lid_map;   /* work area of publish_lid_map() */
+
+	/* link emulation */
+	int			timerfd;   /* expires at the next slot of the wheel */
+	struct pib_timing_wheel *wheel;
+	uint64_t		random_state;
+
+	/* pib_merge_port_traffic() で pib_port_perf に足し込む */
+	struct pib_port_traffic *traffic; /* indexed by sw->port_base + port number */
+
+	struct pib_worker_metrics *metrics; /* &control->worker_metrics[id] */
+};
+
+
 struct pib_control pib_control;
 uint64_t pib_hca_guid_base;
 
 static int verbose;
 static int is_daemon;
 static uint32_t port_num = PIB_NETD_DEFAULT_PORT;
-static sig_atomic_t signal_flags;
+static int nr_threads = 1;
+static int use_io_uring;
+static int switch_radix = PIB_DEFAULT_SWITCH_RADIX;
+static const char *topology_file;
+static const char *shaping_file;
+static const char *capture_file;
+static const char *capture_filter;
+static uint32_t capture_snaplen = PIB_PACKET_BUFFER;
+static const char *snapshot_file;
+static int warm_restart;
+static const char *metrics_path;
+static int direct_mode;
+static volatile sig_atomic_t signal_flags;
+static volatile sig_atomic_t reload_requested; /* SIGUSR1 */
+static int base_log_level = PIB_LOG_INFO; /* SIGUSR2 toggles PIB_LOG_DEBUG */
 
 static void init_control(struct pib_control *control);
+static uint64_t get_monotonic_nsec(void);
+static void init_worker(struct pib_control *control, struct pib_worker *worker, int id, struct sockaddr_in *sockaddr);
 static void finish_control(struct pib_control *control);
-static struct pib_switch *init_switch(struct pib_control *control);
+static void init_fabric(struct pib_control *control);
+static struct pib_switch *init_switch(struct pib_control *control, int index, const char *name, int radix);
 static void finish_switch(struct pib_switch *sw);
+static void restore_port_guids(struct pib_control *control);
+static void link_switch_ports(struct pib_port *port1, struct pib_port *port2);
 static void construct_hca_guid_base(int sockfd);
-static void do_work(struct pib_switch *sw);
-static void receive_packet(struct pib_switch *sw);
-static void process_raw_packet(struct pib_switch *sw, uint64_t port_guid, struct sockaddr *sockaddr, void *buffer, int size);
-static void resend_ack(struct pib_switch *sw, int size, uint8_t port_num);
-static void send_trap_ntc128(struct pib_switch *sw);
-static uint8_t detect_in_port(struct pib_switch *sw, uint64_t port_guid);
-static int process_mad_packet(struct pib_switch *sw, uint8_t in_port_num, struct pib_packet_lrh *lrh, struct pib_packet_bth *bth, void *buffer, int size);
-static void relay_unicast_packet(struct pib_switch *sw, uint8_t in_port_num, uint16_t dlid, int size);
-static void relay_multicast_packet(struct pib_switch *sw, uint8_t in_port_num, uint16_t dlid, int size);
+static void start_workers(struct pib_control *control);
+static void stop_workers(struct pib_control *control);
+static void *worker_thread(void *arg);
+static void do_work(struct pib_worker *worker);
+static int get_wait_timeout(struct pib_control *control);
+static void do_uring_work(struct pib_worker *worker);
+static void receive_packets(struct pib_worker *worker);
+static void process_packet(struct pib_worker *worker, void *packet, ssize_t size, struct sockaddr *sockaddr);
+static void switch_packet(struct pib_worker *worker, struct pib_switch *sw, uint8_t in_port_num, void *packet, int size, struct pib_packet_lrh *lrh, struct pib_packet_bth *bth, int header_size);
+static void begin_exclusive(struct pib_worker *worker);
+static void end_exclusive(struct pib_worker *worker);
+static void transmit_packet(struct pib_worker *worker, struct pib_switch *sw, uint8_t out_port_num, void *packet, size_t length, int count_perf);
+static void deliver_to_peer(struct pib_worker *worker, struct pib_port *port, void *packet, size_t length, int count_perf);
+static void queue_packet(struct pib_worker *worker, struct pib_port *port, void *packet, size_t length, int count_perf);
+static void queue_sendmsg(struct pib_worker *worker, struct sockaddr *sockaddr, socklen_t socklen, void *packet, size_t length, int perf_index);
+static void shape_packet(struct pib_worker *worker, struct pib_port *port, void *packet, size_t length);
+static int reserve_bandwidth(struct pib_port *port, size_t length, uint64_t now, uint64_t *time_p);
+static void delay_packet(struct pib_worker *worker, struct pib_port *port, void *packet, size_t length, int perf_index, uint64_t time);
+static void run_timing_wheel(struct pib_worker *worker);
+static void reload_link_shaping(struct pib_worker *worker);
+static uint32_t random_ppm(struct pib_worker *worker);
+static void flush_send_queue(struct pib_worker *worker);
+static void flush_send_queue_to_uring(struct pib_worker *worker);
+static void report_batch_stats(struct pib_worker *worker);
+static void record_latency(struct pib_worker *worker, uint64_t start, int nr_packets);
+static int get_histogram_bucket(uint64_t value, int nr_buckets);
+static void process_raw_packet(struct pib_worker *worker, uint64_t port_guid, struct sockaddr *sockaddr, void *buffer, int size);
+static void resend_ack(struct pib_worker *worker, struct pib_port *port, void *packet, int size);
+static void send_trap_ntc128(struct pib_worker *worker, struct pib_switch *sw);
+static void publish_lid_map(struct pib_worker *worker);
+static void send_lid_map(struct pib_worker *worker, struct pib_port *port);
+static struct pib_port *detect_in_port(struct pib_control *control, uint64_t port_guid);
+static struct pib_port *find_empty_port(struct pib_control *control);
+static void insert_port_guid(struct pib_control *control, struct pib_port *port);
+static void remove_port_guid(struct pib_control *control, struct pib_port *port);
+static int process_mad_packet(struct pib_worker *worker, struct pib_switch *sw, uint8_t in_port_num, struct pib_packet_lrh *lrh, struct pib_packet_bth *bth, void *buffer, int size);
+static void relay_unicast_packet(struct pib_worker *worker, struct pib_switch *sw, uint8_t in_port_num, uint16_t dlid, void *packet, int size);
+static void relay_multicast_packet(struct pib_worker *worker, struct pib_switch *sw, uint8_t in_port_num, uint16_t dlid, void *packet, int size);
 
 static int parse_packet_header(void *buffer, int size, struct pib_packet_lrh **lrh_p, struct pib_grh **grh_p, struct pib_packet_bth **bth_p);
 static int pib_is_unicast_lid(uint16_t lid);
@@ -70,18 +174,72 @@ static void usage(void)
 		"--port, -p=<port-number>\n"
 		"\tSpecify the number of UDP (default: %u)\n"
 		"\n"
+		"--radix, -r=<number>\n"
+		"\tSpecify the number of external ports of the switch (default: %u, max: %u)\n"
+		"\n"
+		"--topology, -T=<file>\n"
+		"\tEmulate the fabric of switches described in <file>\n"
+		"\n"
+		"--shaping, -S=<file>\n"
+		"\tEmulate delay, rate, loss, reordering and duplication of links described in <file>.\n"
+		"\tSend SIGUSR1 to reload it\n"
+		"\n"
+		"--capture, -C=<file>\n"
+		"\tWrite packets going through the switch ports into <file> in pcapng format\n"
+		"\n"
+		"--capture-filter, -F=<filter>\n"
+		"\tCapture only packets matching lid=<LID>,qpn=<QPN>,opcode=<OpCode>\n"
+		"\n"
+		"--snaplen, -s=<bytes>\n"
+		"\tCapture at most <bytes> of each packet (default: %u)\n"
+		"\n"
+		"--snapshot, -P=<file>\n"
+		"\tWrite the state of the switches into <file> when it changes\n"
+		"\n"
+		"--warm-restart, -W\n"
+		"\tRestore the state of the switches from the file of --snapshot at startup\n"
+		"\n"
+		"--metrics, -M=<path>\n"
+		"\tServe counters in Prometheus text or JSON format on the UNIX socket <path>\n"
+		"\n"
+		"--direct, -D\n"
+		"\tLet hosts send unicast data directly to each other.\n"
+		"\tIgnored with --topology, --shaping or --capture\n"
+		"\n"
+		"--threads, -t=<number>\n"
+		"\tRun <number> worker threads sharing the UDP port (default: 1, max: %u)\n"
+		"\n"
+		"--io-uring, -U\n"
+		"\tReceive and send packets with io_uring instead of epoll\n"
+		"\n"
+		"--log-level, -L=<err|info|debug>\n"
+		"\tSet the log level (default: info). Send SIGUSR2 to toggle debug messages\n"
+		"\n"
 		"--verbose, -v\n"
 		"\tIncrease the log verbosity level.\n"
 		"\n"
 		"--help, -h\n"
 		"\tDisplay this usage\n",
 
-		PIB_NETD_DEFAULT_PORT);
+		PIB_NETD_DEFAULT_PORT,
+		PIB_DEFAULT_SWITCH_RADIX, PIB_MAX_PORTS - 1,
+		PIB_PACKET_BUFFER,
+		PIB_NETD_MAX_THREADS);
 }
 
 
 static void signal_handler(int signum, siginfo_t *info, void * data)
 {
+	if (signum == SIGUSR1) {
+		reload_requested = 1;
+		return;
+	}
+
+	if (signum == SIGUSR2) {
+		pib_log_level = (pib_log_level == PIB_LOG_DEBUG) ? base_log_level : PIB_LOG_DEBUG;
+		return;
+	}
+
 	signal_flags |= (1U << signum);
 }
 
@@ -100,11 +258,15 @@ static void setup_signal_mask(void)
 	sigaddset(&act.sa_mask, SIGHUP);
 	sigaddset(&act.sa_mask, SIGINT);
 	sigaddset(&act.sa_mask, SIGQUIT);
+	sigaddset(&act.sa_mask, SIGUSR1);
+	sigaddset(&act.sa_mask, SIGUSR2);
 
 	sigaction(SIGTERM, &act, NULL);
 	sigaction(SIGHUP,  &act, NULL);
 	sigaction(SIGINT,  &act, NULL);
 	sigaction(SIGQUIT, &act, NULL);
+	sigaction(SIGUSR1, &act, NULL);
+	sigaction(SIGUSR2, &act, NULL);
 }
 
 
@@ -112,14 +274,29 @@ int main(int argc, char** argv)
 {
 	struct option longopts[] = {
 		{"port",     required_argument, NULL, 'p' },
+		{"radix",    required_argument, NULL, 'r' },
+		{"threads",  required_argument, NULL, 't' },
+		{"topology", required_argument, NULL, 'T' },
+		{"shaping",  required_argument, NULL, 'S' },
+		{"capture",  required_argument, NULL, 'C' },
+		{"capture-filter", required_argument, NULL, 'F' },
+		{"snaplen",  required_argument, NULL, 's' },
+		{"snapshot", required_argument, NULL, 'P' },
+		{"warm-restart", no_argument,   NULL, 'W' },
+		{"metrics",  required_argument, NULL, 'M' },
+		{"direct",   no_argument,       NULL, 'D' },
+		{"io-uring", no_argument,       NULL, 'U' },
 		{"daemon",   no_argument,       NULL, 'B' },
+		{"log-level", required_argument, NULL, 'L' },
 		{"verbose",  no_argument,       NULL, 'v' },
 		{"hep",      no_argument,       NULL, 'h' },
 	};
 
 	int ch, option_index;
 
-	while ((ch = getopt_long(argc, argv, "p:Bhv", longopts, &option_index)) != -1) {
+	pib_logger_init();
+
+	while ((ch = getopt_long(argc, argv, "p:r:t:T:S:C:F:s:P:M:L:DWUBhv", longopts, &option_index)) != -1) {
 		switch (ch) {
 
 		case 'p':
@@ -127,12 +304,86 @@ int main(int argc, char** argv)
 			assert((0 < port_num) && (port_num < 65536));
 			break;
 
+		case 'r':
+			switch_radix = atoi(optarg);
+			if ((switch_radix < 1) || (PIB_MAX_PORTS - 1 < switch_radix)) {
+				usage();
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 't':
+			nr_threads = atoi(optarg);
+			if ((nr_threads < 1) || (PIB_NETD_MAX_THREADS < nr_threads)) {
+				usage();
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'T':
+			topology_file = optarg;
+			break;
+
+		case 'S':
+			shaping_file = optarg;
+			break;
+
+		case 'C':
+			capture_file = optarg;
+			break;
+
+		case 'F':
+			capture_filter = optarg;
+			break;
+
+		case 's':
+			capture_snaplen = atoi(optarg);
+			if ((int)capture_snaplen < (int)sizeof(struct pib_packet_lrh)) {
+				usage();
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'P':
+			snapshot_file = optarg;
+			break;
+
+		case 'W':
+			warm_restart = 1;
+			break;
+
+		case 'M':
+			metrics_path = optarg;
+			break;
+
+		case 'D':
+			direct_mode = 1;
+			break;
+
+		case 'U':
+			use_io_uring = 1;
+			break;
+
 		case 'B':
 			is_daemon = 1;
 			break;
 
+		case 'L':
+			if (strcmp(optarg, "err") == 0)
+				base_log_level = PIB_LOG_ERR;
+			else if (strcmp(optarg, "info") == 0)
+				base_log_level = PIB_LOG_INFO;
+			else if (strcmp(optarg, "debug") == 0)
+				base_log_level = PIB_LOG_DEBUG;
+			else {
+				usage();
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case 'v': // verbose
 			verbose = 1;
+			base_log_level = PIB_LOG_DEBUG;
 			break;
 
 		case 'h':
@@ -142,10 +393,47 @@ int main(int argc, char** argv)
 		}
 	}
 
+	if (warm_restart && (snapshot_file == NULL)) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	pib_log_level = base_log_level;
+
+	/* ホスト間で直接送られたパケットはスイッチのエミュレーションを通らない */
+	if (direct_mode && (topology_file || shaping_file || capture_file)) {
+		pib_report_info("pibnetd: --direct is disabled by --topology, --shaping or --capture");
+		direct_mode = 0;
+	}
+
 	init_control(&pib_control);
 
-	struct pib_switch *sw;
-	sw = init_switch(&pib_control);
+	init_fabric(&pib_control);
+
+	if (shaping_file)
+		if (pib_load_link_shaping(&pib_control, shaping_file) < 0)
+			exit(EXIT_FAILURE);
+
+	/* daemon() で chdir する前にファイルを開く */
+	if (snapshot_file) {
+		pib_control.snapshot = pib_snapshot_open(&pib_control, snapshot_file, warm_restart);
+		if (pib_control.snapshot == NULL)
+			exit(EXIT_FAILURE);
+		restore_port_guids(&pib_control);
+	}
+
+	if (capture_file) {
+		pib_control.capture = pib_capture_open(&pib_control, capture_file, capture_filter, capture_snaplen);
+		if (pib_control.capture == NULL)
+			exit(EXIT_FAILURE);
+	}
+
+	if (metrics_path) {
+		pib_control.metrics = pib_metrics_open(&pib_control, metrics_path);
+		if (pib_control.metrics == NULL)
+			exit(EXIT_FAILURE);
+	}
+
 	pib_report_info("pibnetd: " PIB_SWITCH_DESCRIPTION " v" PIB_DRIVER_VERSION);
 
 	if (is_daemon)
@@ -153,58 +441,275 @@ int main(int argc, char** argv)
 
 	setup_signal_mask();
 
-	do_work(sw);
+	/* ワーカー 0 はメインスレッドで動かす */
+	start_workers(&pib_control);
+
+	do_work(&pib_control.workers[0]);
+
+	stop_workers(&pib_control);
+
+	if (pib_control.snapshot)
+		pib_snapshot_close(pib_control.snapshot, &pib_control);
+
+	if (pib_control.capture)
+		pib_capture_close(pib_control.capture);
+
+	if (pib_control.metrics)
+		pib_metrics_close(pib_control.metrics);
+
+	int i;
+	for (i=0 ; i<pib_control.nr_workers ; i++)
+		report_batch_stats(&pib_control.workers[i]);
 
 	pib_report_info("pibnetd: stop");
 
+	pib_logger_stop();
+
 	return 0;
 }
 
 
 static void init_control(struct pib_control *control)
 {
-	int ret;
+	int i;
 	struct sockaddr_in sockaddr;
 
 	memset(control, 0, sizeof(*control));
 
-	control->buffer = malloc(PIB_PACKET_BUFFER);
-	assert(control->buffer);
+	control->shaping_file = shaping_file;
+	control->direct_mode  = direct_mode;
+
+	control->nr_workers = nr_threads;
+	control->workers    = calloc(nr_threads, sizeof(struct pib_worker));
+	assert(control->workers);
 
-	control->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (control->sockfd < 0) {
+	/* ワーカーごとのカウンタを別のキャッシュラインに置く */
+	if (posix_memalign((void **)&control->worker_metrics, 64,
+			   nr_threads * sizeof(struct pib_worker_metrics)) != 0)
+		assert(0);
+	memset(control->worker_metrics, 0, nr_threads * sizeof(struct pib_worker_metrics));
+
+	control->stopfd = eventfd(0, 0);
+	if (control->stopfd < 0) {
 		int eno = errno;
-		pib_report_err("pibnetd: socket(ret=%d)", eno);
+		pib_report_err("pibnetd: eventfd(ret=%d)", eno);
 		exit(EXIT_FAILURE);
 	}
 
-	construct_hca_guid_base(control->sockfd);
-
 	memset(&sockaddr, 0, sizeof(sockaddr));
 	sockaddr.sin_family      = AF_INET;
 	sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 	sockaddr.sin_port        = htons(port_num);
 
-	ret = bind(control->sockfd, (struct sockaddr*)&sockaddr, (socklen_t)sizeof(sockaddr));
+	/*
+	 * 中継が続いても SMP の処理が待たされ続けないよう、書き込み側を優先する。
+	 * 共有ロックを再帰的に取ることはない。
+	 */
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&control->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	for (i=0 ; i<control->nr_workers ; i++)
+		init_worker(control, &control->workers[i], i, &sockaddr);
+
+	construct_hca_guid_base(control->workers[0].sockfd);
+
+	control->sockaddr = calloc(1, sizeof(sockaddr));
+
+	memcpy(control->sockaddr, &sockaddr, sizeof(sockaddr));
+}
+
+
+static void init_worker(struct pib_control *control, struct pib_worker *worker, int id, struct sockaddr_in *sockaddr)
+{
+	int i, ret;
+	struct epoll_event event;
+	struct pib_io_batch *batch;
+
+	worker->id      = id;
+	worker->control = control;
+	worker->metrics = &control->worker_metrics[id];
+
+	worker->buffer = malloc(PIB_PACKET_BUFFER);
+	assert(worker->buffer);
+
+	worker->lid_map = calloc(PIB_MCAST_LID_BASE, sizeof(struct pib_port *));
+	assert(worker->lid_map);
+
+	batch = calloc(1, sizeof(*batch));
+	assert(batch);
+
+	batch->recv_buffers = malloc(PIB_NETD_RECV_BATCH * PIB_PACKET_BUFFER);
+	assert(batch->recv_buffers);
+
+	for (i=0 ; i<PIB_NETD_RECV_BATCH ; i++) {
+		batch->recv_iovecs[i].iov_base = batch->recv_buffers + i * PIB_PACKET_BUFFER;
+		batch->recv_iovecs[i].iov_len  = PIB_PACKET_BUFFER;
+
+		batch->recv_msgs[i].msg_hdr.msg_iov    = &batch->recv_iovecs[i];
+		batch->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->recv_msgs[i].msg_hdr.msg_name   = &batch->recv_sockaddrs[i];
+	}
+
+	worker->batch = batch;
+
+	worker->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (worker->sockfd < 0) {
+		int eno = errno;
+		pib_report_err("pibnetd: socket(ret=%d)", eno);
+		exit(EXIT_FAILURE);
+	}
+
+	if (control->nr_workers > 1) {
+		int on = 1;
+
+		ret = setsockopt(worker->sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+		if (ret != 0) {
+			int eno  = errno;
+			pib_report_err("pibnetd: setsockopt(SO_REUSEPORT, ret=%d)", eno);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	ret = bind(worker->sockfd, (struct sockaddr*)sockaddr, (socklen_t)sizeof(*sockaddr));
 	if (ret != 0) {
 		int eno  = errno;
 		pib_report_err("pibnetd: bind(ret=%d)", eno);
 		exit(EXIT_FAILURE);
 	}
 
-	control->sockaddr = calloc(1, sizeof(sockaddr));
+	worker->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (worker->timerfd < 0) {
+		int eno  = errno;
+		pib_report_err("pibnetd: timerfd_create(ret=%d)", eno);
+		exit(EXIT_FAILURE);
+	}
 
-	memcpy(control->sockaddr, &sockaddr, sizeof(sockaddr));
+	worker->wheel = malloc(sizeof(*worker->wheel));
+	assert(worker->wheel);
+
+	pib_wheel_init(worker->wheel, get_monotonic_nsec());
+
+	worker->random_state = (get_monotonic_nsec() ^ ((uint64_t)(id + 1) << 32)) | 1;
+
+	if (use_io_uring) {
+		worker->uring = pib_uring_create(worker->sockfd, control->stopfd, worker->timerfd);
+		if (worker->uring == NULL)
+			pib_report_err("pibnetd: worker[%d]: io_uring is not available, falling back to epoll", id);
+	}
+
+	worker->epollfd = epoll_create(3);
+	if (worker->epollfd < 0) {
+		int eno  = errno;
+		pib_report_err("pibnetd: epoll_create(ret=%d)", eno);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events  = EPOLLIN;
+	event.data.fd = worker->sockfd;
+
+	ret = epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->sockfd, &event);
+	if (ret != 0) {
+		int eno  = errno;
+		pib_report_err("pibnetd: epoll_ctl(ret=%d)", eno);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events  = EPOLLIN;
+	event.data.fd = control->stopfd;
+
+	ret = epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, control->stopfd, &event);
+	if (ret != 0) {
+		int eno  = errno;
+		pib_report_err("pibnetd: epoll_ctl(ret=%d)", eno);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events  = EPOLLIN;
+	event.data.fd = worker->timerfd;
+
+	ret = epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->timerfd, &event);
+	if (ret != 0) {
+		int eno  = errno;
+		pib_report_err("pibnetd: epoll_ctl(ret=%d)", eno);
+		exit(EXIT_FAILURE);
+	}
 }
 
 
 static void finish_control(struct pib_control *control)
 {
-	close(control->sockfd);
+	int i;
+
+	for (i=0 ; i<control->nr_workers ; i++) {
+		close(control->workers[i].epollfd);
+		close(control->workers[i].sockfd);
+	}
+
+	close(control->stopfd);
 }
 
 
-static struct pib_switch *init_switch(struct pib_control *control)
+/*
+ *  トポロジーファイルがなければ switch_radix 個のポートを持つスイッチを 1 つ作る。
+ */
+static void init_fabric(struct pib_control *control)
+{
+	int i;
+	struct pib_topology *topology;
+
+	if (topology_file)
+		topology = pib_load_topology(topology_file, switch_radix);
+	else {
+		topology = calloc(1, sizeof(*topology));
+		assert(topology);
+
+		topology->nr_switches = 1;
+		topology->switches    = calloc(1, sizeof(struct pib_topology_switch));
+		assert(topology->switches);
+
+		strcpy(topology->switches[0].name, "switch0");
+		topology->switches[0].radix = switch_radix;
+	}
+
+	control->nr_switches = topology->nr_switches;
+	control->switches    = calloc(topology->nr_switches, sizeof(struct pib_switch *));
+	assert(control->switches);
+
+	for (i=0 ; i<topology->nr_switches ; i++)
+		control->switches[i] = init_switch(control, i,
+						   topology->switches[i].name,
+						   topology->switches[i].radix);
+
+	for (i=0 ; i<topology->nr_links ; i++) {
+		struct pib_topology_link *link = &topology->links[i];
+
+		link_switch_ports(&control->switches[link->switch_index[0]]->ports[link->port_num[0]],
+				  &control->switches[link->switch_index[1]]->ports[link->port_num[1]]);
+	}
+
+	for (i=0 ; i<control->nr_workers ; i++) {
+		control->workers[i].traffic = calloc(control->nr_ports, sizeof(struct pib_port_traffic));
+		assert(control->workers[i].traffic);
+	}
+
+	if (topology_file)
+		pib_report_info("pibnetd: %d switches, %d links from %s",
+				topology->nr_switches, topology->nr_links, topology_file);
+
+	free(topology->switches);
+	free(topology->links);
+	free(topology);
+}
+
+
+static struct pib_switch *init_switch(struct pib_control *control, int index, const char *name, int radix)
 {
 	int i, j;
 	struct pib_switch *sw;
@@ -212,11 +717,28 @@ static struct pib_switch *init_switch(struct pib_control *control)
 	sw = calloc(1, sizeof(*sw));
 	assert(sw);
 
-	sw->control = control;
+	sw->control   = control;
+	sw->index     = index;
+	/* スイッチ 0 は単一スイッチの時と同じ GUID になる */
+	sw->guid_base = pib_hca_guid_base | ((uint64_t)index << 48);
+	sw->port_base = control->nr_ports;
+
+	strncpy(sw->name, name, sizeof(sw->name) - 1);
+
+	if (control->nr_switches > 1)
+		snprintf(sw->description, sizeof(sw->description), "%s %s", PIB_SWITCH_DESCRIPTION, name);
+	else
+		strncpy(sw->description, PIB_SWITCH_DESCRIPTION, sizeof(sw->description) - 1);
+
+	sw->port_cnt     = radix + 1;
+	sw->pm_block_cnt = (sw->port_cnt + 15) / 16;
 
-	sw->port_cnt = PIB_MAX_PORTS;
+	control->nr_ports += sw->port_cnt;
 
-	for (i=0 ; i<PIB_MAX_PORTS ; i++) {
+	sw->ports = calloc(sw->port_cnt, sizeof(struct pib_port));
+	assert(sw->ports);
+
+	for (i=0 ; i<sw->port_cnt ; i++) {
 		struct ibv_port_attr port_attr = {
 			.state           = IBV_PORT_DOWN,
 			.max_mtu         = IBV_MTU_4096,
@@ -242,6 +764,7 @@ static struct pib_switch *init_switch(struct pib_control *control)
 		struct pib_port* port;
 		port = &sw->ports[i];
 
+		port->sw	    = sw;
 		port->port_num	    = i;
 		port->ibv_port_attr = port_attr;
 		port->gid[0].global.subnet_prefix =
@@ -249,7 +772,7 @@ static struct pib_switch *init_switch(struct pib_control *control)
 			htobe64(0xFE80000000000000ULL);
 		/* the same guid for all ports on a switch */
 		port->gid[0].global.interface_id  =
-			htobe64(pib_hca_guid_base | 0x0101ULL);
+			htobe64(sw->guid_base | 0x0101ULL);
 
 		port->link_width_enabled = PIB_LINK_WIDTH_SUPPORTED;
 		port->link_speed_enabled = PIB_LINK_SPEED_SUPPORTED;
@@ -261,7 +784,7 @@ static struct pib_switch *init_switch(struct pib_control *control)
 	sw->ucast_fwd_table = calloc(1, PIB_MCAST_LID_BASE);
 	assert(sw->ucast_fwd_table);
 
-	sw->mcast_fwd_table = calloc(sizeof(struct pib_port_bits), PIB_MAX_LID - PIB_MCAST_LID_BASE);
+	sw->mcast_fwd_table = calloc(sizeof(uint16_t) * sw->pm_block_cnt, PIB_MAX_LID - PIB_MCAST_LID_BASE);
 	assert(sw->mcast_fwd_table);
 
 	return sw;
@@ -273,6 +796,45 @@ static void finish_switch(struct pib_switch *sw)
 }
 
 
+/*
+ *  スナップショットから戻したホストのポートを port_guid のハッシュに登録する。
+ *  ホストはつながったままなので、LID map を送り直すだけで中継を再開できる。
+ */
+static void restore_port_guids(struct pib_control *control)
+{
+	int i, port_num;
+
+	for (i=0 ; i<control->nr_switches ; i++) {
+		struct pib_switch *sw = control->switches[i];
+
+		for (port_num = 1 ; port_num < sw->port_cnt ; port_num++) {
+			struct pib_port *port = &sw->ports[port_num];
+
+			if (port->port_guid == 0)
+				continue;
+
+			insert_port_guid(control, port);
+			control->lid_map_dirty = 1;
+		}
+	}
+}
+
+
+/*
+ *  スイッチ間のリンクは起動時から物理的にリンクアップしている。
+ */
+static void link_switch_ports(struct pib_port *port1, struct pib_port *port2)
+{
+	port1->peer = port2;
+	port2->peer = port1;
+
+	port1->ibv_port_attr.state      = IBV_PORT_INIT;
+	port1->ibv_port_attr.phys_state = PIB_PHYS_PORT_LINK_UP;
+	port2->ibv_port_attr.state      = IBV_PORT_INIT;
+	port2->ibv_port_attr.phys_state = PIB_PHYS_PORT_LINK_UP;
+}
+
+
 static void construct_hca_guid_base(int sockfd)
 {
 	uint64_t hwaddr = 0xCafeBabe0000ULL;
@@ -324,91 +886,310 @@ done:
 }
 
 
-static void do_work(struct pib_switch *sw)
+static void start_workers(struct pib_control *control)
+{
+	int i, ret;
+	sigset_t mask, old_mask;
+
+	/* シグナルはメインスレッドで受けて、他のワーカーは stopfd で止める */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGQUIT);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+	pib_logger_start();
+
+	if (control->capture)
+		pib_capture_start(control->capture);
+
+	if (control->metrics)
+		pib_metrics_start(control->metrics);
+
+	for (i=1 ; i<control->nr_workers ; i++) {
+		struct pib_worker *worker = &control->workers[i];
+
+		ret = pthread_create(&worker->thread, NULL, worker_thread, worker);
+		if (ret != 0) {
+			pib_report_err("pibnetd: pthread_create(ret=%d)", ret);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+
+static void stop_workers(struct pib_control *control)
+{
+	int i;
+	uint64_t value = 1;
+
+	if (write(control->stopfd, &value, sizeof(value)) != sizeof(value)) {
+		int eno = errno;
+		pib_report_err("pibnetd: write(eventfd, errno=%d)", eno);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i=1 ; i<control->nr_workers ; i++)
+		pthread_join(control->workers[i].thread, NULL);
+}
+
+
+static void *worker_thread(void *arg)
+{
+	do_work((struct pib_worker *)arg);
+
+	return NULL;
+}
+
+
+static void do_work(struct pib_worker *worker)
 {
 	sigset_t empty_mask;
 
 	sigemptyset(&empty_mask);
 
+	if (worker->uring) {
+		do_uring_work(worker);
+		/* io_uring が使えないと分かった時は NULL になって epoll で続ける */
+		if (worker->uring)
+			return;
+	}
+
 	while (!signal_flags) {
-		int ret, max = 0;
-		fd_set rfds;
+		int i, ret, timeout;
+		struct epoll_event events[3];
 
-		FD_ZERO(&rfds);
-		FD_SET(sw->control->sockfd, &rfds);
+		if (reload_requested && (worker->id == 0))
+			reload_link_shaping(worker);
 
-		if (max < sw->control->sockfd + 1)
-			max = sw->control->sockfd + 1;
-    
-		struct timespec tv;
-		tv.tv_sec  = 10;
-		tv.tv_nsec =  0;
+		/* LID map やスナップショットの書き出しを待っている間は短い間隔で起きる */
+		timeout = get_wait_timeout(worker->control);
 
-	retry:
-		ret = pselect(max, &rfds, NULL, NULL, &tv, &empty_mask);
+		ret = epoll_pwait(worker->epollfd, events, ARRAY_SIZE(events), timeout, &empty_mask);
 		if (ret < 0) {
 			int eno = errno;
-			if (eno == EINTR) {
-				if (signal_flags)
-					break;
-				goto retry;
-			}
-			pib_report_err("pibnetd: select(errno=%d)", eno);
+			if (eno == EINTR)
+				continue;
+			pib_report_err("pibnetd: epoll_pwait(errno=%d)", eno);
 			exit(EXIT_FAILURE);
-		} else if (ret > 0) {
-			if (FD_ISSET(sw->control->sockfd, &rfds))
-				receive_packet(sw);
+		} else if (ret == 0) {
+			if (verbose)
+				report_batch_stats(worker);
 		}
+
+		for (i=0 ; i<ret ; i++) {
+			if (events[i].data.fd == worker->control->stopfd)
+				return;
+			if (events[i].data.fd == worker->sockfd)
+				receive_packets(worker);
+			if (events[i].data.fd == worker->timerfd) {
+				uint64_t expirations;
+				if (read(worker->timerfd, &expirations, sizeof(expirations)) < 0)
+					; /* 期限切れでなければ EAGAIN になるだけ */
+			}
+		}
+
+		run_timing_wheel(worker);
+
+		if (worker->control->lid_map_dirty)
+			publish_lid_map(worker);
+
+		if (worker->control->snapshot && worker->control->snapshot_dirty)
+			pib_snapshot_save(worker->control->snapshot, worker->control);
+
 	}
 }
 
 
-static void receive_packet(struct pib_switch *sw)
+/*
+ *  epoll_pwait と io_uring_enter で待つ時間 [msec]
+ */
+static int get_wait_timeout(struct pib_control *control)
 {
-	struct iovec iovec;
-	struct msghdr msghdr;
-	struct sockaddr_in sockaddr;
+	if (control->lid_map_dirty)
+		return PIB_NETD_LID_MAP_INTERVAL;
 
-	memset(&msghdr,   0, sizeof(msghdr));
-	memset(&sockaddr, 0, sizeof(sockaddr));
+	if (control->snapshot && control->snapshot_dirty)
+		return PIB_NETD_SNAPSHOT_INTERVAL;
 
-	iovec.iov_base     = sw->control->buffer;
-	iovec.iov_len      = PIB_PACKET_BUFFER;
+	return 10 * 1000;
+}
 
-	msghdr.msg_name    = &sockaddr;
-	msghdr.msg_namelen = sizeof(sockaddr);
-	msghdr.msg_iov     = &iovec;
-	msghdr.msg_iovlen  = 1;
 
-	ssize_t size, packet_size;
+/*
+ *  io_uring で動かす場合のメインループ。
+ *  1 回の io_uring_enter で、前回積んだ sendmsg の投入と次の完了待ちを行う。
+ *  受信パケットは受信バッファのまま処理し、中継の sendmsg が完了するまで
+ *  バッファを再利用しない。
+ */
+static void do_uring_work(struct pib_worker *worker)
+{
+	struct pib_control *control = worker->control;
+	struct pib_io_batch *batch = worker->batch;
+	sigset_t empty_mask;
 
-retry:
-	size = recvmsg(sw->control->sockfd, &msghdr, 0);
-	if (size < 0) {
-		int eno  = errno;
-		if (eno == EINTR) {
-			if (signal_flags)
+	sigemptyset(&empty_mask);
+
+	while (!signal_flags) {
+		int ret, timeout, nr_received = 0;
+		struct pib_uring_event event;
+
+		if (reload_requested && (worker->id == 0))
+			reload_link_shaping(worker);
+
+		timeout = get_wait_timeout(control);
+
+		ret = pib_uring_wait(worker->uring, timeout, &empty_mask);
+		if (ret == -ETIME) {
+			if (verbose)
+				report_batch_stats(worker);
+		} else if ((ret < 0) && (ret != -EINTR) && (ret != -EAGAIN) && (ret != -EBUSY)) {
+			pib_report_err("pibnetd: io_uring_enter(errno=%d)", -ret);
+			exit(EXIT_FAILURE);
+		}
+
+		batch->nr_recv_calls++;
+
+		pthread_rwlock_rdlock(&control->lock);
+
+		while (pib_uring_next_event(worker->uring, &event)) {
+			switch (event.type) {
+
+			case PIB_URING_EVENT_RECV: {
+				uint64_t start = control->metrics ? get_monotonic_nsec() : 0;
+
+				batch->nr_recv_packets++;
+				nr_received++;
+				process_packet(worker, event.packet, event.size, event.sockaddr);
+				/* 中継の sendmsg がバッファの参照を取ってから手放す */
+				flush_send_queue(worker);
+				pib_uring_put_buffer(worker->uring, event.buf_id);
+
+				if (control->metrics)
+					record_latency(worker, start, 1);
+				break;
+			}
+
+			case PIB_URING_EVENT_SEND:
+				if ((event.perf_index >= 0) && (event.size > 0)) {
+					worker->traffic[event.perf_index].xmit_packets++;
+					worker->traffic[event.perf_index].xmit_data += event.size;
+				}
+				break;
+
+			case PIB_URING_EVENT_TIMER: {
+				uint64_t expirations;
+				if (read(worker->timerfd, &expirations, sizeof(expirations)) < 0)
+					; /* 期限切れでなければ EAGAIN になるだけ */
+				break;
+			}
+
+			case PIB_URING_EVENT_STOP:
+				pthread_rwlock_unlock(&control->lock);
+				return;
+
+			case PIB_URING_EVENT_UNSUPPORTED:
+				pib_report_err("pibnetd: worker[%d]: io_uring recvmsg is not supported (errno=%d), falling back to epoll",
+					       worker->id, -event.size);
+				pib_uring_destroy(worker->uring);
+				worker->uring = NULL;
+				pthread_rwlock_unlock(&control->lock);
 				return;
-			goto retry;
+			}
 		}
-		pib_report_err("pibnetd: recvmsg(errno=%d)", eno);
-		exit(EXIT_FAILURE);
-		return;
+
+		pthread_rwlock_unlock(&control->lock);
+
+		if (nr_received > 0)
+			worker->metrics->recv_batch[get_histogram_bucket(nr_received, PIB_NETD_METRICS_BATCH_BUCKETS)]++;
+
+		run_timing_wheel(worker);
+
+		if (control->lid_map_dirty)
+			publish_lid_map(worker);
+
+		if (control->snapshot && control->snapshot_dirty)
+			pib_snapshot_save(control->snapshot, control);
+
 	}
+}
+
+
+/*
+ *  受信できるだけ recvmmsg でまとめて受信し、中継するパケットは送信キューに
+ *  積んで、受信バッファを再利用する前に sendmmsg でまとめて送信する。
+ *  1 回の recvmmsg で受けたパケットは control->lock を共有ロックで保持したまま処理する。
+ */
+static void receive_packets(struct pib_worker *worker)
+{
+	int i, ret;
+	uint64_t start;
+	struct pib_control *control = worker->control;
+	struct pib_io_batch *batch = worker->batch;
+
+	do {
+		for (i=0 ; i<PIB_NETD_RECV_BATCH ; i++)
+			batch->recv_msgs[i].msg_hdr.msg_namelen = sizeof(batch->recv_sockaddrs[i]);
+
+	retry:
+		ret = recvmmsg(worker->sockfd, batch->recv_msgs, PIB_NETD_RECV_BATCH, MSG_DONTWAIT, NULL);
+		if (ret < 0) {
+			int eno  = errno;
+			if (eno == EINTR) {
+				if (signal_flags)
+					return;
+				goto retry;
+			}
+			if ((eno == EAGAIN) || (eno == EWOULDBLOCK))
+				return;
+			pib_report_err("pibnetd: recvmmsg(errno=%d)", eno);
+			exit(EXIT_FAILURE);
+		}
+
+		batch->nr_recv_calls++;
+		batch->nr_recv_packets += ret;
+
+		worker->metrics->recv_batch[get_histogram_bucket(ret, PIB_NETD_METRICS_BATCH_BUCKETS)]++;
+
+		start = control->metrics ? get_monotonic_nsec() : 0;
+
+		pthread_rwlock_rdlock(&control->lock);
+
+		for (i=0 ; i<ret ; i++)
+			process_packet(worker, batch->recv_iovecs[i].iov_base, batch->recv_msgs[i].msg_len,
+				       (struct sockaddr *)&batch->recv_sockaddrs[i]);
 
-	packet_size = size;
+		flush_send_queue(worker);
 
+		pthread_rwlock_unlock(&control->lock);
+
+		if (control->metrics)
+			record_latency(worker, start, ret);
+
+	} while ((ret == PIB_NETD_RECV_BATCH) && !signal_flags);
+}
+
+
+static void process_packet(struct pib_worker *worker, void *packet, ssize_t size, struct sockaddr *sockaddr)
+{
 	void *buffer;
 	union pib_packet_footer *footer;
 
-	buffer = sw->control->buffer;
+	buffer = packet;
 
 	if (size < sizeof(*footer)) {
 		pib_report_debug("pibnetd: no packet footer(size=%u)", size);
+		worker->metrics->drops[PIB_DROP_BAD_FOOTER]++;
 		return;
 	}
 
-	footer = sw->control->buffer + size - sizeof(*footer);
+	footer = packet + size - sizeof(*footer);
 
 	size -= sizeof(*footer);
 
@@ -421,6 +1202,7 @@ retry:
 	if (port_guid == 0) {
 		pib_report_debug("pibnetd: wrong port_guid=0x%" PRIx64 ", sock-addr=%s",
 				 port_guid, buffer);
+		worker->metrics->drops[PIB_DROP_BAD_FOOTER]++;
 		return;
 	}
 
@@ -432,47 +1214,80 @@ retry:
 	header_size = parse_packet_header(buffer, size, &lrh, &grh, &bth);
 	if (header_size < 0) {
 		pib_report_debug("pibnetd: wrong drop packet(size=%u, ret=%d)", size, header_size);
+		worker->metrics->drops[PIB_DROP_BAD_HEADER]++;
 		return;
 	}
 
-	buffer += header_size;
-
 	if ((lrh->sl_rsv_lnh & 0x3) == 0) {
-		process_raw_packet(sw, port_guid, (struct sockaddr *)&sockaddr, buffer, size - header_size);
+		begin_exclusive(worker);
+		process_raw_packet(worker, port_guid, sockaddr, buffer + header_size, size - header_size);
+		end_exclusive(worker);
 		return;
 	}
 
-	uint8_t in_port_num;
-	in_port_num = detect_in_port(sw, port_guid);
+	struct pib_port *in_port;
+	in_port = detect_in_port(worker->control, port_guid);
 
-	if (in_port_num == 0) {
+	if (in_port == NULL) {
 		char address[64];
-		parse_sockaddr((struct sockaddr*)&sockaddr, address, sizeof(address),  NULL);
+		parse_sockaddr(sockaddr, address, sizeof(address),  NULL);
 		pib_report_debug("pibnetd: unknown port_guid=0x%" PRIx64 ", sock-addr=%s",
-				 port_guid, buffer);
+				 port_guid, address);
+		worker->metrics->drops[PIB_DROP_UNKNOWN_GUID]++;
 		return;
 	}
 
-	if (packet_size > 0) {
-		struct pib_port* port;
-		port = &sw->ports[in_port_num];
+	if (worker->metrics->lids) {
+		struct pib_lid_traffic *lid_traffic = &worker->metrics->lids[be16_to_cpu(lrh->dlid)];
+
+		lid_traffic->packets++;
+		lid_traffic->data += size + sizeof(*footer);
+	}
+
+	if (worker->control->capture)
+		pib_capture_packet(worker->control->capture, worker->id,
+				   in_port->sw->port_base + in_port->port_num,
+				   PIB_CAPTURE_INBOUND, packet, size);
+
+	switch_packet(worker, in_port->sw, in_port->port_num, packet, size, lrh, bth, header_size);
+}
 
-		port->perf.rcv_packets++;
-		port->perf.rcv_data += packet_size;
+
+/*
+ *  in_port_num から入ったパケットを sw で処理する。size はフッタを含まない。
+ *  スイッチ間リンクを渡ったパケットもここに来る。
+ */
+static void switch_packet(struct pib_worker *worker, struct pib_switch *sw, uint8_t in_port_num, void *packet, int size, struct pib_packet_lrh *lrh, struct pib_packet_bth *bth, int header_size)
+{
+	void *buffer = packet + header_size;
+
+	if ((lrh->sl_rsv_lnh & 0x3) == 0) {
+		pib_report_debug("pibnetd: drop raw packet from %s port[%u]", sw->name, in_port_num);
+		worker->metrics->drops[PIB_DROP_BAD_HEADER]++;
+		return;
 	}
 
+	struct pib_port_traffic *traffic;
+	traffic = &worker->traffic[sw->port_base + in_port_num];
+
+	traffic->rcv_packets++;
+	traffic->rcv_data += size + sizeof(union pib_packet_footer);
+
 	uint32_t dest_qp_num;
 	dest_qp_num = be32_to_cpu(bth->destQP);
 	if (dest_qp_num & ~PIB_QPN_MASK) {
 		pib_report_debug("pibnetd: drop packet: dest_qp_num=0x%06x", dest_qp_num);
+		worker->metrics->drops[PIB_DROP_BAD_QPN]++;
 		return;
 	}
 
 	uint16_t dlid = be16_to_cpu(lrh->dlid);
 	if (dest_qp_num == PIB_QP0) {
-		if (process_mad_packet(sw, in_port_num, lrh, bth, buffer, size - header_size)) {
-			relay_unicast_packet(sw, in_port_num, dlid, size);
+		begin_exclusive(worker);
+		if (process_mad_packet(worker, sw, in_port_num, lrh, bth, buffer, size - header_size)) {
+			relay_unicast_packet(worker, sw, in_port_num, dlid, packet, size);
 		}
+		end_exclusive(worker);
 		return;
 	}
 
@@ -480,31 +1295,62 @@ retry:
 	    (dlid != sw->ports[0].ibv_port_attr.lid)) {
 		/* The packet isn't destined for this switch. */
 		if ((dest_qp_num == PIB_MULTICAST_QPN) || !pib_is_unicast_lid(dlid))
-			relay_multicast_packet(sw, in_port_num, dlid, size);
+			relay_multicast_packet(worker, sw, in_port_num, dlid, packet, size);
 		else
-			relay_unicast_packet(sw, in_port_num, dlid, size);
+			relay_unicast_packet(worker, sw, in_port_num, dlid, packet, size);
 		return;
 	}
 
 	if (dest_qp_num == PIB_QP1) {
-		process_mad_packet(sw, in_port_num, lrh, bth, buffer, size - header_size);
+		begin_exclusive(worker);
+		process_mad_packet(worker, sw, in_port_num, lrh, bth, buffer, size - header_size);
+		end_exclusive(worker);
 		return;
 	}
 
 	/* Don't receive any packets except MAD that are destined to this switch. */
 	pib_report_debug("pibnetd: drop packet: dlid=0x%04x, dest_qp_num=0x%06x",
 			 dlid, dest_qp_num);
+	worker->metrics->drops[PIB_DROP_NOT_FOR_SWITCH]++;
 	return;
 }
 
 
+/*
+ *  control->lock を共有ロックから排他ロックに取り直す。送信キューのパケットは
+ *  ポートの sockaddr を参照しているので、ロックを手放す前に送り出しておく。
+ *  スイッチ間を渡ったパケットの処理で入れ子になることがある。
+ */
+static void begin_exclusive(struct pib_worker *worker)
+{
+	if (worker->exclusive++ > 0)
+		return;
+
+	flush_send_queue(worker);
+	pthread_rwlock_unlock(&worker->control->lock);
+	pthread_rwlock_wrlock(&worker->control->lock);
+}
+
+
+static void end_exclusive(struct pib_worker *worker)
+{
+	if (--worker->exclusive > 0)
+		return;
+
+	flush_send_queue(worker);
+	pthread_rwlock_unlock(&worker->control->lock);
+	pthread_rwlock_rdlock(&worker->control->lock);
+}
+
+
 /*
  * Raw packets between pib.ko and pibnetd are reinterpreted as internal-use signals
  */
-static void process_raw_packet(struct pib_switch *sw, uint64_t port_guid, struct sockaddr *sockaddr, void *buffer, int size)
+static void process_raw_packet(struct pib_worker *worker, uint64_t port_guid, struct sockaddr *sockaddr, void *buffer, int size)
 {
+	struct pib_control *control = worker->control;
 	socklen_t socklen;
-	uint8_t port_num;
+	struct pib_port *port;
 	struct pib_packet_link *link;
 	char address[64];
 
@@ -518,112 +1364,311 @@ static void process_raw_packet(struct pib_switch *sw, uint64_t port_guid, struct
 	switch (be32_to_cpu(link->cmd)) {
 
 	case PIB_LINK_CMD_CONNECT:
-		port_num = detect_in_port(sw, port_guid);
+		port = detect_in_port(control, port_guid);
 
-		if (port_num != 0) {
+		if (port != NULL) {
 			/* Receive once more connect command from the node that never be normally disconnect */
-			free(sw->ports[port_num].sockaddr);
+			free(port->sockaddr);
 			goto found_new_port;
 		}
 
-		for (port_num = 1 ; port_num < sw->port_cnt ; port_num++)
-			if (sw->ports[port_num].port_guid == 0)
-				goto found_new_port;
+		port = find_empty_port(control);
 
-		pib_report_err("pibnetd: There is no empty port in this switch.");
-		exit(EXIT_FAILURE);
+		if (port != NULL) {
+			port->port_guid = port_guid;
+			insert_port_guid(control, port);
+			goto found_new_port;
+		}
+
+		/* ACK を返さずに接続を拒否する */
+		pib_report_err("pibnetd: There is no empty port in the fabric: port_guid=0x%" PRIx64 ", sock-addr=%s",
+			       port_guid, address);
 		break;
 
 	found_new_port:
-		sw->ports[port_num].port_guid = port_guid;
-		sw->ports[port_num].sockaddr  = malloc(socklen);
-		sw->ports[port_num].socklen   = socklen;
-		sw->ports[port_num].ibv_port_attr.state      = IBV_PORT_INIT;
-		sw->ports[port_num].ibv_port_attr.phys_state = PIB_PHYS_PORT_LINK_UP;
+		port->sockaddr  = malloc(socklen);
+		port->socklen   = socklen;
+		port->ibv_port_attr.state      = IBV_PORT_INIT;
+		port->ibv_port_attr.phys_state = PIB_PHYS_PORT_LINK_UP;
 
-		memcpy(sw->ports[port_num].sockaddr, sockaddr, socklen);
+		memcpy(port->sockaddr, sockaddr, socklen);
 
 		link->cmd = cpu_to_be32(PIB_LINK_CMD_CONNECT_ACK);
 
-		resend_ack(sw, size, port_num);
-		send_trap_ntc128(sw);
+		resend_ack(worker, port, buffer - sizeof(struct pib_packet_lrh), size);
+		send_trap_ntc128(worker, port->sw);
+
+		control->lid_map_dirty  = 1;
+		control->snapshot_dirty = 1;
 
-		pib_report_info("pibnetd: link up port[%u]: port_guid=0x%" PRIx64 ", sock-addr=%s",
-				port_num, port_guid, address);
+		pib_report_info("pibnetd: link up port[%u]: port_guid=0x%" PRIx64 ", sock-addr=%s, switch=%s",
+				port->port_num, port_guid, address, port->sw->name);
 		break;
 
 	case PIB_LINK_CMD_DISCONNECT:
-		port_num = detect_in_port(sw, port_guid);
+		port = detect_in_port(control, port_guid);
 
-		if (port_num == 0)
+		if (port == NULL)
 			break;
 
-		pib_report_info("pibnetd: link down port[%u]: port_guid=0x%" PRIx64 ", sock-addr=%s",
-				port_num, port_guid, address);
+		pib_report_info("pibnetd: link down port[%u]: port_guid=0x%" PRIx64 ", sock-addr=%s, switch=%s",
+				port->port_num, port_guid, address, port->sw->name);
+
+		link->cmd = cpu_to_be32(PIB_LINK_CMD_DISCONNECT_ACK);
+
+		resend_ack(worker, port, buffer - sizeof(struct pib_packet_lrh), size);
+		send_trap_ntc128(worker, port->sw);
+
+		remove_port_guid(control, port);
+		port->port_guid = 0;
+		free(port->sockaddr);
+		port->sockaddr  = NULL;
+		port->socklen   = 0;
+		port->ibv_port_attr.state      = IBV_PORT_DOWN;
+		port->ibv_port_attr.phys_state = PIB_PHYS_PORT_POLLING;
+
+		control->lid_map_dirty  = 1;
+		control->snapshot_dirty = 1;
+		break;
+
+	case PIB_LINK_SHUTDOWN:
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+static void resend_ack(struct pib_worker *worker, struct pib_port *port, void *packet, int size)
+{
+	queue_packet(worker, port, packet,
+		     sizeof(struct pib_packet_lrh) + size + sizeof(union pib_packet_footer), 0);
+	flush_send_queue(worker);
+}
+
+
+static uint64_t get_monotonic_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static uint64_t get_monotonic_msec(void)
+{
+	return get_monotonic_nsec() / 1000000;
+}
+
+
+/*
+ *  ユニキャストのデータパケットを pibnetd を経由せずにホスト同士で直接
+ *  送れるように、LID からホストのアドレスへの対応表を各ホストに配る。
+ *  ある LID をホストのつながったポートへ転送するスイッチがあれば、その LID は
+ *  そのホストのものとみなす。MAD・マルチキャスト・表に無い LID は今まで通り
+ *  pibnetd を経由する。
+ *
+ *  --direct が無い時は空の表を配り、前に配った表をホストに捨てさせる。
+ */
+static void publish_lid_map(struct pib_worker *worker)
+{
+	struct pib_control *control = worker->control;
+	uint64_t now;
+	int i, port_num, lid;
+
+	now = get_monotonic_msec();
+
+	if (now < control->lid_map_time + PIB_NETD_LID_MAP_INTERVAL)
+		return;
+
+	/* 複数のワーカーが同時に送らないようにフラグを落としたものが送る */
+	if (!__sync_bool_compare_and_swap(&control->lid_map_dirty, 1, 0))
+		return;
+
+	control->lid_map_time = now;
+
+	pthread_rwlock_rdlock(&control->lock);
+
+	memset(worker->lid_map, 0, PIB_MCAST_LID_BASE * sizeof(struct pib_port *));
+
+	for (i=0 ; control->direct_mode && (i<control->nr_switches) ; i++) {
+		struct pib_switch *sw = control->switches[i];
+
+		for (lid=1 ; lid<PIB_MCAST_LID_BASE ; lid++) {
+			struct pib_port *port;
+
+			port_num = sw->ucast_fwd_table[lid];
+
+			if ((port_num == 0) || (sw->port_cnt <= port_num))
+				continue;
+
+			port = &sw->ports[port_num];
+
+			if ((port->peer == NULL) && (port->sockaddr != NULL) && (worker->lid_map[lid] == NULL))
+				worker->lid_map[lid] = port;
+		}
+	}
+
+	for (i=0 ; i<control->nr_switches ; i++) {
+		struct pib_switch *sw = control->switches[i];
+
+		for (port_num = 1 ; port_num < sw->port_cnt ; port_num++)
+			if (sw->ports[port_num].sockaddr != NULL)
+				send_lid_map(worker, &sw->ports[port_num]);
+	}
+
+	pthread_rwlock_unlock(&control->lock);
+}
+
+
+static int is_loopback_sockaddr(const struct sockaddr *sockaddr)
+{
+	const struct sockaddr_in *sockaddr_in = (const struct sockaddr_in *)sockaddr;
+
+	return (ntohl(sockaddr_in->sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+}
+
+
+/*
+ *  表を first_lid 〜 last_lid ごとに 1 パケットに収まるだけ詰めて送る。
+ *  pibnetd と同じホストの HCA のアドレスが 127.0.0.1 として見えている場合、
+ *  それは他のホストからは届かないので、ループバックのホストにだけ教える。
+ */
+static void send_lid_map(struct pib_worker *worker, struct pib_port *port)
+{
+	int lid, max_entries, receiver_is_loopback;
+	struct pib_packet_lrh *lrh;
+	struct pib_packet_link *link;
+	struct pib_packet_lid_map *lid_map;
+	struct pib_packet_lid_map_entry *entries;
+	int nr_entries;
+
+	receiver_is_loopback = is_loopback_sockaddr(port->sockaddr);
+
+	max_entries = (PIB_PACKET_BUFFER - sizeof(*lrh) - sizeof(*link) - sizeof(*lid_map) -
+		       sizeof(union pib_packet_footer)) / sizeof(*entries);
+
+	lid = 1;
+
+	do {
+		size_t size;
+
+		lrh     = worker->buffer;
+		link    = (struct pib_packet_link *)(lrh + 1);
+		lid_map = (struct pib_packet_lid_map *)(link + 1);
+		entries = (struct pib_packet_lid_map_entry *)(lid_map + 1);
+
+		memset(lrh, 0, sizeof(*lrh));
+		lrh->dlid = cpu_to_be16(PIB_LID_PERMISSIVE);
+		lrh->slid = cpu_to_be16(PIB_LID_PERMISSIVE);
+
+		link->cmd = cpu_to_be32(PIB_LINK_CMD_LID_MAP);
+
+		lid_map->first_lid = cpu_to_be16(lid);
+		lid_map->reserved  = 0;
+
+		for (nr_entries = 0 ; (lid < PIB_MCAST_LID_BASE) && (nr_entries < max_entries) ; lid++) {
+			struct pib_port *dest = worker->lid_map[lid];
+			const struct sockaddr_in *sockaddr_in;
+
+			if (dest == NULL)
+				continue;
+
+			if (!receiver_is_loopback && is_loopback_sockaddr(dest->sockaddr))
+				continue;
+
+			sockaddr_in = (const struct sockaddr_in *)dest->sockaddr;
+
+			entries[nr_entries].lid       = cpu_to_be16(lid);
+			entries[nr_entries].udp_port  = sockaddr_in->sin_port;
+			entries[nr_entries].ipv4_addr = sockaddr_in->sin_addr.s_addr;
+			nr_entries++;
+		}
+
+		lid_map->last_lid   = cpu_to_be16(lid - 1);
+		lid_map->nr_entries = cpu_to_be16(nr_entries);
+
+		size = sizeof(*link) + sizeof(*lid_map) + nr_entries * sizeof(*entries);
+
+		pib_packet_lrh_set_pktlen(lrh, (sizeof(*lrh) + size) / 4);
+
+		queue_packet(worker, port, lrh,
+			     sizeof(*lrh) + size + sizeof(union pib_packet_footer), 0);
+		flush_send_queue(worker);
+
+	} while (lid < PIB_MCAST_LID_BASE);
+}
+
+
+static unsigned int hash_port_guid(uint64_t port_guid)
+{
+	/* Fibonacci hashing */
+	return (unsigned int)((port_guid * 0x9E3779B97F4A7C15ULL) >> (64 - PIB_PORT_GUID_HASH_BITS));
+}
+
+
+static struct pib_port *detect_in_port(struct pib_control *control, uint64_t port_guid)
+{
+	struct pib_port *port;
+
+	port = control->port_guid_hash[hash_port_guid(port_guid)];
+
+	while (port != NULL) {
+		if (port_guid == port->port_guid)
+			return port;
+		port = port->port_guid_next;
+	}
 
-		link->cmd = cpu_to_be32(PIB_LINK_CMD_DISCONNECT_ACK);
+	return NULL;
+}
 
-		resend_ack(sw, size, port_num);
-		send_trap_ntc128(sw);
 
-		sw->ports[port_num].port_guid = 0;
-		free(sw->ports[port_num].sockaddr);
-		sw->ports[port_num].sockaddr  = NULL;
-		sw->ports[port_num].socklen   = 0;
-		sw->ports[port_num].ibv_port_attr.state      = IBV_PORT_DOWN;
-		sw->ports[port_num].ibv_port_attr.phys_state = PIB_PHYS_PORT_POLLING;
-		break;
+/*
+ *  スイッチ間リンクにつながっていない空きポートを、スイッチの定義順に探す。
+ */
+static struct pib_port *find_empty_port(struct pib_control *control)
+{
+	int i, port_num;
 
-	case PIB_LINK_SHUTDOWN:
-		break;
+	for (i=0 ; i<control->nr_switches ; i++) {
+		struct pib_switch *sw = control->switches[i];
 
-	default:
-		break;
+		for (port_num = 1 ; port_num < sw->port_cnt ; port_num++)
+			if ((sw->ports[port_num].port_guid == 0) && (sw->ports[port_num].peer == NULL))
+				return &sw->ports[port_num];
 	}
+
+	return NULL;
 }
 
 
-static void resend_ack(struct pib_switch *sw, int size, uint8_t port_num)
+/* The caller must hold control->lock exclusively. */
+static void insert_port_guid(struct pib_control *control, struct pib_port *port)
 {
-	struct iovec iovec;
-	struct msghdr msghdr;
+	unsigned int hash = hash_port_guid(port->port_guid);
 
-	memset(&msghdr, 0, sizeof(msghdr));
-	memset(&iovec,  0, sizeof(iovec));
-
-	iovec.iov_base     = sw->control->buffer;
-	iovec.iov_len      = sizeof(struct pib_packet_lrh) + size + sizeof(union pib_packet_footer);
-				
-	msghdr.msg_name    = sw->ports[port_num].sockaddr;
-	msghdr.msg_namelen = sw->ports[port_num].socklen;
-	msghdr.msg_iov     = &iovec;
-	msghdr.msg_iovlen  = 1;
-
-	int ret;
-retry:
-	ret = sendmsg(sw->control->sockfd, &msghdr, 0);
-	if (ret < 0) {
-		int eno  = errno;
-		if (eno == EINTR) {
-			if (signal_flags)
-				return;
-			goto retry;
-		}
-		pib_report_err("pibnetd: sendmsg(errno=%d)", eno);
-		exit(EXIT_FAILURE);
-	}
+	port->port_guid_next = control->port_guid_hash[hash];
+	control->port_guid_hash[hash] = port;
 }
 
 
-static uint8_t detect_in_port(struct pib_switch *sw, uint64_t port_guid)
+static void remove_port_guid(struct pib_control *control, struct pib_port *port)
 {
-	uint8_t port_num;
+	struct pib_port **link_p;
 
-	for (port_num = 1 ; port_num < sw->port_cnt ; port_num++)
-		if (port_guid == sw->ports[port_num].port_guid)
-			return port_num;
+	link_p = &control->port_guid_hash[hash_port_guid(port->port_guid)];
 
-	return 0;
+	while (*link_p != NULL) {
+		if (*link_p == port) {
+			*link_p = port->port_guid_next;
+			port->port_guid_next = NULL;
+			return;
+		}
+		link_p = &(*link_p)->port_guid_next;
+	}
 }
 
 
@@ -631,13 +1676,11 @@ static uint8_t detect_in_port(struct pib_switch *sw, uint64_t port_guid)
  *  @retval  0  done to process itself
  *  @retval -1  need to relay through other port
  */
-static int process_mad_packet(struct pib_switch *sw, uint8_t in_port_num, struct pib_packet_lrh *lrh, struct pib_packet_bth *bth, void *buffer, int size)
+static int process_mad_packet(struct pib_worker *worker, struct pib_switch *sw, uint8_t in_port_num, struct pib_packet_lrh *lrh, struct pib_packet_bth *bth, void *buffer, int size)
 {
 	int ret;
 	uint16_t dlid;
 	uint8_t out_port_num = 0;
-	struct iovec iovec;
-	struct msghdr msghdr;
 	struct pib_packet_deth *deth;
 	struct pib_smp *smp;
 	struct pib_mad *mad;
@@ -741,7 +1784,13 @@ static int process_mad_packet(struct pib_switch *sw, uint8_t in_port_num, struct
 
 			smp->return_path[smp->hop_ptr] = in_port_num;
 			ret = pib_process_smp(smp, sw, in_port_num);
-			smp->hop_ptr--;
+			/*
+			 * 途中のスイッチは Returning SMP の hop_ptr を減らしてから
+			 * return_path を引くので、hop_ptr は戻りの 1 ホップ目に
+			 * ホストへ直接返すときだけ減らす。
+			 */
+			if (smp->hop_ptr == 1)
+				smp->hop_ptr--;
 			out_port_num = in_port_num;
 
 			lrh->dlid = lrh->slid;
@@ -775,142 +1824,542 @@ static int process_mad_packet(struct pib_switch *sw, uint8_t in_port_num, struct
 	}
 
 send_packet:
-	memset(&msghdr,   0, sizeof(msghdr));
+	/* 応答は受信バッファをそのまま書き換えて送り返す */
+	transmit_packet(worker, sw, out_port_num, lrh,
+		     pib_packet_lrh_get_pktlen(lrh) * 4 + sizeof(union pib_packet_footer), 1);
 
-	iovec.iov_base	   = sw->control->buffer;
-	iovec.iov_len	   = pib_packet_lrh_get_pktlen(lrh) * 4 + sizeof(union pib_packet_footer);
+	return 0;
 
-	msghdr.msg_name    = sw->ports[out_port_num].sockaddr;
-	msghdr.msg_namelen = sw->ports[out_port_num].socklen;
-	msghdr.msg_iov     = &iovec;
-	msghdr.msg_iovlen  = 1;
+silently_drop:
+	pib_report_debug("pibnetd: silently_drop");
+	worker->metrics->drops[PIB_DROP_BAD_MAD]++;
+	return 0;
+}
 
-	if (msghdr.msg_name == NULL)
-		return 0;
 
-retry:
-	ret = sendmsg(sw->control->sockfd, &msghdr, 0);
-	if (ret < 0) {
-		int eno = errno;
-		if (eno == EINTR) {
-			if (signal_flags)
-				return 0;
-			goto retry;
+static void relay_unicast_packet(struct pib_worker *worker, struct pib_switch *sw, uint8_t in_port_num, uint16_t dlid, void *packet, int size)
+{
+	uint8_t out_port_num;
+
+	out_port_num = sw->ucast_fwd_table[dlid];
+
+	if ((out_port_num == 0) || (sw->port_cnt <= out_port_num)) {
+		worker->metrics->drops[PIB_DROP_NO_LFT_ENTRY]++;
+		return;
+	}
+
+	transmit_packet(worker, sw, out_port_num, packet, size + sizeof(union pib_packet_footer), 1);
+}
+
+
+static void relay_multicast_packet(struct pib_worker *worker, struct pib_switch *sw, uint8_t in_port_num, uint16_t dlid, void *packet, int size)
+{
+	uint16_t *pm_blocks;
+	int i;
+
+	if (dlid < PIB_MCAST_LID_BASE)
+		return;
+
+	pm_blocks = pib_get_mcast_pm_blocks(sw, dlid);
+
+	/*
+	 * Replicate to each output port in according with the multicast
+	 * forwarding table.  Only the ports whose bits are set are visited.
+	 */
+	for (i=0 ; i<sw->pm_block_cnt ; i++) {
+		unsigned int pm_block = pm_blocks[i];
+
+		while (pm_block != 0) {
+			int out_port_num = i * 16 + __builtin_ctz(pm_block);
+
+			pm_block &= pm_block - 1;
+
+			/*
+			 * Don't send the packet to the arrival port even if its port
+			 * are participating in the multicast group.
+			 */
+			if ((out_port_num == 0) || (in_port_num == out_port_num) ||
+			    (sw->port_cnt <= out_port_num))
+				continue;
+
+			/* 全ての出力ポートが同じ受信バッファを参照する */
+			transmit_packet(worker, sw, out_port_num, packet, size + sizeof(union pib_packet_footer), 1);
 		}
-		pib_report_err("pibnetd: sendmsg(ret=%d)", eno);
-		exit(EXIT_FAILURE);
 	}
+}
+
+
+/*
+ *  sw の out_port_num からパケットを送り出す。length はフッタを含む。
+ */
+static void transmit_packet(struct pib_worker *worker, struct pib_switch *sw, uint8_t out_port_num, void *packet, size_t length, int count_perf)
+{
+	struct pib_port *port = &sw->ports[out_port_num];
+
+	if (port->peer)
+		deliver_to_peer(worker, port, packet, length, count_perf);
+	else
+		queue_packet(worker, port, packet, length, count_perf);
+}
+
+
+/*
+ *  スイッチ間リンクの先のスイッチに、ソケットを通さずにパケットを渡す。
+ *  パケットは受信バッファ上でそのまま処理される。
+ */
+static void deliver_to_peer(struct pib_worker *worker, struct pib_port *port, void *packet, size_t length, int count_perf)
+{
+	int size, header_size;
+	struct pib_port *peer = port->peer;
+	struct pib_packet_lrh *lrh = NULL;
+	struct pib_grh        *grh = NULL;
+	struct pib_packet_bth *bth = NULL;
+
+	if (PIB_NETD_MAX_HOPS <= worker->nr_hops) {
+		pib_report_debug("pibnetd: drop packet: too many hops at %s port[%u]",
+				 port->sw->name, port->port_num);
+		worker->metrics->drops[PIB_DROP_HOP_LIMIT]++;
+		return;
+	}
+
+	size = length - sizeof(union pib_packet_footer);
 
-	if (ret > 0) {
-		sw->ports[out_port_num].perf.xmit_packets++;
-		sw->ports[out_port_num].perf.xmit_data += ret;
+	header_size = parse_packet_header(packet, size, &lrh, &grh, &bth);
+	if (header_size < 0) {
+		worker->metrics->drops[PIB_DROP_BAD_HEADER]++;
+		return;
 	}
 
-	return 0;
+	if (count_perf) {
+		struct pib_port_traffic *traffic;
+		traffic = &worker->traffic[port->sw->port_base + port->port_num];
 
-silently_drop:
-	pib_report_debug("pibnetd: silently_drop");
-	return 0;
+		traffic->xmit_packets++;
+		traffic->xmit_data += length;
+	}
+
+	worker->nr_hops++;
+	switch_packet(worker, peer->sw, peer->port_num, packet, size, lrh, bth, header_size);
+	worker->nr_hops--;
 }
 
 
-static void relay_unicast_packet(struct pib_switch *sw, uint8_t in_port_num, uint16_t dlid, int size)
+/*
+ *  送信キューにパケットを積む。packet は flush_send_queue() を呼ぶまで
+ *  書き換えてはならない。
+ */
+static void queue_packet(struct pib_worker *worker, struct pib_port *port, void *packet, size_t length, int count_perf)
 {
-	int ret;
-	uint8_t out_port_num;
-	struct iovec iovec;
-	struct msghdr msghdr;
+	if (port->sockaddr == NULL) {
+		worker->metrics->drops[PIB_DROP_PORT_DOWN]++;
+		return;
+	}
 
-	out_port_num = sw->ucast_fwd_table[dlid];
+	/* リンクのエミュレーションを掛ける前に、スイッチから出た時点で記録する */
+	if (worker->control->capture)
+		pib_capture_packet(worker->control->capture, worker->id,
+				   port->sw->port_base + port->port_num,
+				   PIB_CAPTURE_OUTBOUND, packet, length - sizeof(union pib_packet_footer));
 
-	if ((out_port_num == 0) || (sw->port_cnt <= out_port_num))
+	/* pibnetd 自身が返すパケットにはリンクのエミュレーションを掛けない */
+	if (count_perf && port->shaping) {
+		shape_packet(worker, port, packet, length);
 		return;
+	}
+
+	queue_sendmsg(worker, port->sockaddr, port->socklen, packet, length,
+		      count_perf ? port->sw->port_base + port->port_num : -1);
+}
 
-	memset(&msghdr,   0, sizeof(msghdr));
 
-	iovec.iov_base	   = sw->control->buffer;
-	iovec.iov_len	   = size + sizeof(union pib_packet_footer);
+static void queue_sendmsg(struct pib_worker *worker, struct sockaddr *sockaddr, socklen_t socklen, void *packet, size_t length, int perf_index)
+{
+	int i;
+	struct pib_io_batch *batch = worker->batch;
+	struct msghdr *msghdr;
 
-	msghdr.msg_name    = sw->ports[out_port_num].sockaddr;
-	msghdr.msg_namelen = sw->ports[out_port_num].socklen;
-	msghdr.msg_iov     = &iovec;
-	msghdr.msg_iovlen  = 1;
+	if (batch->nr_send_msgs == PIB_NETD_SEND_BATCH)
+		flush_send_queue(worker);
 
-retry:
-	ret = sendmsg(sw->control->sockfd, &msghdr, 0);
-	if (ret < 0) {
-		int eno = errno;
-		if (eno == EINTR) {
-			if (signal_flags)
-				return;
-			goto retry;
+	i = batch->nr_send_msgs++;
+
+	batch->send_iovecs[i].iov_base = packet;
+	batch->send_iovecs[i].iov_len  = length;
+
+	msghdr = &batch->send_msgs[i].msg_hdr;
+
+	memset(msghdr, 0, sizeof(*msghdr));
+
+	msghdr->msg_name    = sockaddr;
+	msghdr->msg_namelen = socklen;
+	msghdr->msg_iov     = &batch->send_iovecs[i];
+	msghdr->msg_iovlen  = 1;
+
+	batch->send_perf_index[i] = perf_index;
+}
+
+
+/*
+ *  ホストへ送り出すパケットにリンクの損失・重複・帯域・遅延・順序入れ替えを
+ *  掛ける。すぐに送れないパケットはコピーしてタイミングホイールに入れる。
+ */
+static void shape_packet(struct pib_worker *worker, struct pib_port *port, void *packet, size_t length)
+{
+	int i, nr_copies = 1;
+	int perf_index = port->sw->port_base + port->port_num;
+	struct pib_link_shaping *shaping = port->shaping;
+	struct pib_port_traffic *traffic = &worker->traffic[perf_index];
+	uint64_t now;
+
+	if ((shaping->loss > 0) && (random_ppm(worker) < shaping->loss)) {
+		traffic->xmit_discards++;
+		return;
+	}
+
+	if ((shaping->duplicate > 0) && (random_ppm(worker) < shaping->duplicate))
+		nr_copies = 2;
+
+	now = get_monotonic_nsec();
+
+	for (i=0 ; i<nr_copies ; i++) {
+		uint64_t time = now;
+
+		if (shaping->rate > 0) {
+			if (reserve_bandwidth(port, length, now, &time) < 0) {
+				traffic->xmit_discards++;
+				continue;
+			}
+			traffic->xmit_wait += (time - now) / 1000;
 		}
-		pib_report_err("pibnetd: sendmsg(ret=%d)", eno);
-		exit(EXIT_FAILURE);
+
+		time += (uint64_t)shaping->delay * 1000;
+
+		if ((shaping->reorder > 0) && (random_ppm(worker) < shaping->reorder))
+			time += (uint64_t)shaping->reorder_delay * 1000;
+
+		if (time == now)
+			queue_sendmsg(worker, port->sockaddr, port->socklen, packet, length, perf_index);
+		else
+			delay_packet(worker, port, packet, length, perf_index, time);
 	}
+}
+
+
+/*
+ *  トークンバケットを仮想時計で表す。port->shaping_clock はそれまでに積んだ
+ *  パケットを rate で送り終える時刻で、now より burst 分以上は遅らせない。
+ *  ワーカー間で共有するので CAS で進める。
+ *  送出時刻を *time_p に返し、キューが queue_limit を超えるなら -1 を返す。
+ */
+static int reserve_bandwidth(struct pib_port *port, size_t length, uint64_t now, uint64_t *time_p)
+{
+	struct pib_link_shaping *shaping = port->shaping;
+	uint64_t old, start, end, cost, burst, limit;
+
+	cost  = (uint64_t)length	       * 1000000000 / shaping->rate;
+	burst = (uint64_t)shaping->burst       * 1000000000 / shaping->rate;
+	limit = (uint64_t)shaping->queue_limit * 1000000000 / shaping->rate;
+
+	do {
+		old   = port->shaping_clock;
+		start = (old + burst < now) ? now - burst : old;
+		end   = start + cost;
+
+		if (now + limit < end)
+			return -1;
+	} while (!__sync_bool_compare_and_swap(&port->shaping_clock, old, end));
+
+	*time_p = (now < end) ? end : now;
+
+	return 0;
+}
+
+
+static void delay_packet(struct pib_worker *worker, struct pib_port *port, void *packet, size_t length, int perf_index, uint64_t time)
+{
+	struct pib_delayed_packet *delayed;
+
+	assert(port->socklen <= sizeof(delayed->sockaddr));
+
+	delayed = malloc(sizeof(*delayed) + length);
+	assert(delayed);
+
+	delayed->time	    = time;
+	delayed->socklen    = port->socklen;
+	delayed->perf_index = perf_index;
+	delayed->length	    = length;
+
+	memcpy(&delayed->sockaddr, port->sockaddr, port->socklen);
+	memcpy(delayed->data, packet, length);
+
+	pib_wheel_insert(worker->wheel, delayed);
+}
+
+
+/*
+ *  送出時刻が来たパケットを送り、次のスロットの時刻に timerfd を合わせる。
+ */
+static void run_timing_wheel(struct pib_worker *worker)
+{
+	struct pib_control *control = worker->control;
+	struct pib_delayed_packet *packet, *next;
+	struct itimerspec its;
+	uint64_t time;
+
+	if (worker->wheel->nr_packets == 0)
+		return;
+
+	packet = pib_wheel_expire(worker->wheel, get_monotonic_nsec());
+
+	if (packet) {
+		struct pib_delayed_packet *list = packet;
+
+		pthread_rwlock_rdlock(&control->lock);
 
-	if (ret > 0) {
-		sw->ports[out_port_num].perf.xmit_packets++;
-		sw->ports[out_port_num].perf.xmit_data += ret;
+		for ( ; packet ; packet = packet->next)
+			queue_sendmsg(worker, (struct sockaddr *)&packet->sockaddr, packet->socklen,
+				      packet->data, packet->length, packet->perf_index);
+
+		flush_send_queue(worker);
+
+		pthread_rwlock_unlock(&control->lock);
+
+		for (packet = list ; packet ; packet = next) {
+			next = packet->next;
+			free(packet);
+		}
 	}
+
+	if (!pib_wheel_next_time(worker->wheel, &time))
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = time / 1000000000;
+	its.it_value.tv_nsec = time % 1000000000;
+
+	timerfd_settime(worker->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
 }
 
 
-static void relay_multicast_packet(struct pib_switch *sw, uint8_t in_port_num, uint16_t dlid, int size)
+/*
+ *  SIGUSR1 でシェーピングファイルを読み直す。読み込みに失敗したら今の設定を残す。
+ */
+static void reload_link_shaping(struct pib_worker *worker)
 {
-	uint8_t out_port_num;
+	struct pib_control *control = worker->control;
 
-	/*
-	 * Replicate to each output port in according with the multicast
-	 * forwarding table.
-	 */
-	for (out_port_num = 1 ; out_port_num < sw->port_cnt ; out_port_num++) {
-		uint16_t pm_block;
-
-		/*
-		 * Don't send the packet to the arrival port even if its port
-		 * are participating in the multicast group.
-		 */
-		if (in_port_num == out_port_num)
-			continue;
+	reload_requested = 0;
+
+	if (control->shaping_file == NULL) {
+		pib_report_info("pibnetd: SIGUSR1 is ignored without --shaping");
+		return;
+	}
 
-		pm_block = sw->mcast_fwd_table[dlid - PIB_MCAST_LID_BASE].pm_blocks[out_port_num / 16];
+	pthread_rwlock_wrlock(&control->lock);
+	pib_load_link_shaping(control, control->shaping_file);
+	pthread_rwlock_unlock(&control->lock);
+}
 
-		if ((pm_block & (1U << (out_port_num % 16))) == 0)
-			continue;
 
-		int ret;
-		struct iovec iovec;
-		struct msghdr msghdr;
+/* xorshift64* */
+static uint32_t random_ppm(struct pib_worker *worker)
+{
+	uint64_t x = worker->random_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
 
-		memset(&msghdr,   0, sizeof(msghdr));
+	worker->random_state = x;
 
-		iovec.iov_base	   = sw->control->buffer;
-		iovec.iov_len	   = size + sizeof(union pib_packet_footer);
+	return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32) % 1000000;
+}
 
-		msghdr.msg_name    = sw->ports[out_port_num].sockaddr;
-		msghdr.msg_namelen = sw->ports[out_port_num].socklen;
-		msghdr.msg_iov     = &iovec;
-		msghdr.msg_iovlen  = 1;
 
-	retry:
-		ret = sendmsg(sw->control->sockfd, &msghdr, 0);
+static void flush_send_queue(struct pib_worker *worker)
+{
+	int i, ret, sent = 0;
+	struct pib_io_batch *batch = worker->batch;
+
+	if (worker->uring) {
+		flush_send_queue_to_uring(worker);
+		return;
+	}
+
+	while (sent < batch->nr_send_msgs) {
+		ret = sendmmsg(worker->sockfd, batch->send_msgs + sent, batch->nr_send_msgs - sent, 0);
 		if (ret < 0) {
 			int eno = errno;
 			if (eno == EINTR) {
 				if (signal_flags)
-					return;
-				goto retry;
+					break;
+				continue;
 			}
-			pib_report_err("pibnetd: sendmsg(ret=%d)", eno);
+			pib_report_err("pibnetd: sendmmsg(ret=%d)", eno);
 			exit(EXIT_FAILURE);
 		}
 
-		if (ret > 0) {
-			sw->ports[out_port_num].perf.xmit_packets++;
-			sw->ports[out_port_num].perf.xmit_data += ret;
+		for (i = sent ; i < sent + ret ; i++) {
+			int index = batch->send_perf_index[i];
+
+			if ((index < 0) || (batch->send_msgs[i].msg_len == 0))
+				continue;
+
+			worker->traffic[index].xmit_packets++;
+			worker->traffic[index].xmit_data += batch->send_msgs[i].msg_len;
+		}
+
+		batch->nr_send_calls++;
+		batch->nr_send_packets += ret;
+
+		worker->metrics->send_batch[get_histogram_bucket(ret, PIB_NETD_METRICS_BATCH_BUCKETS)]++;
+
+		sent += ret;
+	}
+
+	batch->nr_send_msgs = 0;
+}
+
+
+/*
+ *  io_uring の場合は sendmsg 要求を積むだけで、投入は次の io_uring_enter で行う。
+ *  xmit のカウンタは完了時に数える。
+ */
+static void flush_send_queue_to_uring(struct pib_worker *worker)
+{
+	int i;
+	struct pib_io_batch *batch = worker->batch;
+
+	for (i = 0 ; i < batch->nr_send_msgs ; i++) {
+		struct msghdr *msghdr = &batch->send_msgs[i].msg_hdr;
+		int index = batch->send_perf_index[i];
+		ssize_t ret;
+
+		if (pib_uring_sendmsg(worker->uring, msghdr, index) == 0)
+			continue;
+
+		/* 送信中の要求が多すぎる時はその場で送る */
+		ret = sendmsg(worker->sockfd, msghdr, 0);
+		if ((ret > 0) && (index >= 0)) {
+			worker->traffic[index].xmit_packets++;
+			worker->traffic[index].xmit_data += ret;
 		}
 	}
+
+	if (batch->nr_send_msgs > 0)
+		worker->metrics->send_batch[get_histogram_bucket(batch->nr_send_msgs, PIB_NETD_METRICS_BATCH_BUCKETS)]++;
+
+	batch->nr_send_packets += batch->nr_send_msgs;
+	batch->nr_send_msgs = 0;
+}
+
+
+static void report_batch_stats(struct pib_worker *worker)
+{
+	struct pib_io_batch *batch = worker->batch;
+
+	if (worker->uring) {
+		pib_report_info("pibnetd: worker[%d]: io_uring_enter %" PRIu64 " calls (%.1f packets received, %.1f packets sent per call)",
+				worker->id,
+				batch->nr_recv_calls,
+				batch->nr_recv_calls ? (double)batch->nr_recv_packets / batch->nr_recv_calls : 0.0,
+				batch->nr_recv_calls ? (double)batch->nr_send_packets / batch->nr_recv_calls : 0.0);
+		return;
+	}
+
+	pib_report_info("pibnetd: worker[%d]: recvmmsg %" PRIu64 " calls (%.1f packets/call), sendmmsg %" PRIu64 " calls (%.1f packets/call)",
+			worker->id,
+			batch->nr_recv_calls,
+			batch->nr_recv_calls ? (double)batch->nr_recv_packets / batch->nr_recv_calls : 0.0,
+			batch->nr_send_calls,
+			batch->nr_send_calls ? (double)batch->nr_send_packets / batch->nr_send_calls : 0.0);
+}
+
+
+/*
+ *  受信から送信キューを送り出すまでの時間を、その間に処理したパケットの数だけ数える。
+ *  io_uring の場合は sendmsg 要求を積むまでの時間になる。
+ */
+static void record_latency(struct pib_worker *worker, uint64_t start, int nr_packets)
+{
+	uint64_t elapsed = get_monotonic_nsec() - start;
+
+	worker->metrics->latency[get_histogram_bucket(elapsed / 1000, PIB_NETD_METRICS_LATENCY_BUCKETS)] += nr_packets;
+	worker->metrics->latency_sum += elapsed * nr_packets;
+}
+
+
+/*
+ *  value 以上の最小の 2 のべき乗のバケットを返す。nr_buckets 番目は溢れた値を数える。
+ */
+static int get_histogram_bucket(uint64_t value, int nr_buckets)
+{
+	int bucket;
+
+	if (value <= 1)
+		return 0;
+
+	bucket = 64 - __builtin_clzll(value - 1);
+
+	return (bucket < nr_buckets) ? bucket : nr_buckets;
+}
+
+
+/*
+ *  Fold the per-worker traffic counters of the port into pib_port_perf.
+ *  The caller must hold control->lock exclusively, as PMA MADs are processed.
+ */
+void pib_merge_port_traffic(struct pib_switch *sw, uint8_t port_num)
+{
+	int i;
+	struct pib_port_perf *perf = &sw->ports[port_num].perf;
+	struct pib_port_traffic *merged = &sw->ports[port_num].merged;
+
+	for (i=0 ; i<sw->control->nr_workers ; i++) {
+		struct pib_port_traffic *traffic;
+		traffic = &sw->control->workers[i].traffic[sw->port_base + port_num];
+
+		perf->xmit_data    += traffic->xmit_data;
+		perf->rcv_data     += traffic->rcv_data;
+		perf->xmit_packets += traffic->xmit_packets;
+		perf->rcv_packets  += traffic->rcv_packets;
+		perf->xmit_discards += traffic->xmit_discards;
+		perf->xmit_wait     += traffic->xmit_wait;
+
+		merged->xmit_data     += traffic->xmit_data;
+		merged->rcv_data      += traffic->rcv_data;
+		merged->xmit_packets  += traffic->xmit_packets;
+		merged->rcv_packets   += traffic->rcv_packets;
+		merged->xmit_discards += traffic->xmit_discards;
+		merged->xmit_wait     += traffic->xmit_wait;
+
+		memset(traffic, 0, sizeof(*traffic));
+	}
+}
+
+
+/*
+ *  Sum up the traffic of the port since pibnetd started, which PMA MADs
+ *  never clear. The caller must hold control->lock at least shared, and
+ *  the counters of workers being updated may be slightly behind.
+ */
+void pib_sum_port_traffic(struct pib_switch *sw, uint8_t port_num, struct pib_port_traffic *sum)
+{
+	int i;
+
+	*sum = sw->ports[port_num].merged;
+
+	for (i=0 ; i<sw->control->nr_workers ; i++) {
+		const struct pib_port_traffic *traffic;
+		traffic = &sw->control->workers[i].traffic[sw->port_base + port_num];
+
+		sum->xmit_data     += traffic->xmit_data;
+		sum->rcv_data      += traffic->rcv_data;
+		sum->xmit_packets  += traffic->xmit_packets;
+		sum->rcv_packets   += traffic->rcv_packets;
+		sum->xmit_discards += traffic->xmit_discards;
+		sum->xmit_wait     += traffic->xmit_wait;
+	}
 }
 
 
@@ -986,7 +2435,7 @@ skip_grh:
  *
  * IBA Spec. Vol.1 14.3.6 Port State Change
  */
-static void send_trap_ntc128(struct pib_switch *sw)
+static void send_trap_ntc128(struct pib_worker *worker, struct pib_switch *sw)
 {
 	uint16_t slid, dlid;
 
@@ -1006,7 +2455,7 @@ static void send_trap_ntc128(struct pib_switch *sw)
 		struct pib_packet_bth  bth;
 		struct pib_packet_deth deth;
 		struct pib_smp         smp;
-	} *packet = sw->control->buffer;
+	} *packet = worker->buffer;
 
 	memset(packet, 0, sizeof(*packet));
 
@@ -1039,36 +2488,10 @@ static void send_trap_ntc128(struct pib_switch *sw)
 	trap->issuerlid = cpu_to_be16(slid);
 	trap->details.ntc_128.lidaddr = cpu_to_be16(slid);
 
-	struct iovec iovec;
-	struct msghdr msghdr;
-
-	memset(&msghdr, 0, sizeof(msghdr));
-	memset(&iovec,  0, sizeof(iovec));
-
-	iovec.iov_base     = sw->control->buffer;
-	iovec.iov_len      = sizeof(*packet) + sizeof(union pib_packet_footer);
-				
-	msghdr.msg_name    = sw->ports[out_port_num].sockaddr;
-	msghdr.msg_namelen = sw->ports[out_port_num].socklen;
-	msghdr.msg_iov     = &iovec;
-	msghdr.msg_iovlen  = 1;
-
-	if (msghdr.msg_name == NULL)
-		return;
-
-	int ret;
-retry:
-	ret = sendmsg(sw->control->sockfd, &msghdr, 0);
-	if (ret < 0) {
-		int eno  = errno;
-		if (eno == EINTR) {
-			if (signal_flags)
-				return;
-			goto retry;
-		}
-		pib_report_err("pibnetd: sendmsg(errno=%d)", eno);
-		exit(EXIT_FAILURE);
-	}
+	/* worker->buffer は次のパケットの生成で上書きされるので、すぐに送信する */
+	transmit_packet(worker, sw, out_port_num, worker->buffer,
+		     sizeof(*packet) + sizeof(union pib_packet_footer), 0);
+	flush_send_queue(worker);
 }
 
 
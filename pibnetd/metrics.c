@@ -0,0 +1,647 @@
+/*
+ * metrics.c - Counters served on a UNIX socket in Prometheus text or JSON format
+ *
+ * Copyright (c) 2014 Minoru NAKAMURA <nminoru@nminoru.jp>
+ *
+ * This code is licenced under the GPL version 2 or BSD license.
+ */
+#define _GNU_SOURCE /* for accept4 and open_memstream */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "pibnetd.h"
+
+/*
+ *  専用のスレッドが UNIX ドメインソケットで接続を受け、1 回の接続ごとに
+ *  その時点のカウンタを書き出して切断する。
+ *
+ *    GET /metrics       HTTP で Prometheus のテキスト形式
+ *    GET /metrics.json  HTTP で JSON
+ *    json               HTTP でなく JSON だけ
+ *    それ以外           HTTP でなく Prometheus のテキスト形式だけ
+ *
+ *  ポートのカウンタを読む間は control->lock を共有ロックで持つ。
+ *  ワーカーごとのカウンタはロックを取らずに読む。
+ */
+
+#define REQUEST_TIMEOUT		(100)  /* msec to wait for a request */
+#define RESPONSE_TIMEOUT	(1000) /* msec to wait for the client to read */
+
+enum {
+	FORMAT_PROMETHEUS,
+	FORMAT_JSON,
+	FORMAT_NOT_FOUND
+};
+
+
+struct pib_metrics {
+	struct pib_control     *control;
+	char		       *path;
+	int			sockfd;
+	pthread_t		thread;
+};
+
+
+static const char *drop_reasons[PIB_NR_DROP_REASONS] = {
+	[PIB_DROP_BAD_FOOTER]	  = "bad_footer",
+	[PIB_DROP_BAD_HEADER]	  = "bad_header",
+	[PIB_DROP_UNKNOWN_GUID]	  = "unknown_guid",
+	[PIB_DROP_BAD_QPN]	  = "bad_qpn",
+	[PIB_DROP_BAD_MAD]	  = "bad_mad",
+	[PIB_DROP_NO_LFT_ENTRY]	  = "no_lft_entry",
+	[PIB_DROP_NOT_FOR_SWITCH] = "not_for_switch",
+	[PIB_DROP_PORT_DOWN]	  = "port_down",
+	[PIB_DROP_HOP_LIMIT]	  = "hop_limit",
+};
+
+
+static void *metrics_thread(void *arg);
+static void serve_client(struct pib_metrics *metrics, int fd);
+static int read_request(int fd, int *is_http_p);
+static void sum_worker_metrics(struct pib_control *control, struct pib_worker_metrics *sum);
+static void write_prometheus(FILE *fp, struct pib_control *control);
+static void write_prometheus_histogram(FILE *fp, const char *name, const char *help, const uint64_t *buckets, int nr_buckets, double sum);
+static void write_json(FILE *fp, struct pib_control *control);
+static void write_json_histogram(FILE *fp, const char *name, const uint64_t *buckets, int nr_buckets, double sum);
+static void write_escaped(FILE *fp, const char *str);
+static int write_all(int fd, const char *buffer, size_t size);
+
+
+struct pib_metrics *pib_metrics_open(struct pib_control *control, const char *path)
+{
+	int i, ret;
+	struct pib_metrics *metrics;
+	struct sockaddr_un sockaddr;
+
+	if (sizeof(sockaddr.sun_path) <= strlen(path)) {
+		pib_report_err("pibnetd: too long path of the metrics socket: %s", path);
+		return NULL;
+	}
+
+	metrics = calloc(1, sizeof(*metrics));
+	assert(metrics);
+
+	metrics->control = control;
+
+	/* daemon() で chdir しても後で unlink できるように絶対パスにしておく */
+	if (path[0] == '/')
+		metrics->path = strdup(path);
+	else {
+		char *cwd = get_current_dir_name();
+		assert(cwd);
+		if (asprintf(&metrics->path, "%s/%s", cwd, path) < 0)
+			metrics->path = NULL;
+		free(cwd);
+	}
+	assert(metrics->path);
+
+	metrics->sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (metrics->sockfd < 0) {
+		int eno = errno;
+		pib_report_err("pibnetd: socket(AF_UNIX, errno=%d)", eno);
+		goto error;
+	}
+
+	memset(&sockaddr, 0, sizeof(sockaddr));
+	sockaddr.sun_family = AF_UNIX;
+	strncpy(sockaddr.sun_path, path, sizeof(sockaddr.sun_path) - 1);
+
+	/* 前に動いていた pibnetd が残したソケットを消す */
+	unlink(path);
+
+	ret = bind(metrics->sockfd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+	if (ret != 0) {
+		int eno = errno;
+		pib_report_err("pibnetd: bind(%s, errno=%d)", path, eno);
+		goto error_close;
+	}
+
+	ret = listen(metrics->sockfd, 16);
+	if (ret != 0) {
+		int eno = errno;
+		pib_report_err("pibnetd: listen(%s, errno=%d)", path, eno);
+		goto error_close;
+	}
+
+	for (i=0 ; i<control->nr_workers ; i++) {
+		control->worker_metrics[i].lids = calloc(PIB_MAX_LID, sizeof(struct pib_lid_traffic));
+		assert(control->worker_metrics[i].lids);
+	}
+
+	return metrics;
+
+error_close:
+	close(metrics->sockfd);
+error:
+	free(metrics->path);
+	free(metrics);
+
+	return NULL;
+}
+
+
+/*
+ *  シグナルを止めたスレッドから呼ぶこと。
+ */
+void pib_metrics_start(struct pib_metrics *metrics)
+{
+	int ret;
+
+	ret = pthread_create(&metrics->thread, NULL, metrics_thread, metrics);
+	if (ret != 0) {
+		pib_report_err("pibnetd: pthread_create(ret=%d)", ret);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ *  stopfd に書き込んだ後に呼ぶ。
+ */
+void pib_metrics_close(struct pib_metrics *metrics)
+{
+	pthread_join(metrics->thread, NULL);
+
+	close(metrics->sockfd);
+	unlink(metrics->path);
+
+	free(metrics->path);
+	free(metrics);
+}
+
+
+static void *metrics_thread(void *arg)
+{
+	struct pib_metrics *metrics = arg;
+
+	for (;;) {
+		int ret, fd;
+		struct pollfd fds[2] = {
+			{ .fd = metrics->sockfd,	  .events = POLLIN },
+			{ .fd = metrics->control->stopfd, .events = POLLIN },
+		};
+
+		ret = poll(fds, ARRAY_SIZE(fds), -1);
+		if (ret < 0) {
+			int eno = errno;
+			if (eno == EINTR)
+				continue;
+			pib_report_err("pibnetd: poll(errno=%d)", eno);
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		if (!fds[0].revents)
+			continue;
+
+		fd = accept4(metrics->sockfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			int eno = errno;
+			pib_report_debug("pibnetd: accept4(errno=%d)", eno);
+			continue;
+		}
+
+		serve_client(metrics, fd);
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+
+static void serve_client(struct pib_metrics *metrics, int fd)
+{
+	int format, is_http;
+	FILE *fp;
+	char *body = NULL;
+	size_t size = 0;
+	struct timeval tv;
+
+	tv.tv_sec  = REQUEST_TIMEOUT / 1000;
+	tv.tv_usec = (REQUEST_TIMEOUT % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	tv.tv_sec  = RESPONSE_TIMEOUT / 1000;
+	tv.tv_usec = (RESPONSE_TIMEOUT % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	format = read_request(fd, &is_http);
+
+	fp = open_memstream(&body, &size);
+	assert(fp);
+
+	switch (format) {
+
+	case FORMAT_PROMETHEUS:
+		pthread_rwlock_rdlock(&metrics->control->lock);
+		write_prometheus(fp, metrics->control);
+		pthread_rwlock_unlock(&metrics->control->lock);
+		break;
+
+	case FORMAT_JSON:
+		pthread_rwlock_rdlock(&metrics->control->lock);
+		write_json(fp, metrics->control);
+		pthread_rwlock_unlock(&metrics->control->lock);
+		break;
+
+	default:
+		fputs("not found\n", fp);
+		break;
+	}
+
+	fclose(fp);
+
+	if (is_http) {
+		char header[256];
+		int length;
+
+		length = snprintf(header, sizeof(header),
+				  "HTTP/1.0 %s\r\n"
+				  "Content-Type: %s\r\n"
+				  "Content-Length: %zu\r\n"
+				  "Connection: close\r\n"
+				  "\r\n",
+				  (format == FORMAT_NOT_FOUND) ? "404 Not Found" : "200 OK",
+				  (format == FORMAT_JSON) ? "application/json" : "text/plain; version=0.0.4",
+				  size);
+
+		if (write_all(fd, header, length) < 0)
+			goto done;
+	}
+
+	write_all(fd, body, size);
+
+done:
+	free(body);
+}
+
+
+/*
+ *  最初の 1 行だけを見る。何も送ってこないクライアントには Prometheus 形式で返す。
+ */
+static int read_request(int fd, int *is_http_p)
+{
+	char request[1024], *p;
+	size_t length = 0;
+
+	*is_http_p = 0;
+
+	while (length < sizeof(request) - 1) {
+		ssize_t ret;
+
+		ret = read(fd, request + length, sizeof(request) - 1 - length);
+		if (ret <= 0)
+			break;
+
+		length += ret;
+		request[length] = '\0';
+
+		if (strchr(request, '\n'))
+			break;
+	}
+
+	request[length] = '\0';
+
+	if ((p = strpbrk(request, "\r\n")) != NULL)
+		*p = '\0';
+
+	if (strncmp(request, "GET ", 4) == 0) {
+		char *path = request + 4;
+
+		*is_http_p = 1;
+
+		if ((p = strchr(path, ' ')) != NULL)
+			*p = '\0';
+		if ((p = strchr(path, '?')) != NULL)
+			*p = '\0';
+
+		if ((strcmp(path, "/") == 0) || (strcmp(path, "/metrics") == 0))
+			return FORMAT_PROMETHEUS;
+		if (strcmp(path, "/metrics.json") == 0)
+			return FORMAT_JSON;
+
+		return FORMAT_NOT_FOUND;
+	}
+
+	if (strcmp(request, "json") == 0)
+		return FORMAT_JSON;
+
+	return FORMAT_PROMETHEUS;
+}
+
+
+static void sum_worker_metrics(struct pib_control *control, struct pib_worker_metrics *sum)
+{
+	int i, j;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (i=0 ; i<control->nr_workers ; i++) {
+		const struct pib_worker_metrics *metrics = &control->worker_metrics[i];
+
+		for (j=0 ; j<PIB_NR_DROP_REASONS ; j++)
+			sum->drops[j] += metrics->drops[j];
+
+		for (j=0 ; j<=PIB_NETD_METRICS_LATENCY_BUCKETS ; j++)
+			sum->latency[j] += metrics->latency[j];
+
+		for (j=0 ; j<=PIB_NETD_METRICS_BATCH_BUCKETS ; j++) {
+			sum->recv_batch[j] += metrics->recv_batch[j];
+			sum->send_batch[j] += metrics->send_batch[j];
+		}
+
+		sum->latency_sum += metrics->latency_sum;
+	}
+}
+
+
+static void write_prometheus(FILE *fp, struct pib_control *control)
+{
+	static const struct {
+		const char *name;
+		const char *help;
+		size_t	    offset;
+	} port_counters[] = {
+		{ "pibnetd_port_receive_packets_total",  "Packets received from the port",
+		  offsetof(struct pib_port_traffic, rcv_packets) },
+		{ "pibnetd_port_receive_bytes_total",    "Bytes received from the port",
+		  offsetof(struct pib_port_traffic, rcv_data) },
+		{ "pibnetd_port_transmit_packets_total", "Packets transmitted to the port",
+		  offsetof(struct pib_port_traffic, xmit_packets) },
+		{ "pibnetd_port_transmit_bytes_total",   "Bytes transmitted to the port",
+		  offsetof(struct pib_port_traffic, xmit_data) },
+		{ "pibnetd_port_transmit_discards_total", "Packets dropped by link emulation",
+		  offsetof(struct pib_port_traffic, xmit_discards) },
+		{ "pibnetd_port_transmit_wait_microseconds_total", "Time packets waited for the rate limit",
+		  offsetof(struct pib_port_traffic, xmit_wait) },
+	};
+
+	int i, j, lid, sw_index, port_num;
+	struct pib_worker_metrics sum;
+	struct pib_port_traffic *traffic;
+
+	traffic = calloc(control->nr_ports, sizeof(*traffic));
+	assert(traffic);
+
+	for (sw_index=0 ; sw_index<control->nr_switches ; sw_index++) {
+		struct pib_switch *sw = control->switches[sw_index];
+
+		for (port_num=1 ; port_num<sw->port_cnt ; port_num++)
+			pib_sum_port_traffic(sw, port_num, &traffic[sw->port_base + port_num]);
+	}
+
+	for (i=0 ; i<ARRAY_SIZE(port_counters) ; i++) {
+		fprintf(fp, "# HELP %s %s\n", port_counters[i].name, port_counters[i].help);
+		fprintf(fp, "# TYPE %s counter\n", port_counters[i].name);
+
+		for (sw_index=0 ; sw_index<control->nr_switches ; sw_index++) {
+			struct pib_switch *sw = control->switches[sw_index];
+
+			for (port_num=1 ; port_num<sw->port_cnt ; port_num++) {
+				void *base = &traffic[sw->port_base + port_num];
+
+				fprintf(fp, "%s{switch=\"", port_counters[i].name);
+				write_escaped(fp, sw->name);
+				fprintf(fp, "\",port=\"%u\"} %" PRIu64 "\n",
+					port_num, *(uint64_t *)(base + port_counters[i].offset));
+			}
+		}
+	}
+
+	free(traffic);
+
+	fprintf(fp, "# HELP pibnetd_port_state PortState of the port (1: Down, 2: Init, 3: Armed, 4: Active)\n");
+	fprintf(fp, "# TYPE pibnetd_port_state gauge\n");
+
+	for (sw_index=0 ; sw_index<control->nr_switches ; sw_index++) {
+		struct pib_switch *sw = control->switches[sw_index];
+
+		for (port_num=1 ; port_num<sw->port_cnt ; port_num++) {
+			struct pib_port *port = &sw->ports[port_num];
+
+			fprintf(fp, "pibnetd_port_state{switch=\"");
+			write_escaped(fp, sw->name);
+			fprintf(fp, "\",port=\"%u\",port_guid=\"0x%016" PRIx64 "\"} %u\n",
+				port_num, port->port_guid, port->ibv_port_attr.state);
+		}
+	}
+
+	sum_worker_metrics(control, &sum);
+
+	fprintf(fp, "# HELP pibnetd_drops_total Packets dropped by the switch\n");
+	fprintf(fp, "# TYPE pibnetd_drops_total counter\n");
+
+	for (i=0 ; i<PIB_NR_DROP_REASONS ; i++)
+		fprintf(fp, "pibnetd_drops_total{reason=\"%s\"} %" PRIu64 "\n", drop_reasons[i], sum.drops[i]);
+
+	fprintf(fp, "# HELP pibnetd_lid_receive_packets_total Packets received from hosts by DLID\n");
+	fprintf(fp, "# TYPE pibnetd_lid_receive_packets_total counter\n");
+
+	for (lid=0 ; lid<PIB_MAX_LID ; lid++) {
+		uint64_t packets = 0;
+
+		for (j=0 ; j<control->nr_workers ; j++)
+			packets += control->worker_metrics[j].lids[lid].packets;
+
+		if (packets > 0)
+			fprintf(fp, "pibnetd_lid_receive_packets_total{lid=\"%u\"} %" PRIu64 "\n", lid, packets);
+	}
+
+	fprintf(fp, "# HELP pibnetd_lid_receive_bytes_total Bytes received from hosts by DLID\n");
+	fprintf(fp, "# TYPE pibnetd_lid_receive_bytes_total counter\n");
+
+	for (lid=0 ; lid<PIB_MAX_LID ; lid++) {
+		uint64_t data = 0;
+
+		for (j=0 ; j<control->nr_workers ; j++)
+			data += control->worker_metrics[j].lids[lid].data;
+
+		if (data > 0)
+			fprintf(fp, "pibnetd_lid_receive_bytes_total{lid=\"%u\"} %" PRIu64 "\n", lid, data);
+	}
+
+	write_prometheus_histogram(fp, "pibnetd_relay_latency_microseconds",
+				   "Time from receiving a packet to handing the relayed packets to the kernel",
+				   sum.latency, PIB_NETD_METRICS_LATENCY_BUCKETS, sum.latency_sum / 1000.0);
+
+	write_prometheus_histogram(fp, "pibnetd_receive_batch_packets",
+				   "Packets received per recvmmsg or io_uring_enter",
+				   sum.recv_batch, PIB_NETD_METRICS_BATCH_BUCKETS, -1.0);
+
+	write_prometheus_histogram(fp, "pibnetd_send_batch_packets",
+				   "Packets sent per sendmmsg or per flush to io_uring",
+				   sum.send_batch, PIB_NETD_METRICS_BATCH_BUCKETS, -1.0);
+}
+
+
+/*
+ *  バッチの大きさは合計を数えていないので、sum が負なら _sum を出さない。
+ */
+static void write_prometheus_histogram(FILE *fp, const char *name, const char *help, const uint64_t *buckets, int nr_buckets, double sum)
+{
+	int i;
+	uint64_t count = 0;
+
+	fprintf(fp, "# HELP %s %s\n", name, help);
+	fprintf(fp, "# TYPE %s histogram\n", name);
+
+	for (i=0 ; i<nr_buckets ; i++) {
+		count += buckets[i];
+		fprintf(fp, "%s_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n", name, (uint64_t)1 << i, count);
+	}
+
+	count += buckets[nr_buckets];
+	fprintf(fp, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, count);
+
+	if (sum >= 0.0)
+		fprintf(fp, "%s_sum %.3f\n", name, sum);
+
+	fprintf(fp, "%s_count %" PRIu64 "\n", name, count);
+}
+
+
+static void write_json(FILE *fp, struct pib_control *control)
+{
+	int i, j, lid, first, sw_index, port_num;
+	struct pib_worker_metrics sum;
+
+	fprintf(fp, "{\"switches\":[");
+
+	for (sw_index=0 ; sw_index<control->nr_switches ; sw_index++) {
+		struct pib_switch *sw = control->switches[sw_index];
+
+		fprintf(fp, "%s{\"name\":\"", (sw_index > 0) ? "," : "");
+		write_escaped(fp, sw->name);
+		fprintf(fp, "\",\"ports\":[");
+
+		for (port_num=1 ; port_num<sw->port_cnt ; port_num++) {
+			struct pib_port *port = &sw->ports[port_num];
+			struct pib_port_traffic traffic;
+
+			pib_sum_port_traffic(sw, port_num, &traffic);
+
+			fprintf(fp,
+				"%s{\"port\":%u,\"port_guid\":\"0x%016" PRIx64 "\",\"state\":%u,"
+				"\"rcv_packets\":%" PRIu64 ",\"rcv_bytes\":%" PRIu64 ","
+				"\"xmit_packets\":%" PRIu64 ",\"xmit_bytes\":%" PRIu64 ","
+				"\"xmit_discards\":%" PRIu64 ",\"xmit_wait_usec\":%" PRIu64 "}",
+				(port_num > 1) ? "," : "",
+				port_num, port->port_guid, port->ibv_port_attr.state,
+				traffic.rcv_packets, traffic.rcv_data,
+				traffic.xmit_packets, traffic.xmit_data,
+				traffic.xmit_discards, traffic.xmit_wait);
+		}
+
+		fprintf(fp, "]}");
+	}
+
+	fprintf(fp, "],");
+
+	sum_worker_metrics(control, &sum);
+
+	fprintf(fp, "\"drops\":{");
+	for (i=0 ; i<PIB_NR_DROP_REASONS ; i++)
+		fprintf(fp, "%s\"%s\":%" PRIu64, (i > 0) ? "," : "", drop_reasons[i], sum.drops[i]);
+	fprintf(fp, "},");
+
+	fprintf(fp, "\"lids\":{");
+	for (lid=0, first=1 ; lid<PIB_MAX_LID ; lid++) {
+		uint64_t packets = 0, data = 0;
+
+		for (j=0 ; j<control->nr_workers ; j++) {
+			packets += control->worker_metrics[j].lids[lid].packets;
+			data    += control->worker_metrics[j].lids[lid].data;
+		}
+
+		if (packets == 0)
+			continue;
+
+		fprintf(fp, "%s\"%u\":{\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64 "}",
+			first ? "" : ",", lid, packets, data);
+		first = 0;
+	}
+	fprintf(fp, "},");
+
+	write_json_histogram(fp, "relay_latency_usec", sum.latency, PIB_NETD_METRICS_LATENCY_BUCKETS,
+			     sum.latency_sum / 1000.0);
+	fprintf(fp, ",");
+	write_json_histogram(fp, "receive_batch_packets", sum.recv_batch, PIB_NETD_METRICS_BATCH_BUCKETS, -1.0);
+	fprintf(fp, ",");
+	write_json_histogram(fp, "send_batch_packets", sum.send_batch, PIB_NETD_METRICS_BATCH_BUCKETS, -1.0);
+
+	fprintf(fp, "}\n");
+}
+
+
+/*
+ *  JSON のバケットは累積しない。最後の要素の上限は null にする。
+ */
+static void write_json_histogram(FILE *fp, const char *name, const uint64_t *buckets, int nr_buckets, double sum)
+{
+	int i;
+	uint64_t count = 0;
+
+	fprintf(fp, "\"%s\":{\"buckets\":[", name);
+
+	for (i=0 ; i<nr_buckets ; i++) {
+		count += buckets[i];
+		fprintf(fp, "[%" PRIu64 ",%" PRIu64 "],", (uint64_t)1 << i, buckets[i]);
+	}
+
+	count += buckets[nr_buckets];
+	fprintf(fp, "[null,%" PRIu64 "]],", buckets[nr_buckets]);
+
+	if (sum >= 0.0)
+		fprintf(fp, "\"sum\":%.3f,", sum);
+
+	fprintf(fp, "\"count\":%" PRIu64 "}", count);
+}
+
+
+/*
+ *  Prometheus のラベル値と JSON の文字列で共通に使う。
+ */
+static void write_escaped(FILE *fp, const char *str)
+{
+	for ( ; *str ; str++) {
+		if ((*str == '\\') || (*str == '"'))
+			fputc('\\', fp);
+		fputc(*str, fp);
+	}
+}
+
+
+static int write_all(int fd, const char *buffer, size_t size)
+{
+	while (size > 0) {
+		ssize_t ret;
+
+		/* 途中で切断したクライアントで SIGPIPE を受けないようにする */
+		ret = send(fd, buffer, size, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buffer += ret;
+		size   -= ret;
+	}
+
+	return 0;
+}
@@ -449,6 +449,8 @@ static int pma_get_port_counters(struct pib_pma_mad *pmp, struct pib_switch *sw,
 
 	perf = &sw->ports[port_select].perf;
 
+	pib_merge_port_traffic(sw, port_select);
+
 	p->symbol_error_counter		= cpu_to_be16(get_saturation16(perf->symbol_error_counter));
 	p->link_error_recovery_counter	= get_saturation8(perf->link_error_recovery_counter);
 	p->link_downed_counter		= get_saturation8(perf->link_downed_counter);
@@ -501,6 +503,8 @@ static int pma_set_port_counters(struct pib_pma_mad *pmp, struct pib_switch *sw,
 
 	perf = &sw->ports[port_select].perf;
 
+	pib_merge_port_traffic(sw, port_select);
+
 	if (p->counter_select & PIB_PMA_SEL_SYMBOL_ERROR)
 		perf->symbol_error_counter = be16_to_cpu(p->symbol_error_counter);
 
@@ -550,7 +554,7 @@ static int pma_set_port_counters(struct pib_pma_mad *pmp, struct pib_switch *sw,
 		perf->rcv_packets = be32_to_cpu(p->port_rcv_packets);
 
 bail:
-	return pma_set_port_counters(pmp, sw, port_num);
+	return pma_get_port_counters(pmp, sw, port_num);
 }
 
 
@@ -580,6 +584,8 @@ static int pma_get_port_counters_ext(struct pib_pma_mad *pmp, struct pib_switch
 
 	perf = &sw->ports[port_select].perf;
 
+	pib_merge_port_traffic(sw, port_select);
+
 	p->port_xmit_data		= cpu_to_be64(perf->xmit_data);
 	p->port_rcv_data		= cpu_to_be64(perf->rcv_data);
 	p->port_xmit_packets		= cpu_to_be64(perf->xmit_packets);
@@ -616,6 +622,8 @@ static int pma_set_port_counters_ext(struct pib_pma_mad *pmp, struct pib_switch
 
 	perf = &sw->ports[port_select].perf;
 
+	pib_merge_port_traffic(sw, port_select);
+
 	if (p->counter_select & PIB_PMA_SELX_PORT_XMIT_DATA)
 		perf->xmit_data = be64_to_cpu(p->port_xmit_data);
 
@@ -0,0 +1,1265 @@
+/*
+ * pibgen.c - Traffic generator for pib.ko and pibnetd
+ *
+ * Copyright (c) 2014 Minoru NAKAMURA <nminoru@nminoru.jp>
+ *
+ * This code is licenced under the GPL version 2 or BSD license.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "pibnetd.h"
+
+/*
+ *  LRH/BTH と DETH または RETH を持つパケットを組み立てて、pibnetd か pib.ko の
+ *  ポートへ指定したレートで送る。ペイロードの先頭に通し番号と送信時刻を埋め込み、
+ *  リフレクタ (-R で起動した pibgen) が送り返してきたパケットで受信レートと
+ *  往復遅延を測る。
+ *
+ *  pibnetd に対しては pib.ko と同じ CONNECT コマンドでホストとして接続する。
+ *  SM がいない時は --setup で直結したスイッチの LFT に自分の LID を
+ *  directed route SMP で登録する。--direct では pibnetd を介さずに宛先の
+ *  UDP ポートへ直接送る。
+ */
+
+#define PIBGEN_GUID_BASE	(0x0000504942470000ULL) /* "PIBG" */
+#define PIBGEN_MAGIC		(0x5047454E)            /* "PGEN" */
+#define PIBGEN_MAX_BATCH	(PIB_NETD_SEND_BATCH)
+#define PIBGEN_MAX_PAYLOAD	(4096)
+#define PIBGEN_SOCKET_BUFFER	(4 * 1024 * 1024)
+#define PIBGEN_RETRY		(5)
+#define PIBGEN_DRAIN_TIME	(1000000000ULL) /* nsec to wait for late replies */
+#define PIBGEN_LATENCY_BUCKETS	(1024)
+#define PIBGEN_SEQ_WINDOW	(65536) /* 重複を見分けられる通し番号の幅 (2 の冪) */
+
+#define NSEC_PER_SEC		(1000000000ULL)
+
+enum {
+	PIBGEN_OPCODE_RC_SEND_ONLY       = 0x04,
+	PIBGEN_OPCODE_RC_RDMA_WRITE_ONLY = 0x0A,
+	PIBGEN_OPCODE_UD_SEND_ONLY       = 0x64,
+};
+
+enum {
+	PIBGEN_SEQ_IN_ORDER,
+	PIBGEN_SEQ_REORDERED,
+	PIBGEN_SEQ_DUPLICATED,
+};
+
+
+/* ペイロードの先頭に置く */
+struct pibgen_stamp {
+	__be32	magic;
+	__be32	session;
+	u64	seq;
+	u64	time;	/* CLOCK_MONOTONIC in nsec, only meaningful to the sender */
+} __attribute__ ((packed));
+
+
+static int verbose;
+static uint32_t port_num = PIB_NETD_DEFAULT_PORT;
+static const char *address = "127.0.0.1";
+static uint32_t bind_port;
+static int direct;
+static int reflect;
+static int setup;
+static uint64_t port_guid;
+static uint16_t slid = 1;
+static uint16_t dlid = 2;
+static uint64_t rate;		/* packets per second, 0 means as fast as possible */
+static uint32_t payload_size = 64;
+static uint32_t duration = 10;	/* sec */
+static uint8_t  opcode = PIBGEN_OPCODE_UD_SEND_ONLY;
+static uint32_t dest_qpn = 0x10;
+static uint32_t src_qpn  = 0x10;
+static uint32_t qkey;
+static uint32_t batch_size = 32;
+
+static volatile sig_atomic_t stop;
+
+static int sockfd;
+static struct sockaddr_in target;
+static uint32_t session;
+static uint64_t next_tid = 1;
+
+static struct {
+	uint64_t	sent;
+	uint64_t	sent_bytes;
+	uint64_t	received;
+	uint64_t	received_bytes;
+	uint64_t	reordered;
+	uint64_t	duplicated;
+	uint64_t	send_errors;
+	uint64_t	seq_top;	/* 受け取った最大の通し番号 + 1 */
+	uint64_t	latency_sum;
+	uint64_t	latency_min;
+	uint64_t	latency_max;
+	uint64_t	latency[PIBGEN_LATENCY_BUCKETS];
+} stats;
+
+/* 通し番号 seq_top - PIBGEN_SEQ_WINDOW から seq_top - 1 までの受信済みフラグ */
+static uint64_t seq_bitmap[PIBGEN_SEQ_WINDOW / 64];
+
+
+static void usage(void);
+static int parse_opcode(const char *str);
+static void handle_signal(int signo);
+static uint64_t get_time(void);
+static void open_socket(void);
+static int receive_packet(void *buffer, size_t size, uint64_t deadline);
+static int get_data_header_size(void *packet, int length, struct pib_packet_lrh **lrh_p, struct pib_packet_bth **bth_p);
+static int exchange_link_cmd(uint32_t cmd, uint32_t ack);
+static int process_smp(u8 method, u16 attr_id, u32 attr_mod, void *data);
+static int setup_lft(void);
+static int build_packet(void *packet);
+static void run_generator(void);
+static void send_batch(void **packets, struct mmsghdr *msgs, uint32_t count, int stamp_offset, uint64_t now);
+static void receive_replies(struct mmsghdr *msgs);
+static int check_seq(uint64_t seq);
+static void record_latency(uint64_t latency);
+static int get_latency_bucket(uint64_t value);
+static uint64_t get_bucket_value(int bucket);
+static uint64_t get_percentile(double percent);
+static void print_summary(uint64_t elapsed);
+static void run_reflector(void);
+
+
+static void usage(void)
+{
+	printf(
+		"Usage: pibgen [options]\n"
+		"Options:\n"
+		"\n"
+		"--address, -a=<IPv4 address>\n"
+		"\tSpecify the address of pibnetd or the target (default: 127.0.0.1)\n"
+		"\n"
+		"--port, -p=<port-number>\n"
+		"\tSpecify the number of UDP (default: %u)\n"
+		"\n"
+		"--bind, -b=<port-number>\n"
+		"\tBind the local UDP port (default: any)\n"
+		"\n"
+		"--direct, -d\n"
+		"\tSend packets to a pib.ko port or a pibgen directly instead of connecting to pibnetd\n"
+		"\n"
+		"--reflect, -R\n"
+		"\tSend back every received packet to its source LID\n"
+		"\n"
+		"--setup, -S\n"
+		"\tRoute the local LID to this port in the LFT of the attached switch (no SM only)\n"
+		"\n"
+		"--guid, -g=<port-guid>\n"
+		"\tSpecify the port GUID of the emulated host (default: derived from the pid)\n"
+		"\n"
+		"--lid, -l=<LID>\n"
+		"\tSpecify the local LID (default: 1)\n"
+		"\n"
+		"--dlid, -L=<LID>\n"
+		"\tSpecify the destination LID (default: 2)\n"
+		"\n"
+		"--rate, -r=<pps>\n"
+		"\tSend <pps> packets per second (default: 0 = as fast as possible)\n"
+		"\n"
+		"--size, -s=<bytes>\n"
+		"\tSpecify the payload size (default: 64, min: %zu, max: %u)\n"
+		"\n"
+		"--duration, -D=<sec>\n"
+		"\tSend packets for <sec> seconds (default: 10)\n"
+		"\n"
+		"--opcode, -o=<ud-send|rc-send|rdma-write>\n"
+		"\tSpecify the type of packets (default: ud-send)\n"
+		"\n"
+		"--qpn, -q=<QPN>\n"
+		"\tSpecify the destination QP number (default: 0x10)\n"
+		"\n"
+		"--qkey, -k=<Q_Key>\n"
+		"\tSpecify the Q_Key of UD packets, or the R_Key of RDMA WRITE packets (default: 0)\n"
+		"\n"
+		"--batch, -n=<number>\n"
+		"\tSend up to <number> packets per sendmmsg (default: 32, max: %u)\n"
+		"\n"
+		"--verbose, -v\n"
+		"\tIncrease the log verbosity level.\n"
+		"\n"
+		"--help, -h\n"
+		"\tDisplay this usage\n",
+		PIB_NETD_DEFAULT_PORT, sizeof(struct pibgen_stamp), PIBGEN_MAX_PAYLOAD, PIBGEN_MAX_BATCH);
+}
+
+
+int main(int argc, char** argv)
+{
+	struct option longopts[] = {
+		{"address",  required_argument, NULL, 'a' },
+		{"port",     required_argument, NULL, 'p' },
+		{"bind",     required_argument, NULL, 'b' },
+		{"direct",   no_argument,       NULL, 'd' },
+		{"reflect",  no_argument,       NULL, 'R' },
+		{"setup",    no_argument,       NULL, 'S' },
+		{"guid",     required_argument, NULL, 'g' },
+		{"lid",      required_argument, NULL, 'l' },
+		{"dlid",     required_argument, NULL, 'L' },
+		{"rate",     required_argument, NULL, 'r' },
+		{"size",     required_argument, NULL, 's' },
+		{"duration", required_argument, NULL, 'D' },
+		{"opcode",   required_argument, NULL, 'o' },
+		{"qpn",      required_argument, NULL, 'q' },
+		{"qkey",     required_argument, NULL, 'k' },
+		{"batch",    required_argument, NULL, 'n' },
+		{"verbose",  no_argument,       NULL, 'v' },
+		{"help",     no_argument,       NULL, 'h' },
+		{NULL,       0,                 NULL, 0   },
+	};
+
+	int ch, option_index;
+	struct sigaction sa;
+
+	while ((ch = getopt_long(argc, argv, "a:p:b:dRSg:l:L:r:s:D:o:q:k:n:vh", longopts, &option_index)) != -1) {
+		switch (ch) {
+
+		case 'a':
+			address = optarg;
+			break;
+
+		case 'p':
+			port_num = atoi(optarg);
+			assert((0 < port_num) && (port_num < 65536));
+			break;
+
+		case 'b':
+			bind_port = atoi(optarg);
+			assert(bind_port < 65536);
+			break;
+
+		case 'd':
+			direct = 1;
+			break;
+
+		case 'R':
+			reflect = 1;
+			break;
+
+		case 'S':
+			setup = 1;
+			break;
+
+		case 'g':
+			port_guid = strtoull(optarg, NULL, 0);
+			break;
+
+		case 'l':
+			slid = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'L':
+			dlid = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'r':
+			rate = strtoull(optarg, NULL, 0);
+			break;
+
+		case 's':
+			payload_size = strtoul(optarg, NULL, 0);
+			if ((payload_size < sizeof(struct pibgen_stamp)) || (PIBGEN_MAX_PAYLOAD < payload_size)) {
+				fprintf(stderr, "pibgen: payload size must be %zu to %u\n",
+					sizeof(struct pibgen_stamp), PIBGEN_MAX_PAYLOAD);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'D':
+			duration = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'o':
+			if (parse_opcode(optarg) < 0) {
+				fprintf(stderr, "pibgen: unknown opcode: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'q':
+			dest_qpn = strtoul(optarg, NULL, 0) & PIB_QPN_MASK;
+			break;
+
+		case 'k':
+			qkey = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'n':
+			batch_size = strtoul(optarg, NULL, 0);
+			if ((batch_size == 0) || (PIBGEN_MAX_BATCH < batch_size)) {
+				fprintf(stderr, "pibgen: batch must be 1 to %u\n", PIBGEN_MAX_BATCH);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'v': // verbose
+			verbose = 1;
+			break;
+
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (direct && setup) {
+		fprintf(stderr, "pibgen: --setup can't be used with --direct\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((slid == 0) || (PIB_MCAST_LID_BASE <= slid)) {
+		fprintf(stderr, "pibgen: wrong local LID: 0x%x\n", slid);
+		exit(EXIT_FAILURE);
+	}
+
+	if (port_guid == 0)
+		port_guid = PIBGEN_GUID_BASE | (getpid() & 0xFFFF);
+
+	session = (uint32_t)getpid() ^ (uint32_t)get_time();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT,  &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	open_socket();
+
+	if (!direct) {
+		if (exchange_link_cmd(PIB_LINK_CMD_CONNECT, PIB_LINK_CMD_CONNECT_ACK) < 0) {
+			fprintf(stderr, "pibgen: pibnetd doesn't accept port_guid=0x%" PRIx64 " at %s:%u\n",
+				port_guid, address, port_num);
+			exit(EXIT_FAILURE);
+		}
+
+		if (verbose)
+			printf("pibgen: connected to %s:%u as port_guid=0x%" PRIx64 "\n",
+			       address, port_num, port_guid);
+
+		if (setup && (setup_lft() < 0))
+			goto disconnect;
+	}
+
+	if (reflect)
+		run_reflector();
+	else
+		run_generator();
+
+disconnect:
+	if (!direct)
+		exchange_link_cmd(PIB_LINK_CMD_DISCONNECT, PIB_LINK_CMD_DISCONNECT_ACK);
+
+	close(sockfd);
+
+	return 0;
+}
+
+
+static int parse_opcode(const char *str)
+{
+	if (strcmp(str, "ud-send") == 0)
+		opcode = PIBGEN_OPCODE_UD_SEND_ONLY;
+	else if (strcmp(str, "rc-send") == 0)
+		opcode = PIBGEN_OPCODE_RC_SEND_ONLY;
+	else if (strcmp(str, "rdma-write") == 0)
+		opcode = PIBGEN_OPCODE_RC_RDMA_WRITE_ONLY;
+	else
+		return -1;
+
+	return 0;
+}
+
+
+static void handle_signal(int signo)
+{
+	stop = 1;
+}
+
+
+static uint64_t get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+
+static void open_socket(void)
+{
+	int ret, size;
+	struct sockaddr_in sockaddr;
+
+	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sockfd < 0) {
+		int eno  = errno;
+		fprintf(stderr, "pibgen: socket(errno=%d)\n", eno);
+		exit(EXIT_FAILURE);
+	}
+
+	/* 送受信ともにバースト分を溜められるようにする */
+	size = PIBGEN_SOCKET_BUFFER;
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	memset(&sockaddr, 0, sizeof(sockaddr));
+	sockaddr.sin_family      = AF_INET;
+	sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	sockaddr.sin_port        = htons(bind_port);
+
+	ret = bind(sockfd, (struct sockaddr*)&sockaddr, (socklen_t)sizeof(sockaddr));
+	if (ret != 0) {
+		int eno  = errno;
+		fprintf(stderr, "pibgen: bind(errno=%d)\n", eno);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&target, 0, sizeof(target));
+	target.sin_family = AF_INET;
+	target.sin_port   = htons(port_num);
+
+	if (inet_pton(AF_INET, address, &target.sin_addr) != 1) {
+		fprintf(stderr, "pibgen: wrong address: %s\n", address);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ *  deadline (CLOCK_MONOTONIC) まで 1 つのパケットを待つ。
+ *  タイムアウトした時は 0 を返す。
+ */
+static int receive_packet(void *buffer, size_t size, uint64_t deadline)
+{
+	for (;;) {
+		int ret;
+		uint64_t now;
+		struct pollfd pollfd;
+		struct timespec ts;
+
+		ret = recv(sockfd, buffer, size, MSG_DONTWAIT);
+		if (0 < ret)
+			return ret;
+
+		if ((ret < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+			int eno  = errno;
+			fprintf(stderr, "pibgen: recv(errno=%d)\n", eno);
+			exit(EXIT_FAILURE);
+		}
+
+		now = get_time();
+		if (deadline <= now)
+			return 0;
+
+		ts.tv_sec  = (deadline - now) / NSEC_PER_SEC;
+		ts.tv_nsec = (deadline - now) % NSEC_PER_SEC;
+
+		pollfd.fd      = sockfd;
+		pollfd.events  = POLLIN;
+		pollfd.revents = 0;
+
+		ppoll(&pollfd, 1, &ts, NULL);
+	}
+}
+
+
+/*
+ *  LRH/GRH/BTH と拡張ヘッダの長さを返す。データパケットでなければ -1。
+ *  length はフッターを含む長さ。
+ */
+static int get_data_header_size(void *packet, int length, struct pib_packet_lrh **lrh_p, struct pib_packet_bth **bth_p)
+{
+	int size, header_size;
+	struct pib_packet_lrh *lrh;
+	struct pib_packet_bth *bth;
+
+	size = length - sizeof(union pib_packet_footer);
+
+	if (size < (int)sizeof(*lrh))
+		return -1;
+
+	lrh = packet;
+
+	if (pib_packet_lrh_get_pktlen(lrh) * 4 != size)
+		return -1;
+
+	header_size = sizeof(*lrh);
+
+	switch (lrh->sl_rsv_lnh & 0x3) {
+	case 0x2: /* IBA local */
+		break;
+	case 0x3: /* IBA global */
+		header_size += sizeof(struct pib_grh);
+		break;
+	default:
+		return -1;
+	}
+
+	if (size < header_size + (int)sizeof(*bth))
+		return -1;
+
+	bth = packet + header_size;
+	header_size += sizeof(*bth);
+
+	if ((bth->OpCode >> 5) == 3) /* UD */
+		header_size += sizeof(struct pib_packet_deth);
+	else if (((bth->OpCode & 0x1F) == 0x06) || ((bth->OpCode & 0x1F) == 0x0A) || ((bth->OpCode & 0x1F) == 0x0B))
+		/* RDMA WRITE First, Only, Only with Immediate */
+		header_size += sizeof(struct pib_packet_reth);
+
+	if (size < header_size)
+		return -1;
+
+	*lrh_p = lrh;
+	*bth_p = bth;
+
+	return header_size;
+}
+
+
+/*
+ *  pib.ko と同じ raw パケットで CONNECT/DISCONNECT を送り、ACK を待つ。
+ */
+static int exchange_link_cmd(uint32_t cmd, uint32_t ack)
+{
+	int i;
+	uint8_t buffer[PIB_PACKET_BUFFER];
+	struct pib_packet_lrh *lrh;
+	struct pib_packet_link *link;
+	union pib_packet_footer *footer;
+
+	for (i=0 ; i<PIBGEN_RETRY ; i++) {
+		int ret;
+		uint64_t deadline;
+
+		lrh = (struct pib_packet_lrh *)buffer;
+		memset(lrh, 0, sizeof(*lrh));
+		lrh->dlid = cpu_to_be16(PIB_LID_PERMISSIVE);
+		lrh->slid = cpu_to_be16(PIB_LID_PERMISSIVE);
+		pib_packet_lrh_set_pktlen(lrh, (sizeof(*lrh) + sizeof(*link)) / 4);
+
+		link = (struct pib_packet_link *)(buffer + sizeof(*lrh));
+		link->cmd = cpu_to_be32(cmd);
+
+		footer = (union pib_packet_footer *)(buffer + sizeof(*lrh) + sizeof(*link));
+		footer->pib.port_guid = cpu_to_be64(port_guid);
+
+		ret = sendto(sockfd, buffer, sizeof(*lrh) + sizeof(*link) + sizeof(*footer), 0,
+			     (struct sockaddr *)&target, sizeof(target));
+		if (ret < 0) {
+			int eno  = errno;
+			fprintf(stderr, "pibgen: sendto(errno=%d)\n", eno);
+			return -1;
+		}
+
+		deadline = get_time() + NSEC_PER_SEC;
+
+		while ((ret = receive_packet(buffer, sizeof(buffer), deadline)) > 0) {
+			if (ret < (int)(sizeof(*lrh) + sizeof(*link) + sizeof(*footer)))
+				continue;
+
+			/* LID map などの他の raw パケットは読み捨てる */
+			if ((lrh->sl_rsv_lnh & 0x3) != 0)
+				continue;
+
+			if (be32_to_cpu(link->cmd) == ack)
+				return 0;
+		}
+
+		if (stop && (cmd == PIB_LINK_CMD_CONNECT))
+			return -1;
+	}
+
+	return -1;
+}
+
+
+/*
+ *  直結したスイッチに directed route (hop_cnt=1) の SMP を送って応答を待つ。
+ *  data は要求の内容で、応答の内容で上書きする。
+ */
+static int process_smp(u8 method, u16 attr_id, u32 attr_mod, void *data)
+{
+	int i;
+	uint64_t tid = next_tid++;
+	uint8_t buffer[PIB_PACKET_BUFFER];
+
+	for (i=0 ; i<PIBGEN_RETRY ; i++) {
+		int ret, size;
+		uint64_t deadline;
+		struct pib_packet_lrh *lrh;
+		struct pib_packet_bth *bth;
+		struct pib_packet_deth *deth;
+		struct pib_smp *smp;
+		union pib_packet_footer *footer;
+
+		memset(buffer, 0, sizeof(buffer));
+
+		lrh = (struct pib_packet_lrh *)buffer;
+		lrh->dlid       = cpu_to_be16(PIB_LID_PERMISSIVE);
+		lrh->slid       = cpu_to_be16(PIB_LID_PERMISSIVE);
+		lrh->sl_rsv_lnh = 0x2; /* IBA local */
+
+		bth = (struct pib_packet_bth *)(lrh + 1);
+		bth->OpCode = PIBGEN_OPCODE_UD_SEND_ONLY;
+		bth->pkey   = cpu_to_be16(PIB_DEFAULT_PKEY_FULL);
+		bth->destQP = cpu_to_be32(PIB_QP0);
+
+		deth = (struct pib_packet_deth *)(bth + 1);
+		deth->srcQP = cpu_to_be32(PIB_QP0);
+
+		smp = (struct pib_smp *)(deth + 1);
+		smp->base_version  = PIB_MGMT_BASE_VERSION;
+		smp->mgmt_class    = PIB_MGMT_CLASS_SUBN_DIRECTED_ROUTE;
+		smp->class_version = PIB_MGMT_CLASS_VERSION;
+		smp->method        = method;
+		smp->hop_ptr       = 1; /* the sender has already done C14-9:1 */
+		smp->hop_cnt       = 1;
+		smp->tid           = cpu_to_be64(tid);
+		smp->attr_id       = cpu_to_be16(attr_id);
+		smp->attr_mod      = cpu_to_be32(attr_mod);
+		smp->dr_slid       = cpu_to_be16(PIB_LID_PERMISSIVE);
+		smp->dr_dlid       = cpu_to_be16(PIB_LID_PERMISSIVE);
+		smp->initial_path[1] = 1;
+		memcpy(smp->data, data, PIB_SMP_DATA_SIZE);
+
+		size = (void *)(smp + 1) - (void *)buffer + 4; /* add ICRC size */
+		pib_packet_lrh_set_pktlen(lrh, size / 4);
+
+		footer = (union pib_packet_footer *)(buffer + size);
+		footer->pib.port_guid = cpu_to_be64(port_guid);
+
+		ret = sendto(sockfd, buffer, size + sizeof(*footer), 0,
+			     (struct sockaddr *)&target, sizeof(target));
+		if (ret < 0) {
+			int eno  = errno;
+			fprintf(stderr, "pibgen: sendto(errno=%d)\n", eno);
+			return -1;
+		}
+
+		deadline = get_time() + NSEC_PER_SEC;
+
+		while ((ret = receive_packet(buffer, sizeof(buffer), deadline)) > 0) {
+			int header_size;
+
+			header_size = get_data_header_size(buffer, ret, &lrh, &bth);
+			if (header_size < 0)
+				continue;
+
+			if ((be32_to_cpu(bth->destQP) & PIB_QPN_MASK) != PIB_QP0)
+				continue;
+
+			if (ret < header_size + (int)sizeof(*smp))
+				continue;
+
+			smp = (struct pib_smp *)(buffer + header_size);
+
+			if ((smp->method != PIB_MGMT_METHOD_GET_RESP) || (be64_to_cpu(smp->tid) != tid))
+				continue;
+
+			if (smp->status & ~PIB_SMP_DIRECTION) {
+				fprintf(stderr, "pibgen: SMP(attr_id=0x%04x) failed: status=0x%04x\n",
+					attr_id, be16_to_cpu(smp->status));
+				return -1;
+			}
+
+			memcpy(data, smp->data, PIB_SMP_DATA_SIZE);
+
+			return 0;
+		}
+
+		if (stop)
+			break;
+	}
+
+	fprintf(stderr, "pibgen: no response of SMP(attr_id=0x%04x)\n", attr_id);
+
+	return -1;
+}
+
+
+/*
+ *  SM を使わずに測る時のために、直結したスイッチの LFT で自分の LID を
+ *  このポートに向ける。他のエントリは読み出した値のまま書き戻す。
+ */
+static int setup_lft(void)
+{
+	u8 in_port_num;
+	u64 switch_guid;
+	u8 data[PIB_SMP_DATA_SIZE];
+	struct pib_smp_node_info   *node_info   = (struct pib_smp_node_info *)data;
+	struct pib_smp_switch_info *switch_info = (struct pib_smp_switch_info *)data;
+
+	memset(data, 0, sizeof(data));
+	if (process_smp(PIB_MGMT_METHOD_GET, PIB_SMP_ATTR_NODE_INFO, 0, data) < 0)
+		return -1;
+
+	if (node_info->node_type != IBV_NODE_SWITCH) {
+		fprintf(stderr, "pibgen: --setup needs a switch at the other end of the link\n");
+		return -1;
+	}
+
+	in_port_num = node_info->local_port_num;
+	switch_guid = be64_to_cpu(node_info->node_guid);
+
+	/* LinearFDBTop より上の LFT のエントリは読み出せないので先に引き上げる */
+	memset(data, 0, sizeof(data));
+	if (process_smp(PIB_MGMT_METHOD_GET, PIB_SMP_ATTR_SWITCH_INFO, 0, data) < 0)
+		return -1;
+
+	if (be16_to_cpu(switch_info->linear_fdb_top) < slid) {
+		switch_info->linear_fdb_top = cpu_to_be16(slid);
+		switch_info->various1 &= ~(1 << 2); /* don't clear PortStateChange */
+
+		if (process_smp(PIB_MGMT_METHOD_SET, PIB_SMP_ATTR_SWITCH_INFO, 0, data) < 0)
+			return -1;
+	}
+
+	memset(data, 0, sizeof(data));
+	if (process_smp(PIB_MGMT_METHOD_GET, PIB_SMP_ATTR_LINEAR_FORWARD_TABLE, slid / 64, data) < 0)
+		return -1;
+
+	data[slid % 64] = in_port_num;
+
+	if (process_smp(PIB_MGMT_METHOD_SET, PIB_SMP_ATTR_LINEAR_FORWARD_TABLE, slid / 64, data) < 0)
+		return -1;
+
+	printf("pibgen: LID 0x%04x is routed to port[%u] of switch 0x%016" PRIx64 "\n",
+	       slid, in_port_num, switch_guid);
+
+	return 0;
+}
+
+
+/*
+ *  packet にパケットを組み立てて、フッターを含む長さを返す。
+ *  通し番号と送信時刻は送る直前に send_batch() で埋める。
+ */
+static int build_packet(void *packet)
+{
+	void *buffer = packet;
+	uint32_t padded_size;
+	struct pib_packet_lrh *lrh;
+	struct pib_packet_bth *bth;
+	struct pibgen_stamp *stamp;
+	union pib_packet_footer *footer;
+
+	padded_size = (payload_size + 3) & ~3U;
+
+	lrh = buffer;
+	memset(lrh, 0, sizeof(*lrh));
+	lrh->dlid       = cpu_to_be16(dlid);
+	lrh->slid       = cpu_to_be16(slid);
+	lrh->sl_rsv_lnh = 0x2; /* IBA local */
+	buffer += sizeof(*lrh);
+
+	bth = buffer;
+	memset(bth, 0, sizeof(*bth));
+	bth->OpCode = opcode;
+	bth->pkey   = cpu_to_be16(PIB_DEFAULT_PKEY_FULL);
+	bth->destQP = cpu_to_be32(dest_qpn);
+	pib_packet_bth_set_padcnt(bth, padded_size - payload_size);
+	buffer += sizeof(*bth);
+
+	if (opcode == PIBGEN_OPCODE_UD_SEND_ONLY) {
+		struct pib_packet_deth *deth = buffer;
+		deth->qkey  = cpu_to_be32(qkey);
+		deth->srcQP = cpu_to_be32(src_qpn);
+		buffer += sizeof(*deth);
+	} else if (opcode == PIBGEN_OPCODE_RC_RDMA_WRITE_ONLY) {
+		struct pib_packet_reth *reth = buffer;
+		reth->vaddr  = cpu_to_be64(0);
+		reth->rkey   = cpu_to_be32(qkey);
+		reth->dmalen = cpu_to_be32(payload_size);
+		buffer += sizeof(*reth);
+	}
+
+	memset(buffer, 0, padded_size + 4); /* payload, pad and ICRC */
+
+	stamp = buffer;
+	stamp->magic   = cpu_to_be32(PIBGEN_MAGIC);
+	stamp->session = cpu_to_be32(session);
+
+	buffer += padded_size + 4;
+
+	pib_packet_lrh_set_pktlen(lrh, (buffer - packet) / 4);
+
+	footer = buffer;
+	footer->pib.port_guid = cpu_to_be64(port_guid);
+	buffer += sizeof(*footer);
+
+	return buffer - packet;
+}
+
+
+static void run_generator(void)
+{
+	uint32_t i;
+	int packet_length, stamp_offset;
+	uint64_t start, now, end, next_report;
+	uint64_t last_sent = 0, last_received = 0, last_received_bytes = 0;
+	void *packets[PIBGEN_MAX_BATCH];
+	struct iovec send_iovecs[PIBGEN_MAX_BATCH];
+	struct mmsghdr send_msgs[PIBGEN_MAX_BATCH];
+	struct mmsghdr recv_msgs[PIBGEN_MAX_BATCH];
+	struct iovec recv_iovecs[PIBGEN_MAX_BATCH];
+
+	memset(send_msgs, 0, sizeof(send_msgs));
+	memset(recv_msgs, 0, sizeof(recv_msgs));
+
+	for (i=0 ; i<batch_size ; i++) {
+		packets[i] = malloc(PIB_PACKET_BUFFER);
+		packet_length = build_packet(packets[i]);
+
+		send_iovecs[i].iov_base = packets[i];
+		send_iovecs[i].iov_len  = packet_length;
+
+		send_msgs[i].msg_hdr.msg_name    = &target;
+		send_msgs[i].msg_hdr.msg_namelen = sizeof(target);
+		send_msgs[i].msg_hdr.msg_iov     = &send_iovecs[i];
+		send_msgs[i].msg_hdr.msg_iovlen  = 1;
+
+		recv_iovecs[i].iov_base = malloc(PIB_PACKET_BUFFER);
+		recv_iovecs[i].iov_len  = PIB_PACKET_BUFFER;
+
+		recv_msgs[i].msg_hdr.msg_iov     = &recv_iovecs[i];
+		recv_msgs[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	stamp_offset = packet_length - sizeof(union pib_packet_footer) - 4 - ((payload_size + 3) & ~3U);
+
+	stats.latency_min = UINT64_MAX;
+
+	printf("pibgen: sending %u-byte payloads (%d-byte datagrams) from LID 0x%04x to LID 0x%04x QPN 0x%06x at %s\n",
+	       payload_size, packet_length, slid, dlid, dest_qpn,
+	       rate ? "a fixed rate" : "full speed");
+
+	start       = get_time();
+	end         = start + (uint64_t)duration * NSEC_PER_SEC;
+	next_report = start + NSEC_PER_SEC;
+	now         = start;
+
+	while (!stop && (now < end)) {
+		int64_t budget;
+
+		/* トークンバケット: 開始からの経過時間で送ってよい数を決める */
+		if (rate)
+			budget = (int64_t)((double)(now - start) * rate / NSEC_PER_SEC) + 1 - (int64_t)stats.sent;
+		else
+			budget = batch_size;
+
+		if (budget > batch_size)
+			budget = batch_size;
+
+		if (budget > 0)
+			send_batch(packets, send_msgs, budget, stamp_offset, now);
+		else {
+			struct pollfd pollfd;
+			struct timespec ts;
+			int64_t wait;
+
+			/* 次の 1 つを送ってよくなるまで返送を待つ */
+			wait = (int64_t)(start + (double)stats.sent * NSEC_PER_SEC / rate) - (int64_t)now;
+			if (wait < 0)
+				wait = 0;
+			if (wait > NSEC_PER_SEC)
+				wait = NSEC_PER_SEC;
+
+			ts.tv_sec  = wait / NSEC_PER_SEC;
+			ts.tv_nsec = wait % NSEC_PER_SEC;
+
+			pollfd.fd      = sockfd;
+			pollfd.events  = POLLIN;
+			pollfd.revents = 0;
+
+			ppoll(&pollfd, 1, &ts, NULL);
+		}
+
+		receive_replies(recv_msgs);
+
+		now = get_time();
+
+		if (next_report <= now) {
+			double interval = (double)(now - next_report + NSEC_PER_SEC) / NSEC_PER_SEC;
+
+			printf("%6.1f s: sent %10.0f pps, received %10.0f pps, %9.1f Mbps\n",
+			       (double)(now - start) / NSEC_PER_SEC,
+			       (stats.sent - last_sent) / interval,
+			       (stats.received - last_received) / interval,
+			       (stats.received_bytes - last_received_bytes) * 8 / interval / 1000000);
+			fflush(stdout);
+
+			last_sent           = stats.sent;
+			last_received       = stats.received;
+			last_received_bytes = stats.received_bytes;
+			next_report         = now + NSEC_PER_SEC;
+		}
+	}
+
+	end = now;
+
+	/* 遅れて返ってくるパケットを待つ */
+	while (!stop && (stats.received < stats.sent) && (now < end + PIBGEN_DRAIN_TIME)) {
+		struct pollfd pollfd = { .fd = sockfd, .events = POLLIN };
+		poll(&pollfd, 1, 10);
+		receive_replies(recv_msgs);
+		now = get_time();
+	}
+
+	print_summary(end - start);
+
+	for (i=0 ; i<batch_size ; i++) {
+		free(packets[i]);
+		free(recv_iovecs[i].iov_base);
+	}
+}
+
+
+static void send_batch(void **packets, struct mmsghdr *msgs, uint32_t count, int stamp_offset, uint64_t now)
+{
+	int ret;
+	uint32_t i;
+
+	for (i=0 ; i<count ; i++) {
+		struct pib_packet_bth *bth   = packets[i] + sizeof(struct pib_packet_lrh);
+		struct pibgen_stamp   *stamp = packets[i] + stamp_offset;
+
+		bth->psn    = cpu_to_be32((stats.sent + i) & PIB_PSN_MASK);
+		stamp->seq  = stats.sent + i;
+		stamp->time = now;
+	}
+
+	ret = sendmmsg(sockfd, msgs, count, 0);
+	if (ret < 0) {
+		int eno  = errno;
+
+		if ((eno == EINTR) || (eno == EAGAIN) || (eno == ENOBUFS) || (eno == ECONNREFUSED)) {
+			stats.send_errors++;
+			return;
+		}
+
+		fprintf(stderr, "pibgen: sendmmsg(errno=%d)\n", eno);
+		exit(EXIT_FAILURE);
+	}
+
+	/* 送れなかった残りは次の呼び出しで同じ通し番号から送り直す */
+	stats.sent       += ret;
+	stats.sent_bytes += (uint64_t)ret * msgs[0].msg_hdr.msg_iov->iov_len;
+}
+
+
+static void receive_replies(struct mmsghdr *msgs)
+{
+	for (;;) {
+		int i, ret;
+		uint64_t now;
+
+		ret = recvmmsg(sockfd, msgs, batch_size, MSG_DONTWAIT, NULL);
+		if (ret <= 0)
+			return;
+
+		now = get_time();
+
+		for (i=0 ; i<ret ; i++) {
+			int header_size;
+			void *packet = msgs[i].msg_hdr.msg_iov->iov_base;
+			int length   = msgs[i].msg_len;
+			struct pib_packet_lrh *lrh;
+			struct pib_packet_bth *bth;
+			struct pibgen_stamp *stamp;
+
+			header_size = get_data_header_size(packet, length, &lrh, &bth);
+			if (header_size < 0)
+				continue;
+
+			if (length < header_size + (int)(sizeof(*stamp) + sizeof(union pib_packet_footer)))
+				continue;
+
+			stamp = packet + header_size;
+
+			if ((stamp->magic != cpu_to_be32(PIBGEN_MAGIC)) || (stamp->session != cpu_to_be32(session)))
+				continue;
+
+			switch (check_seq(stamp->seq)) {
+			case PIBGEN_SEQ_DUPLICATED:
+				stats.duplicated++;
+				continue;
+			case PIBGEN_SEQ_REORDERED:
+				stats.reordered++;
+				break;
+			default:
+				break;
+			}
+
+			stats.received++;
+			stats.received_bytes += length;
+
+			record_latency(now - stamp->time);
+		}
+
+		if (ret < batch_size)
+			return;
+	}
+}
+
+
+/*
+ *  通し番号を直近 PIBGEN_SEQ_WINDOW 個分のビットマップで覚えて、重複と
+ *  順序の入れ替わりを見分ける。ウィンドウより古い通し番号は重複かどうか
+ *  分からないので、遅れて届いたものとして数える。
+ */
+static int check_seq(uint64_t seq)
+{
+	uint64_t s, mask;
+
+	if (stats.seq_top <= seq) {
+		if (seq - stats.seq_top >= PIBGEN_SEQ_WINDOW)
+			memset(seq_bitmap, 0, sizeof(seq_bitmap));
+		else
+			for (s = stats.seq_top ; s < seq ; s++)
+				seq_bitmap[(s % PIBGEN_SEQ_WINDOW) / 64] &= ~(1ULL << (s % 64));
+
+		seq_bitmap[(seq % PIBGEN_SEQ_WINDOW) / 64] |= 1ULL << (seq % 64);
+		stats.seq_top = seq + 1;
+
+		return PIBGEN_SEQ_IN_ORDER;
+	}
+
+	if (stats.seq_top - seq > PIBGEN_SEQ_WINDOW)
+		return PIBGEN_SEQ_REORDERED;
+
+	mask = 1ULL << (seq % 64);
+
+	if (seq_bitmap[(seq % PIBGEN_SEQ_WINDOW) / 64] & mask)
+		return PIBGEN_SEQ_DUPLICATED;
+
+	seq_bitmap[(seq % PIBGEN_SEQ_WINDOW) / 64] |= mask;
+
+	return PIBGEN_SEQ_REORDERED;
+}
+
+
+static void record_latency(uint64_t latency)
+{
+	stats.latency[get_latency_bucket(latency)]++;
+	stats.latency_sum += latency;
+
+	if (latency < stats.latency_min)
+		stats.latency_min = latency;
+	if (stats.latency_max < latency)
+		stats.latency_max = latency;
+}
+
+
+/*
+ *  2 の冪ごとの区間をさらに 16 に分けたヒストグラム (誤差 1/16 以内)。
+ */
+static int get_latency_bucket(uint64_t value)
+{
+	int msb;
+
+	if (value < 16)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+
+	return (msb - 3) * 16 + ((value >> (msb - 4)) & 15);
+}
+
+
+static uint64_t get_bucket_value(int bucket)
+{
+	if (bucket < 16)
+		return bucket;
+
+	return (uint64_t)(16 + (bucket & 15)) << (bucket / 16 - 1);
+}
+
+
+static uint64_t get_percentile(double percent)
+{
+	int i;
+	uint64_t count = 0, threshold;
+
+	threshold = (uint64_t)(stats.received * percent / 100);
+	if (threshold == 0)
+		threshold = 1;
+
+	for (i=0 ; i<PIBGEN_LATENCY_BUCKETS ; i++) {
+		count += stats.latency[i];
+		if (threshold <= count)
+			return get_bucket_value(i);
+	}
+
+	return stats.latency_max;
+}
+
+
+static void print_summary(uint64_t elapsed)
+{
+	double seconds = (double)elapsed / NSEC_PER_SEC;
+	/* ウィンドウより古い重複は見分けられないので、受信が送信を超えても負にしない */
+	uint64_t lost  = (stats.received < stats.sent) ? stats.sent - stats.received : 0;
+
+	if (seconds <= 0)
+		seconds = 1;
+
+	printf("pibgen: sent %" PRIu64 " packets (%.0f pps, %.1f Mbps), send errors %" PRIu64 "\n",
+	       stats.sent, stats.sent / seconds, stats.sent_bytes * 8 / seconds / 1000000,
+	       stats.send_errors);
+
+	printf("pibgen: received %" PRIu64 " packets (%.0f pps, %.1f Mbps), lost %" PRIu64 " (%.2f%%), reordered %" PRIu64 ", duplicated %" PRIu64 "\n",
+	       stats.received, stats.received / seconds, stats.received_bytes * 8 / seconds / 1000000,
+	       lost, stats.sent ? (double)lost * 100 / stats.sent : 0.0,
+	       stats.reordered, stats.duplicated);
+
+	if (stats.received == 0)
+		return;
+
+	printf("pibgen: rtt usec min %.1f, avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+	       stats.latency_min / 1000.0,
+	       (double)stats.latency_sum / stats.received / 1000.0,
+	       get_percentile(50)   / 1000.0,
+	       get_percentile(90)   / 1000.0,
+	       get_percentile(99)   / 1000.0,
+	       get_percentile(99.9) / 1000.0,
+	       stats.latency_max / 1000.0);
+}
+
+
+/*
+ *  受け取ったデータパケットの LID と QPN を入れ替えて送り返す。
+ *  pibnetd 経由なら pibnetd へ、--direct なら送ってきたアドレスへ返す。
+ */
+static void run_reflector(void)
+{
+	uint32_t i;
+	uint64_t start, now, next_report;
+	uint64_t reflected = 0, last_reflected = 0;
+	struct sockaddr_in sources[PIBGEN_MAX_BATCH];
+	struct iovec iovecs[PIBGEN_MAX_BATCH];
+	struct mmsghdr msgs[PIBGEN_MAX_BATCH];
+	struct mmsghdr send_msgs[PIBGEN_MAX_BATCH];
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i=0 ; i<batch_size ; i++) {
+		iovecs[i].iov_base = malloc(PIB_PACKET_BUFFER);
+		iovecs[i].iov_len  = PIB_PACKET_BUFFER;
+
+		msgs[i].msg_hdr.msg_iov    = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	printf("pibgen: reflecting packets sent to LID 0x%04x\n", slid);
+	fflush(stdout);
+
+	start       = get_time();
+	next_report = start + NSEC_PER_SEC;
+
+	while (!stop) {
+		int ret, count = 0, sent = 0;
+		struct pollfd pollfd = { .fd = sockfd, .events = POLLIN };
+
+		poll(&pollfd, 1, 100);
+
+		for (i=0 ; i<batch_size ; i++) {
+			iovecs[i].iov_len           = PIB_PACKET_BUFFER;
+			msgs[i].msg_hdr.msg_name    = &sources[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+		}
+
+		ret = recvmmsg(sockfd, msgs, batch_size, MSG_DONTWAIT, NULL);
+
+		for (i=0 ; (int)i<ret ; i++) {
+			int header_size;
+			void *packet = iovecs[i].iov_base;
+			int length   = msgs[i].msg_len;
+			uint16_t lid;
+			struct pib_packet_lrh *lrh;
+			struct pib_packet_bth *bth;
+			union pib_packet_footer *footer;
+
+			header_size = get_data_header_size(packet, length, &lrh, &bth);
+			if (header_size < 0)
+				continue;
+
+			if ((be32_to_cpu(bth->destQP) & PIB_QPN_MASK) == PIB_QP0)
+				continue;
+
+			lid       = lrh->dlid;
+			lrh->dlid = lrh->slid;
+			lrh->slid = lid;
+
+			if ((bth->OpCode >> 5) == 3) { /* UD */
+				struct pib_packet_deth *deth = (struct pib_packet_deth *)(bth + 1);
+				__be32 qpn = bth->destQP;
+				bth->destQP = deth->srcQP;
+				deth->srcQP = qpn;
+			}
+
+			footer = packet + length - sizeof(*footer);
+			footer->pib.port_guid = cpu_to_be64(port_guid);
+
+			send_msgs[count].msg_hdr = msgs[i].msg_hdr;
+			send_msgs[count].msg_hdr.msg_iov->iov_len = length;
+
+			if (!direct) {
+				send_msgs[count].msg_hdr.msg_name    = &target;
+				send_msgs[count].msg_hdr.msg_namelen = sizeof(target);
+			}
+
+			count++;
+		}
+
+		while (sent < count) {
+			ret = sendmmsg(sockfd, send_msgs + sent, count - sent, 0);
+			if (ret < 0) {
+				if ((errno == EINTR) || (errno == EAGAIN) || (errno == ENOBUFS) || (errno == ECONNREFUSED))
+					break;
+
+				fprintf(stderr, "pibgen: sendmmsg(errno=%d)\n", errno);
+				exit(EXIT_FAILURE);
+			}
+			sent += ret;
+		}
+
+		reflected += sent;
+
+		now = get_time();
+
+		if (verbose && (next_report <= now)) {
+			printf("%6.1f s: reflected %10" PRIu64 " pps\n",
+			       (double)(now - start) / NSEC_PER_SEC, reflected - last_reflected);
+			fflush(stdout);
+
+			last_reflected = reflected;
+			next_report    = now + NSEC_PER_SEC;
+		}
+	}
+
+	printf("pibgen: reflected %" PRIu64 " packets\n", reflected);
+
+	for (i=0 ; i<batch_size ; i++)
+		free(iovecs[i].iov_base);
+}
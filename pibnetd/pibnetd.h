@@ -8,6 +8,9 @@
 #ifndef _PIBNETD_H_
 #define _PIBNETD_H_
 
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <infiniband/verbs.h>
@@ -34,8 +37,40 @@
 #define PIB_DRIVER_REVISION	(1)
 
 #define PIB_NETD_DEFAULT_PORT	        (8432)
+#define PIB_NETD_RECV_BATCH		(64)  /* datagrams per recvmmsg */
+#define PIB_NETD_SEND_BATCH		(256) /* datagrams per sendmmsg */
+#define PIB_NETD_MAX_THREADS		(64)
+#define PIB_NETD_MAX_SWITCHES		(1024)
+#define PIB_NETD_MAX_HOPS		(64)  /* switch-to-switch hops inside pibnetd */
+#define PIB_SWITCH_NAME_LEN		(32)
+#define PIB_NETD_LID_MAP_INTERVAL	(100) /* msec between LID map updates */
 
-#define PIB_MAX_PORTS		        (32 + 1)
+#define PIB_NETD_URING_SQ_ENTRIES	(256)
+#define PIB_NETD_URING_CQ_ENTRIES	(4096)
+#define PIB_NETD_URING_NR_BUFFERS	(256)  /* provided receive buffers, power of 2 */
+#define PIB_NETD_URING_SEND_SLOTS	(1024) /* sendmsg requests in flight */
+
+#define PIB_NETD_WHEEL_SLOTS		(4096)   /* power of 2 */
+#define PIB_NETD_WHEEL_TICK		(100000) /* nsec per slot of the timing wheel */
+#define PIB_NETD_DEFAULT_REORDER_DELAY	(1000)   /* usec */
+
+#define PIB_NETD_CAPTURE_RING_SIZE	(4 * 1024 * 1024) /* bytes per worker, power of 2 */
+#define PIB_NETD_CAPTURE_INTERVAL	(10)   /* msec the writer sleeps when idle */
+
+#define PIB_NETD_LOG_RING_SLOTS		(1024) /* power of 2 */
+#define PIB_NETD_LOG_MESSAGE_LEN	(512)
+#define PIB_NETD_LOG_RATE_LIMIT		(10)   /* messages per second per call site */
+#define PIB_NETD_LOG_INTERVAL		(10)   /* msec the writer sleeps when idle */
+
+#define PIB_NETD_SNAPSHOT_INTERVAL	(1000) /* msec between snapshots of the switch state */
+
+#define PIB_NETD_METRICS_LATENCY_BUCKETS (21) /* 1 usec to 2^20 usec in powers of 2 */
+#define PIB_NETD_METRICS_BATCH_BUCKETS	(9)   /* 1 to 256 packets in powers of 2 */
+
+#define PIB_DEFAULT_SWITCH_RADIX	(32)
+#define PIB_MAX_PORTS		        (254 + 1)
+#define PIB_PORT_GUID_HASH_BITS		(10)
+#define PIB_PORT_GUID_HASH_SIZE		(1U << PIB_PORT_GUID_HASH_BITS)
 
 #define PIB_MAX_LID			(0x10000)
 #define PIB_MCAST_LID_BASE		(0x0C000)
@@ -79,6 +114,7 @@ enum pib_link_cmd {
 	PIB_LINK_CMD_DISCONNECT,
 	PIB_LINK_CMD_DISCONNECT_ACK,
 	PIB_LINK_SHUTDOWN,
+	PIB_LINK_CMD_LID_MAP,	/* pibnetd -> pib.ko: LID からホストのアドレスへの対応表 */
 };
 
 
@@ -175,6 +211,20 @@ struct pib_port_perf {
 };
 
 
+/*
+ *  Traffic counted by a worker without locking, indexed by
+ *  sw->port_base + port number.
+ */
+struct pib_port_traffic {
+	uint64_t		xmit_data;
+	uint64_t		rcv_data;
+	uint64_t		xmit_packets;
+	uint64_t		rcv_packets;
+	uint64_t		xmit_discards; /* dropped by link emulation */
+	uint64_t		xmit_wait;     /* [usec] held back by the rate limit */
+};
+
+
 struct pib_port {
 	uint8_t			port_num;
 	struct ibv_port_attr	ibv_port_attr;
@@ -192,32 +242,122 @@ struct pib_port {
 	uint8_t			overrun_errors;
 
 	struct pib_port_perf	perf;
+	struct pib_port_traffic	merged; /* all traffic folded into perf, never cleared */
 
 	union ibv_gid		gid[PIB_GID_PER_PORT];
 	uint16_t		pkey_table[PIB_PKEY_TABLE_LEN];
 
+	struct pib_switch      *sw;
+
 	uint64_t		port_guid;
+	struct pib_port	       *port_guid_next; /* next port in the same hash bucket */
 	struct sockaddr        *sockaddr;
 	socklen_t		socklen;
+
+	/* The port of another switch in this process linked to this port */
+	struct pib_port	       *peer;
+
+	/* Link emulation of packets going out to the host (NULL: no shaping) */
+	struct pib_link_shaping *shaping;
+	uint64_t		shaping_clock; /* departure time of the last byte queued [nsec] */
+};
+
+
+/*
+ *  Parameters of link emulation, loaded from the file given by --shaping.
+ */
+struct pib_link_shaping {
+	uint32_t		delay;		/* one-way delay [usec] */
+	uint64_t		rate;		/* [bytes/sec], 0 means unlimited */
+	uint32_t		burst;		/* depth of the token bucket [bytes] */
+	uint32_t		queue_limit;	/* packets beyond it are dropped [bytes] */
+	uint32_t		loss;		/* [ppm] */
+	uint32_t		reorder;	/* [ppm] */
+	uint32_t		reorder_delay;	/* extra delay of reordered packets [usec] */
+	uint32_t		duplicate;	/* [ppm] */
+};
+
+
+/*
+ *  A copy of a packet held in the timing wheel until its departure time.
+ */
+struct pib_delayed_packet {
+	struct pib_delayed_packet *next;
+	uint64_t		time;		/* [nsec] of CLOCK_MONOTONIC */
+	struct sockaddr_in	sockaddr;
+	socklen_t		socklen;
+	int			perf_index;
+	size_t			length;
+	uint8_t			data[];
 };
 
 
-struct pib_port_bits {
-	uint16_t		pm_blocks[16]; /* portmask blocks */
+struct pib_timing_wheel {
+	uint64_t		current;	/* the tick not yet expired */
+	int			nr_packets;
+	struct pib_delayed_packet *heads[PIB_NETD_WHEEL_SLOTS];
+	struct pib_delayed_packet *tails[PIB_NETD_WHEEL_SLOTS];
 };
 
 
+struct pib_worker;
+struct pib_switch;
+
 struct pib_control {
-	void                   *buffer; /* buffer for sendmsg/recvmsg */
-	int 			sockfd;
+	int			nr_workers;
+	struct pib_worker      *workers;
+	int			stopfd; /* eventfd to stop all workers */
 	struct sockaddr        *sockaddr;
+
+	/*
+	 * Workers hold it shared while relaying a batch of packets, and take
+	 * it exclusively to process link commands and MADs that may update
+	 * ports or forwarding tables of any switch.
+	 */
+	pthread_rwlock_t	lock;
+
+	int			nr_switches;
+	struct pib_switch     **switches;
+	int			nr_ports; /* the sum of port_cnt of all switches */
+
+	/* 接続中のホストのポートを port_guid から引くハッシュ */
+	struct pib_port	       *port_guid_hash[PIB_PORT_GUID_HASH_SIZE];
+
+	/*
+	 * Set when the forwarding tables or the connected hosts change.
+	 * A worker then sends the LID map to every host, at most once
+	 * per PIB_NETD_LID_MAP_INTERVAL.
+	 */
+	int			lid_map_dirty;
+	uint64_t		lid_map_time; /* msec of CLOCK_MONOTONIC */
+	int			direct_mode;  /* publish host addresses in the LID map (--direct) */
+
+	const char	       *shaping_file; /* reloaded on SIGUSR1 */
+
+	struct pib_capture     *capture; /* NULL unless --capture */
+	struct pib_metrics     *metrics; /* NULL unless --metrics */
+	struct pib_worker_metrics *worker_metrics; /* [nr_workers] */
+
+	/*
+	 * Set when the state of the switches changes. A worker then writes
+	 * a snapshot, at most once per PIB_NETD_SNAPSHOT_INTERVAL.
+	 */
+	int			snapshot_dirty;
+	struct pib_snapshot    *snapshot; /* NULL unless --snapshot */
 };
 
 
 struct pib_switch {
 	struct pib_control     *control;
+	int			index;
+	char			name[PIB_SWITCH_NAME_LEN];
+	char			description[64]; /* NodeDescription */
+	uint64_t		guid_base;
+	int			port_base; /* index of port 0 in per-worker counters */
+
 	uint8_t                 port_cnt; /* include port 0 */
-	struct pib_port	        ports[PIB_MAX_PORTS];
+	uint8_t			pm_block_cnt; /* portmask blocks per MLID */
+	struct pib_port	       *ports;
 
 	uint16_t		linear_fdb_top;
 	uint8_t			default_port;
@@ -227,10 +367,36 @@ struct pib_switch {
 	uint8_t			port_state_change;
 
 	uint8_t		       *ucast_fwd_table;
-	struct pib_port_bits   *mcast_fwd_table;
+	uint16_t	       *mcast_fwd_table; /* pm_block_cnt portmask blocks per MLID */
+};
+
+
+struct pib_topology_switch {
+	char			name[PIB_SWITCH_NAME_LEN];
+	int			radix;
+};
+
+
+struct pib_topology_link {
+	int			switch_index[2];
+	int			port_num[2];
 };
 
 
+struct pib_topology {
+	int				nr_switches;
+	struct pib_topology_switch     *switches;
+	int				nr_links;
+	struct pib_topology_link       *links;
+};
+
+
+static inline uint16_t *pib_get_mcast_pm_blocks(struct pib_switch *sw, uint16_t mlid)
+{
+	return &sw->mcast_fwd_table[(mlid - PIB_MCAST_LID_BASE) * sw->pm_block_cnt];
+}
+
+
 extern struct pib_control pib_control;
 extern uint64_t pib_hca_guid_base;
 
@@ -238,24 +404,161 @@ struct pib_smp;
 
 extern int pib_process_smp(struct pib_smp *smp, struct pib_switch *sw, uint8_t in_port_num);
 extern int pib_process_pma_mad(struct pib_pma_mad *pmp, struct pib_switch *sw, uint8_t port_num);
+extern void pib_merge_port_traffic(struct pib_switch *sw, uint8_t port_num);
+extern struct pib_topology *pib_load_topology(const char *filename, int default_radix);
 
-#define pib_report_debug(fmt, ...)					\
+extern int pib_load_link_shaping(struct pib_control *control, const char *filename);
+extern void pib_wheel_init(struct pib_timing_wheel *wheel, uint64_t now);
+extern void pib_wheel_insert(struct pib_timing_wheel *wheel, struct pib_delayed_packet *packet);
+extern struct pib_delayed_packet *pib_wheel_expire(struct pib_timing_wheel *wheel, uint64_t now);
+extern int pib_wheel_next_time(struct pib_timing_wheel *wheel, uint64_t *time_p);
+
+/*
+ *  pcapng capture (capture.c)
+ */
+enum pib_capture_direction {
+	PIB_CAPTURE_INBOUND	= 1,	/* from the host to the switch */
+	PIB_CAPTURE_OUTBOUND		/* from the switch to the host */
+};
+
+enum {
+	PIB_CAPTURE_FILTER_LID	  = 1U << 0, /* SLID or DLID */
+	PIB_CAPTURE_FILTER_QPN	  = 1U << 1, /* Destination QP */
+	PIB_CAPTURE_FILTER_OPCODE = 1U << 2
+};
+
+struct pib_capture;
+
+extern struct pib_capture *pib_capture_open(struct pib_control *control, const char *filename, const char *filter, uint32_t snaplen);
+extern void pib_capture_start(struct pib_capture *capture);
+extern void pib_capture_close(struct pib_capture *capture);
+extern void pib_capture_packet(struct pib_capture *capture, int worker_id, int if_index, int direction, const void *packet, size_t length);
+
+/*
+ *  Metrics endpoint (metrics.c)
+ */
+enum pib_drop_reason {
+	PIB_DROP_BAD_FOOTER,	/* too short or port GUID 0 */
+	PIB_DROP_BAD_HEADER,
+	PIB_DROP_UNKNOWN_GUID,	/* from a host that is not connected */
+	PIB_DROP_BAD_QPN,
+	PIB_DROP_BAD_MAD,
+	PIB_DROP_NO_LFT_ENTRY,
+	PIB_DROP_NOT_FOR_SWITCH, /* non-MAD packets destined to the switch */
+	PIB_DROP_PORT_DOWN,	/* forwarded to a port without a host */
+	PIB_DROP_HOP_LIMIT,
+	PIB_NR_DROP_REASONS
+};
+
+struct pib_lid_traffic {
+	uint64_t		packets;
+	uint64_t		data;
+};
+
+/*
+ *  Each worker updates only its own counters, and the metrics thread reads
+ *  them without locking. Histograms count in buckets of powers of 2, and
+ *  the last bucket counts values above them.
+ */
+struct pib_worker_metrics {
+	uint64_t		drops[PIB_NR_DROP_REASONS];
+	uint64_t		latency[PIB_NETD_METRICS_LATENCY_BUCKETS + 1]; /* [usec] per packet */
+	uint64_t		latency_sum; /* [nsec] */
+	uint64_t		recv_batch[PIB_NETD_METRICS_BATCH_BUCKETS + 1];
+	uint64_t		send_batch[PIB_NETD_METRICS_BATCH_BUCKETS + 1];
+	struct pib_lid_traffic *lids; /* indexed by DLID, NULL unless --metrics */
+} __attribute__((aligned(64)));
+
+struct pib_metrics;
+
+extern struct pib_metrics *pib_metrics_open(struct pib_control *control, const char *path);
+extern void pib_metrics_start(struct pib_metrics *metrics);
+extern void pib_metrics_close(struct pib_metrics *metrics);
+extern void pib_sum_port_traffic(struct pib_switch *sw, uint8_t port_num, struct pib_port_traffic *sum);
+
+/*
+ *  Snapshot of the switch state for warm restart (snapshot.c)
+ */
+struct pib_snapshot;
+
+extern struct pib_snapshot *pib_snapshot_open(struct pib_control *control, const char *filename, int restore);
+extern void pib_snapshot_save(struct pib_snapshot *snapshot, struct pib_control *control);
+extern void pib_snapshot_close(struct pib_snapshot *snapshot, struct pib_control *control);
+
+/*
+ *  io_uring engine (uring.c)
+ */
+struct pib_uring;
+
+enum pib_uring_event_type {
+	PIB_URING_EVENT_RECV = 1,	/* a datagram was received */
+	PIB_URING_EVENT_SEND,		/* a sendmsg request completed */
+	PIB_URING_EVENT_STOP,		/* the stop eventfd became readable */
+	PIB_URING_EVENT_TIMER,		/* the timerfd of the timing wheel expired */
+	PIB_URING_EVENT_UNSUPPORTED,	/* the kernel can't run multishot recvmsg */
+};
+
+struct pib_uring_event {
+	enum pib_uring_event_type type;
+	void		       *packet;     /* RECV */
+	int			size;	    /* RECV: datagram size, SEND: result of sendmsg, UNSUPPORTED: -errno */
+	struct sockaddr	       *sockaddr;   /* RECV */
+	int			buf_id;	    /* RECV: release with pib_uring_put_buffer() */
+	int			perf_index; /* SEND */
+};
+
+extern struct pib_uring *pib_uring_create(int sockfd, int stopfd, int timerfd);
+extern void pib_uring_destroy(struct pib_uring *uring);
+extern int pib_uring_wait(struct pib_uring *uring, int timeout, const sigset_t *sigmask);
+extern int pib_uring_next_event(struct pib_uring *uring, struct pib_uring_event *event);
+extern void pib_uring_put_buffer(struct pib_uring *uring, int buf_id);
+extern int pib_uring_sendmsg(struct pib_uring *uring, const struct msghdr *msghdr, int perf_index);
+
+/*
+ *  Logging (logger.c)
+ *
+ *  Messages below pib_log_level are discarded before being formatted, and
+ *  each call site prints at most PIB_NETD_LOG_RATE_LIMIT messages a second.
+ */
+enum pib_log_level {
+	PIB_LOG_ERR	= 0,
+	PIB_LOG_INFO,
+	PIB_LOG_DEBUG
+};
+
+struct pib_log_site {
+	const char	       *filename;
+	int			lineno;
+	uint64_t		window;	/* second of CLOCK_MONOTONIC */
+	uint32_t		count;
+	uint32_t		suppressed;
+};
+
+extern volatile int pib_log_level;
+
+#define __pib_report(level, func, fmt, ...)				\
 	do {								\
-		__pib_report_debug(__FILE__, __LINE__, fmt, ##__VA_ARGS__); \
+		static struct pib_log_site __pib_log_site = {		\
+			.filename = __FILE__, .lineno = __LINE__ };	\
+		if ((level) <= pib_log_level)				\
+			func(&__pib_log_site, fmt, ##__VA_ARGS__);		\
 	} while(0)
 
+#define pib_report_debug(fmt, ...)					\
+	__pib_report(PIB_LOG_DEBUG, __pib_report_debug, fmt, ##__VA_ARGS__)
+
 #define pib_report_info(fmt, ...)					\
-	do {								\
-		__pib_report_info(__FILE__, __LINE__, fmt, ##__VA_ARGS__);	\
-	} while(0)
+	__pib_report(PIB_LOG_INFO, __pib_report_info, fmt, ##__VA_ARGS__)
 
 #define pib_report_err(fmt, ...)						\
-	do {								\
-		__pib_report_err(__FILE__, __LINE__, fmt, ##__VA_ARGS__);	\
-	} while(0)
+	__pib_report(PIB_LOG_ERR, __pib_report_err, fmt, ##__VA_ARGS__)
+
+extern void __pib_report_debug(struct pib_log_site *site, const char *format, ...);
+extern void __pib_report_info(struct pib_log_site *site, const char *format, ...);
+extern void __pib_report_err(struct pib_log_site *site, const char *format, ...);
 
-extern void __pib_report_debug(const char *filename, int lineno, const char *format, ...);
-extern void __pib_report_info(const char *filename, int lineno, const char *format, ...);
-extern void __pib_report_err(const char *filename, int lineno, const char *format, ...);
+extern void pib_logger_init(void);
+extern void pib_logger_start(void);
+extern void pib_logger_stop(void);
 
 #endif /* _PIBNETD_H_ */
@@ -152,11 +152,38 @@ struct pib_packet_deth {
 } __attribute__ ((packed));
 
 
+/* RDMA Extended Transport Header */
+struct pib_packet_reth {
+	__be64	vaddr;	/* Virtual Address */
+	__be32	rkey;	/* Remote Key */
+	__be32	dmalen;	/* DMA Length */
+} __attribute__ ((packed));
+
+
 struct pib_packet_link {
 	__be32	cmd;
 } __attribute__ ((packed));
 
 
+/*
+ * PIB_LINK_CMD_LID_MAP の本体。first_lid から last_lid までの LID のうち
+ * entries に無いものは pibnetd 経由で送る。
+ */
+struct pib_packet_lid_map {
+	__be16	first_lid;
+	__be16	last_lid;
+	__be16	nr_entries;
+	__be16	reserved;
+} __attribute__ ((packed));
+
+
+struct pib_packet_lid_map_entry {
+	__be16	lid;
+	__be16	udp_port;
+	__be32	ipv4_addr;
+} __attribute__ ((packed));
+
+
 union pib_packet_footer {
 	struct {
 		__be16	vcrc; /* Variant CRC */
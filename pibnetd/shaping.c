@@ -0,0 +1,384 @@
+/*
+ * shaping.c - Link emulation (delay, rate, loss, reordering and duplication)
+ *
+ * Copyright (c) 2014 Minoru NAKAMURA <nminoru@nminoru.jp>
+ *
+ * This code is licenced under the GPL version 2 or BSD license.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "pibnetd.h"
+
+/*
+ *  シェーピングファイルは 1 行に 1 つの定義を書く。'#' 以降はコメント。
+ *
+ *    <switch>|* <port>|* <key>=<value> ...
+ *
+ *    delay=<usec>  rate=<Mbit/s>  burst=<bytes>  queue=<bytes>
+ *    loss=<%>  reorder=<%>  reorder_delay=<usec>  duplicate=<%>
+ *
+ *  ポートからホストへ送り出すパケットに適用する。1 つのポートに複数の行が
+ *  一致した場合は最後の行が有効になる。
+ */
+
+#define DEFAULT_QUEUE_LIMIT	(1024 * 1024)
+
+static int parse_line(char *line, struct pib_link_shaping *shaping, char **switch_name_p, int *port_num_p, const char **message_p);
+static int parse_percent(const char *value, uint32_t *ppm_p);
+static int parse_uint(const char *value, uint64_t max, uint64_t *result_p);
+
+
+int pib_load_link_shaping(struct pib_control *control, const char *filename)
+{
+	FILE *fp;
+	int i, lineno = 0, nr_shaped = 0;
+	char line[512];
+	struct pib_link_shaping **table;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		int eno = errno;
+		pib_report_err("pibnetd: fopen(%s, errno=%d)", filename, eno);
+		return -1;
+	}
+
+	/* 途中でエラーになっても今の設定を壊さないよう、一度別の表に読み込む */
+	table = calloc(control->nr_ports, sizeof(*table));
+	assert(table);
+
+	while (fgets(line, sizeof(line), fp)) {
+		int ret, port_num, matched = 0;
+		char *p, *switch_name;
+		const char *message;
+		struct pib_link_shaping shaping;
+
+		lineno++;
+
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+
+		ret = parse_line(line, &shaping, &switch_name, &port_num, &message);
+		if (ret == 0)
+			continue;
+
+		if (ret < 0) {
+			pib_report_err("pibnetd: %s(%d): %s", filename, lineno, message);
+			goto error;
+		}
+
+		for (i=0 ; i<control->nr_switches ; i++) {
+			struct pib_switch *sw = control->switches[i];
+			int first, last, j;
+
+			if ((strcmp(switch_name, "*") != 0) && (strcmp(switch_name, sw->name) != 0))
+				continue;
+
+			first = (port_num < 0) ? 1               : port_num;
+			last  = (port_num < 0) ? sw->port_cnt - 1 : port_num;
+
+			for (j=first ; j<=last && j<sw->port_cnt ; j++) {
+				struct pib_link_shaping **entry;
+
+				/* スイッチ間のリンクは pibnetd の中で閉じているので対象外 */
+				if (sw->ports[j].peer)
+					continue;
+
+				entry = &table[sw->port_base + j];
+				if (*entry == NULL) {
+					*entry = malloc(sizeof(**entry));
+					assert(*entry);
+				}
+				**entry = shaping;
+				matched = 1;
+			}
+		}
+
+		if (!matched) {
+			pib_report_err("pibnetd: %s(%d): no host port matches", filename, lineno);
+			goto error;
+		}
+	}
+
+	fclose(fp);
+
+	for (i=0 ; i<control->nr_switches ; i++) {
+		struct pib_switch *sw = control->switches[i];
+		int j;
+
+		for (j=1 ; j<sw->port_cnt ; j++) {
+			struct pib_port *port = &sw->ports[j];
+
+			free(port->shaping);
+			port->shaping	    = table[sw->port_base + j];
+			port->shaping_clock = 0;
+
+			if (port->shaping)
+				nr_shaped++;
+		}
+	}
+
+	free(table);
+
+	pib_report_info("pibnetd: link shaping on %d ports from %s", nr_shaped, filename);
+
+	return 0;
+
+error:
+	fclose(fp);
+
+	for (i=0 ; i<control->nr_ports ; i++)
+		free(table[i]);
+	free(table);
+
+	return -1;
+}
+
+
+/*
+ *  1 行を解析する。空行なら 0、定義なら 1、エラーなら -1 を返す。
+ *  port_num が -1 なら全ポートを表す。
+ */
+static int parse_line(char *line, struct pib_link_shaping *shaping, char **switch_name_p, int *port_num_p, const char **message_p)
+{
+	char *switch_name, *port, *param;
+	uint64_t value;
+
+	switch_name = strtok(line, " \t\r\n");
+	if (switch_name == NULL)
+		return 0;
+
+	port = strtok(NULL, " \t\r\n");
+	if (port == NULL) {
+		*message_p = "a line needs a switch name and a port number";
+		return -1;
+	}
+
+	if (strcmp(port, "*") == 0)
+		*port_num_p = -1;
+	else if (parse_uint(port, PIB_MAX_PORTS - 1, &value) == 0 && value != 0)
+		*port_num_p = (int)value;
+	else {
+		*message_p = "port number out of range";
+		return -1;
+	}
+
+	*switch_name_p = switch_name;
+
+	memset(shaping, 0, sizeof(*shaping));
+	shaping->reorder_delay = PIB_NETD_DEFAULT_REORDER_DELAY;
+
+	while ((param = strtok(NULL, " \t\r\n")) != NULL) {
+		char *eq = strchr(param, '=');
+		int ret;
+
+		if (eq == NULL) {
+			*message_p = "a parameter must be <key>=<value>";
+			return -1;
+		}
+
+		*eq++ = '\0';
+
+		if (strcmp(param, "delay") == 0) {
+			ret = parse_uint(eq, UINT32_MAX, &value);
+			shaping->delay = (uint32_t)value;
+		} else if (strcmp(param, "rate") == 0) {
+			ret = parse_uint(eq, 1000000, &value); /* up to 1 Tbit/s */
+			shaping->rate = value * 1000000 / 8;
+		} else if (strcmp(param, "burst") == 0) {
+			ret = parse_uint(eq, UINT32_MAX, &value);
+			shaping->burst = (uint32_t)value;
+		} else if (strcmp(param, "queue") == 0) {
+			ret = parse_uint(eq, UINT32_MAX, &value);
+			shaping->queue_limit = (uint32_t)value;
+		} else if (strcmp(param, "loss") == 0) {
+			ret = parse_percent(eq, &shaping->loss);
+		} else if (strcmp(param, "reorder") == 0) {
+			ret = parse_percent(eq, &shaping->reorder);
+		} else if (strcmp(param, "reorder_delay") == 0) {
+			ret = parse_uint(eq, UINT32_MAX, &value);
+			shaping->reorder_delay = (uint32_t)value;
+		} else if (strcmp(param, "duplicate") == 0) {
+			ret = parse_percent(eq, &shaping->duplicate);
+		} else {
+			*message_p = "unknown parameter";
+			return -1;
+		}
+
+		if (ret < 0) {
+			*message_p = "invalid parameter value";
+			return -1;
+		}
+	}
+
+	if (shaping->rate > 0) {
+		/* 少なくとも最大長のパケット 1 つ分は溜められるようにする */
+		if (shaping->burst < PIB_PACKET_BUFFER)
+			shaping->burst = PIB_PACKET_BUFFER;
+		if (shaping->queue_limit == 0)
+			shaping->queue_limit = DEFAULT_QUEUE_LIMIT;
+		if (shaping->queue_limit < PIB_PACKET_BUFFER)
+			shaping->queue_limit = PIB_PACKET_BUFFER;
+	}
+
+	return 1;
+}
+
+
+static int parse_percent(const char *value, uint32_t *ppm_p)
+{
+	char *end;
+	double percent;
+
+	errno = 0;
+	percent = strtod(value, &end);
+	if ((errno != 0) || (end == value) || (*end != '\0') || (percent < 0.0) || (100.0 < percent))
+		return -1;
+
+	*ppm_p = (uint32_t)(percent * 10000.0 + 0.5);
+
+	return 0;
+}
+
+
+static int parse_uint(const char *value, uint64_t max, uint64_t *result_p)
+{
+	char *end;
+	unsigned long long result;
+
+	if ((*value < '0') || ('9' < *value))
+		return -1;
+
+	errno = 0;
+	result = strtoull(value, &end, 10);
+	if ((errno != 0) || (*end != '\0') || (max < result))
+		return -1;
+
+	*result_p = result;
+
+	return 0;
+}
+
+
+/******************************************************************************/
+/* Timing wheel                                                               */
+/******************************************************************************/
+
+/*
+ *  送出時刻を PIB_NETD_WHEEL_TICK 単位のスロットに振り分ける。
+ *  PIB_NETD_WHEEL_SLOTS 周以上先のパケットも同じスロットに入れて、
+ *  期限が来るまで残しておく。同じスロットの中は挿入順を保つ。
+ */
+
+void pib_wheel_init(struct pib_timing_wheel *wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(*wheel));
+
+	wheel->current = now / PIB_NETD_WHEEL_TICK;
+}
+
+
+void pib_wheel_insert(struct pib_timing_wheel *wheel, struct pib_delayed_packet *packet)
+{
+	uint64_t tick;
+	int slot;
+
+	tick = packet->time / PIB_NETD_WHEEL_TICK;
+	if (tick < wheel->current)
+		tick = wheel->current;
+
+	slot = tick & (PIB_NETD_WHEEL_SLOTS - 1);
+
+	packet->next = NULL;
+
+	if (wheel->tails[slot])
+		wheel->tails[slot]->next = packet;
+	else
+		wheel->heads[slot] = packet;
+
+	wheel->tails[slot] = packet;
+	wheel->nr_packets++;
+}
+
+
+/*
+ *  送出時刻が now 以前のパケットを取り出し、送出時刻の若いスロット順に
+ *  つないだリストを返す。
+ */
+struct pib_delayed_packet *pib_wheel_expire(struct pib_timing_wheel *wheel, uint64_t now)
+{
+	uint64_t i, now_tick, nr_ticks;
+	struct pib_delayed_packet *head = NULL, **tail = &head;
+
+	now_tick = now / PIB_NETD_WHEEL_TICK;
+
+	if ((wheel->nr_packets == 0) || (now_tick < wheel->current)) {
+		if (wheel->current < now_tick)
+			wheel->current = now_tick;
+		return NULL;
+	}
+
+	nr_ticks = now_tick - wheel->current + 1;
+	if (PIB_NETD_WHEEL_SLOTS < nr_ticks)
+		nr_ticks = PIB_NETD_WHEEL_SLOTS;
+
+	for (i=0 ; i<nr_ticks ; i++) {
+		int slot = (wheel->current + i) & (PIB_NETD_WHEEL_SLOTS - 1);
+		struct pib_delayed_packet *packet, **link, *last = NULL;
+
+		link = &wheel->heads[slot];
+
+		while ((packet = *link) != NULL) {
+			if (packet->time <= now) {
+				*link = packet->next;
+				packet->next = NULL;
+				*tail = packet;
+				tail  = &packet->next;
+				wheel->nr_packets--;
+			} else {
+				last = packet;
+				link = &packet->next;
+			}
+		}
+
+		wheel->tails[slot] = last;
+	}
+
+	/* now_tick のスロットには now より後のパケットが残りうるので次回も見る */
+	wheel->current = now_tick;
+
+	return head;
+}
+
+
+/*
+ *  次にタイマーを起こす時刻を返す。精度はスロット単位。
+ */
+int pib_wheel_next_time(struct pib_timing_wheel *wheel, uint64_t *time_p)
+{
+	uint64_t i;
+
+	if (wheel->nr_packets == 0)
+		return 0;
+
+	for (i=0 ; i<PIB_NETD_WHEEL_SLOTS ; i++) {
+		int slot = (wheel->current + i) & (PIB_NETD_WHEEL_SLOTS - 1);
+
+		if (wheel->heads[slot] == NULL)
+			continue;
+
+		/* 現在のスロットに残っているのは now より後のパケットだけ */
+		*time_p = (wheel->current + i + (i == 0)) * PIB_NETD_WHEEL_TICK;
+
+		return 1;
+	}
+
+	assert(0);
+
+	return 0;
+}
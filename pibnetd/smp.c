@@ -54,6 +54,7 @@ int pib_process_smp(struct pib_smp *smp, struct pib_switch *sw, uint8_t in_port_
 		return process_smp_get_method(smp, sw, in_port_num);
 
 	case PIB_MGMT_METHOD_SET:
+		sw->control->snapshot_dirty = 1;
 		ret = process_smp_set_method(smp, sw, in_port_num);
 		if (smp->status & ~PIB_SMP_DIRECTION)
 			return ret;
@@ -182,7 +183,7 @@ static int subn_get_nodedescription(struct pib_smp *smp, struct pib_switch *sw,
 	if (smp->attr_mod)
 		smp->status |= PIB_SMP_INVALID_FIELD;
 
-	strncpy((char*)smp->data, PIB_SWITCH_DESCRIPTION, 64);
+	strncpy((char*)smp->data, sw->description, 64);
 
 	return reply(smp);
 }
@@ -198,9 +199,9 @@ static int subn_get_nodeinfo(struct pib_smp *smp, struct pib_switch *sw, u8 in_p
 	node_info->class_version	= PIB_MGMT_CLASS_VERSION;
 	node_info->node_type		= IBV_NODE_SWITCH;
 	node_info->node_ports		= sw->port_cnt - 1;
-	node_info->sys_image_guid	= cpu_to_be64(pib_hca_guid_base | 0x0200ULL);
-	node_info->node_guid		= cpu_to_be64(pib_hca_guid_base | 0x0100ULL);
-	node_info->port_guid		= cpu_to_be64(pib_hca_guid_base | 0x0100ULL);
+	node_info->sys_image_guid	= cpu_to_be64(sw->guid_base | 0x0200ULL);
+	node_info->node_guid		= cpu_to_be64(sw->guid_base | 0x0100ULL);
+	node_info->port_guid		= cpu_to_be64(sw->guid_base | 0x0100ULL);
 	node_info->partition_cap	= cpu_to_be16(1); /* @todo */
 	node_info->device_id		= cpu_to_be16(PIB_DRIVER_DEVICE_ID);
 	node_info->revision		= cpu_to_be32(PIB_DRIVER_REVISION);
@@ -657,6 +658,8 @@ static int subn_set_linear_forward_table(struct pib_smp *smp, struct pib_switch
 	for (i = 0 ; i < 64 ; i++)
 		sw->ucast_fwd_table[attr_mod * 64 + i] = table[i];
 
+	sw->control->lid_map_dirty = 1;
+
 bail:
 	return reply(smp);
 }
@@ -695,6 +698,8 @@ static int subn_set_random_forward_table(struct pib_smp *smp, struct pib_switch
 			(value & 0xFFU) : sw->default_port;
 	}
 
+	sw->control->lid_map_dirty = 1;
+
 bail:
 	return reply(smp);
 }
@@ -711,9 +716,15 @@ static int subn_get_mcast_forward_table(struct pib_smp *smp, struct pib_switch *
 	mcast_lid_offset = (attr_mod & 0xFF) * 32;
 	port_index       = (attr_mod >> 28);
 
+	if (sw->pm_block_cnt <= port_index) {
+		smp->status |= PIB_SMP_INVALID_FIELD;
+		goto bail;
+	}
+
 	for (i=0 ; i<32 ; i++)
-		table[i] = cpu_to_be16(sw->mcast_fwd_table[mcast_lid_offset + i].pm_blocks[port_index]);
+		table[i] = cpu_to_be16(pib_get_mcast_pm_blocks(sw, PIB_MCAST_LID_BASE + mcast_lid_offset + i)[port_index]);
 
+bail:
 	return reply(smp);
 }
 
@@ -729,10 +740,16 @@ static int subn_set_mcast_forward_table(struct pib_smp *smp, struct pib_switch *
 	mcast_lid_offset = (attr_mod & 0xFF) * 32;
 	port_index       = (attr_mod >> 28);
 
+	if (sw->pm_block_cnt <= port_index) {
+		smp->status |= PIB_SMP_INVALID_FIELD;
+		goto bail;
+	}
+
 	for (i=0 ; i<32 ; i++)
-		sw->mcast_fwd_table[mcast_lid_offset + i].pm_blocks[port_index] =
+		pib_get_mcast_pm_blocks(sw, PIB_MCAST_LID_BASE + mcast_lid_offset + i)[port_index] =
 			be16_to_cpu(table[i]);
 
+bail:
 	return reply(smp);
 }
 
@@ -0,0 +1,600 @@
+/*
+ * snapshot.c - Persistent snapshot of the switch state for warm restart
+ *
+ * Copyright (c) 2014 Minoru NAKAMURA <nminoru@nminoru.jp>
+ *
+ * This code is licenced under the GPL version 2 or BSD license.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pibnetd.h"
+
+/*
+ *  スナップショットファイルはヘッダーと 2 つのイメージからなり、mmap して
+ *  交互に書き込む。イメージは generation を 0 にしてから本体を書き、
+ *  チェックサムを計算してから最後に generation を書く。pibnetd が書き込みの
+ *  途中で落ちても、もう一方のイメージが残る。
+ *
+ *    header | image 0 | image 1   (それぞれページ境界から始まる)
+ *    image = image header | switch 0 | ... | switch N-1
+ *    switch = pib_snapshot_switch | pib_snapshot_port * port_cnt | LFT | MFT
+ *
+ *  ファブリックの形 (スイッチの名前・ポート数・スイッチ間リンク) が
+ *  起動時と違うスナップショットは読み込まない。
+ */
+
+#define PIB_SNAPSHOT_MAGIC	"PIBSNAP"
+#define PIB_SNAPSHOT_VERSION	(1)
+#define PIB_SNAPSHOT_PAGE_SIZE	(4096)
+
+
+struct pib_snapshot_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		nr_switches;
+	uint32_t		nr_ports;
+	uint32_t		reserved;
+	uint64_t		image_size;
+	uint64_t		hca_guid_base;
+};
+
+
+struct pib_snapshot_image {
+	uint64_t		generation; /* 0: not valid */
+	uint64_t		checksum;   /* of the switches following this */
+	uint64_t		time;	    /* [sec] of CLOCK_REALTIME */
+	uint64_t		reserved;
+};
+
+
+struct pib_snapshot_switch {
+	char			name[PIB_SWITCH_NAME_LEN];
+	uint32_t		port_cnt;
+	uint16_t		linear_fdb_top;
+	uint8_t			default_port;
+	uint8_t			default_mcast_primary_port;
+	uint8_t			default_mcast_not_primary_port;
+	uint8_t			life_time_value;
+	uint8_t			port_state_change;
+	uint8_t			reserved[5]; /* keep the ports after this 8-byte aligned */
+};
+
+
+struct pib_snapshot_port {
+	uint64_t		port_guid;  /* 0: no host */
+	struct sockaddr_in	sockaddr;
+	uint32_t		socklen;
+	int32_t			peer_switch; /* -1: not linked to another switch */
+	int32_t			peer_port;
+
+	struct ibv_port_attr	ibv_port_attr;
+
+	uint8_t			mkey;
+	uint8_t			mkeyprot;
+	uint16_t		mkey_lease_period;
+	uint8_t			link_down_default_state;
+	uint8_t			link_width_enabled;
+	uint8_t			link_speed_enabled;
+	uint8_t			master_smsl;
+	uint8_t			client_reregister;
+	uint8_t			subnet_timeout;
+	uint8_t			local_phy_errors;
+	uint8_t			overrun_errors;
+
+	union ibv_gid		gid[PIB_GID_PER_PORT];
+	uint16_t		pkey_table[PIB_PKEY_TABLE_LEN];
+};
+
+
+struct pib_snapshot {
+	int			fd;
+	const char	       *filename;
+	void		       *map;
+	size_t			map_size;
+	size_t			image_size;  /* including pib_snapshot_image */
+	pthread_mutex_t		lock;
+
+	uint64_t		generation;  /* of the last image written */
+	int			next_image;  /* 0 or 1 */
+	uint64_t		save_time;   /* msec of CLOCK_MONOTONIC */
+};
+
+
+static size_t get_switch_size(const struct pib_switch *sw);
+static size_t get_image_size(const struct pib_control *control);
+static struct pib_snapshot_image *get_image(struct pib_snapshot *snapshot, void *map, int index);
+static int restore_snapshot(struct pib_snapshot *snapshot, struct pib_control *control);
+static int restore_switch(struct pib_switch *sw, void *data, int apply);
+static void write_image(struct pib_snapshot *snapshot, struct pib_control *control);
+static void *write_switch(struct pib_switch *sw, void *data);
+static uint64_t calc_checksum(const void *data, size_t size);
+static uint64_t get_monotonic_msec(void);
+
+
+/*
+ *  restore が真ならファイルに残っているスナップショットから状態を戻す。
+ *  戻せなかった時は何もせずに起動を続ける。ファイルを開けない時は NULL を返す。
+ */
+struct pib_snapshot *pib_snapshot_open(struct pib_control *control, const char *filename, int restore)
+{
+	int ret, restored = 0;
+	struct pib_snapshot *snapshot;
+	struct pib_snapshot_header *header;
+
+	snapshot = calloc(1, sizeof(*snapshot));
+	assert(snapshot);
+
+	snapshot->filename   = filename;
+	snapshot->image_size = get_image_size(control);
+	snapshot->map_size   = PIB_SNAPSHOT_PAGE_SIZE + 2 * snapshot->image_size;
+
+	pthread_mutex_init(&snapshot->lock, NULL);
+
+	snapshot->fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (snapshot->fd < 0) {
+		int eno = errno;
+		pib_report_err("pibnetd: open(%s, errno=%d)", filename, eno);
+		free(snapshot);
+		return NULL;
+	}
+
+	if (restore)
+		restored = (restore_snapshot(snapshot, control) == 0);
+
+	ret = ftruncate(snapshot->fd, snapshot->map_size);
+	if (ret < 0) {
+		int eno = errno;
+		pib_report_err("pibnetd: ftruncate(%s, errno=%d)", filename, eno);
+		goto error;
+	}
+
+	snapshot->map = mmap(NULL, snapshot->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, snapshot->fd, 0);
+	if (snapshot->map == MAP_FAILED) {
+		int eno = errno;
+		pib_report_err("pibnetd: mmap(%s, errno=%d)", filename, eno);
+		goto error;
+	}
+
+	header = snapshot->map;
+
+	/*
+	 * 形の違う古いスナップショットは書き換える前に無効にしておく。
+	 * 同じ形なら古いイメージより新しい generation から書き始める。
+	 * 戻したイメージは次の書き込みが終わるまで上書きしない。
+	 */
+	if ((memcmp(header->magic, PIB_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) ||
+	    (header->version     != PIB_SNAPSHOT_VERSION) ||
+	    (header->nr_switches != control->nr_switches) ||
+	    (header->nr_ports    != control->nr_ports) ||
+	    (header->image_size  != snapshot->image_size)) {
+		get_image(snapshot, snapshot->map, 0)->generation = 0;
+		get_image(snapshot, snapshot->map, 1)->generation = 0;
+		snapshot->generation = 0;
+		snapshot->next_image = 0;
+	} else {
+		uint64_t generation0 = get_image(snapshot, snapshot->map, 0)->generation;
+		uint64_t generation1 = get_image(snapshot, snapshot->map, 1)->generation;
+
+		if (snapshot->generation < generation0)
+			snapshot->generation = generation0;
+		if (snapshot->generation < generation1)
+			snapshot->generation = generation1;
+
+		if (!restored)
+			snapshot->next_image = (generation0 <= generation1) ? 0 : 1;
+	}
+
+	memcpy(header->magic, PIB_SNAPSHOT_MAGIC, sizeof(header->magic));
+	header->version       = PIB_SNAPSHOT_VERSION;
+	header->nr_switches   = control->nr_switches;
+	header->nr_ports      = control->nr_ports;
+	header->image_size    = snapshot->image_size;
+	header->hca_guid_base = pib_hca_guid_base;
+
+	/* 起動時の状態を最初のイメージとして残す */
+	control->snapshot_dirty = 1;
+
+	return snapshot;
+
+error:
+	close(snapshot->fd);
+	free(snapshot);
+
+	return NULL;
+}
+
+
+/*
+ *  状態が変わっていれば PIB_NETD_SNAPSHOT_INTERVAL に 1 回までイメージを書く。
+ *  control->lock を持たずに呼ぶこと。
+ */
+void pib_snapshot_save(struct pib_snapshot *snapshot, struct pib_control *control)
+{
+	uint64_t now;
+
+	now = get_monotonic_msec();
+
+	if (now < snapshot->save_time + PIB_NETD_SNAPSHOT_INTERVAL)
+		return;
+
+	if (pthread_mutex_trylock(&snapshot->lock) != 0)
+		return;
+
+	if (__sync_bool_compare_and_swap(&control->snapshot_dirty, 1, 0)) {
+		snapshot->save_time = now;
+
+		pthread_rwlock_rdlock(&control->lock);
+		write_image(snapshot, control);
+		pthread_rwlock_unlock(&control->lock);
+
+		msync(snapshot->map, snapshot->map_size, MS_ASYNC);
+	}
+
+	pthread_mutex_unlock(&snapshot->lock);
+}
+
+
+/*
+ *  ワーカーを止めた後に呼ぶ。最後の状態を書いてからファイルを閉じる。
+ */
+void pib_snapshot_close(struct pib_snapshot *snapshot, struct pib_control *control)
+{
+	write_image(snapshot, control);
+
+	msync(snapshot->map, snapshot->map_size, MS_SYNC);
+	munmap(snapshot->map, snapshot->map_size);
+	close(snapshot->fd);
+
+	pib_report_info("pibnetd: snapshot generation %" PRIu64 " written to %s",
+			snapshot->generation, snapshot->filename);
+
+	pthread_mutex_destroy(&snapshot->lock);
+	free(snapshot);
+}
+
+
+static size_t get_switch_size(const struct pib_switch *sw)
+{
+	return sizeof(struct pib_snapshot_switch) +
+		sw->port_cnt * sizeof(struct pib_snapshot_port) +
+		PIB_MCAST_LID_BASE +
+		sizeof(uint16_t) * sw->pm_block_cnt * (PIB_MAX_LID - PIB_MCAST_LID_BASE);
+}
+
+
+static size_t get_image_size(const struct pib_control *control)
+{
+	int i;
+	size_t size = sizeof(struct pib_snapshot_image);
+
+	for (i=0 ; i<control->nr_switches ; i++)
+		size += get_switch_size(control->switches[i]);
+
+	return (size + PIB_SNAPSHOT_PAGE_SIZE - 1) & ~(size_t)(PIB_SNAPSHOT_PAGE_SIZE - 1);
+}
+
+
+static struct pib_snapshot_image *get_image(struct pib_snapshot *snapshot, void *map, int index)
+{
+	return map + PIB_SNAPSHOT_PAGE_SIZE + index * snapshot->image_size;
+}
+
+
+/*
+ *  有効なイメージのうち新しい方を読む。まず全スイッチを検査してから書き戻す。
+ */
+static int restore_snapshot(struct pib_snapshot *snapshot, struct pib_control *control)
+{
+	int i, j, nr_hosts = 0;
+	void *map, *data;
+	struct stat st;
+	struct pib_snapshot_header *header;
+	struct pib_snapshot_image *image = NULL;
+	const char *reason;
+
+	if (fstat(snapshot->fd, &st) < 0) {
+		int eno = errno;
+		pib_report_err("pibnetd: fstat(%s, errno=%d)", snapshot->filename, eno);
+		return -1;
+	}
+
+	if (st.st_size != snapshot->map_size) {
+		reason = (st.st_size == 0) ? "no snapshot" : "the fabric has changed";
+		goto cold_start;
+	}
+
+	map = mmap(NULL, snapshot->map_size, PROT_READ, MAP_SHARED, snapshot->fd, 0);
+	if (map == MAP_FAILED) {
+		int eno = errno;
+		pib_report_err("pibnetd: mmap(%s, errno=%d)", snapshot->filename, eno);
+		return -1;
+	}
+
+	header = map;
+
+	if ((memcmp(header->magic, PIB_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) ||
+	    (header->version != PIB_SNAPSHOT_VERSION)) {
+		reason = "not a snapshot of this version";
+		goto unmap;
+	}
+
+	if ((header->nr_switches != control->nr_switches) ||
+	    (header->nr_ports    != control->nr_ports) ||
+	    (header->image_size  != snapshot->image_size)) {
+		reason = "the fabric has changed";
+		goto unmap;
+	}
+
+	/* スイッチの GUID が変わるとサブネットマネージャーから見て別のファブリックになる */
+	if (header->hca_guid_base != pib_hca_guid_base) {
+		reason = "taken on another host";
+		goto unmap;
+	}
+
+	for (i=0 ; i<2 ; i++) {
+		struct pib_snapshot_image *candidate = get_image(snapshot, map, i);
+
+		if (candidate->generation == 0)
+			continue;
+
+		if (candidate->checksum != calc_checksum(candidate + 1, snapshot->image_size - sizeof(*candidate)))
+			continue;
+
+		if ((image == NULL) || (image->generation < candidate->generation)) {
+			image = candidate;
+			snapshot->next_image = 1 - i;
+		}
+	}
+
+	if (image == NULL) {
+		reason = "no valid image";
+		goto unmap;
+	}
+
+	data = image + 1;
+	for (i=0 ; i<control->nr_switches ; i++) {
+		if (restore_switch(control->switches[i], data, 0) < 0) {
+			reason = "the fabric has changed";
+			goto unmap;
+		}
+		data += get_switch_size(control->switches[i]);
+	}
+
+	data = image + 1;
+	for (i=0 ; i<control->nr_switches ; i++) {
+		struct pib_switch *sw = control->switches[i];
+
+		restore_switch(sw, data, 1);
+		data += get_switch_size(sw);
+
+		for (j=1 ; j<sw->port_cnt ; j++)
+			if (sw->ports[j].port_guid != 0)
+				nr_hosts++;
+	}
+
+	pib_report_info("pibnetd: warm restart from %s: generation %" PRIu64 ", %d hosts",
+			snapshot->filename, image->generation, nr_hosts);
+
+	munmap(map, snapshot->map_size);
+
+	return 0;
+
+unmap:
+	munmap(map, snapshot->map_size);
+
+cold_start:
+	pib_report_info("pibnetd: cold start: %s in %s", reason, snapshot->filename);
+
+	return -1;
+}
+
+
+/*
+ *  apply が偽ならファブリックの形が一致するかだけを調べる。
+ */
+static int restore_switch(struct pib_switch *sw, void *data, int apply)
+{
+	int i;
+	struct pib_snapshot_switch *snap_sw = data;
+	struct pib_snapshot_port *snap_ports = (struct pib_snapshot_port *)(snap_sw + 1);
+	void *lft = snap_ports + sw->port_cnt;
+	void *mft = lft + PIB_MCAST_LID_BASE;
+
+	if (!apply) {
+		if ((strncmp(snap_sw->name, sw->name, sizeof(sw->name)) != 0) ||
+		    (snap_sw->port_cnt != sw->port_cnt))
+			return -1;
+
+		for (i=0 ; i<sw->port_cnt ; i++) {
+			struct pib_port *peer = sw->ports[i].peer;
+
+			if (peer == NULL) {
+				if (snap_ports[i].peer_switch != -1)
+					return -1;
+			} else if ((snap_ports[i].peer_switch != peer->sw->index) ||
+				   (snap_ports[i].peer_port   != peer->port_num))
+				return -1;
+
+			if ((snap_ports[i].port_guid != 0) &&
+			    ((snap_ports[i].socklen == 0) || (sizeof(struct sockaddr_in) < snap_ports[i].socklen)))
+				return -1;
+		}
+
+		return 0;
+	}
+
+	sw->linear_fdb_top		   = snap_sw->linear_fdb_top;
+	sw->default_port		   = snap_sw->default_port;
+	sw->default_mcast_primary_port	   = snap_sw->default_mcast_primary_port;
+	sw->default_mcast_not_primary_port = snap_sw->default_mcast_not_primary_port;
+	sw->life_time_value		   = snap_sw->life_time_value;
+	sw->port_state_change		   = snap_sw->port_state_change;
+
+	for (i=0 ; i<sw->port_cnt ; i++) {
+		struct pib_port *port = &sw->ports[i];
+		struct pib_snapshot_port *snap_port = &snap_ports[i];
+
+		port->ibv_port_attr		= snap_port->ibv_port_attr;
+		port->mkey			= snap_port->mkey;
+		port->mkeyprot			= snap_port->mkeyprot;
+		port->mkey_lease_period		= snap_port->mkey_lease_period;
+		port->link_down_default_state	= snap_port->link_down_default_state;
+		port->link_width_enabled	= snap_port->link_width_enabled;
+		port->link_speed_enabled	= snap_port->link_speed_enabled;
+		port->master_smsl		= snap_port->master_smsl;
+		port->client_reregister		= snap_port->client_reregister;
+		port->subnet_timeout		= snap_port->subnet_timeout;
+		port->local_phy_errors		= snap_port->local_phy_errors;
+		port->overrun_errors		= snap_port->overrun_errors;
+
+		memcpy(port->gid, snap_port->gid, sizeof(port->gid));
+		memcpy(port->pkey_table, snap_port->pkey_table, sizeof(port->pkey_table));
+
+		/* port_guid のハッシュへの登録は呼び出し元で行う */
+		if (snap_port->port_guid != 0) {
+			port->port_guid = snap_port->port_guid;
+			port->sockaddr  = malloc(snap_port->socklen);
+			assert(port->sockaddr);
+			port->socklen   = snap_port->socklen;
+			memcpy(port->sockaddr, &snap_port->sockaddr, snap_port->socklen);
+		}
+	}
+
+	memcpy(sw->ucast_fwd_table, lft, PIB_MCAST_LID_BASE);
+	memcpy(sw->mcast_fwd_table, mft,
+	       sizeof(uint16_t) * sw->pm_block_cnt * (PIB_MAX_LID - PIB_MCAST_LID_BASE));
+
+	return 0;
+}
+
+
+/*
+ *  control->lock を共有ロックで持って呼ぶ。
+ */
+static void write_image(struct pib_snapshot *snapshot, struct pib_control *control)
+{
+	int i;
+	void *data;
+	struct pib_snapshot_image *image;
+
+	image = get_image(snapshot, snapshot->map, snapshot->next_image);
+
+	__atomic_store_n(&image->generation, 0, __ATOMIC_RELEASE);
+
+	data = image + 1;
+	for (i=0 ; i<control->nr_switches ; i++)
+		data = write_switch(control->switches[i], data);
+
+	image->time	= time(NULL);
+	image->checksum = calc_checksum(image + 1, snapshot->image_size - sizeof(*image));
+
+	snapshot->generation++;
+	snapshot->next_image ^= 1;
+
+	__atomic_store_n(&image->generation, snapshot->generation, __ATOMIC_RELEASE);
+}
+
+
+static void *write_switch(struct pib_switch *sw, void *data)
+{
+	int i;
+	struct pib_snapshot_switch *snap_sw = data;
+	struct pib_snapshot_port *snap_ports = (struct pib_snapshot_port *)(snap_sw + 1);
+	void *lft = snap_ports + sw->port_cnt;
+	void *mft = lft + PIB_MCAST_LID_BASE;
+
+	memset(snap_sw, 0, sizeof(*snap_sw));
+	strncpy(snap_sw->name, sw->name, sizeof(snap_sw->name) - 1);
+	snap_sw->port_cnt			= sw->port_cnt;
+	snap_sw->linear_fdb_top			= sw->linear_fdb_top;
+	snap_sw->default_port			= sw->default_port;
+	snap_sw->default_mcast_primary_port	= sw->default_mcast_primary_port;
+	snap_sw->default_mcast_not_primary_port = sw->default_mcast_not_primary_port;
+	snap_sw->life_time_value		= sw->life_time_value;
+	snap_sw->port_state_change		= sw->port_state_change;
+
+	for (i=0 ; i<sw->port_cnt ; i++) {
+		struct pib_port *port = &sw->ports[i];
+		struct pib_snapshot_port *snap_port = &snap_ports[i];
+
+		memset(snap_port, 0, sizeof(*snap_port));
+
+		if (port->sockaddr != NULL) {
+			snap_port->port_guid = port->port_guid;
+			snap_port->socklen   = port->socklen;
+			memcpy(&snap_port->sockaddr, port->sockaddr, port->socklen);
+		}
+
+		if (port->peer) {
+			snap_port->peer_switch = port->peer->sw->index;
+			snap_port->peer_port   = port->peer->port_num;
+		} else {
+			snap_port->peer_switch = -1;
+			snap_port->peer_port   = -1;
+		}
+
+		snap_port->ibv_port_attr	   = port->ibv_port_attr;
+		snap_port->mkey			   = port->mkey;
+		snap_port->mkeyprot		   = port->mkeyprot;
+		snap_port->mkey_lease_period	   = port->mkey_lease_period;
+		snap_port->link_down_default_state = port->link_down_default_state;
+		snap_port->link_width_enabled	   = port->link_width_enabled;
+		snap_port->link_speed_enabled	   = port->link_speed_enabled;
+		snap_port->master_smsl		   = port->master_smsl;
+		snap_port->client_reregister	   = port->client_reregister;
+		snap_port->subnet_timeout	   = port->subnet_timeout;
+		snap_port->local_phy_errors	   = port->local_phy_errors;
+		snap_port->overrun_errors	   = port->overrun_errors;
+
+		memcpy(snap_port->gid, port->gid, sizeof(snap_port->gid));
+		memcpy(snap_port->pkey_table, port->pkey_table, sizeof(snap_port->pkey_table));
+	}
+
+	memcpy(lft, sw->ucast_fwd_table, PIB_MCAST_LID_BASE);
+	memcpy(mft, sw->mcast_fwd_table,
+	       sizeof(uint16_t) * sw->pm_block_cnt * (PIB_MAX_LID - PIB_MCAST_LID_BASE));
+
+	return data + get_switch_size(sw);
+}
+
+
+/*
+ *  FNV-1a を 8 バイト単位で回す。壊れたイメージを見分けられれば十分。
+ */
+static uint64_t calc_checksum(const void *data, size_t size)
+{
+	size_t i;
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	const uint64_t *p = data;
+
+	assert((size & 7) == 0);
+
+	for (i=0 ; i<size / 8 ; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+
+static uint64_t get_monotonic_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
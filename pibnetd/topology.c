@@ -0,0 +1,174 @@
+/*
+ * topology.c - Load a fabric topology file
+ *
+ * Copyright (c) 2014 Minoru NAKAMURA <nminoru@nminoru.jp>
+ *
+ * This code is licenced under the GPL version 2 or BSD license.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "pibnetd.h"
+
+/*
+ *  トポロジーファイルは 1 行に 1 つの定義を書く。'#' 以降はコメント。
+ *
+ *    switch <name> [<radix>]
+ *    link   <name> <port> <name> <port>
+ *
+ *  link で結んだポートは pibnetd の中でスイッチ間を直接つなぎ、それ以外の
+ *  ポートにホストが接続する。
+ */
+
+static int find_switch(struct pib_topology *topology, const char *name);
+static int is_linked_port(struct pib_topology *topology, int switch_index, int port_num);
+static void parse_error(const char *filename, int lineno, const char *message) __attribute__((noreturn));
+
+
+struct pib_topology *pib_load_topology(const char *filename, int default_radix)
+{
+	FILE *fp;
+	int lineno = 0;
+	char line[256];
+	struct pib_topology *topology;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		int eno = errno;
+		pib_report_err("pibnetd: fopen(%s, errno=%d)", filename, eno);
+		exit(EXIT_FAILURE);
+	}
+
+	topology = calloc(1, sizeof(*topology));
+	assert(topology);
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *p, *keyword;
+
+		lineno++;
+
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+
+		keyword = strtok(line, " \t\r\n");
+		if (keyword == NULL)
+			continue;
+
+		if (strcmp(keyword, "switch") == 0) {
+			char *name, *radix;
+			struct pib_topology_switch *entry;
+
+			name  = strtok(NULL, " \t\r\n");
+			radix = strtok(NULL, " \t\r\n");
+
+			if (name == NULL)
+				parse_error(filename, lineno, "switch needs a name");
+
+			if (PIB_SWITCH_NAME_LEN <= strlen(name))
+				parse_error(filename, lineno, "too long switch name");
+
+			if (0 <= find_switch(topology, name))
+				parse_error(filename, lineno, "duplicate switch name");
+
+			if (PIB_NETD_MAX_SWITCHES <= topology->nr_switches)
+				parse_error(filename, lineno, "too many switches");
+
+			topology->switches = realloc(topology->switches,
+						     (topology->nr_switches + 1) * sizeof(*entry));
+			assert(topology->switches);
+
+			entry = &topology->switches[topology->nr_switches++];
+
+			strcpy(entry->name, name);
+			entry->radix = radix ? atoi(radix) : default_radix;
+
+			if ((entry->radix < 1) || (PIB_MAX_PORTS - 1 < entry->radix))
+				parse_error(filename, lineno, "radix must be 1 through 254");
+
+		} else if (strcmp(keyword, "link") == 0) {
+			int i;
+			struct pib_topology_link *link;
+
+			topology->links = realloc(topology->links,
+						  (topology->nr_links + 1) * sizeof(*link));
+			assert(topology->links);
+
+			link = &topology->links[topology->nr_links];
+
+			for (i=0 ; i<2 ; i++) {
+				char *name, *port;
+
+				name = strtok(NULL, " \t\r\n");
+				port = strtok(NULL, " \t\r\n");
+
+				if ((name == NULL) || (port == NULL))
+					parse_error(filename, lineno, "link needs two pairs of a switch name and a port number");
+
+				link->switch_index[i] = find_switch(topology, name);
+				if (link->switch_index[i] < 0)
+					parse_error(filename, lineno, "unknown switch");
+
+				link->port_num[i] = atoi(port);
+				if ((link->port_num[i] < 1) ||
+				    (topology->switches[link->switch_index[i]].radix < link->port_num[i]))
+					parse_error(filename, lineno, "port number out of range");
+
+				if (is_linked_port(topology, link->switch_index[i], link->port_num[i]))
+					parse_error(filename, lineno, "port is already linked");
+			}
+
+			if ((link->switch_index[0] == link->switch_index[1]) &&
+			    (link->port_num[0] == link->port_num[1]))
+				parse_error(filename, lineno, "port is linked to itself");
+
+			topology->nr_links++;
+
+		} else
+			parse_error(filename, lineno, "unknown keyword");
+	}
+
+	fclose(fp);
+
+	if (topology->nr_switches == 0)
+		parse_error(filename, lineno, "no switch is defined");
+
+	return topology;
+}
+
+
+static int find_switch(struct pib_topology *topology, const char *name)
+{
+	int i;
+
+	for (i=0 ; i<topology->nr_switches ; i++)
+		if (strcmp(topology->switches[i].name, name) == 0)
+			return i;
+
+	return -1;
+}
+
+
+static int is_linked_port(struct pib_topology *topology, int switch_index, int port_num)
+{
+	int i, j;
+
+	for (i=0 ; i<topology->nr_links ; i++)
+		for (j=0 ; j<2 ; j++)
+			if ((topology->links[i].switch_index[j] == switch_index) &&
+			    (topology->links[i].port_num[j] == port_num))
+				return 1;
+
+	return 0;
+}
+
+
+static void parse_error(const char *filename, int lineno, const char *message)
+{
+	pib_report_err("pibnetd: %s(%d): %s", filename, lineno, message);
+	exit(EXIT_FAILURE);
+}
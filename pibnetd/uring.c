@@ -0,0 +1,607 @@
+/*
+ * uring.c - io_uring based I/O engine
+ *
+ * Copyright (c) 2014 Minoru NAKAMURA <nminoru@nminoru.jp>
+ *
+ * This code is licenced under the GPL version 2 or BSD license.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "pibnetd.h"
+
+
+/*
+ *  liburing には依存せず、io_uring_setup/io_uring_enter/io_uring_register を
+ *  直接呼ぶ。
+ *
+ *  受信は provided buffer ring を使った multishot recvmsg 1 つで行い、
+ *  受信バッファのまま process_packet() で処理して、中継する sendmsg も同じ
+ *  バッファを指す。バッファは参照カウントを持ち、処理と全ての sendmsg が
+ *  終わったら buffer ring に戻す。
+ */
+
+#define PIB_URING_BGID		(0)
+
+#define PIB_URING_BUF_SIZE	(sizeof(struct io_uring_recvmsg_out) + \
+				 sizeof(struct sockaddr_in) + PIB_PACKET_BUFFER)
+
+#define PIB_URING_TAG_SHIFT	(56)
+#define PIB_URING_TAG_RECV	(1ULL << PIB_URING_TAG_SHIFT)
+#define PIB_URING_TAG_SEND	(2ULL << PIB_URING_TAG_SHIFT)
+#define PIB_URING_TAG_STOP	(3ULL << PIB_URING_TAG_SHIFT)
+#define PIB_URING_TAG_TIMER	(4ULL << PIB_URING_TAG_SHIFT)
+#define PIB_URING_TAG_MASK	(0xFFULL << PIB_URING_TAG_SHIFT)
+
+
+struct pib_uring_send_slot {
+	struct msghdr		msghdr;
+	struct iovec		iovec;
+	struct sockaddr_storage	sockaddr;
+	int			buf_id;	/* -1 の時は bounce を指す */
+	void		       *bounce;
+	int			perf_index;
+	int			next_free;
+};
+
+
+struct pib_uring {
+	int			ring_fd;
+	int			sockfd;
+	int			stopfd;
+	int			timerfd;
+
+	/* submission queue */
+	void		       *sq_ring;
+	size_t			sq_ring_size;
+	unsigned	       *sq_head;
+	unsigned	       *sq_tail;
+	unsigned		sq_mask;
+	unsigned		sq_entries;
+	struct io_uring_sqe    *sqes;
+
+	/* completion queue */
+	void		       *cq_ring;
+	size_t			cq_ring_size;
+	unsigned	       *cq_head;
+	unsigned	       *cq_tail;
+	unsigned		cq_mask;
+	struct io_uring_cqe    *cqes;
+
+	/* provided buffers */
+	struct io_uring_buf_ring *buf_ring;
+	void		       *buffers;
+	int		       *buf_refs;
+	uint16_t		buf_tail;
+	int			nr_free_buffers;
+
+	struct msghdr		recv_msghdr; /* template of multishot recvmsg */
+	int			recv_armed;
+	int			recv_started; /* multishot recvmsg がパケットを返したことがある */
+	int			stop_armed;
+	int			timer_armed;
+
+	struct pib_uring_send_slot *slots;
+	int			free_slot;
+};
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+static int map_rings(struct pib_uring *uring, struct io_uring_params *params);
+static int setup_buffer_ring(struct pib_uring *uring);
+static struct io_uring_sqe *get_sqe(struct pib_uring *uring);
+static unsigned nr_pending_sqes(struct pib_uring *uring);
+static void arm_recv(struct pib_uring *uring);
+static void arm_poll(struct pib_uring *uring, int fd, uint64_t tag);
+static void release_send_slot(struct pib_uring *uring, int index);
+
+
+/*
+ *  カーネルが io_uring や必要な機能を持たない場合は NULL を返すので、
+ *  呼び出し側は epoll に戻る。
+ */
+struct pib_uring *pib_uring_create(int sockfd, int stopfd, int timerfd)
+{
+	int i, fd;
+	struct io_uring_params params;
+	struct pib_uring *uring;
+
+	memset(&params, 0, sizeof(params));
+
+	params.flags	  = IORING_SETUP_CQSIZE;
+	params.cq_entries = PIB_NETD_URING_CQ_ENTRIES;
+
+	fd = sys_io_uring_setup(PIB_NETD_URING_SQ_ENTRIES, &params);
+	if (fd < 0) {
+		int eno = errno;
+		pib_report_err("pibnetd: io_uring_setup(errno=%d)", eno);
+		return NULL;
+	}
+
+	if ((params.features & IORING_FEAT_EXT_ARG) == 0) {
+		pib_report_err("pibnetd: io_uring doesn't support IORING_FEAT_EXT_ARG");
+		close(fd);
+		return NULL;
+	}
+
+	uring = calloc(1, sizeof(*uring));
+	assert(uring);
+
+	uring->ring_fd = fd;
+	uring->sockfd  = sockfd;
+	uring->stopfd  = stopfd;
+	uring->timerfd = timerfd;
+
+	if (map_rings(uring, &params) < 0)
+		goto err;
+
+	if (setup_buffer_ring(uring) < 0)
+		goto err;
+
+	uring->slots = calloc(PIB_NETD_URING_SEND_SLOTS, sizeof(struct pib_uring_send_slot));
+	assert(uring->slots);
+
+	for (i=0 ; i<PIB_NETD_URING_SEND_SLOTS ; i++)
+		uring->slots[i].next_free = i + 1;
+	uring->slots[PIB_NETD_URING_SEND_SLOTS - 1].next_free = -1;
+	uring->free_slot = 0;
+
+	uring->recv_msghdr.msg_namelen = sizeof(struct sockaddr_in);
+
+	arm_recv(uring);
+	arm_poll(uring, stopfd,  PIB_URING_TAG_STOP);
+	arm_poll(uring, timerfd, PIB_URING_TAG_TIMER);
+
+	return uring;
+
+err:
+	/* 失敗した時はプロセスの終了で後始末する */
+	close(fd);
+	return NULL;
+}
+
+
+static int map_rings(struct pib_uring *uring, struct io_uring_params *params)
+{
+	unsigned i, *sq_array;
+
+	uring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = params->cq_off.cqes  + params->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params->features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->sq_ring_size < uring->cq_ring_size)
+			uring->sq_ring_size = uring->cq_ring_size;
+		uring->cq_ring_size = uring->sq_ring_size;
+	}
+
+	uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED)
+		goto err;
+
+	if (params->features & IORING_FEAT_SINGLE_MMAP)
+		uring->cq_ring = uring->sq_ring;
+	else {
+		uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING);
+		if (uring->cq_ring == MAP_FAILED)
+			goto err;
+	}
+
+	uring->sqes = mmap(NULL, params->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED)
+		goto err;
+
+	uring->sq_head	  = uring->sq_ring + params->sq_off.head;
+	uring->sq_tail	  = uring->sq_ring + params->sq_off.tail;
+	uring->sq_mask	  = *(unsigned *)(uring->sq_ring + params->sq_off.ring_mask);
+	uring->sq_entries = params->sq_entries;
+
+	/* SQE の index は常に SQ ring の位置と同じにする */
+	sq_array = uring->sq_ring + params->sq_off.array;
+	for (i=0 ; i<params->sq_entries ; i++)
+		sq_array[i] = i;
+
+	uring->cq_head	  = uring->cq_ring + params->cq_off.head;
+	uring->cq_tail	  = uring->cq_ring + params->cq_off.tail;
+	uring->cq_mask	  = *(unsigned *)(uring->cq_ring + params->cq_off.ring_mask);
+	uring->cqes	  = uring->cq_ring + params->cq_off.cqes;
+
+	return 0;
+
+err:
+	pib_report_err("pibnetd: mmap io_uring (errno=%d)", errno);
+	return -1;
+}
+
+
+static int setup_buffer_ring(struct pib_uring *uring)
+{
+	int i, ret;
+	size_t size;
+	struct io_uring_buf_reg reg;
+
+	size = PIB_NETD_URING_NR_BUFFERS * sizeof(struct io_uring_buf);
+
+	uring->buf_ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (uring->buf_ring == MAP_FAILED) {
+		pib_report_err("pibnetd: mmap buffer ring (errno=%d)", errno);
+		return -1;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr	 = (uint64_t)(uintptr_t)uring->buf_ring;
+	reg.ring_entries = PIB_NETD_URING_NR_BUFFERS;
+	reg.bgid	 = PIB_URING_BGID;
+
+	ret = sys_io_uring_register(uring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (ret < 0) {
+		int eno = errno;
+		pib_report_err("pibnetd: io_uring_register(IORING_REGISTER_PBUF_RING, errno=%d)", eno);
+		return -1;
+	}
+
+	uring->buffers = malloc(PIB_NETD_URING_NR_BUFFERS * PIB_URING_BUF_SIZE);
+	assert(uring->buffers);
+
+	uring->buf_refs = calloc(PIB_NETD_URING_NR_BUFFERS, sizeof(int));
+	assert(uring->buf_refs);
+
+	for (i=0 ; i<PIB_NETD_URING_NR_BUFFERS ; i++) {
+		uring->buf_refs[i] = 1;
+		pib_uring_put_buffer(uring, i);
+	}
+
+	return 0;
+}
+
+
+/*
+ *  io_uring を閉じる。送信中の要求がバッファや送信スロットを指している
+ *  かもしれないので、それらは解放せずにプロセスの終了で後始末する。
+ */
+void pib_uring_destroy(struct pib_uring *uring)
+{
+	munmap(uring->sqes, uring->sq_entries * sizeof(struct io_uring_sqe));
+	if (uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	munmap(uring->sq_ring, uring->sq_ring_size);
+
+	close(uring->ring_fd);
+}
+
+
+/*
+ *  溜めた SQE を投入し、完了が 1 つ以上あるか timeout [msec] が過ぎるまで待つ。
+ *  待っている間だけ sigmask のシグナルマスクにする。
+ *  エラー時は -errno を返す。タイムアウトは -ETIME。
+ */
+int pib_uring_wait(struct pib_uring *uring, int timeout, const sigset_t *sigmask)
+{
+	int ret;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+
+	if (!uring->recv_armed && (uring->nr_free_buffers > 0))
+		arm_recv(uring);
+
+	if (!uring->stop_armed)
+		arm_poll(uring, uring->stopfd, PIB_URING_TAG_STOP);
+
+	if (!uring->timer_armed)
+		arm_poll(uring, uring->timerfd, PIB_URING_TAG_TIMER);
+
+	ts.tv_sec  = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000LL;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask    = (uint64_t)(uintptr_t)sigmask;
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts	       = (uint64_t)(uintptr_t)&ts;
+
+	ret = sys_io_uring_enter(uring->ring_fd, nr_pending_sqes(uring), 1,
+				 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				 &arg, sizeof(arg));
+
+	return (ret < 0) ? -errno : ret;
+}
+
+
+/*
+ *  完了キューから 1 つ取り出して event に入れる。空なら 0 を返す。
+ */
+int pib_uring_next_event(struct pib_uring *uring, struct pib_uring_event *event)
+{
+	for (;;) {
+		unsigned head;
+		struct io_uring_cqe cqe;
+		int buf_id;
+		struct io_uring_recvmsg_out *out;
+
+		head = *uring->cq_head;
+
+		if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+			return 0;
+
+		cqe = uring->cqes[head & uring->cq_mask];
+
+		__atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		memset(event, 0, sizeof(*event));
+
+		switch (cqe.user_data & PIB_URING_TAG_MASK) {
+
+		case PIB_URING_TAG_RECV:
+			if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+				uring->recv_armed = 0;
+
+			if ((cqe.flags & IORING_CQE_F_BUFFER) == 0) {
+				/*
+				 *  全てのバッファが空いている最初の完了で失敗するのは、
+				 *  カーネルが multishot recvmsg や buffer ring を扱えない時。
+				 *  張り直しても同じなので呼び出し側に epoll へ戻ってもらう。
+				 */
+				if (!uring->recv_started &&
+				    ((cqe.res == -EINVAL) || (cqe.res == -ENOBUFS) || (cqe.res == -EOPNOTSUPP))) {
+					event->type = PIB_URING_EVENT_UNSUPPORTED;
+					event->size = cqe.res;
+					return 1;
+				}
+
+				/* -ENOBUFS はバッファが返るのを待って張り直す */
+				if ((cqe.res < 0) && (cqe.res != -ENOBUFS) && (cqe.res != -EINTR))
+					pib_report_err("pibnetd: io_uring recvmsg(errno=%d)", -cqe.res);
+				continue;
+			}
+
+			buf_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+			uring->recv_started = 1;
+			uring->nr_free_buffers--;
+			uring->buf_refs[buf_id] = 1;
+
+			out = uring->buffers + (size_t)buf_id * PIB_URING_BUF_SIZE;
+
+			if ((cqe.res < 0) || (out->flags & MSG_TRUNC)) {
+				pib_uring_put_buffer(uring, buf_id);
+				continue;
+			}
+
+			event->type	= PIB_URING_EVENT_RECV;
+			event->sockaddr = (struct sockaddr *)(out + 1);
+			event->packet	= (void *)(out + 1) + uring->recv_msghdr.msg_namelen;
+			event->size	= out->payloadlen;
+			event->buf_id	= buf_id;
+			return 1;
+
+		case PIB_URING_TAG_SEND: {
+			int index = cqe.user_data & ~PIB_URING_TAG_MASK;
+
+			event->type	  = PIB_URING_EVENT_SEND;
+			event->size	  = cqe.res;
+			event->perf_index = uring->slots[index].perf_index;
+
+			release_send_slot(uring, index);
+			return 1;
+		}
+
+		case PIB_URING_TAG_STOP:
+			uring->stop_armed = 0;
+			if (cqe.res < 0)
+				continue;
+			event->type = PIB_URING_EVENT_STOP;
+			return 1;
+
+		case PIB_URING_TAG_TIMER:
+			uring->timer_armed = 0;
+			if (cqe.res < 0)
+				continue;
+			event->type = PIB_URING_EVENT_TIMER;
+			return 1;
+
+		default:
+			continue;
+		}
+	}
+}
+
+
+void pib_uring_put_buffer(struct pib_uring *uring, int buf_id)
+{
+	struct io_uring_buf *buf;
+
+	if (--uring->buf_refs[buf_id] > 0)
+		return;
+
+	buf = &uring->buf_ring->bufs[uring->buf_tail & (PIB_NETD_URING_NR_BUFFERS - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(uring->buffers + (size_t)buf_id * PIB_URING_BUF_SIZE);
+	buf->len  = PIB_URING_BUF_SIZE;
+	buf->bid  = buf_id;
+
+	uring->buf_tail++;
+	uring->nr_free_buffers++;
+
+	__atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *  1 つの iovec を持つ msghdr を sendmsg 要求として積む。
+ *  受信バッファを指していればそのバッファの参照を増やし、それ以外
+ *  (pibnetd が組み立てたパケット) は完了までの間コピーを持つ。
+ *  投入は次の pib_uring_wait() で行う。空きスロットが無ければ -1 を返す。
+ */
+int pib_uring_sendmsg(struct pib_uring *uring, const struct msghdr *msghdr, int perf_index)
+{
+	int index;
+	struct pib_uring_send_slot *slot;
+	struct io_uring_sqe *sqe;
+	void *base = msghdr->msg_iov[0].iov_base;
+	size_t length = msghdr->msg_iov[0].iov_len;
+
+	if (uring->free_slot < 0)
+		return -1;
+
+	index = uring->free_slot;
+	slot  = &uring->slots[index];
+	uring->free_slot = slot->next_free;
+
+	if ((uring->buffers <= base) &&
+	    (base < uring->buffers + PIB_NETD_URING_NR_BUFFERS * PIB_URING_BUF_SIZE)) {
+		slot->buf_id = (base - uring->buffers) / PIB_URING_BUF_SIZE;
+		slot->bounce = NULL;
+		uring->buf_refs[slot->buf_id]++;
+	} else {
+		slot->buf_id = -1;
+		slot->bounce = malloc(length);
+		assert(slot->bounce);
+		memcpy(slot->bounce, base, length);
+		base = slot->bounce;
+	}
+
+	slot->iovec.iov_base = base;
+	slot->iovec.iov_len  = length;
+
+	memcpy(&slot->sockaddr, msghdr->msg_name, msghdr->msg_namelen);
+
+	memset(&slot->msghdr, 0, sizeof(slot->msghdr));
+	slot->msghdr.msg_name	 = &slot->sockaddr;
+	slot->msghdr.msg_namelen = msghdr->msg_namelen;
+	slot->msghdr.msg_iov	 = &slot->iovec;
+	slot->msghdr.msg_iovlen	 = 1;
+
+	slot->perf_index = perf_index;
+
+	sqe = get_sqe(uring);
+
+	sqe->opcode    = IORING_OP_SENDMSG;
+	sqe->fd	       = uring->sockfd;
+	sqe->addr      = (uint64_t)(uintptr_t)&slot->msghdr;
+	sqe->len       = 1;
+	sqe->user_data = PIB_URING_TAG_SEND | index;
+
+	return 0;
+}
+
+
+static void release_send_slot(struct pib_uring *uring, int index)
+{
+	struct pib_uring_send_slot *slot = &uring->slots[index];
+
+	if (slot->buf_id >= 0)
+		pib_uring_put_buffer(uring, slot->buf_id);
+	else
+		free(slot->bounce);
+
+	slot->bounce	 = NULL;
+	slot->next_free	 = uring->free_slot;
+	uring->free_slot = index;
+}
+
+
+static unsigned nr_pending_sqes(struct pib_uring *uring)
+{
+	return *uring->sq_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ *  SQ が一杯なら先に投入してから空きを返す。
+ */
+static struct io_uring_sqe *get_sqe(struct pib_uring *uring)
+{
+	unsigned tail;
+	struct io_uring_sqe *sqe;
+
+	while (nr_pending_sqes(uring) == uring->sq_entries) {
+		int ret;
+
+		ret = sys_io_uring_enter(uring->ring_fd, uring->sq_entries, 0, 0, NULL, 0);
+		if ((ret < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+			int eno = errno;
+			pib_report_err("pibnetd: io_uring_enter(errno=%d)", eno);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	tail = *uring->sq_tail;
+	sqe  = &uring->sqes[tail & uring->sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	/* SQPOLL は使わないので、カーネルは io_uring_enter まで SQE を読まない */
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+
+static void arm_recv(struct pib_uring *uring)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(uring);
+
+	sqe->opcode    = IORING_OP_RECVMSG;
+	sqe->fd	       = uring->sockfd;
+	sqe->addr      = (uint64_t)(uintptr_t)&uring->recv_msghdr;
+	sqe->len       = 1;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = PIB_URING_BGID;
+	sqe->user_data = PIB_URING_TAG_RECV;
+
+	uring->recv_armed = 1;
+}
+
+
+/*
+ *  fd が読めるようになったら tag の完了を 1 回返す。
+ */
+static void arm_poll(struct pib_uring *uring, int fd, uint64_t tag)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(uring);
+
+	sqe->opcode	   = IORING_OP_POLL_ADD;
+	sqe->fd		   = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data	   = tag;
+
+	if (tag == PIB_URING_TAG_STOP)
+		uring->stop_armed  = 1;
+	else
+		uring->timer_armed = 1;
+}